@@ -0,0 +1,272 @@
+/*
+ * Cache index for mathTeX: a fixed-size, linear-probing hash table of the
+ * files in the cache, keyed by the md5 hash that names each one, in a file
+ * every process maps shared and updates under an fcntl() write lock.
+ *
+ * Eviction is greedy-dual-size-frequency, as in Cherkasova, "Improving WWW
+ * Proxies Performance with Greedy-Dual-Size-Frequency Caching Policy", with
+ * the lowest priority found among CACHEINDEXSAMPLES random entries rather
+ * than in a heap, so each eviction costs the same however big the cache.
+ * fcntl() locks are the process's, so its threads take turns on a mutex too.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cacheindex.h"
+
+/* ---
+ * the index file: a header, then nslots slots
+ * ------------------------------------------- */
+#define CACHEINDEXMAGIC "mtxidx1"
+struct cacheindexhead_struct {
+    char magic[8];        /* CACHEINDEXMAGIC */
+    int nslots;           /* a power of 2 */
+    int unused;
+    long long nentries;   /* occupied slots */
+    long long nbytes;     /* total size of their files */
+    double clock;         /* priority of the last eviction */
+    char reserved[24];    /* header is 64 bytes */
+};
+struct cacheindexslot_struct {
+    unsigned char key[16]; /* the file's md5, from its name */
+    char ext[8];           /* its extension, empty for a free slot */
+    unsigned int nbytes;   /* size */
+    unsigned int cost;     /* milliseconds to make it */
+    unsigned int hits;     /* times made or used */
+    unsigned int atime;    /* last made or used */
+    double priority;       /* clock then, plus hits*cost/size */
+};
+static int indexfd = -1;                              /* open index file */
+static struct cacheindexhead_struct *head = NULL;     /* mapped header */
+static struct cacheindexslot_struct *slots = NULL;    /* and slots after it */
+static size_t nmapped = 0;                            /* #bytes mapped */
+static unsigned int sampleseed = 0;                   /* rand_r() state for eviction, not the caller's random() */
+static pthread_mutex_t openlock = PTHREAD_MUTEX_INITIALIZER;  /* held opening the index */
+static pthread_mutex_t indexlock = PTHREAD_MUTEX_INITIALIZER; /* held with the write lock */
+
+/* --- whole-file write lock, held for each operation --- */
+static void lockindex(int type) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type; /* F_WRLCK or F_UNLCK */
+    lock.l_whence = SEEK_SET;
+    if (type == F_WRLCK) pthread_mutex_lock(&indexlock); /* other threads first, then other processes */
+    while (fcntl(indexfd, F_SETLKW, &lock) != 0 && errno == EINTR);
+    if (type == F_UNLCK) pthread_mutex_unlock(&indexlock);
+}
+
+/* --- 32 hex digits to 16 bytes --- */
+static int hexkey(char *name, unsigned char *key) {
+    int i = 0;
+    if (name == NULL || strspn(name, "0123456789abcdef") < 32) return -1;
+    for (i = 0; i < 16; i++) {
+        int hi = name[2 * i], lo = name[2 * i + 1];
+        hi = (hi <= '9' ? hi - '0' : hi - 'a' + 10);
+        lo = (lo <= '9' ? lo - '0' : lo - 'a' + 10);
+        key[i] = (unsigned char)(16 * hi + lo);
+    }
+    return 0;
+}
+
+/* --- slot a key starts probing from --- */
+static int homeslot(unsigned char *key) {
+    return (int)(((unsigned)key[0] << 24 | (unsigned)key[1] << 16 | (unsigned)key[2] << 8 | key[3]) & (unsigned)(head->nslots - 1));
+}
+
+/* --- the key's slot, or the free one it would go in --- */
+static int findslot(unsigned char *key, char *ext) {
+    int islot = homeslot(key), mask = head->nslots - 1;
+    while (*slots[islot].ext != '\000') {
+        if (memcmp(slots[islot].key, key, 16) == 0 && strncmp(slots[islot].ext, ext, 7) == 0) break;
+        islot = (islot + 1) & mask;
+    }
+    return islot;
+}
+
+/* --- priority now, counting this use --- */
+static void reprioritize(struct cacheindexslot_struct *slot) {
+    slot->atime = (unsigned int)time(NULL);
+    slot->priority = head->clock + (double)slot->hits * slot->cost * 1024. / (slot->nbytes > 0 ? slot->nbytes : 1);
+}
+
+/* --- empty a slot, moving later ones of the same probe run back into it --- */
+static void freeslot(int islot) {
+    int jslot = islot, kslot = 0, mask = head->nslots - 1;
+    while (1) {
+        jslot = (jslot + 1) & mask;
+        if (*slots[jslot].ext == '\000') break;
+        kslot = homeslot(slots[jslot].key);
+        if ((jslot > islot && (kslot <= islot || kslot > jslot)) || (jslot < islot && kslot <= islot && kslot > jslot)) {
+            slots[islot] = slots[jslot];
+            islot = jslot;
+        }
+    }
+    memset(&slots[islot], 0, sizeof(slots[islot]));
+}
+
+int cacheindexopen(char *indexfile, int nslots) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    struct cacheindexhead_struct header; /* of an existing index */
+    struct stat indexstat;               /* its size */
+    struct cacheindexhead_struct *mapped = NULL; /* the header, once mapped */
+    int n = 1;                           /* nslots, rounded up */
+
+    pthread_mutex_lock(&openlock);
+    if (head != NULL) goto is_open;
+    while (n < nslots && n < (1 << 30)) n *= 2;
+    if ((indexfd = open(indexfile, O_RDWR | O_CREAT, 0666)) < 0) {
+        pthread_mutex_unlock(&openlock);
+        return 0;
+    }
+    lockindex(F_WRLCK);
+
+    /* -------------------------------------------------------------------------
+    a new index is sized now; an existing one keeps its size
+    -------------------------------------------------------------------------- */
+    if (fstat(indexfd, &indexstat) != 0) goto not_open;
+    if (indexstat.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        strcpy(header.magic, CACHEINDEXMAGIC);
+        header.nslots = n;
+        if (ftruncate(indexfd, sizeof(header) + (off_t)n * sizeof(*slots)) != 0) goto not_open;
+        if (pwrite(indexfd, &header, sizeof(header), 0) != sizeof(header)) goto not_open;
+    } else if (pread(indexfd, &header, sizeof(header), 0) != sizeof(header) || strcmp(header.magic, CACHEINDEXMAGIC) != 0 || header.nslots < 1 ||
+               (header.nslots & (header.nslots - 1)) != 0 || indexstat.st_size != (off_t)sizeof(header) + (off_t)header.nslots * (off_t)sizeof(*slots)) {
+        goto not_open; /* not ours, or truncated */
+    }
+    nmapped = sizeof(header) + (size_t)header.nslots * sizeof(*slots);
+    if ((mapped = mmap(NULL, nmapped, PROT_READ | PROT_WRITE, MAP_SHARED, indexfd, 0)) == MAP_FAILED) goto not_open;
+    slots = (struct cacheindexslot_struct *)(mapped + 1);
+    sampleseed = (unsigned)getpid() ^ (unsigned)time(NULL);
+    __atomic_store_n(&head, mapped, __ATOMIC_RELEASE); /* last, as other threads check it without the lock */
+    lockindex(F_UNLCK);
+
+is_open:
+    pthread_mutex_unlock(&openlock);
+    return 1;
+
+not_open:
+    lockindex(F_UNLCK);
+    close(indexfd);
+    indexfd = -1;
+    pthread_mutex_unlock(&openlock);
+    return 0;
+}
+
+int cacheindexadd(char *name, char *ext, long nbytes, int cost) {
+    unsigned char key[16];
+    struct cacheindexslot_struct *slot = NULL;
+    int status = 1;
+    if (head == NULL || hexkey(name, key) < 0) return -1;
+    lockindex(F_WRLCK);
+    slot = slots + findslot(key, ext);
+    if (*slot->ext == '\000') { /* new */
+        if (4 * (head->nentries + 1) > 3 * (long long)head->nslots) {
+            status = 0; /* full */
+            goto end_of_job;
+        }
+        memcpy(slot->key, key, 16);
+        strncpy(slot->ext, ext, 7);
+        slot->ext[7] = '\000';
+        slot->nbytes = slot->hits = 0;
+        head->nentries++;
+    }
+    head->nbytes += nbytes - (long long)slot->nbytes;
+    slot->nbytes = (unsigned int)nbytes;
+    slot->cost = (unsigned int)(cost > 0 ? cost : 1);
+    slot->hits++;
+    reprioritize(slot);
+
+end_of_job:
+    lockindex(F_UNLCK);
+    return status;
+}
+
+int cacheindextouch(char *name, char *ext) {
+    unsigned char key[16];
+    struct cacheindexslot_struct *slot = NULL;
+    int isfound = 0;
+    if (head == NULL || hexkey(name, key) < 0) return 0;
+    lockindex(F_WRLCK);
+    slot = slots + findslot(key, ext);
+    if ((isfound = (*slot->ext != '\000'))) {
+        slot->hits++;
+        reprioritize(slot);
+    }
+    lockindex(F_UNLCK);
+    return isfound;
+}
+
+int cacheindexevict(long maxbytes, long maxentries, char *name, char *ext) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    int mask = 0, isample = 0, islot = 0, iprobe = 0, ivictim = -1;
+    struct cacheindexslot_struct *slot = NULL;
+
+    if (head == NULL) return 0;
+    lockindex(F_WRLCK);
+    mask = head->nslots - 1;
+    if (head->nentries < 1) goto end_of_job;
+    if ((maxbytes < 1 || head->nbytes <= maxbytes) && (maxentries < 1 || head->nentries <= maxentries) &&
+        4 * (head->nentries + 1) <= 3 * (long long)head->nslots) {
+        goto end_of_job; /* within limits, with room for another */
+    }
+
+    /* -------------------------------------------------------------------------
+    lowest priority of the entries nearest some random slots, older first on
+    a tie; if a sparse table turns up none, the first entry after the last
+    -------------------------------------------------------------------------- */
+    for (isample = 0; isample < CACHEINDEXSAMPLES; isample++) {
+        islot = (int)(rand_r(&sampleseed) & mask); /* under indexlock, so the seed is ours */
+        for (iprobe = 0; iprobe < 64 && *slots[islot].ext == '\000'; iprobe++) islot = (islot + 1) & mask;
+        if (*slots[islot].ext == '\000') continue;
+        if (ivictim < 0 || slots[islot].priority < slots[ivictim].priority ||
+            (slots[islot].priority == slots[ivictim].priority && slots[islot].atime < slots[ivictim].atime)) {
+            ivictim = islot;
+        }
+    }
+    for (iprobe = 0; ivictim < 0 && iprobe < head->nslots; iprobe++) {
+        islot = (islot + 1) & mask;
+        if (*slots[islot].ext != '\000') ivictim = islot;
+    }
+    if (ivictim < 0) goto end_of_job;
+
+    /* -------------------------------------------------------------------------
+    the clock moves up to it, and it's out
+    -------------------------------------------------------------------------- */
+    slot = slots + ivictim;
+    for (islot = 0; islot < 16; islot++) sprintf(name + 2 * islot, "%02x", slot->key[islot]);
+    strcpy(ext, slot->ext);
+    if (slot->priority > head->clock) head->clock = slot->priority;
+    head->nentries--;
+    head->nbytes -= slot->nbytes;
+    freeslot(ivictim);
+    lockindex(F_UNLCK);
+    return 1;
+
+end_of_job:
+    lockindex(F_UNLCK);
+    return 0;
+}
+
+int cacheindexstats(long *nbytes, long *nentries) {
+    *nbytes = *nentries = 0;
+    if (head == NULL) return 0;
+    lockindex(F_WRLCK);
+    *nbytes = (long)head->nbytes;
+    *nentries = (long)head->nentries;
+    lockindex(F_UNLCK);
+    return 1;
+}
@@ -0,0 +1,66 @@
+#ifndef __cacheindex_h__
+#define __cacheindex_h__
+
+/* ---
+ * size, render cost and use of every cached file, in a hash table mmap()'ed
+ * from one file in the cache directory and shared by every mathtex process,
+ * for greedy-dual-size-frequency eviction: a file's priority is the clock
+ * when it was last used plus hits*cost/size, the file with the lowest goes
+ * first, and the clock moves up to its priority, so what was cheap to make
+ * and hasn't been used for a while goes before what was expensive
+ * ------------------------------------------------------------------------ */
+#define CACHEINDEXFILE ".cacheindex" /* in the cache directory */
+#define CACHEINDEXSLOTS (1 << 18)    /* default table size, up to 3/4 full */
+#define CACHEINDEXSAMPLES 16         /* entries compared to choose each eviction */
+#define CACHEINDEXCOST 400           /* milliseconds, for files whose cost wasn't measured */
+
+/**
+ * Opens (or creates) the index for this process. Already open, it's left as it is.
+ *
+ * @param indexfile[in] Null-terminated char* containing the index's path.
+ * @param nslots[in] int containing the table size for a new index, rounded up to a power of 2 (an existing index keeps its own).
+ * @return 1 if the index is open, 0 if it can't be.
+ */
+int cacheindexopen(char *indexfile, int nslots);
+
+/**
+ * Records a file just written to the cache, or rewritten.
+ *
+ * @param name[in] Null-terminated char* containing its name, 32 hex digits (anything after them is ignored).
+ * @param ext[in] Null-terminated char* containing its extension, without the dot, at most 7 chars.
+ * @param nbytes[in] long containing its size.
+ * @param cost[in] int containing the milliseconds it took to make.
+ * @return 1 if recorded, 0 if the index is full (evict something first), -1 if it's not open or name isn't a hash.
+ */
+int cacheindexadd(char *name, char *ext, long nbytes, int cost);
+
+/**
+ * Records a cache hit.
+ *
+ * @param name[in] Null-terminated char* containing its name, as cacheindexadd().
+ * @param ext[in] Null-terminated char* containing its extension.
+ * @return 1 if it's in the index, 0 if not.
+ */
+int cacheindextouch(char *name, char *ext);
+
+/**
+ * Chooses the next file to evict, if the cache is over either limit (or the index is full), and drops it from the index. The caller removes the file.
+ *
+ * @param maxbytes[in] long containing the most bytes the indexed files may take, or 0 for no limit.
+ * @param maxentries[in] long containing the most files, or 0 for no limit.
+ * @param name[out] char* of at least 33 bytes, receiving the file's name.
+ * @param ext[out] char* of at least 8 bytes, receiving its extension.
+ * @return 1 if there's a file to evict, 0 if the cache is within its limits.
+ */
+int cacheindexevict(long maxbytes, long maxentries, char *name, char *ext);
+
+/**
+ * Reports what the index holds.
+ *
+ * @param nbytes[out] long* receiving the total size of the indexed files.
+ * @param nentries[out] long* receiving their number.
+ * @return 1 if the index is open, 0 if not.
+ */
+int cacheindexstats(long *nbytes, long *nentries);
+
+#endif // __cacheindex_h__
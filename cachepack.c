@@ -0,0 +1,376 @@
+/*
+ * Pack files for mathTeX's cache: images appended to numbered packs in one
+ * directory, with a fixed-size, linear-probing hash index from each image's
+ * md5 key to where it is, mapped shared by every process and updated under
+ * an fcntl() lock (read locks for lookups).
+ *
+ * Packs are only ever appended to. A replaced or removed image leaves dead
+ * bytes behind, which packcompact() reclaims by copying the live ones into
+ * new packs, repointing the index, and unlinking the old packs; a reader
+ * still sending from one of those has its own dup() of the pack from
+ * packfind(), so the pack stays readable until the reader closes it.
+ * fcntl() locks are the process's, so its threads take turns on a mutex too.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cachepack.h"
+
+/* ---
+ * the index file: a header, then nslots slots
+ * ------------------------------------------- */
+#define PACKMAGIC "mtxpak1"
+struct packhead_struct {
+    char magic[8];           /* PACKMAGIC */
+    int nslots;              /* a power of 2 */
+    unsigned int curpack;    /* pack being appended to */
+    long long nentries;      /* occupied slots */
+    long long nlive;         /* bytes of indexed images */
+    long long ntotal;        /* bytes in all packs, live and dead */
+    char reserved[24];       /* header is 64 bytes */
+};
+struct packslot_struct {
+    unsigned char key[16]; /* the image's md5 */
+    long long offset;      /* where it starts in its pack */
+    unsigned int nbytes;   /* its length, 0 for a free slot */
+    unsigned int pack;     /* which pack */
+    int depth;             /* stored with it */
+    int unused;
+};
+static char packpath[512] = "\000";          /* pack directory */
+static int packdurability = 0;               /* 0 none, 1 data, 2 full, as packopen() was told */
+static int indexfd = -1;                     /* open index file */
+static struct packhead_struct *head = NULL;  /* mapped header */
+static struct packslot_struct *slots = NULL; /* and slots after it */
+static struct {
+    unsigned int pack; /* pack number */
+    int fd;            /* open for read and append, or -1 */
+} packfds[PACKOPENFDS];
+static pthread_mutex_t openlock = PTHREAD_MUTEX_INITIALIZER;  /* held opening the index */
+static pthread_mutex_t indexlock = PTHREAD_MUTEX_INITIALIZER; /* held with the file lock, and over packfds[] */
+
+/* --- whole-file lock, held for each operation --- */
+static void lockindex(int type) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type; /* F_RDLCK, F_WRLCK or F_UNLCK */
+    lock.l_whence = SEEK_SET;
+    if (type != F_UNLCK) pthread_mutex_lock(&indexlock); /* other threads first, then other processes */
+    while (fcntl(indexfd, F_SETLKW, &lock) != 0 && errno == EINTR);
+    if (type == F_UNLCK) pthread_mutex_unlock(&indexlock);
+}
+
+/* --- 32 hex digits to 16 bytes --- */
+static int hexkey(char *name, unsigned char *key) {
+    int i = 0;
+    if (name == NULL || strspn(name, "0123456789abcdef") < 32) return -1;
+    for (i = 0; i < 16; i++) {
+        int hi = name[2 * i], lo = name[2 * i + 1];
+        hi = (hi <= '9' ? hi - '0' : hi - 'a' + 10);
+        lo = (lo <= '9' ? lo - '0' : lo - 'a' + 10);
+        key[i] = (unsigned char)(16 * hi + lo);
+    }
+    return 0;
+}
+
+/* --- slot a key starts probing from --- */
+static int homeslot(unsigned char *key) {
+    return (int)(((unsigned)key[0] << 24 | (unsigned)key[1] << 16 | (unsigned)key[2] << 8 | key[3]) & (unsigned)(head->nslots - 1));
+}
+
+/* --- the key's slot, or the free one it would go in --- */
+static int findslot(unsigned char *key) {
+    int islot = homeslot(key), mask = head->nslots - 1;
+    while (slots[islot].nbytes != 0 && memcmp(slots[islot].key, key, 16) != 0) islot = (islot + 1) & mask;
+    return islot;
+}
+
+/* --- empty a slot, moving later ones of the same probe run back into it --- */
+static void freeslot(int islot) {
+    int jslot = islot, kslot = 0, mask = head->nslots - 1;
+    while (1) {
+        jslot = (jslot + 1) & mask;
+        if (slots[jslot].nbytes == 0) break;
+        kslot = homeslot(slots[jslot].key);
+        if ((jslot > islot && (kslot <= islot || kslot > jslot)) || (jslot < islot && kslot <= islot && kslot > jslot)) {
+            slots[islot] = slots[jslot];
+            islot = jslot;
+        }
+    }
+    memset(&slots[islot], 0, sizeof(slots[islot]));
+}
+
+/* --- a pack's descriptor, opened (and created) the first time it's wanted --- */
+static int packfd(unsigned int pack) {
+    int ifd = (int)(pack % PACKOPENFDS);
+    char packfile[640];
+    if (packfds[ifd].fd >= 0 && packfds[ifd].pack == pack) return packfds[ifd].fd;
+    if (packfds[ifd].fd >= 0) close(packfds[ifd].fd);
+    packfds[ifd].pack = pack;
+    packfds[ifd].fd = -1;
+    if (snprintf(packfile, sizeof(packfile), "%s/%08u.pack", packpath, pack) >= (int)sizeof(packfile)) return -1; /* so packstore() fails */
+    packfds[ifd].fd = open(packfile, O_RDWR | O_CREAT | O_APPEND, 0666);
+    return packfds[ifd].fd;
+}
+
+/* --- an image's bytes reach the disk before the index points at them: fdatasync(), or fsync() for full --- */
+static int syncpack(int fd, int isnewpack) {
+    int dirfd = -1, status = 0;
+    if (packdurability < 1) return 0;
+    if ((packdurability > 1 ? fsync(fd) : fdatasync(fd)) != 0) return -1;
+    if (packdurability > 1 && isnewpack) { /* and the new pack's directory entry */
+        if ((dirfd = open(packpath, O_RDONLY | O_DIRECTORY)) < 0) return -1;
+        status = fsync(dirfd);
+        close(dirfd);
+    }
+    return status;
+}
+
+/* --- for full durability, the index pages holding the header and a slot --- */
+static void syncslot(struct packslot_struct *slot) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    char *page = (char *)slot - ((char *)slot - (char *)head) % pagesize; /* mmap()'ed, so head is page aligned */
+    if (packdurability < 2) return;
+    msync(head, sizeof(*head), MS_SYNC);
+    msync(page, (char *)(slot + 1) - page, MS_SYNC);
+}
+
+/* --- append to a pack, returning where it went --- */
+static long long appendpack(unsigned int pack, unsigned char *data, int nbytes) {
+    int fd = packfd(pack), nwritten = 0;
+    long long offset = 0;
+    if (fd < 0 || (offset = (long long)lseek(fd, 0, SEEK_END)) < 0) return -1;
+    while (nwritten < nbytes) {
+        ssize_t n = write(fd, data + nwritten, nbytes - nwritten);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        nwritten += n;
+    }
+    if (nwritten < nbytes) return (ftruncate(fd, (off_t)offset) == 0 ? -1 : -1); /* no partial image left behind, if we can help it */
+    return offset;
+}
+
+int packopen(char *packdir, int nslots, int durability) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    struct packhead_struct header; /* of an existing index */
+    struct stat indexstat;         /* its size */
+    struct packhead_struct *mapped = NULL; /* the header, once mapped */
+    char indexfile[640];           /* packdir/index */
+    int n = 1, ifd = 0;            /* nslots, rounded up; packfds[] index */
+
+    pthread_mutex_lock(&openlock);
+    packdurability = durability; /* the process's setting, open already or not */
+    if (head != NULL) goto is_open;
+    while (n < nslots && n < (1 << 30)) n *= 2;
+    for (ifd = 0; ifd < PACKOPENFDS; ifd++) packfds[ifd].fd = -1;
+    if (snprintf(packpath, sizeof(packpath), "%s", packdir) >= (int)sizeof(packpath) ||
+        snprintf(indexfile, sizeof(indexfile), "%s/%s", packpath, PACKINDEXFILE) >= (int)sizeof(indexfile) ||
+        (indexfd = open(indexfile, O_RDWR | O_CREAT, 0666)) < 0) { /* a packdir too long to hold isn't opened truncated */
+        *packpath = '\000';
+        pthread_mutex_unlock(&openlock);
+        return 0;
+    }
+    lockindex(F_WRLCK);
+
+    /* -------------------------------------------------------------------------
+    a new index is sized now; an existing one keeps its size
+    -------------------------------------------------------------------------- */
+    if (fstat(indexfd, &indexstat) != 0) goto not_open;
+    if (indexstat.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        strcpy(header.magic, PACKMAGIC);
+        header.nslots = n;
+        header.curpack = 1;
+        if (ftruncate(indexfd, sizeof(header) + (off_t)n * sizeof(*slots)) != 0) goto not_open;
+        if (pwrite(indexfd, &header, sizeof(header), 0) != sizeof(header)) goto not_open;
+    } else if (pread(indexfd, &header, sizeof(header), 0) != sizeof(header) || strcmp(header.magic, PACKMAGIC) != 0 || header.nslots < 1 ||
+               (header.nslots & (header.nslots - 1)) != 0 ||
+               indexstat.st_size != (off_t)sizeof(header) + (off_t)header.nslots * (off_t)sizeof(*slots)) {
+        goto not_open; /* not ours, or truncated */
+    }
+    mapped = mmap(NULL, sizeof(header) + (size_t)header.nslots * sizeof(*slots), PROT_READ | PROT_WRITE, MAP_SHARED, indexfd, 0);
+    if (mapped == MAP_FAILED) goto not_open;
+    slots = (struct packslot_struct *)(mapped + 1);
+    __atomic_store_n(&head, mapped, __ATOMIC_RELEASE); /* last, as other threads check it without the lock */
+    lockindex(F_UNLCK);
+
+is_open:
+    pthread_mutex_unlock(&openlock);
+    return 1;
+
+not_open:
+    lockindex(F_UNLCK);
+    close(indexfd);
+    indexfd = -1;
+    pthread_mutex_unlock(&openlock);
+    return 0;
+}
+
+int packfind(char *name, int *fd, long *offset, int *nbytes, int *depth) {
+    unsigned char key[16];
+    struct packslot_struct slot; /* copied out under the lock */
+    if (head == NULL || hexkey(name, key) < 0) return 0;
+    lockindex(F_RDLCK);
+    slot = slots[findslot(key)];
+    if (slot.nbytes > 0 && fd != NULL) { /* dup'ed under the lock, before another thread can close or reopen packfds[] */
+        int ownfd = packfd(slot.pack);
+        if (ownfd < 0 || (*fd = fcntl(ownfd, F_DUPFD_CLOEXEC, 0)) < 0) slot.nbytes = 0;
+    }
+    lockindex(F_UNLCK);
+    if (slot.nbytes == 0) return 0;
+    if (offset != NULL) *offset = (long)slot.offset;
+    if (nbytes != NULL) *nbytes = (int)slot.nbytes;
+    if (depth != NULL) *depth = slot.depth;
+    return 1;
+}
+
+int packstore(char *name, unsigned char *data, int nbytes, int depth) {
+    unsigned char key[16];
+    struct packslot_struct *slot = NULL;
+    long long offset = 0;
+    int status = -1;
+    struct stat packstat; /* size of the current pack */
+    int isnewpack = 0;    /* true if this starts a pack */
+    if (head == NULL || nbytes < 1 || hexkey(name, key) < 0) return -1;
+    lockindex(F_WRLCK);
+    slot = slots + findslot(key);
+    if (slot->nbytes == 0 && 4 * (head->nentries + 1) > 3 * (long long)head->nslots) goto end_of_job; /* full */
+    if (packfd(head->curpack) < 0 || fstat(packfd(head->curpack), &packstat) != 0) goto end_of_job;
+    isnewpack = (packstat.st_size == 0);
+    if (!isnewpack && packstat.st_size + nbytes > PACKMAXBYTES) head->curpack++, isnewpack = 1; /* start another */
+    if ((offset = appendpack(head->curpack, data, nbytes)) < 0) goto end_of_job;
+    if (syncpack(packfd(head->curpack), isnewpack) != 0) { /* never index bytes that may not be there */
+        if (ftruncate(packfd(head->curpack), (off_t)offset) != 0) head->ntotal += nbytes; /* dead space, if we can't take it back */
+        goto end_of_job;
+    }
+    if (slot->nbytes == 0) {
+        memcpy(slot->key, key, 16);
+        head->nentries++;
+    } else {
+        head->nlive -= slot->nbytes; /* the old image is dead space now */
+    }
+    slot->offset = offset;
+    slot->nbytes = (unsigned int)nbytes;
+    slot->pack = head->curpack;
+    slot->depth = depth;
+    head->nlive += nbytes;
+    head->ntotal += nbytes;
+    syncslot(slot);
+    status = 0;
+
+end_of_job:
+    lockindex(F_UNLCK);
+    return status;
+}
+
+int packremove(char *name) {
+    unsigned char key[16];
+    int islot = 0, isfound = 0;
+    if (head == NULL || hexkey(name, key) < 0) return 0;
+    lockindex(F_WRLCK);
+    islot = findslot(key);
+    if ((isfound = (slots[islot].nbytes != 0))) {
+        head->nentries--;
+        head->nlive -= slots[islot].nbytes;
+        freeslot(islot);
+        if (packdurability > 1) msync(head, sizeof(*head) + (size_t)head->nslots * sizeof(*slots), MS_SYNC); /* freeslot() may have moved others */
+    }
+    lockindex(F_UNLCK);
+    return isfound;
+}
+
+int packcompact(long *nreclaimed) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    unsigned int firstpack = 0, pack = 0;  /* first new pack, and the one being written */
+    unsigned char *data = NULL;            /* an image, copied */
+    long long *offsets = NULL;             /* new offset of each slot */
+    unsigned int *packs = NULL;            /* and its new pack */
+    long long npacked = 0;                 /* bytes in the new pack so far */
+    int islot = 0, ncopied = 0, status = -1;
+    DIR *directory = NULL;                 /* packdir, for old packs */
+    struct dirent *entry = NULL;
+
+    *nreclaimed = 0;
+    if (head == NULL) return -1;
+    lockindex(F_WRLCK);
+    offsets = malloc((size_t)head->nslots * sizeof(*offsets));
+    packs = malloc((size_t)head->nslots * sizeof(*packs));
+    if (offsets == NULL || packs == NULL) goto end_of_job;
+
+    /* -------------------------------------------------------------------------
+    copy the live images into new packs, only repointing the index once all
+    of them are safely written
+    -------------------------------------------------------------------------- */
+    firstpack = pack = head->curpack + 1;
+    for (islot = 0; islot < head->nslots; islot++) {
+        struct packslot_struct *slot = slots + islot;
+        int fd = -1;
+        if (slot->nbytes == 0) continue;
+        if ((data = realloc(data, slot->nbytes)) == NULL || (fd = packfd(slot->pack)) < 0) goto end_of_job;
+        if (pread(fd, data, slot->nbytes, (off_t)slot->offset) != (ssize_t)slot->nbytes) goto end_of_job;
+        if (npacked > 0 && npacked + slot->nbytes > PACKMAXBYTES) pack++, npacked = 0;
+        if ((offsets[islot] = appendpack(pack, data, (int)slot->nbytes)) < 0) goto end_of_job;
+        packs[islot] = pack;
+        npacked += slot->nbytes;
+        ncopied++;
+    }
+    for (; firstpack <= pack; firstpack++) {
+        if (packfd(firstpack) < 0 || fsync(packfd(firstpack)) != 0) goto end_of_job;
+    }
+    firstpack = head->curpack + 1;
+    for (islot = 0; islot < head->nslots; islot++) {
+        if (slots[islot].nbytes == 0) continue;
+        slots[islot].offset = offsets[islot];
+        slots[islot].pack = packs[islot];
+    }
+    *nreclaimed = (long)(head->ntotal - head->nlive);
+    head->curpack = pack;
+    head->ntotal = head->nlive;
+    msync(head, sizeof(*head) + (size_t)head->nslots * sizeof(*slots), MS_SYNC);
+
+    /* -------------------------------------------------------------------------
+    nothing points into the old packs now
+    -------------------------------------------------------------------------- */
+    if ((directory = opendir(packpath)) != NULL) {
+        while ((entry = readdir(directory)) != NULL) {
+            unsigned int oldpack = 0;
+            char packfile[sizeof(packpath) + sizeof(entry->d_name) + 1], suffix[8] = "";
+            if (sscanf(entry->d_name, "%u.%5s", &oldpack, suffix) != 2 || strcmp(suffix, "pack") != 0 || oldpack >= firstpack) continue;
+            if (snprintf(packfile, sizeof(packfile), "%s/%s", packpath, entry->d_name) >= (int)sizeof(packfile)) continue; /* left, rather than unlink a truncated name */
+            unlink(packfile);
+        }
+        closedir(directory);
+    }
+    status = ncopied;
+
+end_of_job:
+    lockindex(F_UNLCK);
+    free(data);
+    free(offsets);
+    free(packs);
+    return status;
+}
+
+int packstats(long *nentries, long *nlive, long *ndead) {
+    *nentries = *nlive = *ndead = 0;
+    if (head == NULL) return 0;
+    lockindex(F_RDLCK);
+    *nentries = (long)head->nentries;
+    *nlive = (long)head->nlive;
+    *ndead = (long)(head->ntotal - head->nlive);
+    lockindex(F_UNLCK);
+    return 1;
+}
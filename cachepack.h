@@ -0,0 +1,75 @@
+#ifndef __cachepack_h__
+#define __cachepack_h__
+
+/* ---
+ * cached images appended to a few large pack files instead of a file each,
+ * found through an mmap()'ed hash index from their 128-bit key to pack,
+ * offset, length and depth, so a hit is an index lookup and a sendfile()
+ * from a pack that's already open
+ * ------------------------------------------------------------------------ */
+#define PACKINDEXFILE "index"          /* in the pack directory, with the packs */
+#define PACKINDEXSLOTS (1 << 20)       /* table size, up to 3/4 full */
+#define PACKMAXBYTES (256L << 20)      /* start another pack past this size */
+#define PACKOPENFDS 64                 /* packs kept open by this process */
+
+/**
+ * Opens (or creates) the pack index in packdir for this process. Already open, it's left as it is, apart from its durability.
+ *
+ * @param packdir[in] Null-terminated char* containing the pack directory, which must exist. It's kept to open packs later, so make it absolute.
+ * @param nslots[in] int containing the table size for a new index, rounded up to a power of 2 (an existing index keeps its own).
+ * @param durability[in] int containing how surely packstore() gets an image to disk before indexing it: 0 leaves it to the kernel, 1 fdatasync()'s
+ * the pack, 2 fsync()'s it (and a new pack's directory) and msync()'s the index too.
+ * @return 1 if the index is open, 0 if it can't be.
+ */
+int packopen(char *packdir, int nslots, int durability);
+
+/**
+ * Looks up an image.
+ *
+ * @param name[in] Null-terminated char* containing its key, 32 hex digits.
+ * @param fd[out] int* receiving a descriptor of its own for its pack, which the caller closes; may be `NULL`.
+ * @param offset[out] long* receiving its offset in the pack; may be `NULL`.
+ * @param nbytes[out] int* receiving its length; may be `NULL`.
+ * @param depth[out] int* receiving the depth stored with it; may be `NULL`.
+ * @return 1 if it's packed, 0 if not.
+ */
+int packfind(char *name, int *fd, long *offset, int *nbytes, int *depth);
+
+/**
+ * Appends an image to the current pack and indexes it, replacing any earlier image under the same key (whose bytes become dead space).
+ *
+ * @param name[in] Null-terminated char* containing its key, 32 hex digits.
+ * @param data[in] unsigned char* containing the image.
+ * @param nbytes[in] int containing its length.
+ * @param depth[in] int containing the depth to store with it.
+ * @return 0 if packed, -1 if not (the index is full, or a write failed).
+ */
+int packstore(char *name, unsigned char *data, int nbytes, int depth);
+
+/**
+ * Drops an image from the index. Its bytes stay in the pack as dead space until packcompact().
+ *
+ * @param name[in] Null-terminated char* containing its key, 32 hex digits.
+ * @return 1 if it was packed, 0 if not.
+ */
+int packremove(char *name);
+
+/**
+ * Copies every live image into new packs and deletes the old ones, reclaiming the dead space. Other processes wait on the index meanwhile.
+ *
+ * @param nreclaimed[out] long* receiving the number of bytes reclaimed.
+ * @return Number of images copied, or -1 if a write failed (the old packs are kept, and the index still points into them).
+ */
+int packcompact(long *nreclaimed);
+
+/**
+ * Reports what the packs hold.
+ *
+ * @param nentries[out] long* receiving the number of images.
+ * @param nlive[out] long* receiving their total size.
+ * @param ndead[out] long* receiving the bytes of replaced and removed images still in the packs.
+ * @return 1 if the index is open, 0 if not.
+ */
+int packstats(long *nentries, long *nlive, long *ndead);
+
+#endif // __cachepack_h__
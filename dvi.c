@@ -0,0 +1,590 @@
+/*
+ * Built-in dvi-to-png for mathTeX: a dvi interpreter for the pages latex
+ * writes for an expression and pk glyph decoding, with pngencode() to
+ * write the result, so the common render needs no dvipng process.
+ *
+ * The dvi and pk formats are as described in dvitype.web and pktype.web
+ * by Donald Knuth and Tomas Rokicki.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dvi.h"
+#include "pngopt.h"
+
+/* ---
+ * a font at one resolution, with its glyphs decoded as they're first used
+ * ------------------------------------------------------------------------ */
+struct dviglyph_struct {
+    int isdecoded;         /* bitmap decoded (or found missing) */
+    int width, height;     /* bitmap size in pk pixels */
+    int hoff, voff;        /* reference point, right and down from the top left pixel */
+    long tfm;              /* width, as a fraction of the design size in units of 2^-20 */
+    unsigned char *bitmap; /* width*height, nonzero for ink */
+};
+struct dvifont_struct {
+    char name[64];                       /* tfm name */
+    int dpi;                             /* pk resolution */
+    unsigned char *pk;                   /* pk file, NULL if there's none */
+    int npk;                             /* #bytes in pk */
+    long charpos[256];                   /* offset of each char's flag byte in pk, or -1 */
+    struct dviglyph_struct glyphs[256];  /* indexed by char code */
+};
+static struct dvifont_struct *dvifonts[DVIMAXFONTS]; /* loaded by this process */
+static int ndvifonts = 0;                            /* #fonts in dvifonts[] */
+static dvifontlookup fontlookup = NULL;              /* finds pk files */
+static pthread_mutex_t fontlock = PTHREAD_MUTEX_INITIALIZER; /* held loading fonts and decoding glyphs, which threads share */
+
+/* ---
+ * what a page puts where, in pk pixels
+ * ------------------------------------ */
+struct dvimark_struct {
+    struct dviglyph_struct *glyph; /* glyph, or NULL for a rule */
+    int x, y;                      /* top left pixel */
+    int width, height;             /* rule size */
+};
+
+/* ---
+ * dvi opcodes
+ * ----------- */
+#define DVISET1 128
+#define DVISETRULE 132
+#define DVIPUT1 133
+#define DVIPUTRULE 137
+#define DVINOP 138
+#define DVIBOP 139
+#define DVIEOP 140
+#define DVIPUSH 141
+#define DVIPOP 142
+#define DVIRIGHT1 143
+#define DVIW0 147
+#define DVIX0 152
+#define DVIDOWN1 157
+#define DVIY0 161
+#define DVIZ0 166
+#define DVIFNTNUM0 171
+#define DVIFNT1 235
+#define DVIXXX1 239
+#define DVIFNTDEF1 243
+#define DVIPRE 247
+#define DVIPOST 248
+#define DVISTACKSZ 256 /* push depth */
+
+/* ---
+ * pk opcodes
+ * ---------- */
+#define PKXXX1 240
+#define PKYYY 244
+#define PKPOST 245
+#define PKNOOP 246
+#define PKPRE 247
+
+void dvisetfontlookup(dvifontlookup lookup) { fontlookup = lookup; }
+
+/* --- big-endian unsigned and signed integers of 1 to 4 bytes --- */
+static unsigned long getunsigned(unsigned char *p, int n) {
+    unsigned long value = 0;
+    while (n-- > 0) value = (value << 8) | *p++;
+    return value;
+}
+static long getsigned(unsigned char *p, int n) {
+    long value = (*p & 0x80 ? -1 : 0);
+    while (n-- > 0) value = (value << 8) | *p++;
+    return value;
+}
+
+/* --- a whole file, malloc()'ed --- */
+static unsigned char *readwhole(char *filename, int *nbytes) {
+    FILE *fp = fopen(filename, "rb");
+    unsigned char *buffer = NULL;
+    long size = 0;
+    if (fp == NULL) return NULL;
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0 && (buffer = malloc(size)) != NULL) {
+        if (fread(buffer, 1, size, fp) != (size_t)size) {
+            free(buffer);
+            buffer = NULL;
+        }
+    }
+    fclose(fp);
+    *nbytes = (int)size;
+    return buffer;
+}
+
+/* -------------------------------------------------------------------------
+pk fonts
+-------------------------------------------------------------------------- */
+/* --- run counts are packed in nybbles --- */
+struct pkreader_struct {
+    unsigned char *p, *end; /* next byte, and past the raster */
+    int ishigh;             /* next nybble is the high one of *p */
+    int dynf;               /* packing parameter */
+    int repeat;             /* repeat count for the current row */
+};
+static int getnybble(struct pkreader_struct *pk) {
+    int nybble = 0;
+    if (pk->p >= pk->end) return 0;
+    if (pk->ishigh) {
+        nybble = *pk->p >> 4;
+    } else {
+        nybble = *pk->p++ & 0x0f;
+    }
+    pk->ishigh = !pk->ishigh;
+    return nybble;
+}
+static int getpacked(struct pkreader_struct *pk) {
+    int i = getnybble(pk), j = 0;
+    if (i == 0) { /* large run count, in one more nybble than it has leading zeroes */
+        do {
+            j = getnybble(pk);
+            i++;
+        } while (j == 0 && pk->p < pk->end);
+        while (i-- > 0) j = j * 16 + getnybble(pk);
+        return j - 15 + (13 - pk->dynf) * 16 + pk->dynf;
+    }
+    if (i <= pk->dynf) return i;
+    if (i < 14) return (i - pk->dynf - 1) * 16 + getnybble(pk) + pk->dynf + 1;
+    pk->repeat = (i == 14 ? getpacked(pk) : 1); /* repeat count for this row, then the run count */
+    return getpacked(pk);
+}
+
+/* --- decode one char's raster --- */
+static int decodeglyph(struct dvifont_struct *font, int c) {
+    struct dviglyph_struct *glyph = font->glyphs + c;
+    unsigned char *p = NULL, *end = NULL;
+    int flag = 0, length = 0, row = 0, col = 0, isblack = 0;
+    long nbits = 0;
+
+    glyph->isdecoded = 1;
+    if (font->pk == NULL || font->charpos[c] < 0) return 0;
+    p = font->pk + font->charpos[c];
+    flag = *p++;
+
+    /* --- char preamble, in short, extended short or long form --- */
+    if ((flag & 7) < 4) {
+        if (p + 10 > font->pk + font->npk) return 0;
+        length = ((flag & 3) << 8) + p[0];
+        end = p + 2 + length; /* length counts from after the char code */
+        glyph->tfm = getunsigned(p + 2, 3);
+        glyph->width = p[6];
+        glyph->height = p[7];
+        glyph->hoff = getsigned(p + 8, 1);
+        glyph->voff = getsigned(p + 9, 1);
+        p += 10;
+    } else if ((flag & 7) < 7) {
+        if (p + 17 > font->pk + font->npk) return 0;
+        length = ((flag & 3) << 16) + getunsigned(p, 2);
+        end = p + 3 + length;
+        glyph->tfm = getunsigned(p + 3, 3);
+        glyph->width = getunsigned(p + 8, 2);
+        glyph->height = getunsigned(p + 10, 2);
+        glyph->hoff = getsigned(p + 12, 2);
+        glyph->voff = getsigned(p + 14, 2);
+        p += 16;
+    } else {
+        if (p + 36 > font->pk + font->npk) return 0;
+        length = getunsigned(p, 4);
+        end = p + 8 + length;
+        glyph->tfm = getsigned(p + 8, 4);
+        glyph->width = getunsigned(p + 20, 4);
+        glyph->height = getunsigned(p + 24, 4);
+        glyph->hoff = getsigned(p + 28, 4);
+        glyph->voff = getsigned(p + 32, 4);
+        p += 36;
+    }
+    if (end > font->pk + font->npk || glyph->width < 0 || glyph->height < 0 || (long)glyph->width * glyph->height > DVIMAXPIXELS) {
+        glyph->width = glyph->height = 0;
+        return 0;
+    }
+    if (glyph->width == 0 || glyph->height == 0) return 1; /* e.g. a space */
+    if ((glyph->bitmap = calloc((size_t)glyph->width * glyph->height, 1)) == NULL) return 0;
+
+    /* --- raster: a plain bitmap, or run counts --- */
+    if ((flag >> 4) == 14) {
+        for (nbits = 0; nbits < (long)glyph->width * glyph->height && p + nbits / 8 < end; nbits++) {
+            glyph->bitmap[nbits] = (p[nbits / 8] >> (7 - nbits % 8)) & 1;
+        }
+    } else {
+        struct pkreader_struct pk = {p, end, 1, flag >> 4, 0};
+        isblack = (flag & 8) != 0;
+        while (row < glyph->height) {
+            int count = getpacked(&pk);
+            if (pk.p >= end && count <= 0) break; /* ran off the end of a broken raster */
+            while (count > 0 && row < glyph->height) {
+                int run = (count < glyph->width - col ? count : glyph->width - col);
+                if (isblack) memset(glyph->bitmap + (size_t)row * glyph->width + col, 1, run);
+                col += run;
+                count -= run;
+                if (col == glyph->width) { /* finished a row, so copy it repeat times */
+                    while (pk.repeat > 0 && row + 1 < glyph->height) {
+                        memcpy(glyph->bitmap + (size_t)(row + 1) * glyph->width, glyph->bitmap + (size_t)row * glyph->width, glyph->width);
+                        row++;
+                        pk.repeat--;
+                    }
+                    pk.repeat = 0;
+                    row++;
+                    col = 0;
+                }
+            }
+            isblack = !isblack;
+        }
+    }
+    return 1;
+}
+
+/* --- find (or load) a font at a pk resolution --- */
+static struct dvifont_struct *loadfont(char *name, int dpi) {
+    struct dvifont_struct *font = NULL;
+    unsigned char *p = NULL, *end = NULL;
+    char *pkfile = NULL;
+    int ifont = 0, c = 0;
+
+    for (ifont = 0; ifont < ndvifonts; ifont++) {
+        if (dvifonts[ifont]->dpi == dpi && strcmp(dvifonts[ifont]->name, name) == 0) return dvifonts[ifont];
+    }
+    if (ndvifonts >= DVIMAXFONTS || strlen(name) >= sizeof(font->name)) return NULL;
+    if ((font = calloc(1, sizeof(*font))) == NULL) return NULL;
+    strcpy(font->name, name);
+    font->dpi = dpi;
+    for (c = 0; c < 256; c++) font->charpos[c] = (-1);
+    dvifonts[ndvifonts++] = font; /* remembered even if it has no pk, so we don't look again */
+
+    /* --- read the pk file, and index its chars --- */
+    if (fontlookup == NULL || (pkfile = fontlookup(name, dpi)) == NULL) return font;
+    if ((font->pk = readwhole(pkfile, &font->npk)) == NULL) return font;
+    p = font->pk;
+    end = font->pk + font->npk;
+    if (font->npk < 3 || p[0] != PKPRE || p[1] != 89) goto bad_pk;
+    p += 3 + p[2] + 16; /* comment, ds, cs, hppp, vppp */
+    while (p < end && *p != PKPOST) {
+        int flag = *p;
+        if (flag >= PKXXX1 && flag < PKYYY) { /* special to skip */
+            int n = flag - PKXXX1 + 1;
+            if (p + 1 + n > end) goto bad_pk;
+            p += 1 + n + getunsigned(p + 1, n);
+        } else if (flag == PKYYY) {
+            p += 5;
+        } else if (flag == PKNOOP) {
+            p++;
+        } else if (flag >= PKXXX1) {
+            goto bad_pk;
+        } else if ((flag & 7) < 4) { /* char: remember where it is, and skip it */
+            if (p + 3 > end) goto bad_pk;
+            font->charpos[p[2]] = p - font->pk;
+            p += 3 + ((flag & 3) << 8) + p[1];
+        } else if ((flag & 7) < 7) {
+            if (p + 4 > end) goto bad_pk;
+            font->charpos[p[3]] = p - font->pk;
+            p += 4 + ((flag & 3) << 16) + getunsigned(p + 1, 2);
+        } else {
+            if (p + 9 > end) goto bad_pk;
+            if (getunsigned(p + 5, 4) < 256) font->charpos[getunsigned(p + 5, 4)] = p - font->pk;
+            p += 9 + getunsigned(p + 1, 4);
+        }
+    }
+    return font;
+
+bad_pk:
+    free(font->pk);
+    font->pk = NULL;
+    return font;
+}
+
+int dvipreload(char *fontname, int dpi) {
+    struct dvifont_struct *font = NULL;
+    int c = 0;
+    pthread_mutex_lock(&fontlock);
+    if ((font = loadfont(fontname, dpi * DVISHRINK)) != NULL && font->pk != NULL) {
+        for (c = 0; c < 256; c++) {
+            if (!font->glyphs[c].isdecoded) decodeglyph(font, c);
+        }
+    }
+    pthread_mutex_unlock(&fontlock);
+    return (font != NULL && font->pk != NULL);
+}
+
+/* -------------------------------------------------------------------------
+dvi pages
+-------------------------------------------------------------------------- */
+unsigned char *dvirender(char *dvifile, int page, int dpi, double gamma, int *nbytes) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    unsigned char *dvi = NULL, *p = NULL, *end = NULL; /* dvi file */
+    unsigned char *png = NULL;                         /* returned png */
+    int ndvi = 0;                                      /* #bytes in dvi */
+    struct {
+        unsigned long k;              /* dvi font number */
+        long scaled;                  /* scaled size in dvi units */
+        struct dvifont_struct *font;  /* loaded font */
+    } fontdefs[DVIMAXFONTS];
+    int nfontdefs = 0, ifontdef = -1;               /* #fonts defined, current font */
+    struct { long h, v, w, x, y, z; } stack[DVISTACKSZ], r = {0, 0, 0, 0, 0, 0}; /* registers */
+    int nstack = 0;
+    struct dvimark_struct *marks = NULL;            /* what goes where */
+    int nmarks = 0, maxmarks = 0;
+    double conv = 0.;                               /* pk pixels per dvi unit */
+    long num = 0, den = 0, mag = 0;                 /* from the preamble */
+    int npage = 0, isonpage = 0;                    /* pages seen, true while on the wanted one */
+    int hidpi = dpi * DVISHRINK;                    /* pk resolution */
+    long minx = 0, miny = 0, maxx = -1, maxy = -1;  /* ink extent in shrunk pixels */
+    unsigned char *coverage = NULL;                 /* #ink pk pixels per output pixel */
+    unsigned char *pixels = NULL;                   /* rgba */
+    long width = 0, height = 0;
+    unsigned char alpha[DVISHRINK * DVISHRINK + 1]; /* coverage to alpha */
+    int imark = 0, i = 0;
+
+    *nbytes = 0;
+    if (dpi < 1 || gamma <= 0. || (dvi = readwhole(dvifile, &ndvi)) == NULL) return NULL;
+    p = dvi;
+    end = dvi + ndvi;
+
+    /* -------------------------------------------------------------------------
+    preamble, then the ops up to the end of the page we want
+    -------------------------------------------------------------------------- */
+    if (ndvi < 15 || p[0] != DVIPRE) goto end_of_job;
+    num = getunsigned(p + 2, 4);
+    den = getunsigned(p + 6, 4);
+    mag = getunsigned(p + 10, 4);
+    if (num <= 0 || den <= 0 || mag <= 0) goto end_of_job;
+    conv = (double)num / (double)den * (double)mag / 1000. / 254000. * hidpi;
+    p += 15 + p[14];
+    while (p < end) {
+        int op = *p++, n = 0;
+        long a = 0, b = 0;
+        if (op < DVISET1 || (op >= DVISET1 && op < DVISETRULE) || (op >= DVIPUT1 && op < DVIPUTRULE)) { /* a char */
+            unsigned long c = 0;
+            struct dviglyph_struct *glyph = NULL;
+            if (op < DVISET1) {
+                c = op;
+            } else {
+                n = (op < DVISETRULE ? op - DVISET1 : op - DVIPUT1) + 1;
+                if (p + n > end) goto end_of_job;
+                c = getunsigned(p, n);
+                p += n;
+            }
+            if (!isonpage) continue;
+            if (ifontdef < 0 || c > 255 || fontdefs[ifontdef].font->pk == NULL) goto end_of_job; /* no pk glyph for it */
+            glyph = fontdefs[ifontdef].font->glyphs + c;
+            pthread_mutex_lock(&fontlock);
+            if (!glyph->isdecoded) decodeglyph(fontdefs[ifontdef].font, c);
+            pthread_mutex_unlock(&fontlock);
+            if (fontdefs[ifontdef].font->charpos[c] < 0) goto end_of_job;
+            if (glyph->bitmap != NULL) {
+                if (nmarks >= maxmarks) {
+                    struct dvimark_struct *more = realloc(marks, (maxmarks = 2 * maxmarks + 64) * sizeof(*marks));
+                    if (more == NULL) goto end_of_job;
+                    marks = more;
+                }
+                marks[nmarks].glyph = glyph;
+                marks[nmarks].x = (int)floor(r.h * conv + 0.5) - glyph->hoff;
+                marks[nmarks].y = (int)floor(r.v * conv + 0.5) - glyph->voff;
+                nmarks++;
+            }
+            if (op < DVIPUT1) r.h += (long)floor((double)glyph->tfm * fontdefs[ifontdef].scaled / 1048576. + 0.5); /* set, so move right */
+        } else if (op == DVISETRULE || op == DVIPUTRULE) {
+            if (p + 8 > end) goto end_of_job;
+            a = getsigned(p, 4); /* height */
+            b = getsigned(p + 4, 4); /* width */
+            p += 8;
+            if (!isonpage) continue;
+            if (a > 0 && b > 0) {
+                if (nmarks >= maxmarks) {
+                    struct dvimark_struct *more = realloc(marks, (maxmarks = 2 * maxmarks + 64) * sizeof(*marks));
+                    if (more == NULL) goto end_of_job;
+                    marks = more;
+                }
+                marks[nmarks].glyph = NULL;
+                marks[nmarks].width = (int)ceil(b * conv);
+                marks[nmarks].height = (int)ceil(a * conv);
+                marks[nmarks].x = (int)floor(r.h * conv + 0.5);
+                marks[nmarks].y = (int)floor(r.v * conv + 0.5) - marks[nmarks].height + 1; /* rules sit on the baseline */
+                nmarks++;
+            }
+            if (op == DVISETRULE) r.h += b;
+        } else if (op == DVINOP) {
+            continue;
+        } else if (op == DVIBOP) {
+            if (p + 44 > end) goto end_of_job;
+            p += 44;
+            isonpage = (++npage == page);
+            r.h = r.v = r.w = r.x = r.y = r.z = 0;
+            nstack = 0;
+            ifontdef = -1;
+        } else if (op == DVIEOP) {
+            if (isonpage) break; /* done */
+        } else if (op == DVIPUSH) {
+            if (nstack >= DVISTACKSZ) goto end_of_job;
+            stack[nstack].h = r.h, stack[nstack].v = r.v, stack[nstack].w = r.w;
+            stack[nstack].x = r.x, stack[nstack].y = r.y, stack[nstack].z = r.z;
+            nstack++;
+        } else if (op == DVIPOP) {
+            if (nstack <= 0) goto end_of_job;
+            nstack--;
+            r.h = stack[nstack].h, r.v = stack[nstack].v, r.w = stack[nstack].w;
+            r.x = stack[nstack].x, r.y = stack[nstack].y, r.z = stack[nstack].z;
+        } else if (op >= DVIRIGHT1 && op < DVIW0) {
+            n = op - DVIRIGHT1 + 1;
+            if (p + n > end) goto end_of_job;
+            r.h += getsigned(p, n);
+            p += n;
+        } else if (op >= DVIW0 && op < DVIX0) {
+            n = op - DVIW0;
+            if (p + n > end) goto end_of_job;
+            if (n > 0) r.w = getsigned(p, n);
+            r.h += r.w;
+            p += n;
+        } else if (op >= DVIX0 && op < DVIDOWN1) {
+            n = op - DVIX0;
+            if (p + n > end) goto end_of_job;
+            if (n > 0) r.x = getsigned(p, n);
+            r.h += r.x;
+            p += n;
+        } else if (op >= DVIDOWN1 && op < DVIY0) {
+            n = op - DVIDOWN1 + 1;
+            if (p + n > end) goto end_of_job;
+            r.v += getsigned(p, n);
+            p += n;
+        } else if (op >= DVIY0 && op < DVIZ0) {
+            n = op - DVIY0;
+            if (p + n > end) goto end_of_job;
+            if (n > 0) r.y = getsigned(p, n);
+            r.v += r.y;
+            p += n;
+        } else if (op >= DVIZ0 && op < DVIFNTNUM0) {
+            n = op - DVIZ0;
+            if (p + n > end) goto end_of_job;
+            if (n > 0) r.z = getsigned(p, n);
+            r.v += r.z;
+            p += n;
+        } else if ((op >= DVIFNTNUM0 && op < DVIFNT1) || (op >= DVIFNT1 && op < DVIXXX1)) { /* select a font */
+            unsigned long k = 0;
+            if (op < DVIFNT1) {
+                k = op - DVIFNTNUM0;
+            } else {
+                n = op - DVIFNT1 + 1;
+                if (p + n > end) goto end_of_job;
+                k = getunsigned(p, n);
+                p += n;
+            }
+            for (ifontdef = nfontdefs - 1; ifontdef >= 0 && fontdefs[ifontdef].k != k; ifontdef--);
+            if (ifontdef < 0 && isonpage) goto end_of_job; /* undefined font */
+        } else if (op >= DVIXXX1 && op < DVIFNTDEF1) { /* a special, e.g. color, that dvipng knows what to do with */
+            n = op - DVIXXX1 + 1;
+            if (p + n > end) goto end_of_job;
+            if (isonpage) goto end_of_job;
+            p += n + getunsigned(p, n);
+        } else if (op >= DVIFNTDEF1 && op < DVIPRE) { /* define a font */
+            unsigned long k = 0;
+            long scaled = 0, design = 0;
+            char name[256]; /* a one-byte length, so it always fits */
+            n = op - DVIFNTDEF1 + 1;
+            if (p + n + 14 > end) goto end_of_job;
+            k = getunsigned(p, n);
+            scaled = getunsigned(p + n + 4, 4);
+            design = getunsigned(p + n + 8, 4);
+            if (p + n + 14 + p[n + 12] + p[n + 13] > end) goto end_of_job;
+            memcpy(name, p + n + 14 + p[n + 12], p[n + 13]); /* name, without its area */
+            name[p[n + 13]] = '\000';
+            p += n + 14 + p[n + 12] + p[n + 13];
+            for (i = 0; i < nfontdefs && fontdefs[i].k != k; i++);
+            if (i < nfontdefs) continue; /* already defined */
+            if (nfontdefs >= DVIMAXFONTS || design <= 0) goto end_of_job;
+            fontdefs[nfontdefs].k = k;
+            fontdefs[nfontdefs].scaled = scaled;
+            pthread_mutex_lock(&fontlock);
+            fontdefs[nfontdefs].font = loadfont(name, (int)floor(hidpi * (mag / 1000.) * ((double)scaled / design) + 0.5));
+            pthread_mutex_unlock(&fontlock);
+            if (fontdefs[nfontdefs].font == NULL) goto end_of_job;
+            nfontdefs++;
+        } else { /* post, or garbage, before we found the page */
+            goto end_of_job;
+        }
+    }
+    if (!isonpage) goto end_of_job;
+
+    /* -------------------------------------------------------------------------
+    count ink pk pixels per output pixel
+    -------------------------------------------------------------------------- */
+    for (imark = 0; imark < nmarks; imark++) { /* extent, in output pixels */
+        struct dvimark_struct *mark = marks + imark;
+        long x0 = mark->x, y0 = mark->y;
+        long x1 = x0 + (mark->glyph != NULL ? mark->glyph->width : mark->width) - 1;
+        long y1 = y0 + (mark->glyph != NULL ? mark->glyph->height : mark->height) - 1;
+        x0 = (x0 >= 0 ? x0 / DVISHRINK : -((-x0 + DVISHRINK - 1) / DVISHRINK));
+        y0 = (y0 >= 0 ? y0 / DVISHRINK : -((-y0 + DVISHRINK - 1) / DVISHRINK));
+        x1 = (x1 >= 0 ? x1 / DVISHRINK : -((-x1 + DVISHRINK - 1) / DVISHRINK));
+        y1 = (y1 >= 0 ? y1 / DVISHRINK : -((-y1 + DVISHRINK - 1) / DVISHRINK));
+        if (imark == 0 || x0 < minx) minx = x0;
+        if (imark == 0 || y0 < miny) miny = y0;
+        if (imark == 0 || x1 > maxx) maxx = x1;
+        if (imark == 0 || y1 > maxy) maxy = y1;
+    }
+    if (nmarks == 0) minx = miny = maxx = maxy = 0; /* nothing on the page: one transparent pixel */
+    width = maxx - minx + 1;
+    height = maxy - miny + 1;
+    if (width * height * DVISHRINK * DVISHRINK > DVIMAXPIXELS) goto end_of_job;
+    if ((coverage = calloc(width * height, 1)) == NULL) goto end_of_job;
+    for (imark = 0; imark < nmarks; imark++) {
+        struct dvimark_struct *mark = marks + imark;
+        int w = (mark->glyph != NULL ? mark->glyph->width : mark->width);
+        int h = (mark->glyph != NULL ? mark->glyph->height : mark->height);
+        int row = 0, col = 0;
+        for (row = 0; row < h; row++) {
+            long y = mark->y + row + DVISHRINK * (-miny + 1); /* offset so it's positive before dividing */
+            unsigned char *line = coverage + (y / DVISHRINK - 1) * width;
+            for (col = 0; col < w; col++) {
+                long x = mark->x + col + DVISHRINK * (-minx + 1);
+                if (mark->glyph != NULL && !mark->glyph->bitmap[(size_t)row * w + col]) continue;
+                if (line[x / DVISHRINK - 1] < DVISHRINK * DVISHRINK) line[x / DVISHRINK - 1]++; /* overlaps don't count twice */
+            }
+        }
+    }
+
+    /* -------------------------------------------------------------------------
+    crop to the ink (-T tight), and shade by coverage (--gamma) over transparent
+    -------------------------------------------------------------------------- */
+    if (nmarks > 0) {
+        long top = 0, bottom = height - 1, left = 0, right = width - 1, x = 0;
+        while (top < bottom) {
+            for (x = 0; x < width && coverage[top * width + x] == 0; x++);
+            if (x < width) break;
+            top++;
+        }
+        while (bottom > top) {
+            for (x = 0; x < width && coverage[bottom * width + x] == 0; x++);
+            if (x < width) break;
+            bottom--;
+        }
+        while (left < right) {
+            for (x = top; x <= bottom && coverage[x * width + left] == 0; x++);
+            if (x <= bottom) break;
+            left++;
+        }
+        while (right > left) {
+            for (x = top; x <= bottom && coverage[x * width + right] == 0; x++);
+            if (x <= bottom) break;
+            right--;
+        }
+        if (top > 0 || left > 0 || bottom < height - 1 || right < width - 1) {
+            long row = 0;
+            for (row = top; row <= bottom; row++) memmove(coverage + (row - top) * (right - left + 1), coverage + row * width + left, right - left + 1);
+            width = right - left + 1;
+            height = bottom - top + 1;
+        }
+    }
+    for (i = 0; i <= DVISHRINK * DVISHRINK; i++) alpha[i] = (unsigned char)floor(255. * pow((double)i / (DVISHRINK * DVISHRINK), 1. / gamma) + 0.5);
+    if ((pixels = calloc(width * height, 4)) == NULL) goto end_of_job; /* black */
+    for (i = 0; i < width * height; i++) pixels[4 * i + 3] = alpha[coverage[i]];
+    png = pngencode(pixels, (int)width, (int)height, 9, 0, nbytes); /* formulas are small, so the best level costs little */
+
+end_of_job:
+    free(dvi);
+    free(marks);
+    free(coverage);
+    free(pixels);
+    return png;
+}
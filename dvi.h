@@ -0,0 +1,51 @@
+#ifndef __dvi_h__
+#define __dvi_h__
+
+/* ---
+ * built-in dvi-to-png: pk glyphs at DVISHRINK times the output resolution,
+ * shrunk to DVISHRINK*DVISHRINK+1 levels of coverage like dvipng -Q 4
+ * ------------------------------------------------------------------------ */
+#define DVISHRINK 4                 /* pk pixels per output pixel, each way */
+#define DVIMAXFONTS 256             /* fonts remembered by this process */
+#define DVIMAXPIXELS (4096 * 4096)  /* larger images are left to dvipng */
+
+/**
+ * Finds the pk file for a font at a resolution, e.g. with kpsewhich. Supplied by the caller of dvisetfontlookup().
+ *
+ * @param fontname[in] Null-terminated char* containing the tfm name, e.g. cmr10.
+ * @param dpi[in] int containing the resolution the pk file should have.
+ * @return Null-terminated char* containing the path (which the caller may overwrite on the next call), or `NULL` if there's none.
+ */
+typedef char *(*dvifontlookup)(char *fontname, int dpi);
+
+/**
+ * Sets the function dvirender() uses to find pk files.
+ *
+ * @param lookup[in] dvifontlookup to use.
+ */
+void dvisetfontlookup(dvifontlookup lookup);
+
+/**
+ * Loads a font's pk file and all its glyphs now, so renders in forked children of this process find it already loaded.
+ *
+ * @param fontname[in] Null-terminated char* containing the tfm name, e.g. cmr10.
+ * @param dpi[in] int containing the output resolution it'll be rendered at, at its design size.
+ * @return 1 if loaded, 0 if it can't be.
+ */
+int dvipreload(char *fontname, int dpi);
+
+/**
+ * Renders one page of a dvi file as a png with a transparent background and black glyphs and rules, cropped to the ink (as dvipng -T tight).
+ * Glyphs come from pk fonts, loaded once per (font, size, resolution) and kept for later renders by this process. Anything else (specials, virtual or
+ * Type1-only fonts, a page larger than DVIMAXPIXELS) is left to dvipng by returning `NULL`.
+ *
+ * @param dvifile[in] Null-terminated char* containing the dvi file.
+ * @param page[in] int containing the page to render, 1 for the first.
+ * @param dpi[in] int containing the output resolution.
+ * @param gamma[in] double containing the gamma applied to coverage, as dvipng --gamma (>1 darker, <1 lighter).
+ * @param nbytes[out] int* receiving the size of the png.
+ * @return malloc()'ed png the caller frees, or `NULL` if this page can't be rendered here.
+ */
+unsigned char *dvirender(char *dvifile, int page, int dpi, double gamma, int *nbytes);
+
+#endif // __dvi_h__
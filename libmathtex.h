@@ -0,0 +1,111 @@
+#ifndef __libmathtex_h__
+#define __libmathtex_h__
+
+/* ---
+ * mathTeX as a library, for programs that would otherwise run the mathtex
+ * binary for every expression and read its image back from disk: the same
+ * preprocessing, directives, cache and rendering, with the image returned
+ * in memory, now or (submitted) once a pollable fd says it's ready.
+ * nothing's written to stdout, and nothing calls exit()
+ * ------------------------------------------------------------------------ */
+#define MATHTEXNODEPTH (-9999) /* depth not requested or unknown */
+#define MATHTEXMESSAGESZ 2048  /* mathtexmeta_struct message buffer */
+
+#if defined(LIBMATHTEX)
+    #define MATHTEXAPI __attribute__((visibility("default"))) /* the only symbols libmathtex.so exports */
+#else
+    #define MATHTEXAPI
+#endif
+
+/* --- a cache, and the settings its renders start from --- */
+struct mathtexlib_struct;
+
+/* --- per-render options; zeroed (or a `NULL` pointer) means the defaults --- */
+struct mathtexopts_struct {
+    int dpi;       /* density, or 0 for the default (as -d) */
+    int imagetype; /* 1=gif, 2=png, 3=svg, 4=svgz, or 0 for the default */
+    int isdepth;   /* true to measure depth below baseline, as \depth */
+    int isnocache; /* true to neither read nor write the cache, as -c none */
+};
+
+/* --- what came back with the image --- */
+struct mathtexmeta_struct {
+    char key[33];                      /* cache key, 32 hex digits, or empty if there's none */
+    int ishit;                         /* true if the image came from the cache */
+    int depth;                         /* pixels below baseline, or MATHTEXNODEPTH */
+    int width, height;                 /* pixels, or 0 for svg */
+    char message[MATHTEXMESSAGESZ];    /* why, if mathtex_render() failed: latex's error, or ours */
+};
+
+/**
+ * Opens the library for this process. The cache directory, message level and the paths to latex and friends are the process's, so open it once (again
+ * changes them for every context); its renders can then run on any number of threads at once.
+ *
+ * @param cachedir[in] Null-terminated char* containing the cache directory (made if need be), `NULL` for the default, or "none" to never cache.
+ * @param loglevel[in] int containing the verbosity of the log written to stderr, as -m (0 for errors only).
+ * @return malloc()'ed context to render with and mathtex_close(), or `NULL` if out of memory.
+ */
+MATHTEXAPI struct mathtexlib_struct *mathtex_open(char *cachedir, int loglevel);
+
+/**
+ * Renders one expression, or finds it in the cache: unescape_url(), mathprep(), validate() and the \\directives, exactly as the command line.
+ *
+ * @param lib[in] struct mathtexlib_struct* from mathtex_open().
+ * @param expression[in] Null-terminated char* containing the expression, left as it is.
+ * @param opts[in] struct mathtexopts_struct* containing options for this render, which the expression's directives override; may be `NULL`.
+ * @param image[out] unsigned char** receiving the malloc()'ed image the caller frees, or `NULL` on failure.
+ * @param nbytes[out] int* receiving its size.
+ * @param meta[out] struct mathtexmeta_struct* receiving its key, depth, size and hit, or the error message; may be `NULL`.
+ * @return 0 if there's an image, -1 if not (with meta's message saying why).
+ */
+MATHTEXAPI int mathtex_render(struct mathtexlib_struct *lib, char *expression, struct mathtexopts_struct *opts, unsigned char **image, int *nbytes,
+                              struct mathtexmeta_struct *meta);
+
+/* --- a render running in the background --- */
+struct mathtexjob_struct;
+
+/**
+ * Starts rendering an expression on a thread of its own, as mathtex_render(), and returns at once, for event loops that can't wait out latex.
+ *
+ * @param lib[in] struct mathtexlib_struct* from mathtex_open().
+ * @param expression[in] Null-terminated char* containing the expression, copied.
+ * @param opts[in] struct mathtexopts_struct* containing options for this render, copied; may be `NULL`.
+ * @return Job to poll mathtex_jobfd() for and collect with mathtex_complete() or give up on with mathtex_cancel(), or `NULL` if it couldn't start.
+ */
+MATHTEXAPI struct mathtexjob_struct *mathtex_submit(struct mathtexlib_struct *lib, char *expression, struct mathtexopts_struct *opts);
+
+/**
+ * The job's completion fd, for poll() or epoll: readable once mathtex_complete() has its result. It's closed with the job, so take it out of an epoll
+ * set before collecting or cancelling the job.
+ *
+ * @param job[in] struct mathtexjob_struct* from mathtex_submit().
+ * @return The fd.
+ */
+MATHTEXAPI int mathtex_jobfd(struct mathtexjob_struct *job);
+
+/**
+ * Collects a job's result, without blocking. Once it's returned 0 or -1, the job is freed.
+ *
+ * @param job[in] struct mathtexjob_struct* from mathtex_submit().
+ * @param image[out] unsigned char** receiving the malloc()'ed image the caller frees, or `NULL`.
+ * @param nbytes[out] int* receiving its size.
+ * @param meta[out] struct mathtexmeta_struct* receiving what came back with it, as mathtex_render(); may be `NULL`.
+ * @return 1 if it's still running (and the job is left as it is), otherwise as mathtex_render().
+ */
+MATHTEXAPI int mathtex_complete(struct mathtexjob_struct *job, unsigned char **image, int *nbytes, struct mathtexmeta_struct *meta);
+
+/**
+ * Gives up on a job, without blocking: the latex, dvipng, etc it's running are killed, and it's freed once its thread is done. Don't use it after.
+ *
+ * @param job[in] struct mathtexjob_struct* from mathtex_submit(); may be `NULL`.
+ */
+MATHTEXAPI void mathtex_cancel(struct mathtexjob_struct *job);
+
+/**
+ * Frees a context once no thread is rendering with it (including submitted jobs).
+ *
+ * @param lib[in] struct mathtexlib_struct* from mathtex_open(); may be `NULL`.
+ */
+MATHTEXAPI void mathtex_close(struct mathtexlib_struct *lib);
+
+#endif // __libmathtex_h__
@@ -29,12 +29,15 @@
  *     -DDVIPS=\"/usr/share/texmf/bin/dvips\"       path to dvips
  *     -DPS2EPSI=\"/usr/bin/ps2epsi\"               path to ps2epsi
  *     -DCONVERT=\"/usr/bin/convert\"               path to convert
+ *     -DDVISVGM=\"/usr/share/texmf/bin/dvisvgm\"   path to dvisvgm
  *     -DCACHE=\"mathtex/\"                         relative path to mathTeX's cache dir
  *     -DTIMELIMIT=\"/usr/local/bin/timelimit\"     path to timelimit
  *     -WARNTIME=10                                 #secs latex can run using standalone timelimit
  *     -KILLTIME=10                                 #secs latex can run using built-in timelimit()
  *     -DGIF                                        emit gif images
  *     -DPNG                                        emit png images (default)
+ *     -DSVG                                        emit svg images, the same at any dpi
+ *     -DSVGZ                                       emit gzipped svg images
  *     -DDISPLAYSTYLE                               [ \displaystyle ]
  *     -DTEXTSTYLE                                  $ \textstyle $
  *     -DPARSTYLE                                   paragraph mode, supply your own "$ $" or "[ ]"
@@ -45,6 +48,7 @@
  *     -DGAMMA=\"2.5\"                              dvipng --gamma GAMMA  param (as "string")
  *     -DNOQUIET                                    -halt-on-error (default reply q(uiet) to error)
  *     -DMAXINVALID=0                               max length expression from invalid referer
+ *     -DLIBMATHTEX                                 leave out main(), for libmathtex (see libmathtex.h)
  * See mathtex.h for more information.
  *
  * Notes;
@@ -86,47 +90,57 @@
 
 #include "mathtex.h"
 
+#if !defined(LIBMATHTEX) /* libmathtex has mathtex_open() and mathtex_render() instead */
 int main(int argc, char *argv[]) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
     /* --- expression to be emitted --- */
     static char exprbuffer[MAXEXPRSZ + 1] = "\000"; /* input TeX expression */
-    char hashexpr[MAXEXPRSZ + 1] = "\000";          /* usually use md5 of original expr*/
     char *expression = exprbuffer;                  /* ptr to expression */
-    int isquery = 0;                                /* true if input from QUERY_STRING */
-
-    /* --- preprocess expression for special mathTeX directives, etc --- */
-    int irep = 0;
-    char argstring[256];
-    char *pdirective = NULL; /* ptr to char after \directive */
-
-    /* --- other initialization variables --- */
-    int perm_all = (S_IRWXU | S_IRWXG | S_IRWXO); /* 777 permissions */
     int nbytes = 0;
-    int iscolorpackage = 0;   /* true if \usepackage{color} found*/
-    int iseepicpackage = 0;   /* true if \usepackage{eepic} found*/
-    int ispict2epackage = 0;  /* true if \usepackage{pict2e}found*/
-    int ispreviewpackage = 0; /* true if \usepackage{preview} */
 
     /* --- image caching --- */
-    char *md5hash = NULL; /* md5 has of expression */
+    char *md5hash = NULL; /* cache key of expression */
     char *pwdpath = NULL; /* home pwd for relative file paths */
-
-    char whichtemplate[512] = /* mathTeX which "adtemplate" */
-        "\\begin{center}\n"
-        "\\fbox{\\footnotesize %%whichpath%%}\\\\ \\vspace*{-.2in}"
-        "%%beginmath%% %%expression%% %%endmath%%\n"
-        "\\end{center}\n";
+    char *optend = NULL;  /* past a numeric operand */
+
+    /* --- long options without a short equivalent --- */
+    char servepath[256] = "\000"; /* --serve socket path */
+    char inputfile[256] = "\000"; /* -f expression (or --batch) file */
+    int isbatch = 0;               /* 1 for --batch, 2 for --batch=nul */
+    char workdir[256] = "\000";    /* --work dir, empty for /dev/shm */
+    int iswork = 0;                /* true for --work */
+    static struct option longopts[] = {
+        {"serve", required_argument, NULL, SERVEOPT},
+        {"batch", optional_argument, NULL, BATCHOPT},
+        {"fmt", no_argument, NULL, FORMATOPT},
+        {"pool", required_argument, NULL, POOLOPT},
+        {"work", optional_argument, NULL, WORKOPT},
+        {"dvipng", no_argument, NULL, DVIPNGOPT},
+        {"optimize", optional_argument, NULL, OPTIMIZEOPT},
+        {"master", optional_argument, NULL, MASTEROPT},
+        {"migrate", optional_argument, NULL, MIGRATEOPT},
+        {"shards", required_argument, NULL, SHARDSOPT},
+        {"cache-size", required_argument, NULL, CACHESIZEOPT},
+        {"cache-entries", required_argument, NULL, CACHEENTRIESOPT},
+        {"gc", no_argument, NULL, GCOPT},
+        {"pack", no_argument, NULL, PACKOPT},
+        {"compact", no_argument, NULL, COMPACTOPT},
+        {"error-ttl", required_argument, NULL, ERRORTTLOPT},
+        {"durability", required_argument, NULL, DURABILITYOPT},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
 
     /* -------------------------------------------------------------------------
     Initialization
     -------------------------------------------------------------------------- */
     /* --- set global variables --- */
     msgfp = stdout;                                                  /* for query mode output. hardcoded from `NULL` to `stdout` for now... */
-    msgnumber = 0;                                                   /* no errors to report yet */
-    if (imagetype < 1 || imagetype > 2) imagetype = 1;               /* keep in bounds */
-    if (imagemethod < 1 || imagemethod > 2) imagemethod = 1;         /* keep in bounds */
+    render->msgnumber = 0;                                                   /* no errors to report yet */
+    if (render->imagetype < 1 || render->imagetype > 4) render->imagetype = 1;               /* keep in bounds */
+    if (render->imagemethod < 1 || render->imagemethod > 2) render->imagemethod = 1;         /* keep in bounds */
     if ((pwdpath = presentwd(0)) != NULL) strcpy(homepath, pwdpath); /* pwd where exectuable resides. save it for mathtex() later */
 
     /* ---
@@ -138,11 +152,11 @@ int main(int argc, char *argv[]) {
         fprintf(msgfp, "%s%s%s", about, usage, license);
         exit(0);
     } else {
-        while ((c = getopt(argc, argv, ":c:d:f:hm:no:stw")) != -1) {
+        while ((c = getopt_long(argc, argv, ":c:d:f:hj:m:no:stw", longopts, NULL)) != -1) {
             switch (c) {
                 case 'c': // cache w/ location
                     strcpy(cachepath, optarg);
-                    if (strlen(cachepath) < 1 || strcmp(cachepath, "none") == 0) iscaching = 0; // disable caching if path is an empty string or keyword "none"
+                    if (strlen(cachepath) < 1 || strcmp(cachepath, "none") == 0) render->iscaching = 0; // disable caching if path is an empty string or keyword "none"
                     break;
                 case 'd': // dpi
                     if (isnumeric(optarg)) {
@@ -150,20 +164,15 @@ int main(int argc, char *argv[]) {
                         if (val < 0) {
                             log_info(1, "Negative DPI provided - ignoring.");
                         } else {
-                            strcpy(density, optarg);
+                            strcpy(render->density, optarg);
                         }
                     } else {
                         log_error("Operand to option -%c must be an integer.\n", c);
                         iserror++;
                     }
                     break;
-                case 'f': // input file
-                    nbytes = readcachefile(optarg, (unsigned char *)exprbuffer);
-                    if (nbytes == 0) {
-                        log_error("Unable to open file %s.", optarg);
-                        iserror++;
-                    }
-                    exprbuffer[nbytes] = '\000'; // @TODO whats the point of this? earlier null delimiter?
+                case 'f': // input file. read once we know whether it's a --batch
+                    strninit(inputfile, optarg, 255);
                     break;
                 case 'h': // help. trumps normal message verbosity
                     fprintf(stdout, "%s%s%s", about, usage, license);
@@ -179,8 +188,8 @@ int main(int argc, char *argv[]) {
                     }
                     break;
                 case 'o':                    // output file
-                    strcpy(outfile, optarg); // strcpy output path
-                    trimwhite(outfile);
+                    strcpy(render->outfile, optarg); // strcpy output path
+                    trimwhite(render->outfile);
                     break;
                 case 's': // write stdout
                     write_stdout = 1;
@@ -191,6 +200,138 @@ int main(int argc, char *argv[]) {
                 case 'w': // keep work dir
                     keep_work = 1;
                     break;
+                case SERVEOPT: // serve requests on a unix socket
+                    strninit(servepath, optarg, 255);
+                    break;
+                case FORMATOPT: // start latex from a precompiled preamble
+                    isformat = 1;
+                    break;
+                case WORKOPT: // temp work files in memory, or under another dir
+                    iswork = 1;
+                    if (optarg != NULL) {
+                        strninit(workdir, optarg, 255);
+                    }
+                    break;
+                case DVIPNGOPT: // never render the dvi ourselves
+                    isdvirender = 0;
+                    break;
+                case OPTIMIZEOPT: // smaller png's, without metadata
+                    if (optarg == NULL) {
+                        pnglevel = 9;
+                    } else if (strcmp(optarg, "max") == 0) {
+                        pnglevel = 9;
+                        pngeffort = 1;
+                    } else if (isnumeric(optarg) && atoi(optarg) >= 1 && atoi(optarg) <= 9) {
+                        pnglevel = atoi(optarg);
+                    } else {
+                        log_error("Operand to option --optimize must be 1-9 or max.\n");
+                        iserror++;
+                    }
+                    break;
+                case MASTEROPT: // lower densities shrunk from one rendering
+                    if (optarg == NULL) {
+                        masterdpi = DEFAULTMASTERDPI;
+                    } else if (isnumeric(optarg) && atoi(optarg) > 0) {
+                        masterdpi = atoi(optarg);
+                    } else {
+                        log_error("Operand to option --master must be a positive integer.\n");
+                        iserror++;
+                    }
+                    break;
+                case MIGRATEOPT: // re-shard the cache, then exit
+                    migrateworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                    if (optarg != NULL) {
+                        if (isnumeric(optarg) && atoi(optarg) > 0) {
+                            migrateworkers = atoi(optarg);
+                        } else {
+                            log_error("Operand to option --migrate must be a positive integer.\n");
+                            iserror++;
+                        }
+                    }
+                    if (migrateworkers < 1) migrateworkers = 1;
+                    break;
+                case SHARDSOPT: // levels of cache subdirectories
+                    if (isnumeric(optarg) && atoi(optarg) >= 0 && atoi(optarg) <= MAXCACHESHARDS) {
+                        cacheshards = atoi(optarg);
+                    } else {
+                        log_error("Operand to option --shards must be 0-%d.\n", MAXCACHESHARDS);
+                        iserror++;
+                    }
+                    break;
+                case CACHESIZEOPT: // most bytes of cached files
+                    cachemaxbytes = strtol(optarg, &optend, 10);
+                    if (*optend != '\000' && strchr("kKmMgG", *optend) != NULL) { /* 2^10, 2^20 or 2^30 */
+                        cachemaxbytes <<= (tolower(*optend) == 'k' ? 10 : (tolower(*optend) == 'm' ? 20 : 30));
+                        optend++;
+                    }
+                    if (optend == optarg || *optend != '\000' || cachemaxbytes < 1) {
+                        log_error("Operand to option --cache-size must be a positive integer, with an optional k, m or g.\n");
+                        iserror++;
+                    }
+                    break;
+                case CACHEENTRIESOPT: // most cached files
+                    if (isnumeric(optarg) && atol(optarg) > 0) {
+                        cachemaxentries = atol(optarg);
+                    } else {
+                        log_error("Operand to option --cache-entries must be a positive integer.\n");
+                        iserror++;
+                    }
+                    break;
+                case GCOPT: // evict down to the bounds, then exit
+                    isgc = 1;
+                    break;
+                case PACKOPT: // cache images in pack files
+                    ispack = 1;
+                    break;
+                case COMPACTOPT: // reclaim the packs' dead space, then exit
+                    iscompact = 1;
+                    break;
+                case DURABILITYOPT: // sync cache writes to disk
+                    if (strcmp(optarg, "none") == 0) {
+                        durability = 0;
+                    } else if (strcmp(optarg, "data") == 0) {
+                        durability = 1;
+                    } else if (strcmp(optarg, "full") == 0) {
+                        durability = 2;
+                    } else {
+                        log_error("Operand to option --durability must be none, data or full.\n");
+                        iserror++;
+                    }
+                    break;
+                case ERRORTTLOPT: // seconds to remember a latex failure
+                    if (isnumeric(optarg)) {
+                        errorttl = atoi(optarg);
+                    } else {
+                        log_error("Operand to option --error-ttl must be an integer.\n");
+                        iserror++;
+                    }
+                    break;
+                case 'j': // --batch threads
+                    if (isnumeric(optarg) && atoi(optarg) > 0) {
+                        batchthreads = min2(atoi(optarg), MAXBATCHTHREADS);
+                    } else {
+                        log_error("Operand to option -%c must be a positive integer.\n", c);
+                        iserror++;
+                    }
+                    break;
+                case POOLOPT: // latex workers for --serve
+                    if (isnumeric(optarg)) {
+                        poolsize = atoi(optarg);
+                    } else {
+                        log_error("Operand to option --pool must be an integer.\n");
+                        iserror++;
+                    }
+                    break;
+                case BATCHOPT: // render a stream of requests
+                    if (optarg == NULL || strcmp(optarg, "json") == 0) {
+                        isbatch = 1;
+                    } else if (strcmp(optarg, "nul") == 0) {
+                        isbatch = 2;
+                    } else {
+                        log_error("Operand to option --batch must be json or nul.\n");
+                        iserror++;
+                    }
+                    break;
                 case ':': // one of those without an operand
                     fprintf(stderr, "Option -%c requires an operand.\n", optopt);
                     iserror++;
@@ -206,8 +347,60 @@ int main(int argc, char *argv[]) {
         log_info(1, usage);
         exit(2);
     }
+    if (iswork) setworkpath(workdir); /* falls back to workpath if it can't be used */
+    dvisetfontlookup(findpk);         /* dvirender() finds pk fonts with kpsewhich */
+
+    /* ---
+     * move an existing cache into the current layout
+     * ---------------------------------------------- */
+    if (migrateworkers > 0) {
+        exit(migratecache(migrateworkers) < 0 ? 2 : 0);
+    }
+
+    /* ---
+     * or trim it to its bounds
+     * ------------------------ */
+    if (isgc) {
+        exit(gccache() < 0 ? 2 : 0);
+    }
+
+    /* ---
+     * or compact its packs
+     * -------------------- */
+    if (iscompact) {
+        exit(compactcache() < 0 ? 2 : 0);
+    }
+
+    /* ---
+     * serve requests from a socket instead of rendering one expression
+     * ----------------------------------------------------------------- */
+    if (!isempty(servepath)) {
+        log_info(1, "%s%s\n", about, license);
+        exit(serve(servepath));
+    }
+
+    /* ---
+     * or render every request in a stream
+     * ----------------------------------- */
+    if (isbatch) {
+        FILE *batchfp = (isempty(inputfile) ? stdin : fopen(inputfile, "r"));
+        if (batchfp == NULL) {
+            log_error("Unable to open file %s.\n", inputfile);
+            exit(2);
+        }
+        exit(batch(batchfp, isbatch == 2));
+    }
 
     // get expression
+    if (!isempty(inputfile)) {
+        nbytes = readcachefile(inputfile, (unsigned char *)exprbuffer);
+        if (nbytes == 0) {
+            log_error("Unable to open file %s.", inputfile);
+            exit(2);
+        }
+        exprbuffer[nbytes] = '\000'; // @TODO whats the point of this? earlier null delimiter?
+    }
+
     if (isempty(exprbuffer)) {
         if (optind > argc) {
             log_error("Expression not provided - nothing to render.\n");
@@ -219,9 +412,363 @@ int main(int argc, char *argv[]) {
     log_info(1, "%s%s\n", about, license);
 
     /* ---
-     * pre-process expression
-     * ---------------------- */
-    // @TODO should we throw everything below this into mathprep???
+     * pre-process expression, in a render context of its own
+     * ------------------------------------------------------- */
+    if (renderopen() == NULL) {
+        log_error("%s\n", embeddedtext[UNKNOWNERROR]);
+        exit(2);
+    }
+    if (!preprocess(expression)) goto end_of_job;
+    md5hash = cachekey(expression);
+
+    /* ---
+     * emit informational messages
+     * --------------------- */
+    log_info(5, "[main] running image: %s\n", argv[0]);
+    log_info(5, "[main] home directory: %s\n", homepath);
+    log_info(10, "[main] %s timelimit info: warn/killtime=%d/%d, path=%s\n", (timelimit("", -99) == 992 ? "Built-in" : "Stub"), warntime, killtime,
+             (istimelimitpath ? timelimitpath : "none"));
+
+    /* -------------------------------------------------------------------------
+    Emit cached image or render the expression
+    -------------------------------------------------------------------------- */
+    if (write_stdout && render->imagemethod == 1 && render->imagetype <= 2 && pnglevel == 0 && masterdpi == 0) render->streamfd = fileno(stdout); /* dvipng writes a rendered image straight to stdout */
+    if (md5hash != NULL) {                                     /* md5str() almost surely succeeded*/
+        char *imagefile = cacheimage(expression, md5hash, NULL, NULL); /* cached, or rendered now */
+        if (imagefile == NULL) {                                 /* shits fucked. throw error message and abandon ship */
+            log_error(embeddedtext[render->msgnumber]);
+            goto end_of_job;
+        }
+
+        /* ---
+         * copy cached image out to the explicit output file
+         * ------------------------------------------------- */
+        if (render->iscaching && !isempty(render->outfile)) {
+            if (copycache(imagefile, render->outfile) < 0) {
+                log_error("%s\n", embeddedtext[EMITFAILED]);
+                goto end_of_job;
+            }
+        }
+
+        /** ---
+         * emit image to stdout
+         * -------------------- */
+        if (write_stdout && !render->isstreamed) { /* unless dvipng already wrote it there */
+            if (emitcache(imagefile) < 0) {
+                log_error("Failed to open file to write stdout (did the file get created?)\n"); // @TODO necessary?
+                exit(1);
+            }
+        }
+
+        /* ---
+         * remove images not being cached
+         * ------------------------------ */
+        if (!render->iscaching) {           /* don't want this image cached */
+            if (isempty(render->outfile)) { /* unless explicit outfile provided*/
+                remove(imagefile);  /* remove file */
+            }
+        }
+    }
+
+end_of_job:
+    if (msgfp != NULL && msgfp != stdout) fclose(msgfp); /* have an open message file, so close it at eoj */
+    exit(0);
+}
+#endif
+
+struct mathtexlib_struct *mathtex_open(char *cachedir, int loglevel) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    struct mathtexlib_struct *lib = malloc(sizeof(struct mathtexlib_struct));
+    char *pwdpath = NULL; /* home pwd for relative file paths */
+
+    /* -------------------------------------------------------------------------
+    what main() sets up for the process, with the log on stderr
+    -------------------------------------------------------------------------- */
+    if (lib == NULL) return NULL;
+    msgfp = stderr;   /* stdout is the caller's */
+    msglevel = loglevel;
+    if ((pwdpath = presentwd(0)) != NULL) strcpy(homepath, pwdpath);
+    if (cachedir != NULL) strninit(cachepath, cachedir, 255);
+    dvisetfontlookup(findpk);
+
+    /* -------------------------------------------------------------------------
+    and the settings its renders start from
+    -------------------------------------------------------------------------- */
+    memcpy(&lib->settings, &settings, sizeof(struct render_struct));
+    if (lib->settings.imagetype < 1 || lib->settings.imagetype > 4) lib->settings.imagetype = 1;       /* keep in bounds */
+    if (lib->settings.imagemethod < 1 || lib->settings.imagemethod > 2) lib->settings.imagemethod = 1; /* keep in bounds */
+    lib->settings.iscaching = !(isempty(cachepath) || strcmp(cachepath, "none") == 0);
+    lib->settings.parent = NULL;
+    return lib;
+}
+
+int mathtex_render(struct mathtexlib_struct *lib, char *expression, struct mathtexopts_struct *opts, unsigned char **image, int *nbytes,
+                   struct mathtexmeta_struct *meta) {
+    return librender(lib, -1, expression, opts, image, nbytes, meta);
+}
+
+int librender(struct mathtexlib_struct *lib, int cancelfd, char *expression, struct mathtexopts_struct *opts, unsigned char **image, int *nbytes,
+              struct mathtexmeta_struct *meta) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    struct mathtexmeta_struct result;       /* meta, if the caller didn't want it */
+    struct render_struct *caller = render;  /* this thread's context, put back after */
+    struct render_struct *context = NULL;   /* this render's */
+    char *exprbuffer = NULL;                /* expression, to preprocess() in place */
+    char *md5hash = NULL;                   /* its cache key */
+    char *imagefile = NULL;                 /* cached or rendered image */
+    int imagefd = (-1);                     /* open imagefile (or its pack) */
+    long offset = 0;                        /* where the image starts in it */
+    int nimage = 0, nread = 0, n = 0;       /* its size, #bytes read, #bytes this pread() */
+    int status = (-1);                      /* -1 until there's an image */
+
+    /* -------------------------------------------------------------------------
+    nothing yet
+    -------------------------------------------------------------------------- */
+    if (meta == NULL) meta = &result;
+    memset(meta, 0, sizeof(struct mathtexmeta_struct));
+    meta->depth = MATHTEXNODEPTH;
+    *image = NULL;
+    *nbytes = 0;
+    if (lib == NULL || expression == NULL || (exprbuffer = malloc(MAXEXPRSZ + 1)) == NULL) {
+        strninit(meta->message, embeddedtext[UNKNOWNERROR], MATHTEXMESSAGESZ - 1);
+        return -1;
+    }
+    if (strlen(expression) > MAXEXPRSZ) {
+        strcpy(meta->message, "Expression too long.\n");
+        free(exprbuffer);
+        return -1;
+    }
+    strcpy(exprbuffer, expression);
+
+    /* -------------------------------------------------------------------------
+    same steps as the command line, in a context opened from lib's settings,
+    with opts applied first so the expression's own directives override them
+    -------------------------------------------------------------------------- */
+    render = &lib->settings;
+    if ((context = renderopen()) == NULL) {
+        strninit(meta->message, embeddedtext[UNKNOWNERROR], MATHTEXMESSAGESZ - 1);
+        goto end_of_job;
+    }
+    render->cancelfd = cancelfd; /* and any contexts opened from it */
+    if (opts != NULL) {
+        if (opts->dpi > 0) sprintf(render->density, "%d", opts->dpi);
+        if (opts->imagetype >= 1 && opts->imagetype <= 4) render->imagetype = opts->imagetype;
+        if (opts->isdepth) {
+            render->isdepth = 1;
+            render->latexwrapper = strcpy(render->wrapper, latexdepthwrapper);
+        }
+        if (opts->isnocache) render->iscaching = 0;
+    }
+    if (!preprocess(exprbuffer)) {
+        strcpy(meta->message, "Expression empty after preprocessing; not rendering.\n");
+        goto end_of_job;
+    }
+    if ((md5hash = cachekey(exprbuffer)) == NULL) {
+        strninit(meta->message, embeddedtext[UNKNOWNERROR], MATHTEXMESSAGESZ - 1);
+        goto end_of_job;
+    }
+    strninit(meta->key, md5hash, FRAMEKEYSZ);
+    if ((imagefile = cacheimage(exprbuffer, md5hash, &meta->ishit, &meta->depth)) == NULL) {
+        if (render->errorcount > 0) { /* latex told us what went wrong */
+            strninit(meta->message, render->errors[0], MATHTEXMESSAGESZ - 1);
+        } else {
+            strninit(meta->message, embeddedtext[render->msgnumber], MATHTEXMESSAGESZ - 1);
+        }
+        goto end_of_job;
+    }
+
+    /* -------------------------------------------------------------------------
+    and the image into memory, rather than out to a file or stdout
+    -------------------------------------------------------------------------- */
+    if ((imagefd = openimage(imagefile, &offset, &nimage)) < 0 || (*image = malloc(nimage > 0 ? nimage : 1)) == NULL) {
+        strninit(meta->message, embeddedtext[EMITFAILED], MATHTEXMESSAGESZ - 1);
+        goto end_of_job;
+    }
+    for (nread = 0; nread < nimage; nread += n) { /* pread(), as a pack's fd is shared */
+        if ((n = (int)pread(imagefd, *image + nread, nimage - nread, offset + nread)) < 0 && errno == EINTR) {
+            n = 0; /* interrupted, so again */
+        } else if (n <= 0) {
+            break; /* the file shrank, or can't be read */
+        }
+    }
+    if (nread < nimage) {
+        free(*image);
+        *image = NULL;
+        strninit(meta->message, embeddedtext[EMITFAILED], MATHTEXMESSAGESZ - 1);
+        goto end_of_job;
+    }
+    *nbytes = nimage;
+    imagesize(*image, nimage, &meta->width, &meta->height);
+    if (!render->iscaching) remove(imagefile); /* don't want this image cached */
+    status = 0;
+
+end_of_job:
+    if (status != 0 && context != NULL && iscancelled()) strcpy(meta->message, "Cancelled.\n");
+    if (imagefd >= 0) close(imagefd);
+    renderclose(context);
+    render = caller;
+    free(exprbuffer);
+    return status;
+}
+
+void mathtex_close(struct mathtexlib_struct *lib) {
+    if (lib != NULL) free(lib);
+}
+
+struct mathtexjob_struct *mathtex_submit(struct mathtexlib_struct *lib, char *expression, struct mathtexopts_struct *opts) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    struct mathtexjob_struct *job = NULL; /* returned */
+
+    /* -------------------------------------------------------------------------
+    copies of what it's given, and its fds, before its thread starts
+    -------------------------------------------------------------------------- */
+    if (lib == NULL || expression == NULL || (job = calloc(1, sizeof(struct mathtexjob_struct))) == NULL) return NULL;
+    job->lib = lib;
+    job->state = JOBRUNNING;
+    job->donefds[0] = job->donefds[1] = job->cancelfds[0] = job->cancelfds[1] = (-1);
+    if (opts != NULL) {
+        memcpy(&job->opts, opts, sizeof(struct mathtexopts_struct));
+        job->isopts = 1;
+    }
+    if ((job->expression = strdup(expression)) == NULL || openevent(job->donefds) != 0 || openevent(job->cancelfds) != 0) goto failed;
+    if (pthread_create(&job->thread, NULL, submitthread, job) != 0) goto failed;
+    return job;
+
+failed:
+    freejob(job);
+    return NULL;
+}
+
+void *submitthread(void *job) {
+    struct mathtexjob_struct *submitted = (struct mathtexjob_struct *)job;
+    unsigned long long one = 1; /* eventfd count */
+    submitted->status = librender(submitted->lib, submitted->cancelfds[0], submitted->expression, (submitted->isopts ? &submitted->opts : NULL),
+                                  &submitted->image, &submitted->nbytes, &submitted->meta);
+    if (__sync_bool_compare_and_swap(&submitted->state, JOBRUNNING, JOBDONE)) {
+        if (write(submitted->donefds[1], &one, sizeof(one)) < 0) log_error("[submit] unable to signal a job's done fd\n"); /* mathtex_complete() joins us */
+    } else { /* cancelled, so nobody's coming for it */
+        pthread_detach(pthread_self());
+        if (submitted->image != NULL) free(submitted->image);
+        freejob(submitted);
+    }
+    return NULL;
+}
+
+int mathtex_jobfd(struct mathtexjob_struct *job) {
+    return job->donefds[0];
+}
+
+int mathtex_complete(struct mathtexjob_struct *job, unsigned char **image, int *nbytes, struct mathtexmeta_struct *meta) {
+    int status = (-1); /* librender()'s, once it's done */
+    *image = NULL;
+    *nbytes = 0;
+    if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != JOBDONE) return 1;
+    pthread_join(job->thread, NULL); /* already past its last use of job */
+    status = job->status;
+    *image = job->image;
+    *nbytes = job->nbytes;
+    if (meta != NULL) memcpy(meta, &job->meta, sizeof(struct mathtexmeta_struct));
+    freejob(job);
+    return status;
+}
+
+void mathtex_cancel(struct mathtexjob_struct *job) {
+    unsigned long long one = 1; /* eventfd count */
+    if (job == NULL) return;
+    if (write(job->cancelfds[1], &one, sizeof(one)) < 0) log_error("[submit] unable to signal a job's cancel fd\n");
+    if (__sync_bool_compare_and_swap(&job->state, JOBRUNNING, JOBCANCELLED)) return; /* its thread frees it */
+    pthread_join(job->thread, NULL); /* already done */
+    if (job->image != NULL) free(job->image);
+    freejob(job);
+}
+
+void freejob(struct mathtexjob_struct *job) {
+    if (job == NULL) return;
+    closeevent(job->donefds);
+    closeevent(job->cancelfds);
+    if (job->expression != NULL) free(job->expression);
+    free(job);
+}
+
+int openevent(int *fds) {
+#if defined(__linux__)
+    fds[0] = fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK); /* one fd, both ends */
+    return (fds[0] < 0 ? -1 : 0);
+#else
+    return pipe2(fds, O_CLOEXEC | O_NONBLOCK);
+#endif
+}
+
+void closeevent(int *fds) {
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0 && fds[1] != fds[0]) close(fds[1]);
+    fds[0] = fds[1] = (-1);
+}
+
+int iscancelled(void) {
+    struct pollfd cancel = {render->cancelfd, POLLIN, 0}; /* never read, so it stays readable */
+    return (render->cancelfd >= 0 && poll(&cancel, 1, 0) == 1);
+}
+
+struct render_struct *renderopen(void) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    struct render_struct *context = malloc(sizeof(struct render_struct));
+
+    /* -------------------------------------------------------------------------
+    the current context's settings, with a wrapper and results of its own
+    -------------------------------------------------------------------------- */
+    if (context == NULL) return NULL;
+    memcpy(context, render, sizeof(struct render_struct));
+    if ((context->wrapper = malloc(MAXEXPRSZ + 16384)) == NULL) {
+        free(context);
+        return NULL;
+    }
+    context->latexwrapper = strcpy(context->wrapper, (render->isdepth ? latexdepthwrapper : latexdefaultwrapper));
+    context->msgnumber = context->errorcount = context->iserror = context->isstreamed = 0;
+    context->errors = NULL;
+    context->workfd = (-1);
+    *context->workdir = *context->tempdir = '\000';
+    context->parent = render;
+    render = context; /* this thread's, until renderclose() */
+    return context;
+}
+
+void renderclose(struct render_struct *context) {
+    int ierror = 0; /* errors[] index */
+    if (context == NULL) return;
+    if (context->errors != NULL) {
+        for (ierror = 0; ierror < context->errorcount; ierror++) free(context->errors[ierror]);
+        free(context->errors);
+    }
+    free(context->wrapper);
+    if (render == context) render = context->parent; /* back to the one it was opened from */
+    free(context);
+}
+
+int preprocess(char *expression) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    int irep = 0;
+    char argstring[256];
+    char *pdirective = NULL;  /* ptr to char after \directive */
+    int iscolorpackage = 0;   /* true if \usepackage{color} found*/
+    int iseepicpackage = 0;   /* true if \usepackage{eepic} found*/
+    int ispict2epackage = 0;  /* true if \usepackage{pict2e}found*/
+    int ispreviewpackage = 0; /* true if \usepackage{preview} */
+
+    /* -------------------------------------------------------------------------
+    pre-process expression
+    -------------------------------------------------------------------------- */
+    log_info(20, "[preprocess] input expression: %s\n", expression);
     unescape_url(expression); // reencode url (latex can crash if not used)
     mathprep(expression);     // preprocess expression; convert &lt; to < and whatnot
     validate(expression);     // remove dangerous stuff like \input
@@ -231,14 +778,13 @@ int main(int argc, char *argv[]) {
      * check for embedded image \message directive (which supercedes everything)
      * ----------------------------------------------------------------------- */
     if (getdirective(expression, "\\message", 1, 0, 1, argstring) != NULL) { /* found \message directive */
-        log_info(1, "%s%s\n", about, license);
-        msgnumber = atoi(argstring); /* requested message number */
-        if (msgnumber > MAXEMBEDDED) {
+        render->msgnumber = atoi(argstring); /* requested message number */
+        if (render->msgnumber > MAXEMBEDDED) {
             log_error("Invalid message number provided.\n");
         } else {
-            log_error("%s\n", embeddedtext[msgnumber]);
+            log_error("%s\n", embeddedtext[render->msgnumber]);
         }
-        goto end_of_job;
+        return 0;
     } /*nothing to do after emitting image*/
 #endif
 
@@ -254,7 +800,7 @@ int main(int argc, char *argv[]) {
         strcat(expression, "\\small\\tt");            /* set font,size */
         strcat(expression, "\\fparbox{");             /* emit -Dswitches in framed box */
         strcat(expression, "Program image...\\\\\n"); /* image */
-        sprintf(expression + strlen(expression), "%s\\\\", argv[0]);
+        sprintf(expression + strlen(expression), "%s\\\\", homepath);
         strcat(expression, "Paths...\\\\\n");                                                                                                    /* paths */
         sprintf(expression + strlen(expression), "-DLATEX=$\\backslash$\"%s$\\backslash$\" \\ (%s)\\\\ \n", latexpath, pathsource[islatexpath]); // latex path
         sprintf(expression + strlen(expression), "-DPDFLATEX=$\\backslash$\"%s$\\backslash$\" \\ (%s)\\\\ \n", pdflatexpath,
@@ -266,6 +812,8 @@ int main(int argc, char *argv[]) {
                 pathsource[isps2epsipath]); // ps2epsi path
         sprintf(expression + strlen(expression), "-DCONVERT=$\\backslash$\"%s$\\backslash$\" \\ (%s)\\\\ \n", convertpath,
                 pathsource[isconvertpath]); // convert path
+        sprintf(expression + strlen(expression), "-DDVISVGM=$\\backslash$\"%s$\\backslash$\" \\ (%s)\\\\ \n", dvisvgmpath,
+                pathsource[isdvisvgmpath]); // dvisvgm path
         strcat(expression, "}");            /* end of \fparbox{} */
     }
 #endif
@@ -279,7 +827,7 @@ int main(int argc, char *argv[]) {
         int ienv = 0;                                                                                           /* environ[] index */
         /*iscaching = 0;*/                                                                                      /* don't cache \environment image */
         *expression = '\000';                                                                                   /* reset expression */
-        setpaths(10 * latexmethod + imagemethod);                                                               /* set paths */
+        setpaths(10 * render->latexmethod + render->imagemethod);                                                               /* set paths */
         strcat(expression, "\\parstyle");                                                                       /* set paragraph mode */
         strcat(expression, "\\scriptsize\\tt");                                                                 /* set font,size */
         strcat(expression, "\\noindent");                                                                       /* don't indent first line */
@@ -294,11 +842,6 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
-    /* ---
-     * save copy of expression before further preprocessing for MD5 hash
-     * ------------------------------------------------------------------ */
-    strcpy(hashexpr, expression); /* save unmodified expr for hash */
-
 #ifdef DISABLE_SWITCHES_DIRECTIVE
     /* ---
      * check for \which directive (supercedes everything not above)
@@ -326,7 +869,6 @@ int main(int argc, char *argv[]) {
         } else {                                          /* display "not permitted" message */
             sprintf(whichmsg, "which(%s) = not permitted", argstring);
         }
-        strreplace(whichtemplate, "%%whichpath%%", whichmsg, 0, 0); /*insert message*/
         // adtemplate = whichtemplate;                                 /* set which message */
         // adfrequency = 1;                                            /* force its display */
         // iscaching = 0;                                              /* don't cache it */
@@ -345,73 +887,72 @@ int main(int argc, char *argv[]) {
     /* ---
      * check for picture environment, i.e., \begin{picture}, but don't remove it
      * ----------------------------------------------------------------------- */
-    if (strstr(expression, "picture") != NULL) ispicture = 1;                /* signal picture environment */
-    if (strreplace(expression, "\\nopicture", "", 0, 0) >= 1) ispicture = 0; /* remove \nopicture; user wants to handle picture */
-
-    if (ispicture) {                               /* set picture environment defaults*/
-        imagemethod = 2;                           /* must use convert, not dvipng */
-        mathmode = 2;                              /* must be in paragraph mode */
-        isdepth = 0;                               /* reset default in case it's true */
-        if (!ISGAMMA) strcpy(gamma, CONVERTGAMMA); /* default convert gamma */
+    if (strstr(expression, "picture") != NULL) render->ispicture = 1;                /* signal picture environment */
+    if (strreplace(expression, "\\nopicture", "", 0, 0) >= 1) render->ispicture = 0; /* remove \nopicture; user wants to handle picture */
+
+    if (render->ispicture) {                               /* set picture environment defaults*/
+        render->imagemethod = 2;                           /* must use convert, not dvipng */
+        render->mathmode = 2;                              /* must be in paragraph mode */
+        render->isdepth = 0;                               /* reset default in case it's true */
+        if (!ISGAMMA) strcpy(render->gamma, CONVERTGAMMA); /* default convert gamma */
     }
 
     /* ---
      * check for embedded directives, remove them and set corresponding values
      * ----------------------------------------------------------------------- */
     /* --- first (re)set default modes required for certain environments --- */
-    if (strstr(expression, "gather") != NULL) mathmode = 2;   /* gather environment used, need paragraph style for gather */
-    if (strstr(expression, "eqnarray") != NULL) mathmode = 2; /* eqnarray environment used, need paragraph style for eqnarray */
+    if (strstr(expression, "gather") != NULL) render->mathmode = 2;   /* gather environment used, need paragraph style for gather */
+    if (strstr(expression, "eqnarray") != NULL) render->mathmode = 2; /* eqnarray environment used, need paragraph style for eqnarray */
 
     // shift around any nefarious preamble stuff
     // specifically: \documentclass and \begin{document}
     // doing this allows more compatibility with user pasted latex layouts
-    if (getdirective(expression, "\\documentclass", 1, 0, 1, dclassargs) != NULL) {
+    if (getdirective(expression, "\\documentclass", 1, 0, 1, render->dclassargs) != NULL) {
         // printf("\n%d\n", noptional);
-        if (noptional >= 1) {
-            dclassoptions = optionalargs[0];
-            dclass = dclassargs[0];
+        if (render->noptional >= 1) {
+            render->dclassoptions = render->optionalargs[0];
+            render->dclass = render->dclassargs[0];
         } else {
-            dclass = dclassargs[0];
+            render->dclass = render->dclassargs[0];
         }
         // printf("dclassoptions: %s\n", dclassoptions);
         // printf("dclass:        %s\n\n", dclass);
     }
-    strreplace(latexwrapper, "%%dclassoptions%%", dclassoptions, 0, 0);
-    strreplace(latexwrapper, "%%dclass%%", dclass, 0, 0);
+    strreplace(render->latexwrapper, "%%dclassoptions%%", render->dclassoptions, 0, 0);
+    strreplace(render->latexwrapper, "%%dclass%%", render->dclass, 0, 0);
 
     // @todo maybe overaggressive
     strreplace(expression, "\\begin{document}", "", 0, 0);
     strreplace(expression, "\\end{document}", "", 0, 0);
 
     /* --- check for explicit displaystyle/textstyle/parstyle directives --- */
-    if (strreplace(expression, "\\displaystyle", "", 0, 0) >= 1) mathmode = 0; /*remove \displaystyle, set displaystyle flag */
-    if (strreplace(expression, "\\textstyle", "", 0, 0) >= 1) mathmode = 1;    /* remove \textstyle, set textstyle flag */
-    if (strreplace(expression, "\\parstyle", "", 0, 0) >= 1) mathmode = 2;     /* remove \parstyle, set parstyle flag */
-    if (strreplace(expression, "\\parmode", "", 0, 0) >= 1) mathmode = 2;      /* \parmode same as \parstyle */
+    if (strreplace(expression, "\\displaystyle", "", 0, 0) >= 1) render->mathmode = 0; /*remove \displaystyle, set displaystyle flag */
+    if (strreplace(expression, "\\textstyle", "", 0, 0) >= 1) render->mathmode = 1;    /* remove \textstyle, set textstyle flag */
+    if (strreplace(expression, "\\parstyle", "", 0, 0) >= 1) render->mathmode = 2;     /* remove \parstyle, set parstyle flag */
+    if (strreplace(expression, "\\parmode", "", 0, 0) >= 1) render->mathmode = 2;      /* \parmode same as \parstyle */
 
     /* --- check for quiet/halt directives (\quiet or \halt) --- */
-    if (strreplace(expression, "\\quiet", "", 0, 0) >= 1) isquiet = 64;     /* remove occurrences of \quiet, set isquiet flag */
-    if (strreplace(expression, "\\noquiet", "", 0, 0) >= 1) isquiet = 0;    /* remove \noquiet, unset quiet flag */
+    if (strreplace(expression, "\\quiet", "", 0, 0) >= 1) render->isquiet = 64;     /* remove occurrences of \quiet, set isquiet flag */
+    if (strreplace(expression, "\\noquiet", "", 0, 0) >= 1) render->isquiet = 0;    /* remove \noquiet, unset quiet flag */
     if (getdirective(expression, "\\nquiet", 1, 0, 1, argstring) != NULL) { /* \nquiet{#Enters}, interpret arg as isquiet value */
-        isquiet = atoi(argstring);
+        render->isquiet = atoi(argstring);
     }
 
     /* --- check for program paths --- */
     if (getdirective(expression, "\\convertpath", 1, 0, 1, argstring) != NULL) { /* convert path. \convertpath{/path/to/convert} */
-        strcpy(convertpath, argstring);                                          /*interpret arg as /path/to/convert*/
-        if (strstr(convertpath, "convert") == NULL) {                            /* just path without name */
-            if (lastchar(convertpath) != '/') strcat(convertpath, "/");          /* not even a / at end of path, so add a / */
-            strcat(convertpath, "convert");
+        strninit(render->convertpath, argstring, 240);                           /*interpret arg as /path/to/convert*/
+        if (strstr(render->convertpath, "convert") == NULL) {                    /* just path without name */
+            if (lastchar(render->convertpath) != '/') strcat(render->convertpath, "/"); /* not even a / at end of path, so add a / */
+            strcat(render->convertpath, "convert");
         } /* add name of convert program */
-        isconvertpath = 1;
-    } /* treat like -DCONVERT switch */
+    } /* like -DCONVERT, for this render only */
 
     /* --- check for fontsize directives (\tiny ... \Huge) --- */
-    if (1 || mathmode != 2) {                                                              /*latex sets font size in \parstyle*/
+    if (1 || render->mathmode != 2) {                                                              /*latex sets font size in \parstyle*/
         for (irep = 0; !isempty(sizedirectives[irep]); irep++) {                           /*1=\tiny...10=\Huge*/
             if (strstr(expression, sizedirectives[irep]) != NULL) {                        /*found \size*/
-                if (mathmode != 2) strreplace(expression, sizedirectives[irep], "", 1, 0); /* not in paragraph mode, so remove \size */
-                fontsize = irep;
+                if (render->mathmode != 2) strreplace(expression, sizedirectives[irep], "", 1, 0); /* not in paragraph mode, so remove \size */
+                render->fontsize = irep;
             } /* found \size so set fontsize */
         }
     }
@@ -427,67 +968,69 @@ int main(int argc, char *argv[]) {
             // int ntilde = 0;                             /* # ~ chars replaced */
             /*ntilde =*/strreplace(expression, "~", " ", 0, 0);
         }
-        isdepth = 1; /* so reset flag */
-        latexwrapper = latexdepthwrapper;
+        render->isdepth = 1; /* so reset flag */
+        render->latexwrapper = strcpy(render->wrapper, latexdepthwrapper);
     }                                                         /* and wrapper */
     if (strreplace(expression, "\\nodepth", "", 0, 0) >= 1) { /* \nodepth requested and found \nodepth */
-        isdepth = 0;                                          /* so reset flag */
-        latexwrapper = latexdefaultwrapper;
+        render->isdepth = 0;                                          /* so reset flag */
+        render->latexwrapper = strcpy(render->wrapper, latexdefaultwrapper);
     } /* and wrapper */
 
     /* --- check for explicit usepackage directives in expression --- */
-    while (npackages < 9) {                                                                         /* no more than 9 extra packages */
-        if (getdirective(expression, "\\usepackage", 1, 0, -1, packages[npackages]) == NULL) break; /* no more \usepackage directives */
+    while (render->npackages < 9) {                                                                         /* no more than 9 extra packages */
+        if (getdirective(expression, "\\usepackage", 1, 0, -1, render->packages[render->npackages]) == NULL) break; /* no more \usepackage directives */
         else {                                                                                      /* found another \usepackage */
             /* --- check for optional \usepackage [args] --- */
-            *(packargs[npackages]) = '\000'; /* init for no optional args */
-            if (noptional > 0) {             /* but we found an optional arg */
-                strninit(packargs[npackages], optionalargs[0], 127);
+            *(render->packargs[render->npackages]) = '\000'; /* init for no optional args */
+            if (render->noptional > 0) {             /* but we found an optional arg */
+                strninit(render->packargs[render->npackages], render->optionalargs[0], 127);
             } /*copy the first*/
 
             /* --- check for particular packages --- */
-            if (strstr(packages[npackages], "color") != NULL) iscolorpackage = 1;     /* set color package flag*/
-            if (strstr(packages[npackages], "eepic") != NULL) iseepicpackage = 1;     /* set eepic package flag */
-            if (strstr(packages[npackages], "pict2e") != NULL) ispict2epackage = 1;   /* set pict2e package flag */
-            if (strstr(packages[npackages], "preview") != NULL) ispreviewpackage = 1; /* set preview package flag */
-            npackages++;
+            if (strstr(render->packages[render->npackages], "color") != NULL) iscolorpackage = 1;     /* set color package flag*/
+            if (strstr(render->packages[render->npackages], "eepic") != NULL) iseepicpackage = 1;     /* set eepic package flag */
+            if (strstr(render->packages[render->npackages], "pict2e") != NULL) ispict2epackage = 1;   /* set pict2e package flag */
+            if (strstr(render->packages[render->npackages], "preview") != NULL) ispreviewpackage = 1; /* set preview package flag */
+            render->npackages++;
         } /* bump package count */
     }
 
     strreplace(expression, "\\version", "", 0, 0); // remove \version
 
-    /* --- check for image type directives (\gif or \png) --- */
-    if (strreplace(expression, "\\png", "", 0, 0) >= 1) imagetype = 2; /* remove occurrences of \png and set png imagetype */
-    if (strreplace(expression, "\\gif", "", 0, 0) >= 1) imagetype = 1; /* remove occurrences of \gif and set gif imagetype */
+    /* --- check for image type directives (\gif, \png, \svg or \svgz) --- */
+    if (strreplace(expression, "\\png", "", 0, 0) >= 1) render->imagetype = 2;  /* remove occurrences of \png and set png imagetype */
+    if (strreplace(expression, "\\gif", "", 0, 0) >= 1) render->imagetype = 1;  /* remove occurrences of \gif and set gif imagetype */
+    if (strreplace(expression, "\\svgz", "", 0, 0) >= 1) render->imagetype = 4; /* before \svg, which it starts with */
+    if (strreplace(expression, "\\svg", "", 0, 0) >= 1) render->imagetype = 3;  /* remove occurrences of \svg and set svg imagetype */
 
     /* --- check for latex method directives (\latex or \pdflatex) --- */
-    if (strreplace(expression, "\\latex", "", 1, 0) >= 1) latexmethod = 1;    /* remove occurrences of \latex and set latex method */
-    if (strreplace(expression, "\\pdflatex", "", 0, 0) >= 1) latexmethod = 2; /* remove occurrences of \pdflatex and set pdflatex */
+    if (strreplace(expression, "\\latex", "", 1, 0) >= 1) render->latexmethod = 1;    /* remove occurrences of \latex and set latex method */
+    if (strreplace(expression, "\\pdflatex", "", 0, 0) >= 1) render->latexmethod = 2; /* remove occurrences of \pdflatex and set pdflatex */
 
     /* --- check for image method directives (\dvips or \dvipng) --- */
     if (strreplace(expression, "\\dvipng", "", 0, 0) >= 1) { /*remove occurrences of \dvipng*/
-        imagemethod = 1;                                     /* set dvipng imagemethod */
-        if (!ISGAMMA) strcpy(gamma, DVIPNGGAMMA);
+        render->imagemethod = 1;                                     /* set dvipng imagemethod */
+        if (!ISGAMMA) strcpy(render->gamma, DVIPNGGAMMA);
     }                                                       /* default dvipng gamma */
     if (strreplace(expression, "\\dvips", "", 0, 0) >= 1) { /* remove occurrences of -dvips*/
-        imagemethod = 2;                                    /* set dvips/convert imagemethod */
-        if (!ISGAMMA) strcpy(gamma, CONVERTGAMMA);
+        render->imagemethod = 2;                                    /* set dvips/convert imagemethod */
+        if (!ISGAMMA) strcpy(render->gamma, CONVERTGAMMA);
     } /* default convert gamma */
 
     /* --- check for convert/dvipng command's -density/-D parameter --- */
-    if (getdirective(expression, "\\density", 1, 1, 1, density) == NULL)
-        getdirective(expression, "\\dpi", 1, 1, 1, density); /* no \density directive, so try \dpi instead */
+    if (getdirective(expression, "\\density", 1, 1, 1, render->density) == NULL)
+        getdirective(expression, "\\dpi", 1, 1, 1, render->density); /* no \density directive, so try \dpi instead */
 
     /* --- check for convert command's \gammacorrection parameter --- */
-    getdirective(expression, "\\gammacorrection", 1, 1, 1, gamma); /*look for \gamma*/
+    getdirective(expression, "\\gammacorrection", 1, 1, 1, render->gamma); /*look for \gamma*/
 
     /* --- check for \cache or \nocache directive --- */
-    if (strreplace(expression, "\\cache", "", 0, 0) >= 1) iscaching = 1;   /* remove \cache and cache this image */
-    if (strreplace(expression, "\\nocache", "", 0, 0) >= 1) iscaching = 0; /* remove \nocache and DON'T cache this image */
+    if (strreplace(expression, "\\cache", "", 0, 0) >= 1) render->iscaching = 1;   /* remove \cache and cache this image */
+    if (strreplace(expression, "\\nocache", "", 0, 0) >= 1) render->iscaching = 0; /* remove \nocache and DON'T cache this image */
 
     /* ---check for \eval{}'s in (1)submitted expressions, (2)\newcommand's--- */
     for (irep = 1; irep <= 2; irep++) {                                                      /* 1=expression, 2=latexwrapper */
-        char *thisrep = (irep == 1 ? expression : latexwrapper);                             /* choose 1 or 2 */
+        char *thisrep = (irep == 1 ? expression : render->latexwrapper);                             /* choose 1 or 2 */
         while ((pdirective = getdirective(thisrep, "\\eval", 1, 0, 1, argstring)) != NULL) { /* found \eval{} directive */
             int ival = (isempty(argstring) ? 0 : evalterm(mathtexstore, argstring));
             char aval[256];            /* buffer to convert ival to alpha */
@@ -497,1384 +1040,3729 @@ int main(int argc, char *argv[]) {
     }
 
     /* --- see if we need any packages not already \usepackage'd by user --- */
-    if (npackages < 9 && !iscolorpackage) {          /* have room for one more package. \usepackage{color} not specified */
+    if (render->npackages < 9 && !iscolorpackage) {          /* have room for one more package. \usepackage{color} not specified */
         if (strstr(expression, "\\color") != NULL) { /* but \color is used */
-            strcpy(packages[npackages], "color");    /* so \usepackage{color} is needed*/
-            *(packargs[npackages]) = '\000';         /* no optional args */
-            npackages++;
+            strcpy(render->packages[render->npackages], "color");    /* so \usepackage{color} is needed*/
+            *(render->packargs[render->npackages]) = '\000';         /* no optional args */
+            render->npackages++;
         } /* bump package count */
     }
-    if (npackages < 9 && ispicture) {                 /* have room for one more package and using picture environment */
-        if (latexmethod == 1) {                       /* using latex with eepic */
+    if (render->npackages < 9 && render->ispicture) {                 /* have room for one more package and using picture environment */
+        if (render->latexmethod == 1) {                       /* using latex with eepic */
             if (!iseepicpackage) {                    /* \usepackage{eepic} not specified*/
-                strcpy(packages[npackages], "eepic"); /* \usepackage{eepic} needed */
-                *(packargs[npackages]) = '\000';      /* no optional args */
-                npackages++;
+                strcpy(render->packages[render->npackages], "eepic"); /* \usepackage{eepic} needed */
+                *(render->packargs[render->npackages]) = '\000';      /* no optional args */
+                render->npackages++;
             } /* bump package count */
         }
-        if (latexmethod == 2 && npackages < 8) {       /* using pdflatex with pict2e and have room for two more packages */
+        if (render->latexmethod == 2 && render->npackages < 8) {       /* using pdflatex with pict2e and have room for two more packages */
             if (!ispict2epackage) {                    /*\usepackage{pict2e} not specified*/
-                strcpy(packages[npackages], "pict2e"); /* \usepackage{pict2e} needed */
-                *(packargs[npackages]) = '\000';       /* no optional args */
-                npackages++;
+                strcpy(render->packages[render->npackages], "pict2e"); /* \usepackage{pict2e} needed */
+                *(render->packargs[render->npackages]) = '\000';       /* no optional args */
+                render->npackages++;
             }                                                    /* bump package count */
             if (!ispreviewpackage) {                             /*\usepackage{preview} not specified*/
-                strcpy(packages[npackages], "preview");          /*\usepackage{preview} needed*/
-                strcpy(packargs[npackages], "active,tightpage"); /* set optional args */
-                npackages++;
+                strcpy(render->packages[render->npackages], "preview");          /*\usepackage{preview} needed*/
+                strcpy(render->packargs[render->npackages], "active,tightpage"); /* set optional args */
+                render->npackages++;
             } /* bump package count */
         }
     }
 
-    /* ---
-     * hash expression for name of cached image file
-     * -------------------------- */
+    /* -------------------------------------------------------------------------
+    anything left to render?
+    -------------------------------------------------------------------------- */
     trimwhite(expression); /*remove leading/trailing whitespace*/
     if (isempty(expression)) {
         log_error("Expression empty after preprocessing; not rendering.\n");
-        goto end_of_job;
+        return 0;
     }
-    md5hash = md5str(hashexpr);
-
-    /* ---
-     * emit informational messages
-     * --------------------- */
-    log_info(5, "[main] running image: %s\n", argv[0]);
-    log_info(5, "[main] home directory: %s\n", homepath);
-    log_info(20, "[main] input expression: %s\n", hashexpr);
-    log_info(5, "[main] === processed expression ===\n\n%s\n\n", expression);
-    log_info(10, "[main] %s timelimit info: warn/killtime=%d/%d, path=%s\n", (timelimit("", -99) == 992 ? "Built-in" : "Stub"), warntime, killtime,
-             (istimelimitpath ? timelimitpath : "none"));
+    log_info(5, "[preprocess] === processed expression ===\n\n%s\n\n", expression);
+    return 1;
+}
 
+char *cacheimage(char *expression, char *md5hash, int *ishit, int *depth) {
     /* -------------------------------------------------------------------------
-    Emit cached image or render the expression
+    Allocations and Declarations
     -------------------------------------------------------------------------- */
-    if (md5hash != NULL) { /* md5str() almost surely succeeded*/
-        /* ---
-         * check for cache directory, and create it if it doesn't already exist
-         * -------------------------------------------------------------------- */
-        if (isempty(outfile)) {                                         /* no explicit output file given */
-            if (!isdexists(makepath(NULL, NULL, NULL))) {               /* and no cache directory */
-                if (mkdir(makepath(NULL, NULL, NULL), perm_all) != 0) { /* tried to mkdir and failed, emit embedded error image*/
-                    log_info(1, "[main] Error occurred whilst `mkdir %s`;\n", makepath(NULL, NULL, NULL));
-                    log_error("%s\n", embeddedtext[CACHEFAILED]);
-                    goto end_of_job;
-                } /* quit if failed to mkdir cache */
+    static THREADLOCAL char cachefile[512];                   /* cached image path/filename */
+    int perm_all = (S_IRWXU | S_IRWXG | S_IRWXO); /* 777 permissions */
+    FILE *fdepth = NULL;                          /* <md5hash>.depth, saved alongside image */
+    int packdepth = FRAMENODEPTH;                 /* depth packed with the image */
+    int isshrunk = 0, shrunkdepth = FRAMENODEPTH; /* made from the master image instead */
+    long starttime = 0;                           /* msclock() when rendering started */
+    int lockfd = (-1);                            /* held on <md5hash>.lock while rendering */
+    int iswaited = 0;                             /* another process was rendering it */
+
+    /* -------------------------------------------------------------------------
+    serve a previously rendered image straight from the cache, before any
+    paths, directories or child processes are set up
+    -------------------------------------------------------------------------- */
+    render->msgnumber = render->errorcount = 0;                                        /* no errors to report yet */
+    if (ishit != NULL) *ishit = 0;                                     /* not found in cache yet */
+    if (depth != NULL) *depth = FRAMENODEPTH;                          /* and no depth known yet */
+    strcpy(cachefile, makepath(NULL, md5hash, extensions[render->imagetype])); /* where image is (or will be) cached */
+    if (render->iscaching) {                                                   /* only trust the cache if we're caching */
+        if (openpack() && packfind(md5hash, NULL, NULL, NULL, &packdepth)) { /* image already rendered, and packed */
+            log_info(5, "[cacheimage] cache hit: %s in %s\n", md5hash, PACKDIR);
+            if (ishit != NULL) *ishit = 1;
+            if (openindex()) cacheindextouch(md5hash, extensions[render->imagetype]);
+            if (render->isdepth && depth != NULL) *depth = packdepth;
+            return imagepath(md5hash, render->imagetype);
+        }
+        if (isfexists(cachefile)) {                                    /* image already rendered */
+            log_info(5, "[cacheimage] cache hit: %s\n", cachefile);
+            if (ishit != NULL) *ishit = 1;
+            if (openindex()) cacheindextouch(md5hash, extensions[render->imagetype]); /* counts toward keeping it */
+            if (render->isdepth && depth != NULL) { /* need its depth, too */
+                if ((fdepth = fopen(makepath(NULL, md5hash, ".depth"), "r")) != NULL) {
+                    if (fscanf(fdepth, "%d", depth) != 1) *depth = FRAMENODEPTH;
+                    fclose(fdepth);
+                }
             }
+            return cachefile;
         }
+        log_info(5, "[cacheimage] cache miss: %s\n", cachefile);
+        if (readerrors(md5hash)) return NULL; /* latex failed on it a moment ago, and would again */
+    }
 
-        /* ---
-         * now generate the new image and emit it
-         * -------------------------------------- */
+    /* -------------------------------------------------------------------------
+    check for cache directory, and create it if it doesn't already exist
+    -------------------------------------------------------------------------- */
+    if (render->iscaching || isempty(render->outfile)) {                            /* image goes to cache, even if -o also given */
+        if (!isdexists(makepath(NULL, NULL, NULL))) {               /* and no cache directory */
+            if (mkdir(makepath(NULL, NULL, NULL), perm_all) != 0) { /* tried to mkdir and failed, emit embedded error image*/
+                log_info(1, "[cacheimage] Error occurred whilst `mkdir %s`;\n", makepath(NULL, NULL, NULL));
+                render->msgnumber = CACHEFAILED;
+                return NULL;
+            } /* quit if failed to mkdir cache */
+        }
+        if (render->iscaching) checkcacheversion(makepath(NULL, NULL, NULL)); /* drop images cached under an older key format */
+        if (mkshards(cachefile) < 0) {                                /* and cachefile's subdirectory */
+            log_info(1, "[cacheimage] Error occurred whilst making the subdirectories of %s;\n", cachefile);
+            render->msgnumber = CACHEFAILED;
+            return NULL;
+        }
+    }
+
+    /* -------------------------------------------------------------------------
+    one process renders a key at a time: the rest wait their turn, by which
+    time the image (or the failure) is usually in the cache
+    -------------------------------------------------------------------------- */
+    if (render->iscaching) {
+        lockfd = lockrender(md5hash, &iswaited);
+        if (iscached(md5hash, render->imagetype)) { /* just published, so serve it as a hit */
+            unlockrender(lockfd, md5hash);
+            return cacheimage(expression, md5hash, ishit, depth);
+        }
+        if (readerrors(md5hash)) {
+            unlockrender(lockfd, md5hash);
+            return NULL;
+        }
+        if (iswaited) log_info(5, "[cacheimage] %s wasn't cached by the process we waited on, rendering it\n", md5hash);
+    }
+
+    /* -------------------------------------------------------------------------
+    below the master resolution, shrink the master image instead
+    -------------------------------------------------------------------------- */
+    openindex(); /* here, while paths relative to the cache directory work */
+    starttime = msclock();
+    if (usemaster()) {
+        isshrunk = (shrinkmaster(expression, md5hash, &shrunkdepth) == 0);
+        strcpy(cachefile, makepath(NULL, md5hash, extensions[render->imagetype])); /* the master's cacheimage() reused cachefile */
+        if (!isshrunk && render->msgnumber > 0) {                                   /* the master didn't render, nor would this */
+            unlockrender(lockfd, md5hash);
+            return NULL;
+        }
+    }
+
+    /* -------------------------------------------------------------------------
+    now generate the new image
+    -------------------------------------------------------------------------- */
+    if (!isshrunk) {
         /* --- set up name for temporary work directory --- */
         // strninit(tempdir, tmpnam(NULL), 255);   /* maximum name length is 255 */
-        strninit(tempdir, md5hash, 255);                        /* maximum name length is 255 */
-        log_info(5, "[main] working directory: %s\n", tempdir); /* additional message. working directory */
+        sprintf(render->tempdir, "%.200s-%d", md5hash, (int)gettid());        /* our own, even if we gave up waiting on another process rendering it */
+        log_info(5, "[cacheimage] working directory: %s\n", render->tempdir); /* additional message. working directory */
 
-        if (mathtex(expression, md5hash) != imagetype) {
-            // shits fucked. throw error message and abandon ship
+        if (mathtex(expression, md5hash) != render->imagetype) {
+            // shits fucked. abandon ship
             // isdepth = 0; /* no imageinfo in embedded images */
-            if (msgnumber < 1) {
+            if (render->msgnumber < 1) {
                 // if nothing specific, emit general error message.
-                msgnumber = 2;
+                render->msgnumber = UNKNOWNERROR;
             }
-            log_error(embeddedtext[msgnumber]);
-            goto end_of_job;
+            if (render->msgnumber == LATEXFAILED && render->errorcount > 0 && !iscancelled()) writeerrors(md5hash); /* what latex said, for the next request */
+            unlockrender(lockfd, md5hash);
+            return NULL;
         }
+    }
 
-        /**
-         * remove temp dir
-         */
+    /* --- record what it cost, making room for it if need be --- */
+    if (render->iscaching) {
+        evictcache();
+        indexcache(cachefile, md5hash, extensions[render->imagetype], (int)(msclock() - starttime));
+    }
 
-        /** ---
-         * emit generated image to stdout
-         * ------------------------------ */
-        if (write_stdout) {
-            FILE *img = fopen(makepath(NULL, md5hash, extensions[imagetype]), "rb");
-            if (img == NULL) {
-                log_error("Failed to open file to write stdout (did the file get created?)\n"); // @TODO necessary?
-                exit(1);
+    /* --- remember depth for later cache hits --- */
+    if (render->isdepth && depth != NULL) {
+        *depth = (isshrunk ? shrunkdepth : imagedepth());
+        if (render->iscaching && *depth != FRAMENODEPTH) {
+            char depthfile[512], tempfile[512]; /* <md5hash>.depth, and until it's written */
+            strcpy(depthfile, makepath(NULL, md5hash, ".depth"));
+            sprintf(tempfile, "%s.%d", depthfile, (int)gettid());
+            if ((fdepth = fopen(tempfile, "w")) != NULL) {
+                fprintf(fdepth, "%d\n", *depth);
+                if (fclose(fdepth) != 0 || publishfile(tempfile, depthfile) != 0) remove(tempfile);
             }
-            fseek(img, 0, SEEK_END);
-            int s = ftell(img);
-            fseek(img, 0, SEEK_SET);
-            // dumb shit ahead.
-            // i don't know why `write(1, img, s)` doesn't write the whole file to stdout, but here we are.
-            int c;
-            while ((c = fgetc(img)) != EOF) putchar(c);
-            fflush(stdout);
-            fclose(img);
         }
+    }
 
-        /* ---
-         * remove images not being cached
-         * ------------------------------ */
-        if (!iscaching) {                                               /* don't want this image cached */
-            if (isempty(outfile)) {                                     /* unless explicit outfile provided*/
-                remove(makepath(NULL, md5hash, extensions[imagetype])); /* remove file */
-            }
-        }
+    /* --- and into a pack, depth and all, if packing --- */
+    if (render->iscaching && storepack(cachefile, md5hash, (depth != NULL ? *depth : FRAMENODEPTH)) == 0) {
+        unlockrender(lockfd, md5hash); /* published, so the processes waiting on it find it */
+        return imagepath(md5hash, render->imagetype);
     }
+    unlockrender(lockfd, md5hash);
+    return (render->iscaching || isempty(render->outfile) ? cachefile : render->outfile); /* where mathtex() put it */
+}
 
-end_of_job:
-    if (msgfp != NULL && msgfp != stdout) fclose(msgfp); /* have an open message file, so close it at eoj */
-    exit(0);
+char *masterkey(char *expression) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    static THREADLOCAL char key[64];   /* master's cachekey() */
+    char thisdensity[256]; /* density of this request */
+
+    /* -------------------------------------------------------------------------
+    the same request at masterdpi
+    -------------------------------------------------------------------------- */
+    if (!usemaster()) return NULL;
+    strcpy(thisdensity, render->density);
+    sprintf(render->density, "%d", masterdpi);
+    strcpy(key, cachekey(expression));
+    strcpy(render->density, thisdensity);
+    cachekey(expression); /* and cachekey()'s buffer back to this request's key, which our caller may hold */
+    return key;
 }
 
-int mathtex(char *expression, char *filename) {
+int usemaster(void) {
+    return (masterdpi > 0 && render->imagetype == 2 && render->iscaching && atof(render->density) > 0. && atof(render->density) < masterdpi);
+}
+
+int shrinkmaster(char *expression, char *md5hash, int *depth) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    char errormsg[1024] = /* latex runs but can't make .dvi */
-        "\\fbox{\\footnotesize $\\mbox{Latex failed, probably due to} "
-        "\\atop \\mbox{an error in your expression.}$}";
-    char usepackage[1024] = "\000"; /* additional \usepackage{}'s */
-    char convertargs[1024] =        /* args/switches for convert */
-        " -density %%dpi%% -gamma %%gamma%%"
-        //" -border 0% -fuzz 2%"
-        " -trim -transparent \"#FFFFFF\" ";
-    char dvipngargs[1024] = /* args/switches for dvipng */
-        " --%%imagetype%% -D %%dpi%% --gamma %%gamma%%"
-        " -bg Transparent -T tight -v" /* -q for quiet, -v for verbose */
-        " -o %%giffile%% ";            /* output filename supplied as -o */
+    char imagefile[512], masterfile[512], tempfile[512]; /* image we're making, master, and its temp file */
+    char thisdensity[256];                               /* density of this request */
+    char *cachedfile = NULL;                             /* master, from cacheimage() */
+    unsigned char *png = NULL, *rgba = NULL, *shrunk = NULL, *shrunkpng = NULL;
+    long offset = 0;                                     /* master's offset in its file (or pack) */
+    int nmaster = 0;                                     /* and its size */
+    double scale = atof(render->density) / masterdpi;            /* shrink master by */
+    int masterdepth = FRAMENODEPTH;                      /* master's depth, if isdepth */
+    int npng = (-1), nshrunkpng = 0, width = 0, height = 0, nwidth = 0, nheight = 0;
+    int fd = (-1), status = (-1);
 
-    /* --- other variables --- */
-    static int iserror = 0; /* true if procesing error message */
-    char latexfile[256];
-    char giffile[256] = "\000";
-    FILE *latexfp = NULL;                 /*latex wrapper file for expression*/
-    char command[2048], subcommand[1024]; /*system(command) runs latex, etc*/
-    char *beginmath[] = {"\\noindent \\(\n\\displaystyle", "\\noindent \\(", ""};
-    char *endmath[] = {"\\)", "\\)", ""};
-    int perm_all = (S_IRWXU | S_IRWXG | S_IRWXO); /* 777 permissions */
-    int dir_stat = 0;                             /* 1=mkdir okay, 2=chdir okay */
-    int sys_stat = 0;                             /* system() return status */
-    char *pwdpath = NULL;
-    int isworkpath = 0; /* true if cd'ed to working dir */
-    int ipackage = 0;   /* packages[] index 0...npackages-1*/
-    int gifpathlen = 0; /* ../ or ../../ prefix of giffile */
-    int status = 0;     /* imagetype or 0=error */
+    /* -------------------------------------------------------------------------
+    the master, from the cache or rendered (and cached) now
+    -------------------------------------------------------------------------- */
+    *depth = FRAMENODEPTH;
+    strcpy(imagefile, makepath(NULL, md5hash, extensions[render->imagetype]));
+    strcpy(thisdensity, render->density);
+    strcpy(tempfile, masterkey(expression));           /* cacheimage() wants it in a buffer of its own */
+    sprintf(render->density, "%d", masterdpi);                 /* render (and key) the master at masterdpi */
+    cachedfile = cacheimage(expression, tempfile, NULL, &masterdepth);
+    strcpy(render->density, thisdensity);
+    if (cachedfile == NULL) return -1;                  /* msgnumber says why */
+    strcpy(masterfile, cachedfile);
 
     /* -------------------------------------------------------------------------
-    Make temporary work directory and cd to ~workpath/tempdir/
+    read it, shrink it, and write the result to the cache
     -------------------------------------------------------------------------- */
-    msgnumber = 0;                      /* no error to report yet */
-    if (!isempty(workpath)) {           /*have a working dir for temp files*/
-        if (isdexists(workpath)) {      /* if working directory exists */
-            if (chdir(workpath) == 0) { /* cd to working directory */
-                isworkpath = 1;         /* signal cd to workpath succeeded */
-            }
-        }
-    }
-    if (!isdexists(tempdir)) {               /* if temp directory doesn't exist */
-        if (mkdir(tempdir, perm_all) != 0) { /* tried to make temp dir, but mkdir failed */
-            msgnumber = MKDIRFAILED;         /* set corresponding message number and quit */
-            goto end_of_job;
-        }
+    if ((fd = openimage(masterfile, &offset, &nmaster)) < 0) return -1;
+    if (nmaster > 0 && (png = malloc(nmaster)) != NULL) npng = (int)pread(fd, png, nmaster, (off_t)offset);
+    close(fd);
+    if (npng < 1 || npng != nmaster || (rgba = pngdecode(png, npng, &width, &height)) == NULL ||
+        (shrunk = pngshrink(rgba, width, height, scale, &nwidth, &nheight)) == NULL ||
+        (shrunkpng = pngencode(shrunk, nwidth, nheight, (pnglevel > 0 ? pnglevel : 9), pngeffort, &nshrunkpng)) == NULL) {
+        log_info(5, "[shrinkmaster] can't shrink %s, rendering at %s dpi\n", masterfile, render->density);
+        goto end_of_job;
     }
-    dir_stat++;                  /* signal mkdir successful */
-    if (chdir(tempdir) != 0) {   /* tried to cd to temp dir, but failed */
-        msgnumber = CHDIRFAILED; /* set corresponding message number and quit */
+    sprintf(tempfile, "%s.%d", imagefile, (int)gettid());
+    if ((fd = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) goto end_of_job;
+    if (writefd(fd, shrunkpng, nshrunkpng) < 0 || close(fd) != 0 || publishfile(tempfile, imagefile) != 0) {
+        remove(tempfile);
         goto end_of_job;
     }
-    dir_stat++; /* signal chdir successful */
+    if (masterdepth != FRAMENODEPTH) *depth = (int)(masterdepth * scale + (masterdepth < 0 ? -0.5 : 0.5)); /* rounded, as imagedepth() */
+    log_info(5, "[shrinkmaster] %s: %dx%d at %d dpi to %dx%d at %s dpi\n", imagefile, width, height, masterdpi, nwidth, nheight, render->density);
+    status = 0;
+
+end_of_job:
+    free(png);
+    free(rgba);
+    free(shrunk);
+    free(shrunkpng);
+    return status;
+}
+
+int imagedepth(void) {
+    if (render->imageinfo[0].value <= -9999.) return FRAMENODEPTH; /* latex.info missing or unreadable */
+    return (int)(render->imageinfo[0].value * atof(render->density) / 72.27 + (render->imageinfo[0].value < 0. ? -0.5 : 0.5)); /* pt to px, rounded */
+}
+
+int imagesize(unsigned char *image, int nbytes, int *width, int *height) {
+    *width = *height = 0;
+    if (nbytes >= 24 && memcmp(image, "\211PNG\r\n\032\n", 8) == 0) { /* IHDR's big-endian width and height */
+        *width = image[16] << 24 | image[17] << 16 | image[18] << 8 | image[19];
+        *height = image[20] << 24 | image[21] << 16 | image[22] << 8 | image[23];
+    } else if (nbytes >= 10 && memcmp(image, "GIF", 3) == 0) { /* logical screen, little-endian */
+        *width = image[6] | image[7] << 8;
+        *height = image[8] | image[9] << 8;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int writefd(int fd, void *buffer, int nbytes) {
+    int nwritten = 0; /* total #bytes written so far */
+    while (nwritten < nbytes) {
+        int n = write(fd, (char *)buffer + nwritten, nbytes - nwritten);
+        if (n < 0 && errno == EINTR) continue; /* interrupted, so just retry */
+        if (n <= 0) return -1;                 /* peer went away */
+        nwritten += n;
+    }
+    return nwritten;
+}
+
+int readfd(int fd, void *buffer, int nbytes) {
+    int nread = 0; /* total #bytes read so far */
+    while (nread < nbytes) {
+        int n = read(fd, (char *)buffer + nread, nbytes - nread);
+        if (n < 0 && errno == EINTR) continue; /* interrupted, so just retry */
+        if (n < 0) return -1;                  /* read error */
+        if (n == 0) break;                     /* eof */
+        nread += n;
+    }
+    return nread;
+}
+
+int sendfd(int tofd, int fromfd, long offset, int nbytes) {
+    char buffer[65536];         /* when the kernel can't copy it for us */
+    off_t from = (off_t)offset; /* next byte to send */
+    int nsent = 0;              /* total #bytes sent so far */
+#if defined(__linux__)
+    while (nsent < nbytes) { /* file to pipe, socket or file, without coming through user space */
+        ssize_t n = sendfile(tofd, fromfd, &from, nbytes - nsent);   /* advances from, leaving fromfd's own position alone */
+        if (n < 0 && errno == EINTR) continue;                        /* interrupted, so just retry */
+        if (n < 0 && nsent == 0 && (errno == EINVAL || errno == ENOSYS)) break; /* not for these fds, so copy it */
+        if (n < 0) return -1;                                         /* peer went away */
+        if (n == 0) return nsent;                                     /* file shrank */
+        nsent += n;
+    }
+    if (nsent > 0) return nsent;
+#endif
+    while (nsent < nbytes) {
+        ssize_t n = pread(fromfd, buffer, (nbytes - nsent < (int)sizeof(buffer) ? nbytes - nsent : (int)sizeof(buffer)), (off_t)offset + nsent);
+        if (n < 0 && errno == EINTR) continue; /* interrupted, so just retry */
+        if (n < 0) return -1;
+        if (n == 0) break; /* file shrank */
+        if (writefd(tofd, buffer, n) < 0) return -1;
+        nsent += n;
+    }
+    return nsent;
+}
 
+int emitframe(int fd, int status, char *key, int depth, char *imagefile, char *message) {
     /* -------------------------------------------------------------------------
-    set up latex directives for user-specified additional \usepackage{}'s
+    Allocations and Declarations
     -------------------------------------------------------------------------- */
-    if (!iserror) {                                                /* don't \usepackage for error */
-        if (npackages > 0) {                                       /* have additional packages */
-            for (ipackage = 0; ipackage < npackages; ipackage++) { /*make \usepackage{}*/
-                strcat(usepackage, "\\usepackage");                /* start with a directive */
-                if (!isempty(packargs[ipackage])) {                /* have an optional arg */
-                    strcat(usepackage, "[");                       /* begin optional argument */
-                    strcat(usepackage, packargs[ipackage]);        /* add optional arg */
-                    strcat(usepackage, "]");
-                }                                       /* finish optional arg */
-                strcat(usepackage, "{");                /* begin package name argument */
-                strcat(usepackage, packages[ipackage]); /* add package name */
-                strcat(usepackage, "}\n");
-            } /* finish constructing directive */
-        }
-    }
+    unsigned char header[FRAMEHEADERSZ]; /* length, status, key, depth */
+    unsigned int length = 0;             /* #bytes following the length field */
+    int imagefd = (-1);                  /* open imagefile (or its pack) */
+    long offset = 0;                     /* where the image starts in it */
+    int nimage = 0;                      /* and its size */
+    int nbytes = 0, nemitted = 0;        /* #bytes sent, #bytes emitted */
 
     /* -------------------------------------------------------------------------
-    Replace "keywords" in latex template with expression and other directives
+    size the payload, then write the header
     -------------------------------------------------------------------------- */
-    /* --- usually replace %%pagestyle%% with \pagestyle{empty} --- */
-    if (!ispicture || latexmethod == 1) { /* not \begin{picture} environment or using latex/dvips/ps2epsi */
-        strreplace(latexwrapper, "%%pagestyle%%", "\\pagestyle{empty}", 1, 0);
+    if (imagefile != NULL && (imagefd = openimage(imagefile, &offset, &nimage)) < 0) { /* evicted since, say */
+        status = FRAMEERROR;
+        message = embeddedtext[EMITFAILED];
     }
-    /* --- replace %%previewenviron%% if a picture and using pfdlatex --- */
-    if (ispicture && latexmethod == 2) { /* have \begin{picture} environment and using pdflatex/convert */
-        strreplace(latexwrapper, "%%previewenviron%%", "\\PreviewEnvironment{picture}", 1, 0);
+    if (imagefd >= 0) {
+        length = (unsigned int)nimage;
+    } else if (message != NULL) {
+        length = strlen(message);
     }
-    /* --- replace %%beginmath%%...%%endmath%% with \[...\] or with $...$ --- */
-    if (mathmode < 0 || mathmode > 2) mathmode = 0; /* mathmode validity check */
-    strreplace(latexwrapper, "%%beginmath%%", beginmath[mathmode], 1, 0);
-    strreplace(latexwrapper, "%%endmath%%", endmath[mathmode], 1, 0);
-    /* --- replace %%fontsize%% in template with \tiny...\Huge --- */
-    strreplace(latexwrapper, "%%fontsize%%", sizedirectives[fontsize], 1, 0);
-    /* --- replace %%setlength%% in template for pictures when necessary --- */
-    if (ispicture && strstr(expression, "\\unitlength") == NULL) {                           /* have \begin{picture} environment, but no \unitlength */
-        strreplace(latexwrapper, "%%setlength%%", "\\setlength{\\unitlength}{1.0in}", 1, 0); /* so default it to 1 inch */
+    length += FRAMEHEADERSZ - 4;                             /* status, key, depth */
+    *(unsigned int *)header = htonl(length);                 /* big-endian length */
+    header[4] = (unsigned char)status;                       /* FRAMEMISS, FRAMEHIT or FRAMEERROR */
+    memset(header + 5, '0', FRAMEKEYSZ);                     /* key unknown if preprocess failed */
+    if (key != NULL) memcpy(header + 5, key, FRAMEKEYSZ);    /* 32 hex digit cache key */
+    *(unsigned int *)(header + 5 + FRAMEKEYSZ) = htonl((unsigned int)depth);
+    if (writefd(fd, header, FRAMEHEADERSZ) < 0) goto end_of_job;
+    nemitted = FRAMEHEADERSZ;
+
+    /* -------------------------------------------------------------------------
+    then the payload: image bytes, or an error message
+    -------------------------------------------------------------------------- */
+    if (imagefd >= 0) {
+        if ((nbytes = sendfd(fd, imagefd, offset, nimage)) != nimage)
+            nemitted = (-1); /* short frame, so the client can't trust what follows */
+        else
+            nemitted += nbytes;
+    } else if (message != NULL) {
+        if (writefd(fd, message, strlen(message)) < 0)
+            nemitted = (-1);
+        else
+            nemitted += strlen(message);
     }
-    /* --- replace %%usepackage%% in template with extra \usepackage{}'s --- */
-    strreplace(latexwrapper, "%%usepackage%%", usepackage, 1, 0);
-    /* --- replace %%expression%% in template with expression --- */
-    strreplace(latexwrapper, "%%expression%%", expression, 1, 0);
 
+end_of_job:
+    if (imagefd >= 0) close(imagefd);
+    return nemitted > 0 ? nemitted : -1;
+}
+
+int serverequest(int fd, char *expression) {
     /* -------------------------------------------------------------------------
-    Create latex document wrapper file containing expression
+    Allocations and Declarations
     -------------------------------------------------------------------------- */
-    strcpy(latexfile, makepath("", "latex", ".tex")); /* latex filename latex.tex */
-    latexfp = fopen(latexfile, "w");                  /* open latex file for write */
-    if (latexfp == NULL) {                            /* couldn't open latex file */
-        msgnumber = FOPENFAILED;                      /* set corresponding message number*/
-        goto end_of_job;
-    }                                     /* and quit */
-    fprintf(latexfp, "%s", latexwrapper); /* write file */
-    fclose(latexfp);                      /* close file after writing it */
+    char *md5hash = NULL;        /* cache key of expression */
+    char *imagefile = NULL;      /* cached or rendered image */
+    int ishit = 0;               /* true if image came from the cache */
+    int depth = FRAMENODEPTH;    /* pixels below baseline */
+    char message[2048] = "\000"; /* for error frames */
+    int nbytes = 0;              /* #bytes in response frame */
+    struct render_struct *context = renderopen();
 
     /* -------------------------------------------------------------------------
-    Set paths to programs we'll need to run
+    same steps as the command line, with the image framed onto fd
     -------------------------------------------------------------------------- */
-    setpaths(10 * latexmethod + imagemethod);
+    if (context == NULL) return emitframe(fd, FRAMEERROR, NULL, FRAMENODEPTH, NULL, embeddedtext[UNKNOWNERROR]);
+    if (!preprocess(expression)) {
+        nbytes = emitframe(fd, FRAMEERROR, NULL, FRAMENODEPTH, NULL, "Expression empty after preprocessing; not rendering.\n");
+        goto end_of_job;
+    }
+    if ((md5hash = cachekey(expression)) == NULL) {
+        nbytes = emitframe(fd, FRAMEERROR, NULL, FRAMENODEPTH, NULL, embeddedtext[UNKNOWNERROR]);
+        goto end_of_job;
+    }
+    if ((imagefile = cacheimage(expression, md5hash, &ishit, &depth)) == NULL) {
+        if (render->errorcount > 0) { /* latex told us what went wrong */
+            strninit(message, render->errors[0], sizeof(message) - 1);
+        } else {
+            strninit(message, embeddedtext[render->msgnumber], sizeof(message) - 1);
+        }
+        nbytes = emitframe(fd, FRAMEERROR, md5hash, FRAMENODEPTH, NULL, message);
+        goto end_of_job;
+    }
+    nbytes = emitframe(fd, (ishit ? FRAMEHIT : FRAMEMISS), md5hash, depth, imagefile, NULL);
+    if (!render->iscaching) remove(imagefile); /* don't want this image cached */
+
+end_of_job:
+    renderclose(context);
+    return nbytes;
+}
 
+/* --- set by the --serve signal handler --- */
+static volatile sig_atomic_t isserving = 1;
+void sigserve(int sig) { isserving = 0; }
+
+int serve(char *sockpath) {
     /* -------------------------------------------------------------------------
-    Execute the latex file
+    Allocations and Declarations
     -------------------------------------------------------------------------- */
-    /* --- initialize system(command); to execute the latex file --- */
-    *command = '\000'; /* init command as empty string */
+    int listenfd = (-1), fd = (-1);               /* listening and accepted sockets */
+    struct sockaddr_un addr;                      /* socket address */
+    struct pollfd pfd;                            /* wait for connections */
+    int perm_all = (S_IRWXU | S_IRWXG | S_IRWXO); /* 777 permissions */
+    static char expression[MAXEXPRSZ + 1];        /* request expression */
+    unsigned int length = 0;                      /* request length */
+    pid_t pid = 0;                                /* per-connection children */
+    int status = 1;                               /* exit status */
+    static char *pkfonts[] = {"cmr10", "cmmi10", "cmsy10", "cmex10", "cmr7", "cmmi7", "cmsy7", "cmr5", "cmmi5", "cmsy5", NULL}; /* for dvirender() */
+    int ifont = 0, npreloaded = 0;
 
-    /* --- run latex under timelimit if explicitly given -DTIMELIMIT switch --- */
-    if (istimelimitpath && warntime > 0 &&
-        !iscompiletimelimit) {                              /* given explict -DTIMELIMIT path, and positive warntime, and not using builtin timelimit()... */
-        if (killtime < 1) killtime = 1;                     /* don't make trouble for timelimit*/
-        strcat(command, makepath("", timelimitpath, NULL)); /* timelimit program */
-        if (isempty(command))                               /* no path to timelimit */
-            warntime = -1;                                  /* reset flag to signal no timelimit*/
-        else {                                              /* have path to timelimit program */
-            sprintf(command + strlen(command), " -t%d -T%d ", warntime, killtime); /* add timelimit args after path */
+    /* -------------------------------------------------------------------------
+    paths and cache directory are the same for every request, so do them once
+    -------------------------------------------------------------------------- */
+    setpaths(10 * render->latexmethod + render->imagemethod);
+    if (render->iscaching && !isdexists(makepath(NULL, NULL, NULL))) {
+        if (mkdir(makepath(NULL, NULL, NULL), perm_all) != 0) {
+            log_error("[serve] Error occurred whilst `mkdir %s`;\n", makepath(NULL, NULL, NULL));
+            return 1;
         }
     }
+    if (render->iscaching) checkcacheversion(makepath(NULL, NULL, NULL));
+    openindex(); /* mapped once, shared by every request */
+    openpack();  /* and the pack index */
+    if (poolsize > 0 && startpool(poolsize) < 1) log_error("[serve] Unable to start --pool, so running latex per request\n");
+    if (isdvirender && render->imagemethod == 1 && render->imagetype == 2) { /* glyphs every request uses, decoded once for all the children */
+        for (ifont = 0; pkfonts[ifont] != NULL; ifont++) npreloaded += dvipreload(pkfonts[ifont], (int)(atof(render->density) + 0.5));
+        log_info(5, "[serve] preloaded %d of %d pk fonts\n", npreloaded, ifont);
+    }
 
-    /* --- path to latex executable image followed by args --- */
-    if (latexmethod != 2) {                                   /* not explicitly using pdflatex */
-        strcpy(subcommand, makepath("", latexpath, NULL));    /* running latex program */
-    } else {                                                  /* explicitly using pdflatex */
-        strcpy(subcommand, makepath("", pdflatexpath, NULL)); /* running pdflatex */
+    /* -------------------------------------------------------------------------
+    bind and listen
+    -------------------------------------------------------------------------- */
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        log_error("[serve] Socket path too long: %s\n", sockpath);
+        return 1;
     }
-    if (isempty(subcommand)) {   /* no program path to latex */
-        msgnumber = SYLTXFAILED; /* set corresponding error message */
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockpath);
+    unlink(sockpath); /* stale socket from an earlier run */
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenfd, 64) != 0) {
+        log_error("[serve] Unable to listen on %s\n", sockpath);
         goto end_of_job;
-    }                                                      /* signal failure and emit error */
-    strcat(command, subcommand);                           /* add latex path (after timelimit)*/
-    strcat(command, " ");                                  /* add a blank before latex args */
-    strcat(command, latexfile);                            /* run on latexfile we just wrote */
-    if (isquiet > 0) {                                     /* to continue after latex error */
-        if (isquiet > 99) {                                /* explicit q requested */
-            system("echo \"q\" > reply.txt");              /* reply  q  to latex error prompt */
-        } else {                                           /* reply <Enter>'s followed by x */
-            int nquiet = isquiet;                          /* this many <Enter>'s before x */
-            FILE *freply = fopen("reply.txt", "w");        /* open reply.txt for write */
-            if (freply != NULL) {                          /* opened successfully */
-                while (--nquiet >= 0) fputs("\n", freply); /* write \n's to reply.txt nquiet times */
-                fputs("x", freply);                        /* finally followed by an x */
-                fclose(freply);
-            }
-        } /* close reply.txt */
-        strcat(command, " < reply.txt");
-    } else {                             /*by redirecting stdin to reply.txt*/
-        strcat(command, " < /dev/null"); /* or redirect stdin to /dev/null */
-    }
-    strcat(command, " >latex.out 2>latex.err");                     /* redirect stdout and stderr */
-    log_info(5, "[mathtex] latex command executed: %s\n", command); /* show latex command executed*/
-
-    /* --- execute the latex file --- */
-    sys_stat = timelimit(command, killtime); /* throttle the latex command */
-    log_info(10, "[mathtex] system() return status: %d\n", sys_stat);
-    if (latexmethod != 2) {
-        if (!isfexists(makepath("", "latex", ".dvi"))) sys_stat = -1; /* ran latex, but no latex dvi. signal that latex failed */
-    }
-    if (latexmethod == 2) {
-        if (!isfexists(makepath("", "latex", ".pdf"))) sys_stat = -1; /* ran pdflatex, but no pdflatex pdf. signal that pdflatex failed */
-    }
-    if (sys_stat == -1) {                         /* system() or pdf/latex failed */
-        if (!iserror) {                           /* don't recurse if errormsg fails */
-            iserror = 1;                          /* set error flag */
-            isdepth = ispicture = 0;              /* reset depth, picture mode */
-            status = mathtex(errormsg, filename); /* recurse just once for error msg*/
-            goto end_of_job;
-        } else {                                                     /* ignore 2nd try to recurse */
-            msgnumber = sys_stat == 127 ? SYLTXFAILED : LATEXFAILED; /* latex failed for whatever reason */
-            goto end_of_job;
-        } /* and quit */
-    } else {
-        // system() does not return a value other than 0 if the render goes wrongly.
-        // thus, we need to check the error log ourselves. using a handy global variable for this.
-        char logname[96];
-        sprintf(logname, "%s/latex", filename);
-        char *logpath = makepath("", "latex", ".log");
-        if (isfexists(logpath)) {
-            char **errors = malloc(sizeof(char *) * LATEXERRORCOUNT); // dynamically allocate some pointers for our error messages.
-            int num = checkerrors(filename, errors);
-            if (num == -1) {
-                log_error("An error occured whilst parsing the latex log for errors. Continuing as if nothing went wrong...");
-            } else if (num != 0) {
-                // errors were parsed.
-                for (int i = 0; i < num; i++) {
-                    //log_error(errors[i]);
-                    if (msglevel >= 0) {
-                        fprintf(stderr, errors[i]);
-                    }
-                }
-                fflush(stderr);
-                msgnumber = sys_stat == 127 ? SYLTXFAILED : LATEXFAILED;
-                goto end_of_job;
-            }
-        }
     }
+    signal(SIGPIPE, SIG_IGN); /* clients hanging up shouldn't kill us */
+    signal(SIGTERM, sigserve);
+    signal(SIGINT, sigserve);
+    log_info(1, "[serve] listening on %s\n", sockpath);
 
     /* -------------------------------------------------------------------------
-    Extract image info from latex.info (if available)
+    accept connections, one child per connection, whose requests each get a
+    render context of their own from serverequest()
     -------------------------------------------------------------------------- */
-    if (isdepth) {                                                   /* image info requested */
-        if (isfexists(makepath("", "latex", ".info"))) {             /* and have latex.info */
-            FILE *info = fopen(makepath("", "latex", ".info"), "r"); /* open it for read */
-            char infoline[256];                                      /* read a line from latex.info */
-            if (info != NULL) {                                      /* open succeeded */
-                while (fgets(infoline, 255, info) != NULL) {         /* read until eof or error */
-                    int i = 0;                                       /* imageinfo[] index */
-                    char *delim = NULL;                              /* find '=' in infoline */
-                    trimwhite(infoline);                             /* remove leading/trailing whitespace */
-                    for (i = 0; imageinfo[i].format != NULL; i++) {  /* all imageinfo[] fields */
-                        if (strstr(infoline, imageinfo[i].identifier) == infoline) {
-                            imageinfo[i].value = (-9999.);                      /* init value to signal error */
-                            *(imageinfo[i].units) = '\000';                     /* init units to signal error */
-                            if ((delim = strchr(infoline, '=')) == NULL) break; /* no '=' delim */
-                            memmove(infoline, delim + 1, strlen(delim));        /* get value after '=' */
-                            trimwhite(infoline);                                /* remove leading/trailing whitespace*/
-                            imageinfo[i].value = strtod(infoline, &delim);      /* convert to integer */
-                            if (!isempty(delim)) {                              /* units, e.g., "pt", after value */
-                                memmove(infoline, delim, strlen(delim) + 1);    /* get units field */
-                                trimwhite(infoline);                            /* remove leading/trailing whitespace */
-                                strninit(imageinfo[i].units, infoline, 16);
-                            }      /* copy units */
-                            break; /* don't check further identifiers */
-                        }
-                    }
+    pfd.fd = listenfd;
+    pfd.events = POLLIN;
+    while (isserving) {
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) { /* reap finished connections, and workers */
+            int iworker = 0;
+            for (iworker = 0; iworker < npool; iworker++) {
+                if (pool[iworker].pid == pid) __sync_bool_compare_and_swap(&pool[iworker].state, POOLIDLE, POOLDEAD);
+            }
+        }
+        if (npool > 0) fillpool();                                  /* replace used workers */
+        if (poll(&pfd, 1, (npool > 0 ? 100 : 1000)) <= 0) continue; /* timeout or signal */
+        if ((fd = accept(listenfd, NULL, NULL)) < 0) continue;
+        fflush(NULL); /* flush all buffers before fork */
+        if ((pid = fork()) < 0) {
+            log_error("[serve] Unable to fork for connection\n");
+        } else if (pid == 0) { /* connection child */
+            close(listenfd);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGINT, SIG_DFL);
+            while (readfd(fd, &length, 4) == 4) {
+                length = ntohl(length);
+                if (length > MAXEXPRSZ) { /* can't hold it, so hang up */
+                    emitframe(fd, FRAMEERROR, NULL, FRAMENODEPTH, NULL, "Expression too long.\n");
+                    break;
                 }
-                fclose(info); /* close info file */
+                if (readfd(fd, expression, length) != (int)length) break;
+                expression[length] = '\000';
+                if (serverequest(fd, expression) < 0) break; /* client's gone */
             }
+            close(fd);
+            _exit(0);
         }
+        close(fd);
     }
+    status = 0;
+    log_info(1, "[serve] shutting down\n");
 
+end_of_job:
+    stoppool();
+    if (listenfd >= 0) close(listenfd);
+    unlink(sockpath);
+    return status;
+}
+
+int startpool(int nworkers) {
     /* -------------------------------------------------------------------------
-    Construct the output path/filename.[gif,png] for the image file
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    struct render_struct *context = NULL;         /* for the default request's document */
+    char *document = NULL, *body = NULL;          /* default request's document, and its \begin{document} */
+    int perm_all = (S_IRWXU | S_IRWXG | S_IRWXO); /* 777 permissions */
+    int iworker = 0;
+
+    /* -------------------------------------------------------------------------
+    workers load the preamble a request with no directives gets
     -------------------------------------------------------------------------- */
-    if (isempty(outfile) || !isthischar(*outfile, "/\\")) { /* using default cache directory, or juts given a relative path */
-        *giffile = '\000';                                  /* start with empty string */
-        if (isworkpath) {                                   /* we've cd'ed to a working dir */
-            if (!isempty(homepath))                         /* have a homepath */
-                strcpy(giffile, homepath);                  /* so just use it */
-            else {                                          /* home path not available */
-                int nsub = (isworkpath ? 2 : 1);            /* up two dirs for workdir, else 1 */
-                if (iserror) nsub++;                        /* and another if in error subdir */
-                if ((pwdpath = presentwd(nsub))             /* get path nsub dirs up from pwd */
-                    != NULL)                                /* got it */
-                    strcpy(giffile, pwdpath);
-            } /* use it as giffile prefix */
-        }
-        if (isempty(giffile) && !tmp_cache) {       /* haven't constructed giffile */
-            if (iserror) strcat(giffile, "../");    /*up to temp if in error subdir*/
-            strcat(giffile, "../");                 /* up to home or working dir */
-            if (isworkpath) strcat(giffile, "../"); /* temp under working dir */
-        }
-        gifpathlen = strlen(giffile); /* #chars in ../ or ../../ prefix */
-    }
-
-    if (isempty(outfile)) {
-        strcat(giffile, makepath(NULL, filename, extensions[imagetype])); /* using default output filename */
+    npool = 0;
+    if (nworkers < 1 || render->latexmethod == 2 || render->isdepth) return 0; /* pdflatex, or expression in the preamble */
+    if (nworkers > MAXPOOL) nworkers = MAXPOOL;
+    if ((context = renderopen()) == NULL) return 0;
+    strreplace(render->latexwrapper, "%%dclassoptions%%", render->dclassoptions, 0, 0); /* as preprocess() fills it in */
+    strreplace(render->latexwrapper, "%%dclass%%", render->dclass, 0, 0);
+    document = latexdocument("", 1);
+    if ((body = strstr(document, "\\begin{document}")) != NULL) {
+        *body = '\000';
+        poolpreamble = strdup(document);
+    }
+    if (poolpreamble == NULL) goto end_of_job;
+
+    /* --- workers get directories of their own, next to the requests' --- */
+    *pooldir = '\000';
+    if (isdexists(workpath)) {
+        if (*workpath != '/') strcpy(pooldir, homepath);
+        strcat(pooldir, workpath);
+        if (lastchar(pooldir) != '/') strcat(pooldir, "/");
     } else {
-        strcat(giffile, makepath("", outfile, NULL)); /* have an explicit output file */
+        strcpy(pooldir, homepath);
     }
-    log_info(5, "[mathtex] output image file: %s\n", giffile + gifpathlen); /* show output filename (?) */
 
     /* -------------------------------------------------------------------------
-    Run dvipng for .dvi-to-gif/png
+    and start from its format, if we're using them, which latexformat()
+    builds in a work dir of the context's own
     -------------------------------------------------------------------------- */
-    if (imagemethod == 1) { /*dvipng method requested (default)*/
-        /* ---
-         * First replace "keywords" in dvipngargs template with actual values
-         *------------------------------------------------------------------- */
-        /* --- replace %%imagetype%% in dvipng arg template with gif or png --- */
-        strreplace(dvipngargs, "%%imagetype%%", extensions[imagetype], 1, 0);
-        /* --- replace %%dpi%% in dvipng arg template with actual dpi --- */
-        strreplace(dvipngargs, "%%dpi%%", density, 1, 0);
-        /* --- replace %%gamma%% in dvipng arg template with actual gamma --- */
-        strreplace(dvipngargs, "%%gamma%%", gamma, 1, 0);
-        /* --- replace %%giffile%% in dvipng arg template with actual giffile --- */
-        strreplace(dvipngargs, "%%giffile%%", giffile, 1, 0);
-        /* ---
-         * And run dvipng to convert .dvi file directly to .gif/.png
-         *---------------------------------------------------------- */
-        strcpy(command, makepath("", dvipngpath, NULL)); /* running dvipng program */
-        if (isempty(command)) {                          /* no program path to dvipng */
-            msgnumber = SYPNGFAILED;                     /* set corresponding error message */
-            goto end_of_job;
-        }                                                                 /* signal failure and emit error */
-        strcat(command, dvipngargs);                                      /* add dvipng switches */
-        strcat(command, makepath("", "latex", ".dvi"));                   /* run dvipng on latex.dvi */
-        strcat(command, " >dvipng.out 2>dvipng.err");                     /* redirect stdout, stderr */
-        log_info(10, "[mathtex] dvipng command executed: %s\n", command); /* dvipng command executed */
-        sys_stat = system(command);                                       /* execute the dvipng command */
-        if (sys_stat == -1 || !isfexists(giffile)) {                      /* system(dvipng) failed or dvipng failed to create giffile*/
-            msgnumber = sys_stat == 127 ? SYPNGFAILED : DVIPNGFAILED;     /* dvipng failed for whatever reason */
-            goto end_of_job;
-        } /* and quit */
+    *poolformat = '\000';
+    if (isformat && render->iscaching && (document = malloc(strlen(poolpreamble) + 32)) != NULL) {
+        sprintf(document, "%s\\begin{document}\n", poolpreamble); /* latexformat() looks for the end of the preamble */
+        sprintf(render->workdir, "%spool%d-fmt/", pooldir, (int)getpid());
+        if (mkdir(render->workdir, perm_all) == 0 && (render->workfd = open(render->workdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+            if ((body = latexformat(document)) != NULL) strcpy(poolformat, body);
+            close(render->workfd);
+        }
+        rrmdir(render->workdir);
+        free(document);
     }
 
     /* -------------------------------------------------------------------------
-    Run dvips for .dvi-to-postscript and convert for postscript-to-gif/png
+    slots are shared with the request children, which claim idle workers
     -------------------------------------------------------------------------- */
-    if (imagemethod == 2) { /* dvips/convert method requested */
-        /* ---
-         * First run dvips to convert .dvi file to .ps postscript
-         *------------------------------------------------------- */
-        if (latexmethod != 2) {                             /* only if not using pdflatex */
-            strcpy(command, makepath("", dvipspath, NULL)); /* running dvips program */
-            if (isempty(command)) {                         /* no program path to dvips */
-                msgnumber = SYPSFAILED;                     /* set corresponding error message */
-                goto end_of_job;
-            }                                                    /* signal failure and emit error */
-            if (!ispicture) strcat(command, " -E");              /*add -E switch if not picture*/
-            strcat(command, " ");                                /* add a blank */
-            strcat(command, makepath("", "latex", ".dvi"));      /* run dvips on latex.dvi */
-            strcat(command, " -o ");                             /* to produce output file in */
-            if (!ispicture) {                                    /* when not a picture (usually) */
-                strcat(command, makepath("", "dvips", ".ps"));   /*dvips.ps postscript file*/
-            } else {                                             /*intermediate temp file for ps2epsi*/
-                strcat(command, makepath("", "dvitemp", ".ps")); /*temp postscript file*/
-            }
-            strcat(command, " >dvips.out 2>dvips.err");                      /* redirect stdout, stderr */
-            log_info(10, "[mathtex] dvips command executed: %s\n", command); /* dvips command executed */
-            sys_stat = system(command);                                      /* execute system(dvips) */
+    pool = mmap(NULL, MAXPOOL * sizeof(struct poolworker_struct), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        pool = NULL;
+        goto end_of_job;
+    }
+    memset(pool, 0, MAXPOOL * sizeof(struct poolworker_struct));
+    for (iworker = 0; iworker < MAXPOOL; iworker++) poolfds[iworker] = (-1);
+    npool = nworkers;
+    fillpool();
+    log_info(1, "[startpool] %d latex workers%s\n", npool, (isempty(poolformat) ? "" : ", preamble from format"));
 
-            /* --- run ps2epsi if dvips ran without -E (for \begin{picture}) --- */
-            if (sys_stat != -1 && ispicture) {                    /* system(dvips) succeeded and we ran dvips without -E */
-                strcpy(command, makepath("", ps2epsipath, NULL)); /* running ps2epsi */
-                if (isempty(command)) {                           /* no program path to ps2epsi */
-                    msgnumber = SYPSFAILED;                       /* set corresponding error message */
-                    goto end_of_job;
-                }                                                                  /* signal failure and emit error */
-                strcat(command, " ");                                              /* add a blank */
-                strcat(command, makepath("", "dvitemp", ".ps"));                   /*temp postscript file*/
-                strcat(command, " ");                                              /* add a blank */
-                strcat(command, makepath("", "dvips", ".ps"));                     /*dvips.ps postscript file*/
-                strcat(command, " >ps2epsi.out 2>ps2epsi.err");                    /*redirect stdout,stderr*/
-                log_info(10, "[mathtex] ps2epsi command executed: %s\n", command); /* command executed */
-                sys_stat = system(command);                                        /* execute system(ps2epsi) */
-            }
-            if (sys_stat == -1 || !isfexists(makepath("", "dvips", ".ps"))) { /* system(dvips) failed; dvips didn't create .ps*/
-                msgnumber = sys_stat == 127 ? SYPSFAILED : DVIPSFAILED;       /* dvips failed for whatever reason */
-                goto end_of_job;
-            } /* and quit */
-        }
+end_of_job:
+    renderclose(context);
+    return npool;
+}
 
-        /* ---
-         * Then replace "keywords" in convertargs template with actual values
-         *------------------------------------------------------------------- */
-        /* --- replace %%dpi%% in convert arg template with actual density --- */
-        strreplace(convertargs, "%%dpi%%", density, 1, 0);
-        /* --- replace %%gamma%% in convert arg template with actual gamma --- */
-        strreplace(convertargs, "%%gamma%%", gamma, 1, 0);
+int startworker(int iworker) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    static int generation = 0;                         /* so a replacement never reuses a directory */
+    struct poolworker_struct *worker = pool + iworker; /* slot being filled */
+    char fifo[512];                                    /* worker's input, reply and done fifos */
+    char program[512], fmtarg[600];                    /* latex, and &format if there is one */
+    char *args[8];                                     /* latex's argv */
+    char status[16];                                   /* its exit status, for done */
+    int nargs = 0;                                     /* #args so far */
+    pid_t pid = 0;                                     /* worker, which runs and waits for latex */
+    pid_t latexpid = 0;                                /* and latex itself */
+    int fd = (-1), inputfd = (-1);                     /* its reply and input fifos, in the worker */
 
-        /* ---
-         * And run convert to convert .ps file to .gif/.png
-         *-------------------------------------------------- */
-        strcpy(command, makepath("", convertpath, NULL)); /*running convert program*/
-        if (isempty(command)) {                           /* no program path to convert */
-            msgnumber = SYCVTFAILED;                      /* set corresponding error message */
-            goto end_of_job;
-        }                                                  /* signal failure and emit error */
-        strcat(command, convertargs);                      /* add convert switches */
-        if (latexmethod != 2) {                            /* we ran latex and dvips */
-            strcat(command, makepath("", "dvips", ".ps")); /* convert from postscript */
-        }
-        if (latexmethod == 2) {                             /* we ran pdflatex */
-            strcat(command, makepath("", "latex", ".pdf")); /* convert from pdf */
-        }
-        strcat(command, " ");                                              /* field separator */
-        strcat(command, giffile);                                          /* followed by ../cache/filename */
-        strcat(command, " >convert.out 2>convert.err");                    /*redirect stdout, stderr*/
-        log_info(10, "[mathtex] convert command executed: %s\n", command); /*convert command executed*/
-        sys_stat = system(command);                                        /* execute system(convert) command */
-        if (sys_stat == -1 || !isfexists(giffile)) {                       /* system(convert) failed or convert didn't create giffile*/
-            msgnumber = sys_stat == 127 ? SYCVTFAILED : CONVERTFAILED;     /* convert failed for whatever reason */
-            goto end_of_job;
-        } /* and quit */
-    }
-    status = imagetype; /* signal success */
+    /* -------------------------------------------------------------------------
+    a directory of its own, with a fifo to read the request from, one for its
+    terminal (the request's replies to error prompts), and another to report
+    latex's exit status through
+    -------------------------------------------------------------------------- */
+    sprintf(worker->dir, "%spool%d-%d-%d", pooldir, (int)getpid(), iworker, generation++);
+    if (mkdir(worker->dir, S_IRWXU) != 0) return -1;
+    sprintf(fifo, "%s/done", worker->dir);
+    if (mkfifo(fifo, S_IRUSR | S_IWUSR) != 0) goto failed;
+    sprintf(fifo, "%s/reply", worker->dir);
+    if (mkfifo(fifo, S_IRUSR | S_IWUSR) != 0) goto failed;
+    sprintf(fifo, "%s/input", worker->dir);
+    if (mkfifo(fifo, S_IRUSR | S_IWUSR) != 0) goto failed;
+    if ((poolfds[iworker] = open(fifo, O_RDWR)) < 0) goto failed; /* we hold it open, so latex never sees eof */
 
-/* -------------------------------------------------------------------------
-Back to caller
--------------------------------------------------------------------------- */
-end_of_job:
-    if (dir_stat >= 2) chdir(".."); /* return up to working dir or home */
-    if (dir_stat >= 1) {
-        int status = rrmdir(tempdir /* filename */); /* rm -r [temp working dir] */
-        if (status == -1) {
-            log_info(99, "[main] rrmdir returned %d;\n", status);
-            log_error("%s\n", embeddedtext[REMOVEWORKFAILED]);
+    /* -------------------------------------------------------------------------
+    the worker spawns latex reading the input fifo as /dev/fd/3, with the
+    reply fifo as its stdin, so an error prompt gets the same replies as it
+    would from mathtex()'s reply.txt (or eof, as from /dev/null). then it
+    waits, and reports latex's exit status through done
+    -------------------------------------------------------------------------- */
+    strcpy(program, makepath("", latexpath, NULL));
+    args[nargs++] = program;
+    args[nargs++] = "-jobname=latex";
+    if (!isempty(poolformat)) { /* start from the precompiled preamble */
+        sprintf(fmtarg, "&%s", poolformat);
+        args[nargs++] = fmtarg;
+    }
+    args[nargs++] = "/dev/fd/3";
+    args[nargs] = NULL;
+    fflush(NULL); /* flush all buffers before fork */
+    if ((pid = fork()) < 0) goto failed;
+    if (pid == 0) {
+        setpgid(0, 0); /* so a request that times out can kill latex along with its worker */
+        close(poolfds[iworker]);
+        if (chdir(worker->dir) != 0) _exit(1);
+        render->workfd = render->cancelfd = (-1); /* spawnstart() starts it here, and nothing cancels it */
+        if ((fd = open("reply", O_RDONLY | O_NONBLOCK)) < 0) _exit(1); /* no writer yet, so don't wait for one */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        if (dup2(fd, 0) < 0) _exit(1);
+        if (fd != 0) close(fd);
+        if ((inputfd = open("input", O_RDONLY)) < 0) _exit(1); /* serve() holds the other end, so no wait */
+        if (spawnstart(args, NULL, "latex.out", "latex.err", inputfd, &latexpid) != 0) _exit(1);
+        close(inputfd);
+        sprintf(status, "%d\n", spawnwait(latexpid, program, 0));
+        if ((fd = open("done", O_WRONLY)) < 0 || writefd(fd, status, strlen(status)) < 0) _exit(1); /* waits for poollatex() to be reading */
+        _exit(0);
+    }
+    setpgid(pid, pid);
+    if (isempty(poolformat)) { /* no format, so have it load the preamble now */
+        if (writefd(poolfds[iworker], poolpreamble, strlen(poolpreamble)) < 0) goto failed;
+    }
+    worker->pid = pid;
+    worker->state = POOLIDLE;
+    log_info(10, "[startworker] latex worker %d started in %s\n", iworker, worker->dir);
+    return 0;
+
+failed:
+    if (poolfds[iworker] >= 0) close(poolfds[iworker]);
+    poolfds[iworker] = (-1);
+    rrmdir(worker->dir);
+    worker->state = POOLEMPTY;
+    return -1;
+}
+
+int fillpool(void) {
+    int iworker = 0, nstarted = 0;
+    for (iworker = 0; iworker < npool; iworker++) {
+        struct poolworker_struct *worker = pool + iworker;
+        if (worker->state == POOLIDLE || worker->state == POOLBUSY) continue;
+        if (worker->state == POOLDEAD) { /* latex quit before it got a request */
+            log_error("[fillpool] latex worker %d exited while idle; see %s/latex.log\n", iworker, worker->dir);
+            if (++poolfailures > 2 * npool) { /* the preamble itself is broken, so stop trying */
+                log_error("[fillpool] too many latex workers failed; pool disabled\n");
+                stoppool();
+                return 0;
+            }
         }
+        if (worker->state == POOLDONE) kill(-worker->pid, SIGKILL); /* in case it hasn't quite exited */
+        if (poolfds[iworker] >= 0) close(poolfds[iworker]);
+        poolfds[iworker] = (-1);
+        if (!isempty(worker->dir)) rrmdir(worker->dir);
+        *worker->dir = '\000';
+        worker->state = POOLEMPTY;
+        if (startworker(iworker) == 0) nstarted++;
     }
-    if (isworkpath) chdir((!isempty(homepath) ? homepath : "..")); /* return from working dir to home, best guess at home */
-    iserror = 0;                                                   /* always reset error flag */
-    return status;
+    return nstarted;
 }
 
-int setpaths(int method) {
+void stoppool(void) {
+    int iworker = 0;
+    if (pool == NULL) return;
+    for (iworker = 0; iworker < npool; iworker++) {
+        struct poolworker_struct *worker = pool + iworker;
+        if (worker->state == POOLIDLE || worker->state == POOLBUSY) kill(-worker->pid, SIGKILL);
+        if (poolfds[iworker] >= 0) close(poolfds[iworker]);
+        if (!isempty(worker->dir)) rrmdir(worker->dir);
+    }
+    munmap(pool, MAXPOOL * sizeof(struct poolworker_struct));
+    pool = NULL;
+    npool = 0;
+}
+
+char *latexreply(void) {
+    static THREADLOCAL char reply[128];              /* returned replies */
+    int nquiet = min2(render->isquiet, (int)sizeof(reply) - 2); /* this many <Enter>'s before x */
+    *reply = '\000';                                 /* isquiet=0: none, so latex quits */
+    if (render->isquiet > 99) {                       /* explicit q requested */
+        strcpy(reply, "q\n");                        /* reply  q  to latex error prompt */
+    } else if (render->isquiet > 0) {                 /* reply <Enter>'s followed by x */
+        memset(reply, '\n', nquiet);                 /* \n's nquiet times */
+        strcpy(reply + nquiet, "x");                  /* finally followed by an x */
+    }
+    return reply;
+}
+
+int poollatex(char *document) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    char *programpath = NULL;    /* look for latex,dvipng,etc */
-    int nlocate = 0;             /*if which fails, #locate|grep hits*/
-    int ltxmethod = method / 10; /* divide by 10 */
-    int imgmethod = method % 10; /* remainder after division by 10 */
-    static int islatexwhich = 0; /* set true after we try whichpath() for that program */
-    static int ispdflatexwhich = 0;
-    static int isdvipngwhich = 0;
-    static int isdvipswhich = 0;
-    static int isps2epsiwhich = 0;
-    static int isconvertwhich = 0;
-    static int istimelimitwhich = 0;
+    struct poolworker_struct *worker = NULL;                   /* claimed worker */
+    char *body = strstr(document, "\\begin{document}");        /* end of preamble */
+    char fifo[512], result[512];                               /* worker's fifos, and files */
+    char status[16] = "\000";                                  /* latex's exit status, from done */
+    char *reply = latexreply();                                /* to latex's error prompts */
+    struct pollfd fds[2] = {{-1, POLLIN, 0}, {-1, POLLIN, 0}}; /* done, readable once latex exits, and the render's cancelfd */
+    long deadline = 0, remaining = -1;                         /* msclock() to give up at, and ms until then (-1 for never) */
+    int fd = (-1), iworker = 0, iext = 0, sys_stat = -1;
+    int isreplied = 0, istimeout = 0, iscancel = 0; /* true once its terminal has our replies, and why we gave up on it */
 
-    /* ---
-     * set paths, either from -DLATEX=\"path/latex\", etc, or call whichpath()
-     * ----------------------------------------------------------------------- */
-    /* --- path for latex program --- */
-    if (ltxmethod == 1 || ltxmethod == 0) {                             /* not needed for pdflatex only */
-        /*if ( !ISLATEXSWITCH && !islatexwhich )*/                      /* nb, use islatexpath instead */
-        if (!islatexpath && !islatexwhich) {                            /* no -DLATEX=\"path/latex\" */
-            islatexwhich = 1;                                           /* signal that which already tried */
-            nlocate = ISLOCATE;                                         /* use locate if which fails??? */
-            if ((programpath = whichpath("latex", &nlocate)) != NULL) { /* try to find latex path */
-                islatexpath = (nlocate == 0 ? 2 : 3);                   /* set flag signalling which() */
-                strninit(latexpath, programpath, 255);
-            }
-        } /* copy path from whichpath() */
+    /* -------------------------------------------------------------------------
+    claim an idle worker with our preamble already loaded
+    -------------------------------------------------------------------------- */
+    if (pool == NULL || body == NULL) return -1;
+    if (strlen(poolpreamble) != (size_t)(body - document) || strncmp(document, poolpreamble, body - document) != 0) return -1;
+    for (iworker = 0; iworker < npool && worker == NULL; iworker++) {
+        if (__sync_bool_compare_and_swap(&pool[iworker].state, POOLIDLE, POOLBUSY)) worker = pool + iworker;
     }
+    if (worker == NULL) return -1; /* all busy, so run latex ourselves */
+    log_info(10, "[poollatex] using latex worker %d\n", (int)(worker - pool));
 
-    /* --- path for pdflatex program --- */
-    if (ltxmethod == 2 || ltxmethod == 0) {                                /* not needed for latex only */
-        /*if ( !ISPDFLATEXSWITCH && !ispdflatexwhich )*/                   /* nb, use ispdflatexpath*/
-        if (!ispdflatexpath && !ispdflatexwhich) {                         /* no -DPDFLATEX=\"pdflatex\"*/
-            ispdflatexwhich = 1;                                           /* signal that which already tried */
-            nlocate = ISLOCATE;                                            /* use locate if which fails??? */
-            if ((programpath = whichpath("pdflatex", &nlocate)) != NULL) { /* try to find pdflatex */
-                ispdflatexpath = (nlocate == 0 ? 2 : 3);                   /* set flag signalling which() */
-                strninit(pdflatexpath, programpath, 255);
-            }
-        } /*copy path from whichpath()*/
+    /* -------------------------------------------------------------------------
+    answer its error prompts as mathtex() would, then stream it the rest of
+    the document. every fifo is opened non-blocking, and the body fits in
+    the input fifo's buffer, so nothing here can hang on a stuck worker
+    -------------------------------------------------------------------------- */
+    sprintf(fifo, "%s/reply", worker->dir);
+    if ((fd = open(fifo, O_WRONLY | O_NONBLOCK)) >= 0) { /* fails if latex has gone */
+        isreplied = (writefd(fd, reply, strlen(reply)) >= 0);
+        close(fd); /* so latex reads eof after the replies */
+        fd = (-1);
     }
-
-    /* --- path for timelimit program --- */
-    if (0) {                            /* only use explicit -DTIMELIMIT */
-        if (warntime > 0) {             /* have -DWARNTIME or -DTIMELIMIT */
-            /*if ( !ISTIMELIMITSWITCH*/ /* nb, use istimelimitpath instead */
-            if (!istimelimitpath        /*no -DTIMELIMIT=\"path/timelimit\"*/
-                && !istimelimitwhich) {
-                istimelimitwhich = 1;                                /* signal that which already tried */
-                nlocate = ISLOCATE;                                  /* use locate if which fails??? */
-                if ((programpath = whichpath("timelimit", &nlocate)) /* try to find path */
-                    != NULL) {                                       /* succeeded */
-                    istimelimitpath = (nlocate == 0 ? 2 : 3);        /* set flag signalling which() */
-                    strninit(timelimitpath, programpath, 255);
+    sprintf(fifo, "%s/done", worker->dir);
+    if (isreplied) fds[0].fd = open(fifo, O_RDONLY | O_NONBLOCK); /* before latex can finish, so the worker's status finds a reader */
+    sprintf(fifo, "%s/input", worker->dir);
+    if (fds[0].fd >= 0 && (fd = open(fifo, O_WRONLY | O_NONBLOCK)) >= 0) {
+        if (writefd(fd, body, strlen(body)) >= 0) {
+
+            /* -----------------------------------------------------------------
+            wait for latex's exit status, no longer than killtime, and only as
+            long as the render's wanted. poll(), not alarm(), which is the
+            whole process's
+            ----------------------------------------------------------------- */
+            if (killtime > 0) deadline = msclock() + 1000L * min2(killtime, 999);
+            fds[1].fd = render->cancelfd;
+            while (!(iscancel = iscancelled()) && !(istimeout = (killtime > 0 && (remaining = deadline - msclock()) <= 0))) {
+                if (poll(fds, 2, (int)remaining) > 0 && fds[0].revents != 0) {
+                    if (read(fds[0].fd, status, sizeof(status) - 1) > 0) sys_stat = atoi(status);
+                    break;
                 }
-            } /* copy from whichpath()*/
+            }
         }
+        close(fd);
     }
-
-    /* --- path for dvipng program --- */
-    if (imgmethod != 2) {                                     /* not needed for dvips/convert */
-        /*if ( !ISDVIPNGSWITCH && !isdvipngwhich )*/          /* nb, use isdvipngpath instead*/
-        if (!isdvipngpath && !isdvipngwhich) {                /* no -DDVIPNG=\"path/dvipng\" */
-            isdvipngwhich = 1;                                /* signal that which already tried */
-            nlocate = ISLOCATE;                               /* use locate if which fails??? */
-            if ((programpath = whichpath("dvipng", &nlocate)) /* try to find dvipng */
-                != NULL) {                                    /* succeeded */
-                isdvipngpath = (nlocate == 0 ? 2 : 3);        /* set flag signalling which() */
-                strninit(dvipngpath, programpath, 255);
-            }
-        } /*so copy path from whichpath()*/
+    if (fds[0].fd >= 0) close(fds[0].fd);
+    if (sys_stat < 0) { /* hung, cancelled, or worse */
+        log_info(5, "[poollatex] latex worker %d %s\n", (int)(worker - pool), (istimeout ? "timed out" : (iscancel ? "cancelled" : "failed")));
+        kill(-worker->pid, SIGKILL);
     }
 
-    /* --- path for dvips program --- */
-    if (imgmethod != 1) {                                    /* not needed for dvipng */
-        /*if ( !ISDVIPSSWITCH && !isdvipswhich )*/           /* nb, use isdvipspath instead */
-        if (!isdvipspath && !isdvipswhich) {                 /* no -DDVIPS=\"path/dvips\" */
-            isdvipswhich = 1;                                /* signal that which already tried */
-            nlocate = ISLOCATE;                              /* use locate if which fails??? */
-            if ((programpath = whichpath("dvips", &nlocate)) /* try to find dvips path */
-                != NULL) {                                   /* succeeded */
-                isdvipspath = (nlocate == 0 ? 2 : 3);        /* set flag signalling which() */
-                strninit(dvipspath, programpath, 255);
-            }
-        } /* so copy path from whichpath()*/
+    /* -------------------------------------------------------------------------
+    bring its dvi and log back to our own working directory
+    -------------------------------------------------------------------------- */
+    for (iext = 0; iext < 2; iext++) {
+        char *ext = (iext == 0 ? ".dvi" : ".log");
+        sprintf(result, "%s/latex%s", worker->dir, ext);
+        if (isfexists(result) && rename(result, makepath(render->workdir, "latex", ext)) != 0) copycache(result, makepath(render->workdir, "latex", ext));
     }
+    worker->state = POOLDONE; /* serve() starts a replacement */
+    return sys_stat;
+}
 
-    /* --- path for ps2epsi program --- */
-    if ((ispicture || method == 0) && imgmethod != 1 && ltxmethod != 2) { /* not needed for pdflatex */
-        /*if ( !ISPS2EPSISWITCH && !isps2epsiwhich )*/                    /*use isps2epsipath instead*/
-        if (!isps2epsipath && !isps2epsiwhich) {                          /*no -DPS2EPSI=\"path/ps2epsi\"*/
-            isps2epsiwhich = 1;                                           /* signal that which already tried */
-            nlocate = ISLOCATE;                                           /* use locate if which fails??? */
-            if ((programpath = whichpath("ps2epsi", &nlocate))            /*try to find ps2epsi path*/
-                != NULL) {                                                /* succeeded */
-                isps2epsipath = (nlocate == 0 ? 2 : 3);                   /* set flag signalling which() */
-                strninit(ps2epsipath, programpath, 255);
-            }
-        } /*copy path from whichpath()*/
+struct batchseen_struct *batchlookup(char *key) {
+    unsigned int slot = 0; /* open addressing slot */
+    int nprobe = 0;        /* #slots tried */
+    if (batchseen == NULL) return NULL; /* not running a --batch */
+    sscanf(key, "%8x", &slot);          /* md5 is already well mixed */
+    for (nprobe = 0; nprobe < BATCHSEENSZ; nprobe++, slot++) {
+        struct batchseen_struct *seen = batchseen + (slot % BATCHSEENSZ);
+        if (isempty(seen->key) || strcmp(seen->key, key) == 0) return seen;
     }
+    return NULL; /* table full, so just don't dedup */
+}
 
-    /* --- path for convert program --- */
-    if (imgmethod != 1) {                                                 /* not needed for dvipng */
-        /*if ( !ISCONVERTSWITCH && !isconvertwhich )*/                    /*use isconvertpath instead*/
-        if (!isconvertpath && !isconvertwhich) {                          /*no -DCONVERT=\"path/convert\"*/
-            isconvertwhich = 1;                                           /* signal that which already tried */
-            nlocate = ISLOCATE;                                           /* use locate if which fails??? */
-            if ((programpath = whichpath("convert", &nlocate)) != NULL) { /* try to find convert */
-                isconvertpath = (nlocate == 0 ? 2 : 3);                   /* set flag signalling which() */
-                strninit(convertpath, programpath, 255);
+char *jsonstring(char *json, char *string, int maxlen) {
+    int nchars = 0; /* #chars stored in string */
+    if (json == NULL || *json != '"') return NULL;
+    for (json++; *json != '"'; json++) {
+        unsigned int c = (unsigned char)*json;
+        if (c == '\000') return NULL; /* unterminated */
+        if (c == '\\') {
+            switch (*++json) {
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'u':
+                    if (sscanf(json + 1, "%4x", &c) != 1 || strlen(json + 1) < 4) return NULL;
+                    json += 4;
+                    if (c >= 0xd800 && c < 0xdc00 && json[1] == '\\' && json[2] == 'u') { /* surrogate pair */
+                        unsigned int low = 0;
+                        if (sscanf(json + 3, "%4x", &low) == 1 && low >= 0xdc00 && low < 0xe000) {
+                            c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                            json += 6;
+                        }
+                    }
+                    break;
+                case '\000': return NULL;
+                default: c = (unsigned char)*json; break; /* \" \\ \/ */
             }
-        } /*copy path from whichpath()*/
+        }
+        if (nchars + 4 > maxlen) return NULL; /* too long for string */
+        if (c < 0x80) {                        /* utf-8 encode it */
+            string[nchars++] = c;
+        } else if (c < 0x800) {
+            string[nchars++] = 0xc0 | (c >> 6);
+            string[nchars++] = 0x80 | (c & 0x3f);
+        } else if (c < 0x10000) {
+            string[nchars++] = 0xe0 | (c >> 12);
+            string[nchars++] = 0x80 | ((c >> 6) & 0x3f);
+            string[nchars++] = 0x80 | (c & 0x3f);
+        } else {
+            string[nchars++] = 0xf0 | (c >> 18);
+            string[nchars++] = 0x80 | ((c >> 12) & 0x3f);
+            string[nchars++] = 0x80 | ((c >> 6) & 0x3f);
+            string[nchars++] = 0x80 | (c & 0x3f);
+        }
     }
+    string[nchars] = '\000';
+    return json + 1; /* just past the closing quote */
+}
 
-    /* --- adjust imagemethod to comply with available programs --- */
-    if (imgmethod != imagemethod && imgmethod != 0) goto end_of_job; /* ignore recursive call. 0 is a call for both methods */
-    if (imagemethod == 1) {                                          /* dvipng wanted */
-        if (!isdvipngpath) {                                         /* but we have no real path to it */
-            if (imgmethod == 1) setpaths(2);                         /* try to set dvips/convert paths */
-            if (isdvipspath && isconvertpath) {                      /* and we do have dvips, convert */
-                imagemethod = 2;                                     /* so flip default to use them */
-                if (!ISGAMMA) strcpy(gamma, CONVERTGAMMA);
-            }
-        } /*default convert gamma*/
+int readbatch(FILE *fp, char *expression, int isnul) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    static char *line = NULL; /* one request, grown by getdelim() */
+    static size_t linesz = 0; /* allocated size of line */
+    char key[64];             /* object member name */
+    char *json = NULL;        /* current position in line */
+    int depth = 0;            /* nesting while skipping a member's value */
+    ssize_t nread = 0;        /* #bytes in line */
+
+    /* -------------------------------------------------------------------------
+    nul-separated requests are just the expression
+    -------------------------------------------------------------------------- */
+    do {
+        if ((nread = getdelim(&line, &linesz, (isnul ? '\000' : '\n'), fp)) < 0) return 0; /* eof */
+        if (nread > 0 && line[nread - 1] == (isnul ? '\000' : '\n')) line[--nread] = '\000';
+        json = line + strspn(line, WHITESPACE);
+    } while (*json == '\000'); /* skip blank lines */
+    if (isnul) {
+        if (nread > MAXEXPRSZ) return -1;
+        strcpy(expression, line);
+        return 1;
     }
-    if (imagemethod == 2) {                   /* dvips, convert wanted */
-        if (!isdvipspath || !isconvertpath) { /*but we have no real paths to them*/
-            if (imgmethod == 2) setpaths(1);  /* try to set dvipng path */
-            if (isdvipngpath) {               /* and we do have dvipng path */
-                imagemethod = 1;              /* so flip default to use it */
-                if (!ISGAMMA) strcpy(gamma, DVIPNGGAMMA);
+
+    /* -------------------------------------------------------------------------
+    otherwise a json string, or an object with an "expression" member
+    -------------------------------------------------------------------------- */
+    if (*json == '"') return (jsonstring(json, expression, MAXEXPRSZ) == NULL ? -1 : 1);
+    if (*json != '{') return -1;
+    for (json++;;) {
+        json += strspn(json, WHITESPACE ",");
+        if (*json == '}' || *json == '\000') return -1; /* no "expression" member */
+        if ((json = jsonstring(json, key, 63)) == NULL) return -1;
+        json += strspn(json, WHITESPACE);
+        if (*json++ != ':') return -1;
+        json += strspn(json, WHITESPACE);
+        if (strcmp(key, "expression") == 0) return (jsonstring(json, expression, MAXEXPRSZ) == NULL ? -1 : 1);
+        for (depth = 0; *json != '\000' && (depth > 0 || (*json != ',' && *json != '}'));) { /* skip some other member's value */
+            if (*json == '"') {
+                if ((json = jsonstring(json, expression, MAXEXPRSZ)) == NULL) return -1;
+                continue;
             }
-        } /* default dvipng gamma */
+            if (*json == '{' || *json == '[') depth++;
+            if (*json == '}' || *json == ']') depth--;
+            json++;
+        }
     }
-
-/* --- back to caller --- */
-end_of_job:
-    return 1;
 }
 
-int checkerrors(char *filename, char **errors) {
-    int current_error = 0;
-    FILE *fp = fopen(makepath("", "latex", "log"), "r"); // authors note: need to use makepath func to load the right file
+int planrequest(char *expression, int isrender, struct batchplan_struct *plan, char **text) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char *md5hash = NULL;                                                                          /* cache key of expression */
+    char *master = NULL;                                                                           /* and of its master image */
+    char *document = NULL, *body = NULL, *enddocument = NULL;                                      /* filled in latex wrapper */
+    char *pagebreaks[] = {"\\newpage", "\\clearpage", "\\pagebreak", "\\eject", "\\end{document}", /* would throw page numbers */
+                          "\\enlargethispage", NULL};                                              /* out of step with requests */
+    char groupbuff[1024];                                                                          /* what pages must share */
+    int ibreak = 0, ishit = 0;
 
-    if (!fp) {
-        goto set_error_code;
+    /* -------------------------------------------------------------------------
+    directives and cache key, as for any other request
+    -------------------------------------------------------------------------- */
+    memset(plan, 0, sizeof(*plan));
+    plan->status = FRAMEERROR;
+    plan->depth = FRAMENODEPTH;
+    if (!preprocess(expression)) {
+        strcpy(plan->message, "Expression empty after preprocessing; not rendering.\n");
+        goto end_of_job;
     }
-
-    // load file into memory
-    fseek(fp, 0, SEEK_END);
-    int filesize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    char *filebuf = malloc(sizeof(char) * filesize);
-    fread(filebuf, sizeof filebuf[0], filesize, fp);
-    
-    regex_t preg;
-    if ((regcomp(&preg, "(!(\\n|.)*?)\\?", (REG_EXTENDED))) != 0) { // old: "(![[:space:]]+?)\\?"
-        goto set_error_code;
+    if ((md5hash = cachekey(expression)) == NULL) {
+        strcpy(plan->message, embeddedtext[UNKNOWNERROR]);
+        goto end_of_job;
     }
+    strcpy(plan->key, md5hash);
+    plan->imagetype = render->imagetype;
+    plan->iscaching = render->iscaching;
 
-    regmatch_t groups[LATEXERRORCOUNT];
-    int matchres = regexec(&preg, filebuf, LATEXERRORCOUNT, &groups, 0);
-    if (matchres != REG_NOMATCH) {
-        // we got somefin. do some fucked up shit
-        //for (int j = 0; j < LATEXERRORCOUNT; j++) {
-            //if (groups[j].rm_so == -1) continue;
-            //int size = (groups[j].rm_eo - groups[j].rm_so) - 0; // chop off last '?' character 
-            int size = (groups[0].rm_eo - groups[0].rm_so);
-            errors[current_error] = malloc(sizeof(char) * size);
-            if (errors[current_error]) {
-                //memcpy(errors[current_error], (filebuf + groups[j].rm_so), size);
-                memcpy(errors[current_error], (filebuf + groups[0].rm_so), size);
+    /* -------------------------------------------------------------------------
+    not cached yet, so see whether it can be a page in a shared latex run. it
+    can't if it needs its own latex.info (depth), dvips, pdflatex or pictures,
+    is shrunk from a master image, or mustn't be cached (pages are published
+    straight into the cache)
+    -------------------------------------------------------------------------- */
+    if (!isrender && (!render->iscaching || (!iscached(md5hash, render->imagetype) && !readerrors(md5hash)))) {
+        plan->status = BATCHSINGLE;
+        if ((master = masterkey(expression)) != NULL) {
+            goto end_of_job; /* cacheimage() renders (and caches) the master at masterdpi, or just shrinks it */
+        }
+        if (render->iscaching && render->imagemethod == 1 && render->latexmethod != 2 && !render->isdepth && !render->ispicture) {
+            for (ibreak = 0; pagebreaks[ibreak] != NULL; ibreak++) {
+                if (strstr(expression, pagebreaks[ibreak]) != NULL) break;
             }
-            errors[current_error][size - 1] = '\0'; // throw a null on the end of that
-            current_error++;
-        //}
-        // most of the above code is for checking each group.
-        // turns out they all get bunched into the first group for some reason? i dont know man posix regex fucking blows
+            if (pagebreaks[ibreak] == NULL) { /* it's a single page */
+                document = latexdocument(expression, 1);
+                if ((body = strstr(document, "\\begin{document}\n")) != NULL) enddocument = strstr(body, "\\end{document}");
+            }
+        }
+        if (enddocument != NULL) { /* everything before \begin{document} must match the rest of its group */
+            plan->status = BATCHGROUP;
+            plan->npreamble = (int)(body - document);
+            body += strlen("\\begin{document}\n");
+            plan->nbody = (int)(enddocument - body);
+            strcpy(plan->density, render->density);
+            strcpy(plan->gamma, render->gamma);
+            plan->isquiet = render->isquiet;
+            *(document + plan->npreamble) = '\000';
+            sprintf(groupbuff, "%s\n%s\n%s\n%d\n%d\n", md5str(document), render->density, render->gamma, render->imagetype, render->isquiet);
+            *(document + plan->npreamble) = '\\';
+            strcpy(plan->group, md5str(groupbuff));
+        }
+        goto end_of_job;
     }
 
-    free(filebuf);
+    /* -------------------------------------------------------------------------
+    otherwise find it in the cache, or render it by itself
+    -------------------------------------------------------------------------- */
+    if (cacheimage(expression, md5hash, &ishit, &plan->depth) == NULL) {
+        if (render->errorcount > 0) { /* latex told us what went wrong */
+            strninit(plan->message, render->errors[0], sizeof(plan->message) - 1);
+        } else {
+            strninit(plan->message, embeddedtext[render->msgnumber], sizeof(plan->message) - 1);
+        }
+    } else {
+        plan->status = (ishit ? FRAMEHIT : FRAMEMISS);
+    }
 
 end_of_job:
-    if (fp != NULL) fclose(fp);
-    if (&preg) regfree(&preg);
-    return current_error;
+    if (plan->status == BATCHGROUP) { /* the page it would contribute, as preamble\0body\0 */
+        if (text == NULL || (*text = malloc(plan->npreamble + plan->nbody + 2)) == NULL) return -1;
+        memcpy(*text, document, plan->npreamble);
+        memcpy(*text + plan->npreamble + 1, body, plan->nbody);
+        (*text)[plan->npreamble] = (*text)[plan->npreamble + 1 + plan->nbody] = '\000';
+    }
+    return 0;
+}
 
-set_error_code:
-    // goto statements are evil but this program is ridden with em so if you cant beat em join em
-    current_error = -1;
-    goto end_of_job;
+int runplan(char *expression, int isrender, struct batchplan_struct *plan, char **text) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    struct render_struct *context = NULL; /* the request's own */
+    char *exprbuffer = NULL;              /* preprocess() may lengthen it */
+    int status = -1;                      /* planrequest() return status */
+
+    /* -------------------------------------------------------------------------
+    planrequest() in a context of its own, so its directives stay out of
+    everyone else's
+    -------------------------------------------------------------------------- */
+    if ((exprbuffer = malloc(MAXEXPRSZ + 1)) != NULL && (context = renderopen()) != NULL) {
+        strninit(exprbuffer, expression, MAXEXPRSZ);
+        status = planrequest(exprbuffer, isrender, plan, text);
+        renderclose(context);
+    }
+    free(exprbuffer);
+    if (status < 0) {
+        memset(plan, 0, sizeof(*plan));
+        plan->status = FRAMEERROR;
+        plan->depth = FRAMENODEPTH;
+        strcpy(plan->message, embeddedtext[UNKNOWNERROR]);
+        return -1;
+    }
+    return 0;
 }
 
-#if 0
-int checkerrors(char *filename, char **errors) {
-    int current_error = 0;
-    regex_t preg;
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL) { goto set_error_code; }
+int rendergroup(int *members, int nmembers, char **expressions, struct batchplan_struct *plans, char **texts) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    struct batchplan_struct *first = plans + members[0]; /* preamble and settings come from the first page */
+    char *document = NULL;                               /* the multi-page latex.tex */
+    char pagename[64];                                   /* <firstkey>-<page> */
+    int ndocument = 0;                                   /* #bytes allocated for document */
+    int imember = 0, nhalf = nmembers / 2;               /* members[] index, bisection */
+    struct render_struct *context = NULL;                /* the group's own */
+    int isok = 1;                                        /* all pages present and accounted for */
+    long starttime = msclock();                          /* for each page's share of the cost */
 
-    if ((regcomp(&preg, "^[\\s](! .*)", (REG_ICASE | REG_EXTENDED))) != 0) {
-        // shits fucked
-        goto set_error_code;
+    /* -------------------------------------------------------------------------
+    one page on its own just renders in the usual way
+    -------------------------------------------------------------------------- */
+    if (nmembers < 2) {
+        if (nmembers == 1) runplan(expressions[members[0]], 1, plans + members[0], NULL);
+        return 0;
     }
 
-    size_t len = 0;
-    ssize_t read;
-    char *line = NULL;
-    char buffer[LATEXSTACKLENGTH];
-    int iserror = 0;
-    while ((read = getline(&line, &len, fp)) != -1) {
-        if (iserror) {
-            if (line[0] == '?') {
-                // lines starting with '?' indicate the end of the stack trace
-                // the issue is that some traces continue immediately without a newline delimiter
-                // so, set the beginning to a ' ' and continue forward. the regex expression can handle it.
-                line[0] = ' ';
-                iserror = 0;
-                errors[current_error] = buffer;
-                *buffer = calloc(LATEXSTACKLENGTH, sizeof(char));
-                current_error++;
-            } else {
-                strcat(errors[current_error], line);
+    /* -------------------------------------------------------------------------
+    one page per request, each in its own group with counters reset, so nothing
+    it sets spills over onto the next page
+    -------------------------------------------------------------------------- */
+    ndocument = first->npreamble + 64;
+    for (imember = 0; imember < nmembers; imember++) ndocument += plans[members[imember]].nbody + 128;
+    if ((document = malloc(ndocument)) == NULL) goto bisect;
+    strcpy(document, texts[members[0]]); /* shared preamble */
+    strcat(document, "\\begin{document}\n");
+    for (imember = 0; imember < nmembers; imember++) {
+        if (imember > 0) strcat(document, "\\newpage\n");
+        strcat(document, "\\setcounter{equation}{0}\\setcounter{footnote}{0}\n\\begingroup\n");
+        strcat(document, texts[members[imember]] + plans[members[imember]].npreamble + 1);
+        strcat(document, "\\endgroup\n");
+    }
+    strcat(document, "\\end{document}\n");
+
+    /* -------------------------------------------------------------------------
+    run latex and dvipng once, in a context of its own, then move page N to the
+    cache under request N's key
+    -------------------------------------------------------------------------- */
+    if ((context = renderopen()) == NULL) {
+        free(document);
+        goto bisect;
+    }
+    render->latexwrapper = document; /* already filled in, so mathtex() writes it as is */
+    render->npages = nmembers;
+    render->isdepth = render->ispicture = 0;
+    render->imagetype = first->imagetype;
+    strcpy(render->density, first->density);
+    strcpy(render->gamma, first->gamma);
+    render->isquiet = first->isquiet; /* everything else in the group hash is in the preamble */
+    sprintf(render->tempdir, "%s-group-%d", first->key, (int)gettid());
+    sprintf(pagename, "%s-%%d", first->key);
+    if (mkshards(makepath(NULL, pagename, extensions[render->imagetype])) < 0 || mathtex("", pagename) != render->imagetype) isok = 0;
+    sprintf(pagename, "%s-%d", first->key, nmembers + 1);
+    if (isfexists(makepath(NULL, pagename, extensions[render->imagetype]))) isok = 0; /* more pages than requests */
+    for (imember = 0; imember <= nmembers; imember++) {
+        char pagefile[512]; /* rendered page */
+        sprintf(pagename, "%s-%d", first->key, imember + 1);
+        strcpy(pagefile, makepath(NULL, pagename, extensions[render->imagetype]));
+        if (isok && imember < nmembers) {
+            char keyfile[512]; /* where request N's image goes */
+            strcpy(keyfile, makepath(NULL, plans[members[imember]].key, extensions[render->imagetype]));
+            if (!isfexists(pagefile) || mkshards(keyfile) < 0 || publishfile(pagefile, keyfile) != 0) isok = 0;
+            if (isok && openindex()) {
+                evictcache();
+                indexcache(keyfile, plans[members[imember]].key, extensions[render->imagetype], (int)((msclock() - starttime) / nmembers));
             }
+            if (isok) storepack(keyfile, plans[members[imember]].key, FRAMENODEPTH);
+        } else {
+            remove(pagefile);
         }
-        if (!iserror) {
-            regmatch_t group; // regmatch_t groups[5];
-            int result = regexec(&preg, line, 1, &group, 0);
-            if (!result) {
-                if (!isstrstr(line, "! LaTeX Error:", 0)) {
-                    iserror = 1; // necessary flag to print entire stack trace
-                } else {
-                    current_error++;
+    }
+    renderclose(context);
+    free(document);
+    if (isok) {
+        log_info(5, "[rendergroup] %d pages in one latex run\n", nmembers);
+        for (imember = 0; imember < nmembers; imember++) plans[members[imember]].status = FRAMEMISS;
+        return 1;
+    }
+
+    /* -------------------------------------------------------------------------
+    something on some page failed, so split the group until it's found
+    -------------------------------------------------------------------------- */
+bisect:
+    log_info(5, "[rendergroup] %d page group failed, bisecting\n", nmembers);
+    return rendergroup(members, nhalf, expressions, plans, texts) + rendergroup(members + nhalf, nmembers - nhalf, expressions, plans, texts);
+}
+
+int runjobs(struct batchjobs_struct *jobs) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    pthread_t threads[MAXBATCHTHREADS]; /* helpers, besides us */
+    int nthreads = 0, ithread = 0;      /* #helpers started, threads[] index */
+
+    /* -------------------------------------------------------------------------
+    helpers, if there's more than one job to share, then us, then wait for them
+    -------------------------------------------------------------------------- */
+    jobs->nextjob = 0;
+    for (ithread = 1; ithread < batchthreads && ithread < jobs->njobs; ithread++) {
+        if (pthread_create(&threads[nthreads], NULL, jobthread, jobs) != 0) break; /* we'll just do more of them ourselves */
+        nthreads++;
+    }
+    jobthread(jobs);
+    for (ithread = 0; ithread < nthreads; ithread++) pthread_join(threads[ithread], NULL);
+    return nthreads + 1;
+}
+
+void *jobthread(void *jobs) {
+    struct batchjobs_struct *round = (struct batchjobs_struct *)jobs;
+    int ijob = 0; /* job claimed */
+    while ((ijob = __sync_fetch_and_add(&round->nextjob, 1)) < round->njobs) round->run(round, ijob);
+    return NULL;
+}
+
+int planjob(struct batchjobs_struct *jobs, int ijob) {
+    int i = jobs->jobs[ijob]; /* plans[] index */
+    if (runplan(jobs->expressions[i], 0, jobs->plans + i, jobs->texts + i) < 0) {
+        log_error("[batch] request %d: no plan\n", jobs->firstrequest + i);
+        __sync_fetch_and_add(&jobs->nfailed, 1);
+        return -1;
+    }
+    return 0;
+}
+
+int renderjob(struct batchjobs_struct *jobs, int ijob) {
+    int i = jobs->jobs[ijob]; /* plans[] or members[] index */
+    if (ijob < jobs->ngroups) {
+        __sync_fetch_and_add(&jobs->nruns, rendergroup(jobs->members + i, jobs->nmembers[ijob], jobs->expressions, jobs->plans, jobs->texts));
+    } else {
+        runplan(jobs->expressions[i], 1, jobs->plans + i, NULL);
+    }
+    return 0;
+}
+
+int batch(FILE *fp, int isnul) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    static char expression[MAXEXPRSZ + 1];               /* current request */
+    char *expressions[BATCHGROUPSZ];                     /* requests in this window */
+    char *texts[BATCHGROUPSZ];                           /* their preamble\0body\0, if groupable */
+    struct batchplan_struct plans[BATCHGROUPSZ];         /* and what to do about them */
+    int repeats[BATCHGROUPSZ];                           /* index of earlier request with same key, or -1 */
+    struct batchjobs_struct jobs;                        /* planned, then rendered, -j at a time */
+    struct batchseen_struct *seen = NULL;                /* key rendered in an earlier window */
+    int framefd = (-1);                                  /* original stdout, for the frames */
+    int perm_all = (S_IRWXU | S_IRWXG | S_IRWXO);        /* 777 permissions */
+    int nrequests = 0, nfailed = 0, nruns = 0;           /* #requests read, #unreadable or lost, #group latex runs */
+    int nwindow = 0, isread = 1, isgone = 0;             /* #requests in window, readbatch() status, reader went away */
+    int i = 0, j = 0, nmembers = 0, nthreads = 1;        /* indexes, #members[] filled, most threads used */
+
+    /* -------------------------------------------------------------------------
+    frames go to stdout, so everything else written there (our own log_info()
+    messages, latex and dvipng chatter) gets moved over to stderr
+    -------------------------------------------------------------------------- */
+    fflush(NULL);
+    if ((framefd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        log_error("[batch] Unable to redirect stdout\n");
+        return 1;
+    }
+    log_info(1, "%s%s\n", about, license);
+    if (!isempty(render->outfile)) {
+        log_info(1, "[batch] ignoring -o %s; images are written as frames\n", render->outfile);
+        *render->outfile = '\000';
+    }
+
+    /* -------------------------------------------------------------------------
+    paths, cache directory and the table of keys seen are set up just once
+    -------------------------------------------------------------------------- */
+    setpaths(10 * render->latexmethod + render->imagemethod);
+    if (!isdexists(makepath(NULL, NULL, NULL))) { /* uncached images are kept there until the batch ends */
+        if (mkdir(makepath(NULL, NULL, NULL), perm_all) != 0) {
+            log_error("[batch] Error occurred whilst `mkdir %s`;\n", makepath(NULL, NULL, NULL));
+            return 1;
+        }
+    }
+    if (render->iscaching) checkcacheversion(makepath(NULL, NULL, NULL));
+    batchseen = calloc(BATCHSEENSZ, sizeof(struct batchseen_struct)); /* still works without it, just without dedup */
+
+    /* -------------------------------------------------------------------------
+    requests are taken BATCHGROUPSZ at a time. each is planned in a render
+    context of its own, so one request's directives can't leak into the next
+    -------------------------------------------------------------------------- */
+    memset(&jobs, 0, sizeof(jobs));
+    jobs.expressions = expressions;
+    jobs.texts = texts;
+    jobs.plans = plans;
+    while (isread != 0 && !isgone) {
+        jobs.firstrequest = nrequests + 1;
+        jobs.njobs = jobs.ngroups = jobs.nfailed = jobs.nruns = 0;
+        for (nwindow = 0; nwindow < BATCHGROUPSZ && (isread = readbatch(fp, expression, isnul)) != 0; nwindow++) {
+            nrequests++;
+            expressions[nwindow] = texts[nwindow] = NULL;
+            repeats[nwindow] = -1;
+            if (isread < 0) {
+                log_error("[batch] request %d: unable to parse\n", nrequests);
+                memset(plans + nwindow, 0, sizeof(plans[0]));
+                plans[nwindow].status = FRAMEERROR;
+                plans[nwindow].depth = FRAMENODEPTH;
+                strcpy(plans[nwindow].message, "Unable to parse request.\n");
+                nfailed++;
+                continue;
+            }
+            if ((expressions[nwindow] = strdup(expression)) == NULL) {
+                memset(plans + nwindow, 0, sizeof(plans[0]));
+                plans[nwindow].status = FRAMEERROR;
+                plans[nwindow].depth = FRAMENODEPTH;
+                strcpy(plans[nwindow].message, embeddedtext[UNKNOWNERROR]);
+                nfailed++;
+                continue;
+            }
+            jobs.jobs[jobs.njobs++] = nwindow;
+        }
+        jobs.run = planjob;
+        if ((i = runjobs(&jobs)) > nthreads) nthreads = i;
+        nfailed += jobs.nfailed;
+
+        /* --- keys already rendered, earlier in this window or in an earlier one --- */
+        for (i = 0; i < nwindow; i++) {
+            if (plans[i].status != BATCHGROUP && plans[i].status != BATCHSINGLE) continue;
+            for (j = 0; j < i && repeats[i] < 0; j++) {
+                if (strcmp(plans[j].key, plans[i].key) == 0 && (plans[j].status == BATCHGROUP || plans[j].status == BATCHSINGLE)) repeats[i] = j;
+            }
+            if (repeats[i] < 0 && (seen = batchlookup(plans[i].key)) != NULL && !isempty(seen->key)) {
+                log_info(5, "[batch] repeated in batch: %s\n", plans[i].key);
+                plans[i].status = FRAMEHIT;
+                plans[i].depth = seen->depth;
+            }
+        }
+
+        /* --- render each group of requests sharing a preamble, then the rest --- */
+        jobs.njobs = nmembers = 0;
+        for (i = 0; i < nwindow; i++) {
+            if (plans[i].status != BATCHGROUP || repeats[i] >= 0) continue;
+            for (j = 0; j < nmembers && strcmp(plans[jobs.members[j]].group, plans[i].group) != 0; j++);
+            if (j < nmembers) continue; /* already in an earlier request's group */
+            jobs.jobs[jobs.njobs] = nmembers;
+            for (j = i; j < nwindow; j++) {
+                if (plans[j].status == BATCHGROUP && repeats[j] < 0 && strcmp(plans[j].group, plans[i].group) == 0) jobs.members[nmembers++] = j;
+            }
+            jobs.nmembers[jobs.njobs] = nmembers - jobs.jobs[jobs.njobs];
+            jobs.njobs++;
+        }
+        jobs.ngroups = jobs.njobs;
+        for (i = 0; i < nwindow; i++) {
+            if (plans[i].status == BATCHSINGLE && repeats[i] < 0) jobs.jobs[jobs.njobs++] = i;
+        }
+        jobs.run = renderjob;
+        if (jobs.njobs > 0 && (i = runjobs(&jobs)) > nthreads) nthreads = i;
+        nruns += jobs.nruns;
+
+        /* --- and emit their frames in order --- */
+        for (i = 0; i < nwindow; i++) {
+            struct batchplan_struct *plan = plans + (repeats[i] >= 0 ? repeats[i] : i); /* repeats answer like the original */
+            int status = (repeats[i] >= 0 && plan->status == FRAMEMISS ? FRAMEHIT : plan->status);
+            if (status == FRAMEERROR) {
+                if (emitframe(framefd, status, (isempty(plan->key) ? NULL : plan->key), FRAMENODEPTH, NULL, plan->message) < 0) isgone = 1;
+                continue;
+            }
+            if (emitframe(framefd, status, plan->key, plan->depth, imagepath(plan->key, plan->imagetype), NULL) < 0) isgone = 1;
+            if ((seen = batchlookup(plan->key)) != NULL) { /* remember it for the rest of the batch */
+                if (isempty(seen->key)) {
+                    strcpy(seen->key, plan->key);
+                    seen->depth = plan->depth;
+                    seen->imagetype = plan->imagetype;
                 }
-                strcat(errors[current_error], line);
-            } else if (result != REG_NOMATCH) { // no matches
-                log_error("An unknown error occured whilst searching for errors in the LaTeX log.\n");
-                goto set_error_code;
+                seen->iscaching |= plans[i].iscaching; /* kept if any request for it may be cached */
             }
         }
+        for (i = 0; i < nwindow; i++) {
+            if (expressions[i] != NULL) free(expressions[i]);
+            if (texts[i] != NULL) free(texts[i]);
+        }
+    }
+    log_info(1, "[batch] %d requests, %d unreadable or failed, %d shared latex runs, on %d threads\n", nrequests, nfailed, nruns, nthreads);
 
-        if (current_error == LATEXERRORCOUNT) { break; }
+    /* -------------------------------------------------------------------------
+    images rendered with caching disabled (for the batch, or by \nocache)
+    were only kept for this batch
+    -------------------------------------------------------------------------- */
+    if (batchseen != NULL) {
+        for (i = 0; i < BATCHSEENSZ; i++) {
+            if (isempty(batchseen[i].key) || (render->iscaching && batchseen[i].iscaching)) continue;
+            remove(makepath(NULL, batchseen[i].key, extensions[batchseen[i].imagetype]));
+        }
+        free(batchseen);
+        batchseen = NULL;
     }
+    close(framefd);
+    if (fp != stdin) fclose(fp);
+    return (nfailed > 0 ? 1 : 0);
+}
 
-end_of_job:
-    fclose(fp);
-    // if (buffer) free(buffer);
-    if (&preg) regfree(&preg);
-    return current_error;
+char *latexdocument(char *expression, int ispackages) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char usepackage[1024] = "\000"; /* additional \usepackage{}'s */
+    char *beginmath[] = {"\\noindent \\(\n\\displaystyle", "\\noindent \\(", ""};
+    char *endmath[] = {"\\)", "\\)", ""};
+    int ipackage = 0; /* packages[] index 0...npackages-1*/
 
-set_error_code:
-    // goto statements are evil but this program is ridden with em so if you cant beat em join em
-    current_error = -1;
-    goto end_of_job;
+    /* -------------------------------------------------------------------------
+    set up latex directives for user-specified additional \usepackage{}'s
+    -------------------------------------------------------------------------- */
+    if (ispackages) {                                              /* don't \usepackage for error */
+        if (render->npackages > 0) {                                       /* have additional packages */
+            for (ipackage = 0; ipackage < render->npackages; ipackage++) { /*make \usepackage{}*/
+                strcat(usepackage, "\\usepackage");                /* start with a directive */
+                if (!isempty(render->packargs[ipackage])) {                /* have an optional arg */
+                    strcat(usepackage, "[");                       /* begin optional argument */
+                    strcat(usepackage, render->packargs[ipackage]);        /* add optional arg */
+                    strcat(usepackage, "]");
+                }                                       /* finish optional arg */
+                strcat(usepackage, "{");                /* begin package name argument */
+                strcat(usepackage, render->packages[ipackage]); /* add package name */
+                strcat(usepackage, "}\n");
+            } /* finish constructing directive */
+        }
+    }
+
+    /* -------------------------------------------------------------------------
+    Replace "keywords" in latex template with expression and other directives
+    -------------------------------------------------------------------------- */
+    /* --- usually replace %%pagestyle%% with \pagestyle{empty} --- */
+    if (!render->ispicture || render->latexmethod == 1) { /* not \begin{picture} environment or using latex/dvips/ps2epsi */
+        strreplace(render->latexwrapper, "%%pagestyle%%", "\\pagestyle{empty}", 1, 0);
+    }
+    /* --- replace %%previewenviron%% if a picture and using pfdlatex --- */
+    if (render->ispicture && render->latexmethod == 2) { /* have \begin{picture} environment and using pdflatex/convert */
+        strreplace(render->latexwrapper, "%%previewenviron%%", "\\PreviewEnvironment{picture}", 1, 0);
+    }
+    /* --- replace %%beginmath%%...%%endmath%% with \[...\] or with $...$ --- */
+    if (render->mathmode < 0 || render->mathmode > 2) render->mathmode = 0; /* mathmode validity check */
+    strreplace(render->latexwrapper, "%%beginmath%%", beginmath[render->mathmode], 1, 0);
+    strreplace(render->latexwrapper, "%%endmath%%", endmath[render->mathmode], 1, 0);
+    /* --- replace %%fontsize%% in template with \tiny...\Huge --- */
+    strreplace(render->latexwrapper, "%%fontsize%%", sizedirectives[render->fontsize], 1, 0);
+    /* --- replace %%setlength%% in template for pictures when necessary --- */
+    if (render->ispicture && strstr(expression, "\\unitlength") == NULL) {                           /* have \begin{picture} environment, but no \unitlength */
+        strreplace(render->latexwrapper, "%%setlength%%", "\\setlength{\\unitlength}{1.0in}", 1, 0); /* so default it to 1 inch */
+    }
+    /* --- replace %%usepackage%% in template with extra \usepackage{}'s --- */
+    strreplace(render->latexwrapper, "%%usepackage%%", usepackage, 1, 0);
+    /* --- replace %%expression%% in template with expression --- */
+    strreplace(render->latexwrapper, "%%expression%%", expression, 1, 0);
+
+    return render->latexwrapper;
 }
-#endif
 
-// ! NOT CURRENTLY IN USE, MAY BE USEFUL LATER... KEEPING IT AROUND !
-// int isnotfound(char *filename) {
-//    /* -------------------------------------------------------------------------
-//    Allocations and Declarations
-//    -------------------------------------------------------------------------- */
-//    int status = 0;       /* set 1 if "not found" found */
-//    char command[256];    /* grep program */
-//    FILE *grepout = NULL; /* grep's stdout */
-//    char grepline[256];   /* line from grep's stdout */
-//    int nlines = 0;       /* #lines read */
-//
-//    /* -------------------------------------------------------------------------
-//    grep filename.err for filename (i.e., the program name), then check each
-//    such line for "not found", "no such", etc.
-//    -------------------------------------------------------------------------- */
-//    /* --- initialization --- */
-//    if (isempty(filename)) goto end_of_job; /* no input filename supplied */
-//    sprintf(command, "%s.err", filename);   /* look for filename.err */
-//    if (!isfexists(command)) {              /* filename.err doesn't exist */
-//        status = 1;                         /* assume this means "not found" */
-//        goto end_of_job;
-//    } /* and return that to caller */
-//
-//    /* --- grep filename.err for filename (i.e., for the program name) --- */
-//    sprintf(command, "grep -i \"%s\" %s.err", filename, filename); /*construct cmd*/
-//
-//    /* --- use popen() to invoke grep --- */
-//    grepout = popen(command, "r");        /* issue grep and capture stdout */
-//    if (grepout == NULL) goto end_of_job; /* failed */
-//
-//    /* --- read the pipe one line at a time --- */
-//    while (fgets(grepline, 255, grepout) != NULL) { /* not at eof yet */
-//        if (strreplace(grepline, "not found", "", 0, 0) > 0) nlines++; /* check for "not found" + count it */
-//        if (strreplace(grepline, "no such", "", 0, 0) > 0) nlines++; /* check for "no such" + count it */
-//    }
-//    if (nlines > 0) status = 1; /* "not found" found */
-//
-//    /* --- pclose() waits for command to terminate --- */
-//    pclose(grepout); /* finish */
-//
-// end_of_job:          /* back to caller */
-//    return status; /*1 if filename contains "not found"*/
-//}
+char *latexcache(char *document) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    static THREADLOCAL char cachedpath[512];  /* returned path, without extension */
+    char keybuff[1024];           /* what latex's output depends on */
+    char latexbinary[512];        /* latex or pdflatex */
+    struct stat latexstat;        /* size, mtime of latexbinary */
 
-int validate(char *expression) {
+    /* -------------------------------------------------------------------------
+    name it after the document and the latex that runs it
+    -------------------------------------------------------------------------- */
+    strcpy(latexbinary, makepath("", (render->latexmethod == 2 ? pdflatexpath : latexpath), NULL));
+    memset(&latexstat, 0, sizeof(latexstat));
+    stat(latexbinary, &latexstat); /* not found just leaves zeros */
+    sprintf(keybuff, "mathtex-dvi\n%s\n%d\n", md5str(document), render->latexmethod);
+    sprintf(keybuff + strlen(keybuff), "%s\n%ld\n%ld\n", latexbinary, (long)latexstat.st_size, (long)latexstat.st_mtime);
+
+    /* --- latex runs in the working dir, so give it an absolute path --- */
+    *cachedpath = '\000';
+    if (*makepath(NULL, "", NULL) != '/') {
+        if (isempty(homepath)) return NULL;
+        strcpy(cachedpath, homepath);
+    }
+    strcat(cachedpath, makepath(NULL, md5str(keybuff), NULL));
+    if (mkshards(cachedpath) < 0) return NULL;
+    return cachedpath;
+}
+
+char *latexformat(char *document) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    /* --- list of invalid \commands --- */
-    static struct {
-        int action;      /* 0=ignore, 1=apply, 2=abort */
-        char *command;   /* invalid \command */
-        int nargs;       /* #args, \command{arg1}...{nargs} */
-        int optionalpos; /* #{args} before optional [arg] */
-        int argformat;   /* 0=LaTeX {arg} or [arg], 1=arg */
-        char *displaystring;
-    } invalid[] = {  /* list of invalid commands */
-#if defined(INVALID) /* cc -DINVALID=\"filename\" */
-    #include INVALID /* filename with invalid \commands */
-#endif               /* as illustrated below... */
-                     // clang-format off
-        /* actn "command"           #args pos fmt "replacement string" or NULL
-         * ---- ------------------- ----- --- --- -------------------------- */
-        {  1,   "\\newcommand",     2,    1,  0,  NULL},
-        {  1,   "\\providecommand", 2,    1,  0,  NULL},
-        {  1,   "\\renewcommand",   2,    1,  0,  NULL},
-        {  1,   "\\input",          1,    -1, 0,  NULL},
-        /* --plain TeX commands with non-{}-enclosed args we can't parse-- */
-        {  1,   "\\def",            2,   -1,  20, NULL},
-        {  1,   "\\edef",           2,   -1,  20, NULL},
-        {  1,   "\\gdef",           2,   -1,  20, NULL},
-        {  1,   "\\xdef",           2,   -1,  20, NULL},
-        {  1,   "\\loop",           0,   -1,  0,  NULL},
-        {  1,   "\\csname",         0,   -1,  0,  NULL},
-        {  1,   "\\catcode",        0,   -1,  0,  NULL},
-        {  1,   "\\output",         0,   -1,  0,  NULL},
-        {  1,   "\\everycr",        0,   -1,  0,  NULL},
-        {  1,   "\\everypar",       0,   -1,  0,  NULL},
-        {  1,   "\\everymath",      0,   -1,  0,  NULL},
-        {  1,   "\\everyhbox",      0,   -1,  0,  NULL},
-        {  1,   "\\everyvbox",      0,   -1,  0,  NULL},
-        {  1,   "\\everyjob",       0,   -1,  0,  NULL},
-        {  1,   "\\openin",         0,   -1,  0,  NULL},
-        {  1,   "\\read",           0,   -1,  0,  NULL},
-        {  1,   "\\openout",        0,   -1,  0,  NULL},
-        {  1,   "\\write",          0,   -1,  0,  NULL},
-        /* --- other dangerous notation --- */
-        {  1,   "^^",               0,   -1,  0,  NULL},
-#if 0
-	    /* --- test cases --- */
-        {  1,  "\\input",           1,   -1,  0,  "{\\mbox{$\\backslash$input\\{#1\\}}}" },*/
-	    {  1,  "\\input",           1,   -1,  0,  "{\\mbox{~$\\backslash$input\\{#1\\}~not~permitted~}}" },
-	    {  1,  "\\newcommand",      2,    1,  0,  NULL},
-	    /*"{\\mbox{~$\\backslash$newcommand\\{#1\\}[#0]\\{#2\\}~not~permitted~}}" },*/
-#endif
-        {  0,  NULL,                0,   -1,  0,  NULL}
-                     // clang-format on
-    };
+    static THREADLOCAL char fmtpath[512];                           /* returned path, without .fmt */
+    char fmtfile[512], fmtname[64];                     /* path/name.fmt in cache, and its name */
+    char keybuff[1024];                                 /* what the format depends on */
+    char *args[8];                                      /* latex -ini argv */
+    char jobarg[96], fmtarg[96];                        /* -jobname=name, "&format" */
+    char latexbinary[512];                              /* latex or pdflatex */
+    char *body = strstr(document, "\\begin{document}"); /* end of preamble */
+    struct stat latexstat;                              /* size, mtime of latexbinary */
+    FILE *fp = NULL;                                    /* format.tex, check.tex, marker */
+    int sys_stat = 0;                                   /* spawn() return status */
+
+    /* -------------------------------------------------------------------------
+    name the format after its preamble and the latex that dumps it
+    -------------------------------------------------------------------------- */
+    if (body == NULL) return NULL;
+    strcpy(latexbinary, makepath("", (render->latexmethod == 2 ? pdflatexpath : latexpath), NULL));
+    if (isempty(latexbinary)) return NULL;
+    memset(&latexstat, 0, sizeof(latexstat));
+    stat(latexbinary, &latexstat); /* not found just leaves zeros */
+    *body = '\000';                /* md5 of the preamble alone */
+    sprintf(keybuff, "mathtex-fmt\n%s\n", md5str(document));
+    *body = '\\';
+    sprintf(keybuff + strlen(keybuff), "%s\n%ld\n%ld\n", latexbinary, (long)latexstat.st_size, (long)latexstat.st_mtime);
+    strcpy(fmtname, md5str(keybuff));
+
+    /* --- latex runs in the working dir, so give it an absolute path --- */
+    *fmtpath = '\000';
+    if (*makepath(NULL, fmtname, NULL) != '/') {
+        if (isempty(homepath)) return NULL;
+        strcpy(fmtpath, homepath);
+    }
+    strcat(fmtpath, makepath(NULL, fmtname, NULL));
+    if (mkshards(fmtpath) < 0) return NULL;
+    sprintf(fmtfile, "%s.fmt", fmtpath);
+    if (isfexists(fmtfile)) return fmtpath;                      /* already built */
+    if (isfexists(makepath("", fmtpath, ".nofmt"))) return NULL; /* tried before, and it can't be dumped */
+
+    /* -------------------------------------------------------------------------
+    dump the preamble with latex -ini
+    -------------------------------------------------------------------------- */
+    if ((fp = fopen(makepath(render->workdir, "format", ".tex"), "w")) == NULL) return NULL;
+    fwrite(document, 1, body - document, fp);
+    fputs("\\dump\n", fp);
+    fclose(fp);
+    sprintf(jobarg, "-jobname=%s", fmtname);
+    sprintf(fmtarg, "&%s", (render->latexmethod == 2 ? "pdflatex" : "latex"));
+    args[0] = latexbinary;
+    args[1] = "-ini";
+    args[2] = jobarg;
+    args[3] = fmtarg;
+    args[4] = "format.tex";
+    args[5] = NULL;
+    sys_stat = spawn(args, "/dev/null", "format.out", "format.err", killtime);
+    if (sys_stat == -1 || !isfexists(makepath(render->workdir, fmtname, ".fmt"))) goto no_format;
+
+    /* -------------------------------------------------------------------------
+    make sure it loads before anyone else picks it up
+    -------------------------------------------------------------------------- */
+    if ((fp = fopen(makepath(render->workdir, "check", ".tex"), "w")) == NULL) goto no_format;
+    fputs("\\begin{document}\n\\end{document}\n", fp);
+    fclose(fp);
+    sprintf(fmtarg, "&%s", fmtname);
+    args[1] = fmtarg;
+    args[2] = "check.tex";
+    args[3] = NULL;
+    if (spawn(args, "/dev/null", "check.out", "check.err", killtime) != 0) goto no_format;
+    if (publishfile(makepath(render->workdir, fmtname, ".fmt"), fmtfile) != 0) return NULL;
+    log_info(5, "[latexformat] built format %s\n", fmtfile);
+    return fmtpath;
+
+no_format:
+    log_info(5, "[latexformat] preamble can't be precompiled; see format.log (keep it with -w)\n");
+    if ((fp = fopen(makepath("", fmtpath, ".nofmt"), "w")) != NULL) fclose(fp);
+    return NULL;
+}
+
+int mathtex(char *expression, char *filename) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char convertargs[1024] =        /* args/switches for convert */
+        " -density %%dpi%% -gamma %%gamma%%"
+        //" -border 0% -fuzz 2%"
+        " -trim -transparent \"#FFFFFF\" ";
+    char dvipngargs[1024] = /* args/switches for dvipng */
+        " --%%imagetype%% -D %%dpi%% --gamma %%gamma%%"
+        " -bg Transparent -T tight -v" /* -q for quiet, -v for verbose */
+        " -o %%giffile%% ";            /* output filename supplied as -o */
+    char dvisvgmargs[1024] = /* args/switches for dvisvgm */
+        " --no-fonts --exact-bbox --optimize %%zip%%" /* glyphs as <path>'s in <defs>, drawn with <use> */
+        " --page=1- -o %%giffile%% ";                 /* every page, for a --batch group */
+
+    /* --- other variables --- */
+    char latexfile[512];
+    char *fmtfile = NULL; /* precompiled preamble, if any */
+    char giffile[512] = "\000";          /* image the programs write, in tempdir */
+    char imagefile[512];                  /* cached or explicit image path */
+    char publishedfile[512] = "\000";    /* imagefile, from tempdir */
+    char publishedpage[512];              /* publishedfile for a --batch group's page */
+    FILE *latexfp = NULL;                 /*latex wrapper file for expression*/
+    char *args[MAXSPAWNARGS];             /* argv spawn() runs latex, etc with */
+    int nargs = 0, iarg = 0;              /* #args, args[] index */
+    char program[512];                    /* path to latex, dvipng, etc */
+    char timelimitprog[512], timelimitargs[64]; /* -DTIMELIMIT program, and its switches */
+    char fmtarg[520];                     /* "&fmtfile" */
+    char dvifile[256], psfile[256], tempfile[256]; /* latex.dvi, dvips.ps (or latex.pdf), dvitemp.ps */
+    char pagefile[512];                   /* giffile, or a --batch group's page of it */
+    int ipage = 0;                        /* page of a --batch group */
+    long starttime = 0;                   /* msclock() when latex started */
+    char *dvicache = NULL;                /* latex's output in the cache, less extension */
+    char *latexext = (render->latexmethod == 2 ? ".pdf" : ".dvi"); /* what latex (or pdflatex) makes */
+    char *cachedext[] = {".info", latexext, NULL}; /* copied to or from the cache, latexext last */
+    char cachedfile[512];                 /* <dvicache>.ext, and its temp copy */
+    int iext = 0;                         /* cachedext[] index */
+    int perm_all = (S_IRWXU | S_IRWXG | S_IRWXO); /* 777 permissions */
+    int dir_stat = 0;                             /* 1=mkdir okay, 2=open okay */
+    int sys_stat = 0;                             /* spawn() return status */
+    int latexstat = 0;                            /* and latex's, before checking for its dvi */
+    int status = 0;                               /* imagetype or 0=error */
+
+    /* -------------------------------------------------------------------------
+    Make temporary work directory ~workpath/tempdir/. We never cd to it: work
+    files are named by their path in it, and the programs we run start in it,
+    so renders on other threads keep their own
+    -------------------------------------------------------------------------- */
+    render->msgnumber = 0;     /* no error to report yet */
+    if (render->workfd < 0) {  /* not already in it for the error message */
+        *render->workdir = '\000'; /* absolute, since the programs we run start in it */
+        if (isempty(workpath) || !isdexists(workpath) || *workpath != '/') strcpy(render->workdir, homepath);
+        if (!isempty(workpath) && isdexists(workpath)) strcat(render->workdir, workpath);
+        sprintf(render->workdir + strlen(render->workdir), "%s/", render->tempdir);
+        if (!isdexists(render->workdir)) {               /* if temp directory doesn't exist */
+            if (mkdir(render->workdir, perm_all) != 0) { /* tried to make temp dir, but mkdir failed */
+                render->msgnumber = MKDIRFAILED;         /* set corresponding message number and quit */
+                goto end_of_job;
+            }
+        }
+        dir_stat++; /* signal mkdir successful */
+        if ((render->workfd = open(render->workdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            render->msgnumber = CHDIRFAILED; /* set corresponding message number and quit */
+            goto end_of_job;
+        }
+        dir_stat++; /* signal open successful */
+    }
+
+    /* -------------------------------------------------------------------------
+    Fill in the latex template with expression and other directives
+    -------------------------------------------------------------------------- */
+    latexdocument(expression, !render->iserror);      /* don't \usepackage for error */
+    setpaths(10 * render->latexmethod + render->imagemethod); /* set paths to programs we'll need to run */
+
+    /* -------------------------------------------------------------------------
+    The same document may already have been through latex, for another
+    density, gamma or image type
+    -------------------------------------------------------------------------- */
+    if (isdvicache && render->iscaching && !render->iserror && render->npages < 2 && (dvicache = latexcache(render->latexwrapper)) != NULL) {
+        strcpy(cachedfile, makepath("", dvicache, latexext));
+        if (isfexists(cachedfile) && (!render->isdepth || isfexists(makepath("", dvicache, ".info")))) {
+            for (iext = 0; cachedext[iext] != NULL; iext++) { /* as if latex had just run */
+                strcpy(cachedfile, makepath("", dvicache, cachedext[iext]));
+                if (isfexists(cachedfile) && copycache(cachedfile, makepath(render->workdir, "latex", cachedext[iext])) < 0) break;
+            }
+            if (cachedext[iext] == NULL) {
+                log_info(5, "[mathtex] latex output from cache: %s%s\n", dvicache, latexext);
+                cacheindextouch(strrchr(dvicache, '/') + 1, latexext + 1);
+                dvicache = NULL; /* nothing new to keep */
+                goto latex_done;
+            }
+        }
+    }
+
+    /* -------------------------------------------------------------------------
+    Create latex document wrapper file containing expression
+    -------------------------------------------------------------------------- */
+    if (isformat && render->iscaching && !render->isdepth && !render->iserror) {
+        fmtfile = latexformat(render->latexwrapper); /* precompiled preamble. not for depth, which puts the expression in the preamble */
+    }
+    strcpy(latexfile, makepath(render->workdir, "latex", ".tex")); /* latex filename latex.tex */
+    latexfp = fopen(latexfile, "w");                  /* open latex file for write */
+    if (latexfp == NULL) {                            /* couldn't open latex file */
+        render->msgnumber = FOPENFAILED;                      /* set corresponding message number*/
+        goto end_of_job;
+    }                                                                                         /* and quit */
+    fprintf(latexfp, "%s", (fmtfile == NULL ? render->latexwrapper : strstr(render->latexwrapper, "\\begin{document}"))); /* write file, less the preamble if in format */
+    fclose(latexfp);                                                                          /* close file after writing it */
+
+    /* -------------------------------------------------------------------------
+    Execute the latex file
+    -------------------------------------------------------------------------- */
+    /* --- run latex under timelimit if explicitly given -DTIMELIMIT switch --- */
+    nargs = 0;
+    if (istimelimitpath && warntime > 0 &&
+        !iscompiletimelimit) {                            /* given explict -DTIMELIMIT path, and positive warntime, and not using builtin timelimit()... */
+        if (killtime < 1) killtime = 1;                   /* don't make trouble for timelimit*/
+        strcpy(timelimitprog, makepath("", timelimitpath, NULL)); /* timelimit program */
+        if (isempty(timelimitprog))                       /* no path to timelimit */
+            warntime = -1;                                /* reset flag to signal no timelimit*/
+        else {                                            /* have path to timelimit program */
+            sprintf(timelimitargs, "-t%d -T%d", warntime, killtime); /* timelimit args after path */
+            args[nargs++] = timelimitprog;
+            nargs += splitargs(timelimitargs, args + nargs, MAXSPAWNARGS - nargs);
+        }
+    }
+
+    /* --- path to latex executable image followed by args --- */
+    if (render->latexmethod != 2) {                                /* not explicitly using pdflatex */
+        strcpy(program, makepath("", latexpath, NULL));    /* running latex program */
+    } else {                                               /* explicitly using pdflatex */
+        strcpy(program, makepath("", pdflatexpath, NULL)); /* running pdflatex */
+    }
+    if (isempty(program)) {      /* no program path to latex */
+        render->msgnumber = SYLTXFAILED; /* set corresponding error message */
+        goto end_of_job;
+    }                                     /* signal failure and emit error */
+    args[nargs++] = program;              /* add latex path (after timelimit)*/
+    if (fmtfile != NULL) {                /* start from precompiled preamble */
+        sprintf(fmtarg, "&%s", fmtfile);
+        args[nargs++] = fmtarg;
+    }
+    args[nargs++] = latexfile;                             /* run on latexfile we just wrote */
+    args[nargs] = NULL;
+    if (render->isquiet > 0) {                                     /* to continue after latex error */
+        FILE *freply = fopen(makepath(render->workdir, "reply.txt", NULL), "w");            /* open reply.txt for write */
+        if (freply != NULL) {                              /* opened successfully */
+            fputs(latexreply(), freply);                   /* <Enter>'s followed by x, or q */
+            fclose(freply);
+        } /* close reply.txt */
+    }
+
+    /* --- execute the latex file, in a --pool worker if one's idle --- */
+    starttime = msclock();
+    sys_stat = -1;
+    if (npool > 0 && !render->iserror && render->npages < 2 && render->latexmethod != 2) sys_stat = poollatex(render->latexwrapper);
+    if (sys_stat < 0) { /* throttle the latex command, with stdin from reply.txt or /dev/null */
+        sys_stat = spawn(args, (render->isquiet > 0 ? "reply.txt" : "/dev/null"), "latex.out", "latex.err", (iscompiletimelimit ? killtime : 0));
+    }
+    log_info(10, "[mathtex] latex return status: %d\n", sys_stat);
+    latexstat = sys_stat;
+    if (render->latexmethod != 2) {
+        if (!isfexists(makepath(render->workdir, "latex", ".dvi"))) sys_stat = -1; /* ran latex, but no latex dvi. signal that latex failed */
+    }
+    if (render->latexmethod == 2) {
+        if (!isfexists(makepath(render->workdir, "latex", ".pdf"))) sys_stat = -1; /* ran pdflatex, but no pdflatex pdf. signal that pdflatex failed */
+    }
+    if (sys_stat == -1 && latexstat == 127) { /* couldn't run latex at all */
+        render->msgnumber = SYLTXFAILED;
+        goto end_of_job;
+    }
+    {
+        // system() does not return a value other than 0 if the render goes wrongly.
+        // thus, we need to check the error log ourselves. using a handy global variable for this.
+        char logname[96];
+        sprintf(logname, "%s/latex", filename);
+        char *logpath = makepath(render->workdir, "latex", ".log");
+        if (render->errors == NULL) render->errors = malloc(sizeof(char *) * LATEXERRORCOUNT); // dynamically allocate some pointers for our error messages. kept for --serve error frames
+        if (isfexists(logpath) && render->errors != NULL) {
+            int num = checkerrors(filename, render->errors);
+            render->errorcount = (num > 0 ? num : 0);
+            if (num == -1) {
+                log_error("An error occured whilst parsing the latex log for errors. Continuing as if nothing went wrong...");
+            } else if (num != 0) {
+                // errors were parsed.
+                for (int i = 0; i < num; i++) {
+                    //log_error(errors[i]);
+                    if (msglevel >= 0) {
+                        fprintf(stderr, render->errors[i]);
+                    }
+                }
+                fflush(stderr);
+                render->msgnumber = LATEXFAILED;
+                goto end_of_job;
+            }
+        }
+        if (sys_stat == -1) { /* no dvi, and nothing in the log says why: fail all the same, so --error-ttl remembers it */
+            if (render->errors != NULL && (render->errors[0] = strdup(embeddedtext[LATEXFAILED])) != NULL) render->errorcount = 1;
+            render->msgnumber = LATEXFAILED;
+            goto end_of_job;
+        }
+    }
+
+    /* --- keep latex's output for the next request with this document --- */
+    if (dvicache != NULL) {
+        for (iext = 0; cachedext[iext] != NULL; iext++) { /* latexext last, so it's only there when the rest is */
+            if (!isfexists(makepath(render->workdir, "latex", cachedext[iext]))) continue;
+            sprintf(cachedfile, "%s%s.%d", dvicache, cachedext[iext], (int)gettid());
+            if (copycache(makepath(render->workdir, "latex", cachedext[iext]), cachedfile) < 0 || publishfile(cachedfile, makepath("", dvicache, cachedext[iext])) != 0) {
+                remove(cachedfile);
+                break;
+            }
+        }
+        if (cachedext[iext] == NULL) indexcache(makepath("", dvicache, latexext), strrchr(dvicache, '/') + 1, latexext + 1, (int)(msclock() - starttime));
+    }
+
+latex_done:
+
+    /* -------------------------------------------------------------------------
+    Extract image info from latex.info (if available)
+    -------------------------------------------------------------------------- */
+    if (render->isdepth) {                                                   /* image info requested */
+        if (isfexists(makepath(render->workdir, "latex", ".info"))) {             /* and have latex.info */
+            FILE *info = fopen(makepath(render->workdir, "latex", ".info"), "r"); /* open it for read */
+            char infoline[256];                                      /* read a line from latex.info */
+            if (info != NULL) {                                      /* open succeeded */
+                while (fgets(infoline, 255, info) != NULL) {         /* read until eof or error */
+                    int i = 0;                                       /* imageinfo[] index */
+                    char *delim = NULL;                              /* find '=' in infoline */
+                    trimwhite(infoline);                             /* remove leading/trailing whitespace */
+                    for (i = 0; render->imageinfo[i].format != NULL; i++) {  /* all imageinfo[] fields */
+                        if (strstr(infoline, render->imageinfo[i].identifier) == infoline) {
+                            render->imageinfo[i].value = (-9999.);                      /* init value to signal error */
+                            *(render->imageinfo[i].units) = '\000';                     /* init units to signal error */
+                            if ((delim = strchr(infoline, '=')) == NULL) break; /* no '=' delim */
+                            memmove(infoline, delim + 1, strlen(delim));        /* get value after '=' */
+                            trimwhite(infoline);                                /* remove leading/trailing whitespace*/
+                            render->imageinfo[i].value = strtod(infoline, &delim);      /* convert to integer */
+                            if (!isempty(delim)) {                              /* units, e.g., "pt", after value */
+                                memmove(infoline, delim, strlen(delim) + 1);    /* get units field */
+                                trimwhite(infoline);                            /* remove leading/trailing whitespace */
+                                strninit(render->imageinfo[i].units, infoline, 16);
+                            }      /* copy units */
+                            break; /* don't check further identifiers */
+                        }
+                    }
+                }
+                fclose(info); /* close info file */
+            }
+        }
+    }
+
+    /* -------------------------------------------------------------------------
+    Construct the output path/filename.[gif,png] for the image file
+    -------------------------------------------------------------------------- */
+    if (isempty(render->outfile) || render->iscaching) {                                    /* image goes to the cache... */
+        strcpy(imagefile, makepath(NULL, filename, extensions[render->imagetype])); /* ...under the default filename, copied to outfile later */
+    } else {
+        strcpy(imagefile, makepath("", render->outfile, NULL)); /* have an explicit output file */
+    }
+    strcpy(publishedfile, imagefile);                                /* relative paths are still from home, as we never left it */
+    log_info(5, "[mathtex] output image file: %s\n", publishedfile); /* show output filename (?) */
+
+    /* --- written in the work dir first, and only renamed into place once it's whole --- */
+    sprintf(giffile, "%simage%s.%s", render->workdir, (render->npages > 1 ? "-%d" : ""), extensions[render->imagetype]);
+
+    /* -------------------------------------------------------------------------
+    Run dvipng for .dvi-to-gif/png
+    -------------------------------------------------------------------------- */
+    if (render->imagemethod == 1 && !ISSVG(render->imagetype)) { /*dvipng method requested (default)*/
+        /* ---
+         * First replace "keywords" in dvipngargs template with actual values
+         *------------------------------------------------------------------- */
+        /* --- replace %%imagetype%% in dvipng arg template with gif or png --- */
+        strreplace(dvipngargs, "%%imagetype%%", extensions[render->imagetype], 1, 0);
+        /* --- replace %%dpi%% in dvipng arg template with actual dpi --- */
+        strreplace(dvipngargs, "%%dpi%%", render->density, 1, 0);
+        /* --- replace %%gamma%% in dvipng arg template with actual gamma --- */
+        strreplace(dvipngargs, "%%gamma%%", render->gamma, 1, 0);
+        /* ---
+         * Render the png ourselves if its fonts are all pk's we can find,
+         * else run dvipng to convert .dvi file directly to .gif/.png
+         *---------------------------------------------------------------- */
+        strcpy(dvifile, makepath(render->workdir, "latex", ".dvi")); /* render latex.dvi */
+        sys_stat = (-1);
+        if (isdvirender && render->imagetype == 2) sys_stat = renderdvi(dvifile, giffile, render->npages, (render->iscaching || !isempty(render->outfile)));
+        if (sys_stat != 0) { /* specials, or fonts without pk's, so dvipng it is */
+            strcpy(program, makepath("", dvipngpath, NULL)); /* running dvipng program */
+            if (isempty(program)) {                          /* no program path to dvipng */
+                render->msgnumber = SYPNGFAILED;                     /* set corresponding error message */
+                goto end_of_job;
+            }                                                                    /* signal failure and emit error */
+            args[0] = program;                                                   /* followed by dvipng switches */
+            nargs = 1 + splitargs(dvipngargs, args + 1, MAXSPAWNARGS - 2);
+            for (iarg = 1; iarg < nargs; iarg++) {                               /* %%giffile%% is an arg of its own */
+                if (strcmp(args[iarg], "%%giffile%%") == 0) args[iarg] = giffile; /* so its path needs no quoting */
+            }
+            args[nargs++] = dvifile;
+            args[nargs] = NULL;
+            if (render->streamfd >= 0 && render->npages < 2) {                                   /* straight to the caller, as dvipng writes it */
+                sys_stat = streamimage(args, giffile, (render->iscaching || !isempty(render->outfile)));
+            } else {
+                sys_stat = spawn(args, "/dev/null", "dvipng.out", "dvipng.err", 0); /* execute the dvipng command */
+            }
+        }
+        strcpy(pagefile, giffile);
+        if (render->npages > 1) strreplace(pagefile, "%d", "1", 1, 1);            /* for a --batch group, check its first page */
+        if (sys_stat == -1 || !(render->isstreamed || isfexists(pagefile))) {     /* spawn(dvipng) failed or dvipng failed to create giffile*/
+            render->msgnumber = sys_stat == 127 ? SYPNGFAILED : DVIPNGFAILED;     /* dvipng failed for whatever reason */
+            goto end_of_job;
+        } /* and quit */
+    }
+
+    /* -------------------------------------------------------------------------
+    Run dvips for .dvi-to-postscript and convert for postscript-to-gif/png
+    -------------------------------------------------------------------------- */
+    if (render->imagemethod == 2 && !ISSVG(render->imagetype)) { /* dvips/convert method requested */
+        /* ---
+         * First run dvips to convert .dvi file to .ps postscript
+         *------------------------------------------------------- */
+        if (render->latexmethod != 2) {                             /* only if not using pdflatex */
+            strcpy(program, makepath("", dvipspath, NULL)); /* running dvips program */
+            if (isempty(program)) {                         /* no program path to dvips */
+                render->msgnumber = SYPSFAILED;                     /* set corresponding error message */
+                goto end_of_job;
+            }                                               /* signal failure and emit error */
+            strcpy(dvifile, makepath(render->workdir, "latex", ".dvi")); /* run dvips on latex.dvi */
+            strcpy(psfile, makepath(render->workdir, "dvips", ".ps"));   /*dvips.ps postscript file*/
+            strcpy(tempfile, makepath(render->workdir, "dvitemp", ".ps")); /*intermediate temp file for ps2epsi*/
+            nargs = 0;
+            args[nargs++] = program;
+            if (!render->ispicture) args[nargs++] = "-E";                           /*add -E switch if not picture*/
+            args[nargs++] = dvifile;
+            args[nargs++] = "-o";                                           /* to produce output file in */
+            args[nargs++] = (!render->ispicture ? psfile : tempfile);               /* dvips.ps, or temp file when a picture */
+            args[nargs] = NULL;
+            sys_stat = spawn(args, "/dev/null", "dvips.out", "dvips.err", 0); /* execute spawn(dvips) */
+
+            /* --- run ps2epsi if dvips ran without -E (for \begin{picture}) --- */
+            if (sys_stat != -1 && render->ispicture) {                    /* spawn(dvips) succeeded and we ran dvips without -E */
+                strcpy(program, makepath("", ps2epsipath, NULL)); /* running ps2epsi */
+                if (isempty(program)) {                           /* no program path to ps2epsi */
+                    render->msgnumber = SYPSFAILED;                       /* set corresponding error message */
+                    goto end_of_job;
+                } /* signal failure and emit error */
+                args[0] = program;
+                args[1] = tempfile;                                                   /*temp postscript file*/
+                args[2] = psfile;                                                     /*dvips.ps postscript file*/
+                args[3] = NULL;
+                sys_stat = spawn(args, "/dev/null", "ps2epsi.out", "ps2epsi.err", 0); /* execute spawn(ps2epsi) */
+            }
+            if (sys_stat == -1 || !isfexists(makepath(render->workdir, "dvips", ".ps"))) { /* spawn(dvips) failed; dvips didn't create .ps*/
+                render->msgnumber = sys_stat == 127 ? SYPSFAILED : DVIPSFAILED;       /* dvips failed for whatever reason */
+                goto end_of_job;
+            } /* and quit */
+        }
+
+        /* ---
+         * Then replace "keywords" in convertargs template with actual values
+         *------------------------------------------------------------------- */
+        /* --- replace %%dpi%% in convert arg template with actual density --- */
+        strreplace(convertargs, "%%dpi%%", render->density, 1, 0);
+        /* --- replace %%gamma%% in convert arg template with actual gamma --- */
+        strreplace(convertargs, "%%gamma%%", render->gamma, 1, 0);
+
+        /* ---
+         * And run convert to convert .ps file to .gif/.png
+         *-------------------------------------------------- */
+        strcpy(program, makepath("", (isempty(render->convertpath) ? convertpath : render->convertpath), NULL)); /*running convert program*/
+        if (isempty(program)) {                           /* no program path to convert */
+            render->msgnumber = SYCVTFAILED;                      /* set corresponding error message */
+            goto end_of_job;
+        }                                                     /* signal failure and emit error */
+        args[0] = program;                                    /* followed by convert switches */
+        nargs = 1 + splitargs(convertargs, args + 1, MAXSPAWNARGS - 3);
+        if (render->latexmethod != 2) {                               /* we ran latex and dvips */
+            strcpy(psfile, makepath(render->workdir, "dvips", ".ps"));     /* convert from postscript */
+        }
+        if (render->latexmethod == 2) {                               /* we ran pdflatex */
+            strcpy(psfile, makepath(render->workdir, "latex", ".pdf"));    /* convert from pdf */
+        }
+        args[nargs++] = psfile;
+        args[nargs++] = giffile;                                               /* followed by ../cache/filename */
+        args[nargs] = NULL;
+        sys_stat = spawn(args, "/dev/null", "convert.out", "convert.err", 0); /* execute spawn(convert) command */
+        if (sys_stat == -1 || !isfexists(giffile)) {                          /* spawn(convert) failed or convert didn't create giffile*/
+            render->msgnumber = sys_stat == 127 ? SYCVTFAILED : CONVERTFAILED;     /* convert failed for whatever reason */
+            goto end_of_job;
+        } /* and quit */
+    }
+
+    /* -------------------------------------------------------------------------
+    Run dvisvgm for .dvi-to-svg (.pdf-to-svg from pdflatex), whatever imagemethod
+    -------------------------------------------------------------------------- */
+    if (ISSVG(render->imagetype)) {
+        strreplace(dvisvgmargs, "%%zip%%", (render->imagetype == 4 ? "--zip=9" : ""), 1, 0);
+        strcpy(program, makepath("", dvisvgmpath, NULL)); /* running dvisvgm program */
+        if (isempty(program)) {
+            render->msgnumber = SYSVGFAILED;
+            goto end_of_job;
+        }
+        args[0] = program;
+        nargs = 1 + splitargs(dvisvgmargs, args + 1, MAXSPAWNARGS - 3);
+        strcpy(pagefile, giffile);                          /* dvisvgm numbers pages with %p, not dvipng's %d */
+        if (render->npages > 1) strreplace(pagefile, "%d", "%p", 1, 1);
+        for (iarg = 1; iarg < nargs; iarg++) {
+            if (strcmp(args[iarg], "%%giffile%%") == 0) args[iarg] = pagefile;
+        }
+        if (render->latexmethod == 2) args[nargs++] = "--pdf";      /* pdflatex made latex.pdf */
+        strcpy(dvifile, makepath(render->workdir, "latex", (render->latexmethod == 2 ? ".pdf" : ".dvi")));
+        args[nargs++] = dvifile;
+        args[nargs] = NULL;
+        sys_stat = spawn(args, "/dev/null", "dvisvgm.out", "dvisvgm.err", 0);
+        strcpy(pagefile, giffile);
+        if (render->npages > 1) strreplace(pagefile, "%d", "1", 1, 1); /* for a --batch group, check its first page */
+        if (sys_stat != 0 || !isfexists(pagefile)) {
+            render->msgnumber = (sys_stat == 127 ? SYSVGFAILED : DVISVGMFAILED);
+            goto end_of_job;
+        }
+    }
+
+    /* -------------------------------------------------------------------------
+    Recompress png's (every page of a --batch group) smaller, without metadata
+    -------------------------------------------------------------------------- */
+    if (pnglevel > 0 && render->imagetype == 2 && !render->isstreamed) {
+        for (ipage = 1; ipage <= (render->npages > 1 ? render->npages : 1); ipage++) {
+            char pagenum[16];
+            strcpy(pagefile, giffile);
+            sprintf(pagenum, "%d", ipage);
+            if (render->npages > 1) strreplace(pagefile, "%d", pagenum, 1, 1);
+            optimizepng(pagefile);
+        }
+    }
+
+    /* -------------------------------------------------------------------------
+    Publish the image (every page of a --batch group): readers of the cache
+    see all of it, or nothing
+    -------------------------------------------------------------------------- */
+    for (ipage = 1; ipage <= (render->npages > 1 ? render->npages : 1); ipage++) {
+        char pagenum[16];
+        strcpy(pagefile, giffile);
+        strcpy(publishedpage, publishedfile);
+        sprintf(pagenum, "%d", ipage);
+        if (render->npages > 1) {
+            strreplace(pagefile, "%d", pagenum, 1, 1);
+            strreplace(publishedpage, "%d", pagenum, 1, 1);
+        }
+        if (!isfexists(pagefile)) continue; /* only streamed to the caller */
+        if (publishfile(pagefile, publishedpage) != 0) {
+            log_info(1, "[mathtex] can't publish %s as %s\n", pagefile, publishedpage);
+            render->msgnumber = PUBLISHFAILED;
+            goto end_of_job;
+        }
+    }
+    status = render->imagetype; /* signal success */
+
+/* -------------------------------------------------------------------------
+Back to caller
+-------------------------------------------------------------------------- */
+end_of_job:
+    if (dir_stat >= 2) { /* done with the work dir */
+        close(render->workfd);
+        render->workfd = (-1);
+    }
+    if (dir_stat >= 1) {
+        int status = rrmdir(render->workdir /* filename */); /* rm -r [temp working dir] */
+        if (status == -1) {
+            log_info(99, "[main] rrmdir returned %d;\n", status);
+            log_error("%s\n", embeddedtext[REMOVEWORKFAILED]);
+        }
+    }
+    if (dir_stat >= 1) render->iserror = 0; /* reset error flag, once back out of the error message */
+    return status;
+}
+
+int setworkpath(char *dir) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char path[256]; /* dir/mathtex-<uid>/ */
+
+    /* -------------------------------------------------------------------------
+    a directory of our own, so other users can't see or race for our files
+    -------------------------------------------------------------------------- */
+    if (isempty(dir)) dir = WORKSHM;
+    if (strlen(dir) > 200) return 0;
+    sprintf(path, "%s%smathtex-%d/", dir, (lastchar(dir) == '/' ? "" : "/"), (int)getuid());
+    if (!isdexists(path)) mkdir(path, S_IRWXU); /* fails if dir isn't there */
+    if (!isdexists(path) || access(path, W_OK | X_OK) != 0) {
+        log_info(5, "[setworkpath] %s isn't usable; temp files stay in %s\n", path, workpath);
+        return 0;
+    }
+    strcpy(workpath, path);
+    log_info(10, "[setworkpath] temp files in %s\n", workpath);
+    return 1;
+}
+
+int setpaths(int method) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char *programpath = NULL;    /* look for latex,dvipng,etc */
+    int nlocate = 0;             /*if which fails, #locate|grep hits*/
+    int ltxmethod = method / 10; /* divide by 10 */
+    int imgmethod = method % 10; /* remainder after division by 10 */
+    static int islatexwhich = 0; /* set true after we try whichpath() for that program */
+    static int ispdflatexwhich = 0;
+    static int isdvipngwhich = 0;
+    static int isdvipswhich = 0;
+    static int isps2epsiwhich = 0;
+    static int isconvertwhich = 0;
+    static int isdvisvgmwhich = 0;
+    static int istimelimitwhich = 0;
+    static pthread_mutex_t pathlock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP; /* one thread at a time, recursing below */
+
+    pthread_mutex_lock(&pathlock);
+
+    /* ---
+     * set paths, either from -DLATEX=\"path/latex\", etc, or call whichpath()
+     * ----------------------------------------------------------------------- */
+    /* --- path for latex program --- */
+    if (ltxmethod == 1 || ltxmethod == 0) {                             /* not needed for pdflatex only */
+        /*if ( !ISLATEXSWITCH && !islatexwhich )*/                      /* nb, use islatexpath instead */
+        if (!islatexpath && !islatexwhich) {                            /* no -DLATEX=\"path/latex\" */
+            islatexwhich = 1;                                           /* signal that which already tried */
+            nlocate = ISLOCATE;                                         /* use locate if which fails??? */
+            if ((programpath = whichpath("latex", &nlocate)) != NULL) { /* try to find latex path */
+                islatexpath = (nlocate == 0 ? 2 : 3);                   /* set flag signalling which() */
+                strninit(latexpath, programpath, 255);
+            }
+        } /* copy path from whichpath() */
+    }
+
+    /* --- path for pdflatex program --- */
+    if (ltxmethod == 2 || ltxmethod == 0) {                                /* not needed for latex only */
+        /*if ( !ISPDFLATEXSWITCH && !ispdflatexwhich )*/                   /* nb, use ispdflatexpath*/
+        if (!ispdflatexpath && !ispdflatexwhich) {                         /* no -DPDFLATEX=\"pdflatex\"*/
+            ispdflatexwhich = 1;                                           /* signal that which already tried */
+            nlocate = ISLOCATE;                                            /* use locate if which fails??? */
+            if ((programpath = whichpath("pdflatex", &nlocate)) != NULL) { /* try to find pdflatex */
+                ispdflatexpath = (nlocate == 0 ? 2 : 3);                   /* set flag signalling which() */
+                strninit(pdflatexpath, programpath, 255);
+            }
+        } /*copy path from whichpath()*/
+    }
+
+    /* --- path for timelimit program --- */
+    if (0) {                            /* only use explicit -DTIMELIMIT */
+        if (warntime > 0) {             /* have -DWARNTIME or -DTIMELIMIT */
+            /*if ( !ISTIMELIMITSWITCH*/ /* nb, use istimelimitpath instead */
+            if (!istimelimitpath        /*no -DTIMELIMIT=\"path/timelimit\"*/
+                && !istimelimitwhich) {
+                istimelimitwhich = 1;                                /* signal that which already tried */
+                nlocate = ISLOCATE;                                  /* use locate if which fails??? */
+                if ((programpath = whichpath("timelimit", &nlocate)) /* try to find path */
+                    != NULL) {                                       /* succeeded */
+                    istimelimitpath = (nlocate == 0 ? 2 : 3);        /* set flag signalling which() */
+                    strninit(timelimitpath, programpath, 255);
+                }
+            } /* copy from whichpath()*/
+        }
+    }
+
+    /* --- path for dvipng program --- */
+    if (imgmethod != 2) {                                     /* not needed for dvips/convert */
+        /*if ( !ISDVIPNGSWITCH && !isdvipngwhich )*/          /* nb, use isdvipngpath instead*/
+        if (!isdvipngpath && !isdvipngwhich) {                /* no -DDVIPNG=\"path/dvipng\" */
+            isdvipngwhich = 1;                                /* signal that which already tried */
+            nlocate = ISLOCATE;                               /* use locate if which fails??? */
+            if ((programpath = whichpath("dvipng", &nlocate)) /* try to find dvipng */
+                != NULL) {                                    /* succeeded */
+                isdvipngpath = (nlocate == 0 ? 2 : 3);        /* set flag signalling which() */
+                strninit(dvipngpath, programpath, 255);
+            }
+        } /*so copy path from whichpath()*/
+    }
+
+    /* --- path for dvips program --- */
+    if (imgmethod != 1) {                                    /* not needed for dvipng */
+        /*if ( !ISDVIPSSWITCH && !isdvipswhich )*/           /* nb, use isdvipspath instead */
+        if (!isdvipspath && !isdvipswhich) {                 /* no -DDVIPS=\"path/dvips\" */
+            isdvipswhich = 1;                                /* signal that which already tried */
+            nlocate = ISLOCATE;                              /* use locate if which fails??? */
+            if ((programpath = whichpath("dvips", &nlocate)) /* try to find dvips path */
+                != NULL) {                                   /* succeeded */
+                isdvipspath = (nlocate == 0 ? 2 : 3);        /* set flag signalling which() */
+                strninit(dvipspath, programpath, 255);
+            }
+        } /* so copy path from whichpath()*/
+    }
+
+    /* --- path for ps2epsi program --- */
+    if ((render->ispicture || method == 0) && imgmethod != 1 && ltxmethod != 2) { /* not needed for pdflatex */
+        /*if ( !ISPS2EPSISWITCH && !isps2epsiwhich )*/                    /*use isps2epsipath instead*/
+        if (!isps2epsipath && !isps2epsiwhich) {                          /*no -DPS2EPSI=\"path/ps2epsi\"*/
+            isps2epsiwhich = 1;                                           /* signal that which already tried */
+            nlocate = ISLOCATE;                                           /* use locate if which fails??? */
+            if ((programpath = whichpath("ps2epsi", &nlocate))            /*try to find ps2epsi path*/
+                != NULL) {                                                /* succeeded */
+                isps2epsipath = (nlocate == 0 ? 2 : 3);                   /* set flag signalling which() */
+                strninit(ps2epsipath, programpath, 255);
+            }
+        } /*copy path from whichpath()*/
+    }
+
+    /* --- path for convert program --- */
+    if (imgmethod != 1) {                                                 /* not needed for dvipng */
+        /*if ( !ISCONVERTSWITCH && !isconvertwhich )*/                    /*use isconvertpath instead*/
+        if (!isconvertpath && !isconvertwhich) {                          /*no -DCONVERT=\"path/convert\"*/
+            isconvertwhich = 1;                                           /* signal that which already tried */
+            nlocate = ISLOCATE;                                           /* use locate if which fails??? */
+            if ((programpath = whichpath("convert", &nlocate)) != NULL) { /* try to find convert */
+                isconvertpath = (nlocate == 0 ? 2 : 3);                   /* set flag signalling which() */
+                strninit(convertpath, programpath, 255);
+            }
+        } /*copy path from whichpath()*/
+    }
+
+    /* --- path for dvisvgm program --- */
+    if (ISSVG(render->imagetype) || method == 0) {                                /* only needed for svg */
+        if (!isdvisvgmpath && !isdvisvgmwhich) {                          /*no -DDVISVGM=\"path/dvisvgm\"*/
+            isdvisvgmwhich = 1;                                           /* signal that which already tried */
+            nlocate = ISLOCATE;                                           /* use locate if which fails??? */
+            if ((programpath = whichpath("dvisvgm", &nlocate)) != NULL) { /* try to find dvisvgm */
+                isdvisvgmpath = (nlocate == 0 ? 2 : 3);                   /* set flag signalling which() */
+                strninit(dvisvgmpath, programpath, 255);
+            }
+        } /*copy path from whichpath()*/
+    }
+
+    /* --- adjust imagemethod to comply with available programs --- */
+    if (imgmethod != render->imagemethod && imgmethod != 0) goto end_of_job; /* ignore recursive call. 0 is a call for both methods */
+    if (render->imagemethod == 1) {                                          /* dvipng wanted */
+        if (!isdvipngpath) {                                         /* but we have no real path to it */
+            if (imgmethod == 1) setpaths(2);                         /* try to set dvips/convert paths */
+            if (isdvipspath && (isconvertpath || !isempty(render->convertpath))) {                      /* and we do have dvips, convert */
+                render->imagemethod = 2;                                     /* so flip default to use them */
+                if (!ISGAMMA) strcpy(render->gamma, CONVERTGAMMA);
+            }
+        } /*default convert gamma*/
+    }
+    if (render->imagemethod == 2) {                   /* dvips, convert wanted */
+        if (!isdvipspath || (!isconvertpath && isempty(render->convertpath))) { /*but we have no real paths to them*/
+            if (imgmethod == 2) setpaths(1);  /* try to set dvipng path */
+            if (isdvipngpath) {               /* and we do have dvipng path */
+                render->imagemethod = 1;              /* so flip default to use it */
+                if (!ISGAMMA) strcpy(render->gamma, DVIPNGGAMMA);
+            }
+        } /* default dvipng gamma */
+    }
+
+/* --- back to caller --- */
+end_of_job:
+    pthread_mutex_unlock(&pathlock);
+    return 1;
+}
+
+int checkerrors(char *filename, char **errors) {
+    int current_error = 0;
+    FILE *fp = fopen(makepath(render->workdir, "latex", "log"), "r"); // authors note: need to use makepath func to load the right file
+
+    if (!fp) {
+        goto set_error_code;
+    }
+
+    // load file into memory
+    fseek(fp, 0, SEEK_END);
+    int filesize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    
+    char *filebuf = malloc(sizeof(char) * (filesize + 1));
+    if (filebuf == NULL) {
+        goto set_error_code;
+    }
+    filebuf[fread(filebuf, sizeof filebuf[0], filesize, fp)] = '\0'; // regexec() wants a string
+    
+    regex_t preg;
+    if ((regcomp(&preg, "(!(\\n|.)*?)\\?", (REG_EXTENDED))) != 0) { // old: "(![[:space:]]+?)\\?"
+        goto set_error_code;
+    }
+
+    regmatch_t groups[LATEXERRORCOUNT];
+    int matchres = regexec(&preg, filebuf, LATEXERRORCOUNT, &groups, 0);
+    if (matchres != REG_NOMATCH) {
+        // we got somefin. do some fucked up shit
+        //for (int j = 0; j < LATEXERRORCOUNT; j++) {
+            //if (groups[j].rm_so == -1) continue;
+            //int size = (groups[j].rm_eo - groups[j].rm_so) - 0; // chop off last '?' character 
+            int size = (groups[0].rm_eo - groups[0].rm_so);
+            errors[current_error] = malloc(sizeof(char) * size);
+            if (errors[current_error]) {
+                //memcpy(errors[current_error], (filebuf + groups[j].rm_so), size);
+                memcpy(errors[current_error], (filebuf + groups[0].rm_so), size);
+            }
+            errors[current_error][size - 1] = '\0'; // throw a null on the end of that
+            current_error++;
+        //}
+        // most of the above code is for checking each group.
+        // turns out they all get bunched into the first group for some reason? i dont know man posix regex fucking blows
+    }
+
+    free(filebuf);
+
+end_of_job:
+    if (fp != NULL) fclose(fp);
+    if (&preg) regfree(&preg);
+    return current_error;
+
+set_error_code:
+    // goto statements are evil but this program is ridden with em so if you cant beat em join em
+    current_error = -1;
+    goto end_of_job;
+}
+
+#if 0
+int checkerrors(char *filename, char **errors) {
+    int current_error = 0;
+    regex_t preg;
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) { goto set_error_code; }
+
+    if ((regcomp(&preg, "^[\\s](! .*)", (REG_ICASE | REG_EXTENDED))) != 0) {
+        // shits fucked
+        goto set_error_code;
+    }
+
+    size_t len = 0;
+    ssize_t read;
+    char *line = NULL;
+    char buffer[LATEXSTACKLENGTH];
+    int iserror = 0;
+    while ((read = getline(&line, &len, fp)) != -1) {
+        if (iserror) {
+            if (line[0] == '?') {
+                // lines starting with '?' indicate the end of the stack trace
+                // the issue is that some traces continue immediately without a newline delimiter
+                // so, set the beginning to a ' ' and continue forward. the regex expression can handle it.
+                line[0] = ' ';
+                iserror = 0;
+                errors[current_error] = buffer;
+                *buffer = calloc(LATEXSTACKLENGTH, sizeof(char));
+                current_error++;
+            } else {
+                strcat(errors[current_error], line);
+            }
+        }
+        if (!iserror) {
+            regmatch_t group; // regmatch_t groups[5];
+            int result = regexec(&preg, line, 1, &group, 0);
+            if (!result) {
+                if (!isstrstr(line, "! LaTeX Error:", 0)) {
+                    iserror = 1; // necessary flag to print entire stack trace
+                } else {
+                    current_error++;
+                }
+                strcat(errors[current_error], line);
+            } else if (result != REG_NOMATCH) { // no matches
+                log_error("An unknown error occured whilst searching for errors in the LaTeX log.\n");
+                goto set_error_code;
+            }
+        }
+
+        if (current_error == LATEXERRORCOUNT) { break; }
+    }
+
+end_of_job:
+    fclose(fp);
+    // if (buffer) free(buffer);
+    if (&preg) regfree(&preg);
+    return current_error;
+
+set_error_code:
+    // goto statements are evil but this program is ridden with em so if you cant beat em join em
+    current_error = -1;
+    goto end_of_job;
+}
+#endif
+
+// ! NOT CURRENTLY IN USE, MAY BE USEFUL LATER... KEEPING IT AROUND !
+// int isnotfound(char *filename) {
+//    /* -------------------------------------------------------------------------
+//    Allocations and Declarations
+//    -------------------------------------------------------------------------- */
+//    int status = 0;       /* set 1 if "not found" found */
+//    char command[256];    /* grep program */
+//    FILE *grepout = NULL; /* grep's stdout */
+//    char grepline[256];   /* line from grep's stdout */
+//    int nlines = 0;       /* #lines read */
+//
+//    /* -------------------------------------------------------------------------
+//    grep filename.err for filename (i.e., the program name), then check each
+//    such line for "not found", "no such", etc.
+//    -------------------------------------------------------------------------- */
+//    /* --- initialization --- */
+//    if (isempty(filename)) goto end_of_job; /* no input filename supplied */
+//    sprintf(command, "%s.err", filename);   /* look for filename.err */
+//    if (!isfexists(command)) {              /* filename.err doesn't exist */
+//        status = 1;                         /* assume this means "not found" */
+//        goto end_of_job;
+//    } /* and return that to caller */
+//
+//    /* --- grep filename.err for filename (i.e., for the program name) --- */
+//    sprintf(command, "grep -i \"%s\" %s.err", filename, filename); /*construct cmd*/
+//
+//    /* --- use popen() to invoke grep --- */
+//    grepout = popen(command, "r");        /* issue grep and capture stdout */
+//    if (grepout == NULL) goto end_of_job; /* failed */
+//
+//    /* --- read the pipe one line at a time --- */
+//    while (fgets(grepline, 255, grepout) != NULL) { /* not at eof yet */
+//        if (strreplace(grepline, "not found", "", 0, 0) > 0) nlines++; /* check for "not found" + count it */
+//        if (strreplace(grepline, "no such", "", 0, 0) > 0) nlines++; /* check for "no such" + count it */
+//    }
+//    if (nlines > 0) status = 1; /* "not found" found */
+//
+//    /* --- pclose() waits for command to terminate --- */
+//    pclose(grepout); /* finish */
+//
+// end_of_job:          /* back to caller */
+//    return status; /*1 if filename contains "not found"*/
+//}
+
+int validate(char *expression) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    /* --- list of invalid \commands --- */
+    static struct {
+        int action;      /* 0=ignore, 1=apply, 2=abort */
+        char *command;   /* invalid \command */
+        int nargs;       /* #args, \command{arg1}...{nargs} */
+        int optionalpos; /* #{args} before optional [arg] */
+        int argformat;   /* 0=LaTeX {arg} or [arg], 1=arg */
+        char *displaystring;
+    } invalid[] = {  /* list of invalid commands */
+#if defined(INVALID) /* cc -DINVALID=\"filename\" */
+    #include INVALID /* filename with invalid \commands */
+#endif               /* as illustrated below... */
+                     // clang-format off
+        /* actn "command"           #args pos fmt "replacement string" or NULL
+         * ---- ------------------- ----- --- --- -------------------------- */
+        {  1,   "\\newcommand",     2,    1,  0,  NULL},
+        {  1,   "\\providecommand", 2,    1,  0,  NULL},
+        {  1,   "\\renewcommand",   2,    1,  0,  NULL},
+        {  1,   "\\input",          1,    -1, 0,  NULL},
+        /* --plain TeX commands with non-{}-enclosed args we can't parse-- */
+        {  1,   "\\def",            2,   -1,  20, NULL},
+        {  1,   "\\edef",           2,   -1,  20, NULL},
+        {  1,   "\\gdef",           2,   -1,  20, NULL},
+        {  1,   "\\xdef",           2,   -1,  20, NULL},
+        {  1,   "\\loop",           0,   -1,  0,  NULL},
+        {  1,   "\\csname",         0,   -1,  0,  NULL},
+        {  1,   "\\catcode",        0,   -1,  0,  NULL},
+        {  1,   "\\output",         0,   -1,  0,  NULL},
+        {  1,   "\\everycr",        0,   -1,  0,  NULL},
+        {  1,   "\\everypar",       0,   -1,  0,  NULL},
+        {  1,   "\\everymath",      0,   -1,  0,  NULL},
+        {  1,   "\\everyhbox",      0,   -1,  0,  NULL},
+        {  1,   "\\everyvbox",      0,   -1,  0,  NULL},
+        {  1,   "\\everyjob",       0,   -1,  0,  NULL},
+        {  1,   "\\openin",         0,   -1,  0,  NULL},
+        {  1,   "\\read",           0,   -1,  0,  NULL},
+        {  1,   "\\openout",        0,   -1,  0,  NULL},
+        {  1,   "\\write",          0,   -1,  0,  NULL},
+        /* --- other dangerous notation --- */
+        {  1,   "^^",               0,   -1,  0,  NULL},
+#if 0
+	    /* --- test cases --- */
+        {  1,  "\\input",           1,   -1,  0,  "{\\mbox{$\\backslash$input\\{#1\\}}}" },*/
+	    {  1,  "\\input",           1,   -1,  0,  "{\\mbox{~$\\backslash$input\\{#1\\}~not~permitted~}}" },
+	    {  1,  "\\newcommand",      2,    1,  0,  NULL},
+	    /*"{\\mbox{~$\\backslash$newcommand\\{#1\\}[#0]\\{#2\\}~not~permitted~}}" },*/
+#endif
+        {  0,  NULL,                0,   -1,  0,  NULL}
+                     // clang-format on
+    };
+
+    /* --- other variables --- */
+    int ninvalid = 0;                                                     /* #invalid =commands found */
+    int ivalid = 0;                                                       /* invalid[ivalid] list index */
+    char *pcommand = NULL;                                                /* find and remove invalid command */
+    static THREADLOCAL char args[10][512] = {"", "", "", "", "", "", "", "", "", ""}; /*\cmd{arg}'s*/
+    char *pargs[11] = {
+        args[0], args[1], args[2], args[3], args[4], args[5], args[6], args[7], args[8], args[9], NULL /* ptrs to them */
+    };
+    char display[2048]; /*displaystring with args*/
+    char argstr[256];
+    char optstr[1024];
+    int iarg = 0; /* args[], optionalargs[] indexes */
+    int iopt = 0;
+
+    /* -------------------------------------------------------------------------
+    Initialization
+    -------------------------------------------------------------------------- */
+    if (isempty(expression)) goto end_of_job; /* no input to validate, so quit */
+
+    /* -------------------------------------------------------------------------
+    Check each invalid command in list
+    -------------------------------------------------------------------------- */
+    for (ivalid = 0; !isempty(invalid[ivalid].command); ivalid++) { /*run list*/
+        /* --- extract local copy of invalid command list elements --- */
+        int action = invalid[ivalid].action;                 /* 0=ignore,1=apply,2=abort*/
+        char *command = invalid[ivalid].command;             /* invalid \command */
+        int nargs = invalid[ivalid].nargs;                   /*number of \command {arg}'s*/
+        int myoptionalpos = invalid[ivalid].optionalpos;     /*#{args} before [arg]*/
+        int myargformat = invalid[ivalid].argformat;         /* 0={arg},1=arg*/
+        char *displaystring = invalid[ivalid].displaystring; /*display template*/
+
+        /* --- arg format info --- */
+        int nfmt = 0;
+        // int isnegfmt = 0;                            /* {arg} format */
+        int argfmt[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0}; /* argformat digits */
+
+        /* --- args returned as (char *) if nargs=1 or (char **) if nargs>1 --- */
+        void *argptr = (nargs < 2 ? (void *)args[0] : (void *)pargs); /*(char * or **)*/
+
+        /* --- find and remove/replace all invalid command occurrences --- */
+        if (action < 1) continue;    /* ignore this invalid \command */
+        render->optionalpos = myoptionalpos; /* set global arg for getdirective */
+        render->argformat = myargformat;     /* set global arg for getdirective */
+
+        /* --- interpret argformat digits --- */
+        if (render->argformat != 0) {      /* have argformat */
+            int myfmt = render->argformat; /* local copy */
+            if (myfmt < 0) {
+                // isnegfmt = 1;
+                myfmt = -myfmt;
+            }                               /* check sign */
+            while (myfmt > 0 && nfmt < 9) { /* have more format digits */
+                argfmt[nfmt] = myfmt % 10;  /* store low-order decimal digit */
+                myfmt /= 10;                /* and shift it out */
+                nfmt++;
+            } /* count another format digit */
+        }
+
+        /* --- remove/replace each occurrence of invalid \command --- */
+        while ((pcommand = getdirective(expression, command, 1, 0, nargs, argptr)) != NULL) { /* found and removed an occurrence */
+            ninvalid++;                                                                       /* count another invalid \command */
+            if (render->noptional >= 8) render->noptional = 7;                                                /* don't overflow our buffers */
+
+            /* --- construct optional [arg]...[arg] for display --- */
+            *optstr = '\000';                                       /*init optional [arg]...[arg] string*/
+            if (render->noptional > 0) {                                    /* have optional [args] */
+                for (iopt = 0; iopt < render->noptional; iopt++) {          /* construct "[arg]...[arg]" */
+                    if (!isempty(render->optionalargs[iopt])) {             /* have an optional arg */
+                        strcat(optstr, "[");                        /* leading [ for optional arg */
+                        strcat(optstr, nomath(render->optionalargs[iopt])); /*optional arg string*/
+                        strcat(optstr, "]");
+                    }
+                }
+            }
+
+            /* --- construct error message display or use supplied template --- */
+            if (isempty(displaystring)) {                                                /*replace \command by not~permitted*/
+                strcpy(display, "\\mbox{~\\underline{");                                 /* underline error in \mbox{}*/
+                strcat(display, nomath(command));                                        /* command without \ */
+                for (iarg = 0; iarg < nargs; iarg++) {                                   /* add {args} and any [args] */
+                    int ifmt = (nfmt <= iarg ? 0 : argfmt[nfmt - iarg - 1]);             /* arg format digit */
+                    if (iarg == myoptionalpos && render->noptional > 0) strcat(display, optstr); /* [args] belong here, insert them before next {arg} */
+                    if (isempty(args[iarg])) break;                                      /* no more args */
+                    if (ifmt == 0) strcat(display, "\\{");                               /* insert leading \{ for arg */
+                    strcat(display, nomath(args[iarg]));                                 /* arg */
+                    if (ifmt == 0) strcat(display, "\\}");
+                }
+                strcat(display, "~not~permitted}~}");
+            } else {                                                                                       /* replace \command by displaystring */
+                strcpy(display, displaystring);                                                            /* local copy of display template */
+                if (render->noptional < 1) strreplace(display, "[#0]", "", 0, 0);                                  /* no optional args, so remove tag from template */
+                for (iarg = 0; iarg < nargs; iarg++) {                                                     /* replace #1 with args[0], etc */
+                    if (iarg == myoptionalpos && render->noptional > 0) strreplace(display, "[#0]", optstr, 0, 0); /* [args] belong here, insert them before {arg}*/
+                    if (isempty(args[iarg])) break;                                                        /* no more args */
+                    else {                                                                                 /* have an arg */
+                        sprintf(argstr, "#%d", iarg + 1);                                                  /* #1 in template displays args[0] */
+                        strreplace(display, argstr, nomath(args[iarg]), 0, 0);
+                    } /* replace */
+                }
+            }
+            strchange(0, pcommand, display);                        /* place display where command was */
+            for (iarg = 0; iarg < 10; iarg++) *args[iarg] = '\000'; /* reset args */
+        }
+    }
+
+end_of_job:
+    return ninvalid; /* back to caller with #invalid */
+}
+
+char *makepath(char *path, char *name, char *extension) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    static THREADLOCAL char namebuff[512]; /* buffer for constructed filename */
+    char *filename = NULL;     /*ptr to filename returned to caller*/
+    int ishard = 0;            /* cache subdirectory level */
+
+    /* -------------------------------------------------------------------------
+    construct filename
+    -------------------------------------------------------------------------- */
+    /* --- validity checks --- */
+    // if (isempty(name)) goto end_of_job; /* no name supplied by caller */
+
+    /* --- start with caller's path/ or default path to cache directory --- */
+    *namebuff = '\000';            /* re-init namebuff */
+    if (path == NULL) {            /* use default path to cache */
+        if (!isempty(cachepath)) { /* have a cache path */
+            if (!tmp_cache) {
+                strcpy(namebuff, cachepath);
+            } else {
+                strcpy(namebuff, "/tmp/mathtex/");
+            }
+        }
+    } else if (*path != '\000') { /* begin filename with path or use caller's supplied path if it's not an empty string */
+        strcpy(namebuff, path);   /* begin filename with path */
+    }
+    if (!isempty(namebuff)) {                           /* have a leading path */
+        if (!isthischar(lastchar(namebuff), "\\/")) {   /* no \ or / at end of path */
+            strcat(namebuff, (iswindows ? "\\" : "/")); /* so add windows\ or unix/ */
+        }
+    }
+
+    /* --- hash-named cache files go in their ab/cd/ subdirectories --- */
+    if (path == NULL && !isempty(name) && strspn(name, "0123456789abcdef") >= 32) {
+        for (ishard = 0; ishard < cacheshards; ishard++) {
+            sprintf(namebuff + strlen(namebuff), "%.2s%s", name + 2 * ishard, (iswindows ? "\\" : "/"));
+        }
+    }
+
+    /* --- add name after path/ (name arg might just be a blank space) --- */
+    if (!isempty(name)) {                         /* name supplied by caller */
+        if (!isempty(namebuff)) {                 /* and if we already have a path */
+            if (isthischar(*name, "\\/")) name++; /* skip leading \ or / in name */
+        }
+        strcat(namebuff, name);
+    } /* name concatanated after path/ */
+
+    /* --- add extension after path/name */
+    if (!isempty(extension)) {                                       /* have a filename extension */
+        if (!isthischar(lastchar(namebuff), ".")) {                  /* no . at end of name */
+            if (!isthischar(*extension, ".")) strcat(namebuff, "."); /* and extension has no leading ., so we need to add our own */
+            strcat(namebuff, extension);
+        } else {                                                                          /* . already at end of name */
+            strcat(namebuff, (!isthischar(*extension, ".") ? extension : extension + 1)); /* add extension without ., skip leading . */
+        }
+    }
+    filename = namebuff; /* successful name back to caller */
+
+    // end_of_job:
+    return filename; /* back with name or NULL=error */
+}
+
+int isfexists(char *filename) {
+    FILE *fp = (isempty(filename) ? NULL : fopen(filename, "r")); /* try to fopen*/
+    int status = 0;                                               /* init for non-existant filename */
+    if (fp != NULL) {                                             /* but filename does exist */
+        status = 1;                                               /* so flip status */
+        fclose(fp);
+    }              /* and close the file */
+    return status; /* tell caller if we found filename*/
+}
+
+int isdexists(char *dirname) {
+    int status = 0;                                /* init for non-existant dirname */
+    if (!isempty(dirname)) {                       /* must have directory name */
+        char directory[512];                       /* local copy of dirname */
+        DIR *dp = NULL;                            /* dp=opendir() opens directory */
+        strcpy(directory, dirname);                /* start with name given by caller */
+        if (!isthischar(lastchar(directory), "/")) /* no / at end of directory */
+            strcat(directory, "/");                /* so add one ourselves */
+        if ((dp = opendir(directory)) != NULL) {   /* dirname exists */
+            status = 1;                            /* so flip status */
+            closedir(dp);
+        } /* and close the directory */
+    }
+    return status; /* tell caller if we found dirname */
+}
+
+char *whichpath(char *program, int *nlocate) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    static THREADLOCAL char pathbuff[256];                                      /* buffer for returned path */
+    char command[256];                                              /* which program */
+    FILE *whichout = NULL;                                          /* which's stdout */
+    int nchars = 0;                                                 /* read whichout one char at a time*/
+    int pathchar;                                                   /* fgetc(whichout) */
+    char *path = NULL;                                              /* either pathbuff or NULL=error */
+    int islocate = (nlocate == NULL ? 1 : (*nlocate != 0 ? 1 : 0)); /* 1=use locate*/
+
+    /* -------------------------------------------------------------------------
+    Issue which command and read its output
+    -------------------------------------------------------------------------- */
+    /* --- check if which() suppressed --- */
+    if (!ISWHICH) return NULL; /*not running which, return failure*/
+
+    /* --- first construct the command --- */
+    if (isempty(program)) goto end_of_job; /* no input */
+    sprintf(command, "which %s", program); /* construct command */
+
+    /* --- use popen() to invoke which --- */
+    whichout = popen(command, "r");        /* issue which and capture stdout */
+    if (whichout == NULL) goto end_of_job; /* failed */
+
+    /* --- read the pipe one char at a time --- */
+    while ((pathchar = fgetc(whichout)) != EOF) { /* get chars until eof */
+        pathbuff[nchars] = (char)pathchar;        /* store the char */
+        if (++nchars >= 255) break;
+    }                          /* don't overflow buffer */
+    pathbuff[nchars] = '\000'; /* null-terminate path */
+    trimwhite(pathbuff);       /*remove leading/trailing whitespace*/
+
+    /* --- pclose() waits for command to terminate --- */
+    pclose(whichout);    /* finish */
+    if (nchars > 0) {    /* found path with which */
+        path = pathbuff; /* give user successful path */
+        if (islocate && nlocate != NULL) *nlocate = 0;
+    } /* signal we used which */
+
+end_of_job:
+    if (path == NULL) {                                    /* which failed to find program */
+        if (islocate) path = locatepath(program, nlocate); /* and we're using locate, so try locate instead */
+    }
+    return path; /* give caller path to command */
+}
+
+char *locatepath(char *program, int *nlocate) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    static THREADLOCAL char pathbuff[256]; /* buffer for returned path */
+    char command[256];         /* locate program | grep /program$ */
+    FILE *locateout = NULL;    /* locate's stdout */
+    char pathline[256];        /* read locateout one line at a time*/
+    int nlines = 0;            /* #lines read */
+    int linelen = 0;           /* choose shortest path */
+    int pathlen = 9999;
+    char *path = NULL; /* either pathbuff or NULL=error */
+
+    /* -------------------------------------------------------------------------
+    Issue locate|grep command and read its output
+    -------------------------------------------------------------------------- */
+    /* --- first construct the command --- */
+    if (isempty(program)) goto end_of_job; /* no input */
+
+    // if (strlen(program) < 2) goto end_of_job; /* might run forever */
+    sprintf(command, "locate -q -r \"/%s$\" | grep \"bin\"", program);
+
+    /* --- use popen() to invoke locate|grep --- */
+    locateout = popen(command, "r");        /* issue locate and capture stdout */
+    if (locateout == NULL) goto end_of_job; /* failed */
+
+    /* --- read the pipe one line at a time --- */
+    while (fgets(pathline, 255, locateout) != NULL) { /* get next line until eof */
+        trimwhite(pathline);                          /*remove leading/trailing whitespace*/
+        if ((linelen = strlen(pathline)) > 0) {       /* ignore empty lines */
+            if (linelen < pathlen) {                  /* new shortest path */
+                strcpy(pathbuff, pathline);           /* store shortest for caller */
+                pathlen = linelen;
+            } /* and reset new shortest length */
+            nlines++;
+        }
+    } /* count another non-empty line */
+
+    /* --- pclose() waits for command to terminate --- */
+    pclose(locateout);                                 /* finish */
+    if (pathlen > 0 && pathlen < 256) path = pathbuff; /*give user successful path*/
+    if (nlocate != NULL) *nlocate = nlines;            /* and number of locate|grep hits*/
+
+end_of_job:
+    return path; /* give caller path to command */
+}
+
+char *presentwd(int nsub) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    static THREADLOCAL char pathbuff[256]; /* buffer for returned path */
+    FILE *pwd = NULL;          /* pwd's stdout */
+    char *path = NULL;         /* either pathbuff or NULL=error */
+    int wdmethod = 1;          /* 1=getcwd(), 2=popen("pwd","r") */
+
+    /* -------------------------------------------------------------------------
+    issue getcwd() call
+    -------------------------------------------------------------------------- */
+    if (wdmethod == 1) {                                             /* --- getcwd(pathbuff,255) --- */
+        if ((path = getcwd(pathbuff, 255)) == NULL) goto end_of_job; /* fail if unable to get cwd */
+        trimwhite(pathbuff);
+    } /*remove leading/trailing whitesapce*/
+
+    /* -------------------------------------------------------------------------
+    issue pwd command and read its output
+    -------------------------------------------------------------------------- */
+    if (wdmethod == 2) { /* --- popen("pwd","r") --- */
+        /* --- use popen() to invoke pwd --- */
+        if ((pwd = popen("pwd", "r")) == NULL) goto end_of_job; /* fail if unable to issue pwd and capture stdout */
+        *pathbuff = '\000';                                     /* empty string in case fgets fails */
+
+        /* --- read the pipe one line at a time --- */
+        while (fgets(pathbuff, 255, pwd) != NULL) { /* get next line while not EOF */
+            trimwhite(pathbuff);                    /*remove leading/trailing whitespace*/
+            if (strlen(pathbuff) > 0) break;
+        } /* try again if empty line */
+
+        /* --- pclose() waits for command to terminate --- */
+        pclose(pwd);
+    } /* finish */
+
+    /* -------------------------------------------------------------------------
+    strip leading directories
+    -------------------------------------------------------------------------- */
+    if (nsub > 0) {                               /* caller wants path above pwd */
+        if (lastchar(pathbuff) == '/')            /* have terminating / */
+            *plastchar(pathbuff) = '\000';        /* strip it */
+        while (nsub > 0) {                        /* still higher path wanted */
+            char *slash = strrchr(pathbuff, '/'); /* last / on path */
+            if (slash == NULL) break;             /* can't go up any higher */
+            *slash = '\000';                      /* truncate "/highestdir" from path */
+            nsub--;
+        } /* we're now one path up */
+    }
+    if (lastchar(pathbuff) != '/') strcat(pathbuff, "/"); /* need terminating, so add it */
+
+    /* --- back to caller --- */
+    path = pathbuff; /* back to caller. we have found a suitable path */
+
+end_of_job:
+    return path; /* give caller path */
+}
+
+int rrmdir(char *path) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    DIR *directory = NULL;       /* opendir() opens path directory */
+    struct dirent *entry = NULL; /* readdir() gives directory entry */
+    struct stat st_info;         /* lstat() gives info about entry */
+    char nextpath[512];
+    char *pnext = NULL; /* recurse path/filename in dir */
+    int status = -1;    /* init in case of any error */
+
+    /* -------------------------------------------------------------------------
+    Check file type at path
+    -------------------------------------------------------------------------- */
+    if (path != NULL) {        /* have path argument */
+        if (*path != '\000') { /* and it's not an empty string */
+            if (strcmp(path, ".") != 0 && strcmp(path, "..") != 0)
+                status = lstat(path, &st_info); /* and also not "." or ".." ... what kind of file is at path? */
+        }
+    }
+    if (status < 0) goto end_of_job; /* no kind of file found at path */
+
+    /* -------------------------------------------------------------------------
+    Recurse level if file is a directory
+    -------------------------------------------------------------------------- */
+    if (S_ISDIR(st_info.st_mode)) { /* have a directory */
+        /* ---
+         * Initialization
+         * -------------- */
+        /* --- init path for each file in directory --- */
+        strcpy(nextpath, path);                  /* start with path from caller */
+        pnext = nextpath + strlen(path);         /* ptr to '\000' at end of path */
+        if (*(pnext - 1) != '/') *pnext++ = '/'; /* no trailing / at end of path, so add one */
+        *pnext = '\000';                         /* null-terminate nextpath */
+
+        /* --- open the directory at caller's path (with trailing /) --- */
+        directory = opendir(nextpath); /* open the directory */
+
+        /* ---
+         * Run through all files in directory
+         * ---------------------------------- */
+        if (directory != NULL) {                                                           /* directory successfully opened */
+            while ((entry = readdir(directory)) != NULL) {                                 /* next entry in directory; NULL signals end-of-directory */
+                if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) { /* filename not "." or ".." */
+                    strcpy(pnext, entry->d_name);                                          /* add filename to path */
+                    status = rrmdir(nextpath);                                             /* recurse */
+                }
+            }
+            closedir(directory);                                             /* close directory after last file */
+            log_info(99, "[rrmdir] trying to remove directory: %s\n", path); /* show directory removed*/
+        }
+    } else {
+        log_info(99, "[rrmdir] trying to remove file: %s\n", path); /* file isn't a directory, so show file removed  */
+    }
+
+    /* -------------------------------------------------------------------------
+    Remove file or directory (keep it for debugging if msglevel>=99)
+    -------------------------------------------------------------------------- */
+    if (msglevel < 999 && !keep_work) { status = remove(path); /* remove file or directory */ }
+
+end_of_job:
+    return status;
+}
+
+int readcachefile(char *cachefile, unsigned char *buffer) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    FILE *cacheptr;               /* cachefile */
+    unsigned char cachebuff[512]; /* bytes from cachefile */
+    int buflen = 256;             /* #bytes we try to read from file */
+    int nread = 0;                /* #bytes actually read from file */
+    int maxbytes = MAXGIFSZ;      /* max #bytes returned in buffer */
+    int nbytes = 0;               /* total #bytes read */
+
+    /* -------------------------------------------------------------------------
+    initialization
+    -------------------------------------------------------------------------- */
+    /* --- check that files opened okay --- */
+    if ((cacheptr = fopen(cachefile, "rb")) == NULL) { goto end_of_job; }
+
+    /* --- check that output buffer provided --- */
+    if (buffer == (unsigned char *)NULL) goto end_of_job; /* no buffer */
+
+    /* -------------------------------------------------------------------------
+    read bytes from cachefile
+    -------------------------------------------------------------------------- */
+    while (1) {
+        /* --- read bytes from cachefile --- */
+        nread = fread(cachebuff, sizeof(unsigned char), buflen, cacheptr); /* read */
+        if (nbytes + nread > maxbytes) nread = maxbytes - nbytes;          /* block too big for buffer, so truncate it */
+        if (nread < 1) break;                                              /* no bytes left in cachefile */
+
+        /* --- store bytes in buffer --- */
+        memcpy(buffer + nbytes, cachebuff, nread); /* copy current block to buffer */
+
+        /* --- ready to read next block --- */
+        nbytes += nread;               /* bump total #bytes emitted */
+        if (nread < buflen) break;     /* no bytes left in cachefile */
+        if (nbytes >= maxbytes) break; /* avoid buffer overflow */
+    }
+
+end_of_job:
+    if (cacheptr != NULL) fclose(cacheptr); /* close file if opened */
+    return nbytes;                          /* back with #bytes emitted */
+}
+
+int emitcache(char *cachefile) {
+    int imagefd = (-1); /* cachefile (or its pack) */
+    long offset = 0;    /* where the image starts in it */
+    int nimage = 0;     /* and its size */
+    int nbytes = -1;    /* total #bytes emitted */
+
+    if (isempty(cachefile) || (imagefd = openimage(cachefile, &offset, &nimage)) < 0) return -1;
+#if defined(HAVE_SETMODE)
+    setmode(fileno(stdout), O_BINARY); /* windows would mangle 0x0A's */
+#endif
+    fflush(stdout); /* anything already printf()'ed goes first */
+    nbytes = sendfd(fileno(stdout), imagefd, offset, nimage);
+    close(imagefd);
+    return nbytes;
+}
+
+int streamimage(char **argv, char *giffile, int iskeep) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char teefile[512];                  /* giffile, until dvipng's done */
+    char buffer[65536];                 /* bytes from dvipng */
+    int fds[2] = {-1, -1}, teefd = (-1); /* dvipng's /dev/fd/3, and teefile */
+    int iarg = 0, nread = 0, nstreamed = 0;
+    int sys_stat = -1;
+    pid_t pid = 0;
+
+    /* -------------------------------------------------------------------------
+    dvipng writes the image to a pipe rather than to giffile
+    -------------------------------------------------------------------------- */
+    for (iarg = 0; argv[iarg] != NULL; iarg++) {
+        if (argv[iarg] == giffile) argv[iarg] = "/dev/fd/3";
+    }
+    if (pipe2(fds, O_CLOEXEC) != 0) return -1; /* dvipng only gets the write end, as fd 3 */
+    if (fds[1] == 3) { /* dup2() onto itself would leave it close-on-exec */
+        int fd = fcntl(fds[1], F_DUPFD_CLOEXEC, 4);
+        close(fds[1]);
+        fds[1] = fd;
+    }
+    if (iskeep) { /* cached, or an explicit outfile, so it's also written to a file next to giffile */
+        sprintf(teefile, "%s.%d", giffile, (int)gettid());
+        teefd = open(teefile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if ((sys_stat = spawnstart(argv, "/dev/null", "dvipng.out", "dvipng.err", fds[1], &pid)) != 0) goto end_of_job;
+    close(fds[1]);
+    fds[1] = (-1);
+
+    /* -------------------------------------------------------------------------
+    and we pass it on as it arrives, to the caller first
+    -------------------------------------------------------------------------- */
+    fflush(NULL); /* anything already printf()'ed goes first */
+    while ((nread = read(fds[0], buffer, sizeof(buffer))) != 0) {
+        if (nread < 0 && errno == EINTR) continue; /* interrupted, so just retry */
+        if (nread < 0) break;
+        if (render->streamfd >= 0 && writefd(render->streamfd, buffer, nread) < 0) render->streamfd = (-1); /* caller went away, but keep the cache copy */
+        if (teefd >= 0 && writefd(teefd, buffer, nread) < 0) {
+            close(teefd);
+            remove(teefile);
+            teefd = (-1);
+        }
+        nstreamed += nread;
+    }
+    sys_stat = spawnwait(pid, argv[0], 0);
+    render->isstreamed = (nstreamed > 0);
+
+end_of_job:
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+    if (teefd >= 0) { /* commit the file once the caller has the image, and only if dvipng finished it */
+        if (close(teefd) != 0 || sys_stat != 0 || nread != 0 || !render->isstreamed || rename(teefile, giffile) != 0) remove(teefile);
+    }
+    log_info(10, "[streamimage] streamed %d bytes\n", nstreamed);
+    return sys_stat;
+}
+
+int renderdvi(char *dvifile, char *giffile, int npages, int iskeep) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char pagefile[512], tempfile[512]; /* giffile for a page, and until it's written */
+    char pagenum[16];                  /* replaces giffile's %d */
+    unsigned char *png = NULL;         /* rendered page */
+    int npng = 0, ipage = 0, fd = (-1);
+    int dpi = (int)(atof(render->density) + 0.5);
+
+    /* -------------------------------------------------------------------------
+    every page, or none: a page we can't do leaves them all to dvipng
+    -------------------------------------------------------------------------- */
+    if (npages < 1) npages = 1;
+    for (ipage = 1; ipage <= npages; ipage++) {
+        if ((png = dvirender(dvifile, ipage, dpi, atof(render->gamma), &npng)) == NULL) {
+            log_info(5, "[renderdvi] page %d of %s left to dvipng\n", ipage, dvifile);
+            return -1;
+        }
+        strcpy(pagefile, giffile);
+        sprintf(pagenum, "%d", ipage);
+        if (npages > 1) strreplace(pagefile, "%d", pagenum, 1, 1); /* --batch group's giffile has a page number */
+        if (render->streamfd >= 0 && npages < 2) {                      /* -s, so it goes straight to the caller */
+            fflush(NULL);                                        /* anything already printf()'ed goes first */
+            if (writefd(render->streamfd, png, npng) < 0) render->streamfd = (-1); /* caller went away, but keep the cache copy */
+            render->isstreamed = 1;
+            if (!iskeep) {
+                free(png);
+                continue;
+            }
+        }
+        sprintf(tempfile, "%s.%d", pagefile, (int)gettid()); /* renamed when it's all there */
+        if ((fd = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+            if (writefd(fd, png, npng) < 0 || close(fd) != 0 || rename(tempfile, pagefile) != 0) remove(tempfile);
+        }
+        free(png);
+    }
+    log_info(5, "[renderdvi] rendered %d page%s of %s\n", npages, (npages == 1 ? "" : "s"), dvifile);
+    return 0;
+}
+
+int optimizepng(char *giffile) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char tempfile[512];                    /* giffile, until it's written */
+    unsigned char *png = NULL, *optimized = NULL; /* giffile, and rewritten */
+    struct stat pngstat;                   /* for giffile's size */
+    int npng = (-1), noptimized = 0, fd = (-1), status = -1;
+
+    /* -------------------------------------------------------------------------
+    read it, re-encode it, and rename the result over it
+    -------------------------------------------------------------------------- */
+    if ((fd = open(giffile, O_RDONLY)) < 0) return -1;
+    if (fstat(fd, &pngstat) == 0 && pngstat.st_size > 0 && (png = malloc(pngstat.st_size)) != NULL) {
+        npng = readfd(fd, png, (int)pngstat.st_size);
+    }
+    close(fd);
+    if (npng < 1 || npng != (int)pngstat.st_size || (optimized = pngoptimize(png, npng, pnglevel, pngeffort, &noptimized)) == NULL) {
+        log_info(5, "[optimizepng] %s left as it is\n", giffile);
+        goto end_of_job;
+    }
+    sprintf(tempfile, "%s.%d", giffile, (int)gettid());
+    if ((fd = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) goto end_of_job;
+    if (writefd(fd, optimized, noptimized) < 0 || close(fd) != 0 || rename(tempfile, giffile) != 0) {
+        remove(tempfile);
+        goto end_of_job;
+    }
+    log_info(10, "[optimizepng] %s: %d bytes to %d\n", giffile, npng, noptimized);
+    status = 0;
+
+end_of_job:
+    free(png);
+    free(optimized);
+    return status;
+}
+
+char *findpk(char *fontname, int dpi) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    static THREADLOCAL char pkfile[512];                  /* returned path */
+    char program[512], dpiarg[32], pkname[80]; /* kpsewhich, and its args */
+    char *args[8], *slash = NULL;
+    int fds[2] = {-1, -1}, nread = 0, nbytes = 0;
+    pid_t pid = 0;
+
+    /* -------------------------------------------------------------------------
+    kpsewhich from latex's own bin directory, else whichever's on the PATH
+    -------------------------------------------------------------------------- */
+    *pkfile = '\000';
+    if (strlen(fontname) > 64) return NULL;
+    strcpy(program, makepath("", latexpath, NULL));
+    if ((slash = strrchr(program, '/')) != NULL) {
+        strcpy(slash + 1, KPSEWHICH);
+        if (!isfexists(program)) strcpy(program, KPSEWHICH);
+    } else {
+        strcpy(program, KPSEWHICH);
+    }
+    sprintf(dpiarg, "-dpi=%d", dpi);
+    sprintf(pkname, "%s.pk", fontname);
+    args[0] = program;
+    args[1] = dpiarg;
+    args[2] = "-mktex=pk"; /* run mktexpk if there's no such pk yet */
+    args[3] = pkname;
+    args[4] = NULL;
+
+    /* -------------------------------------------------------------------------
+    its stdout is the path
+    -------------------------------------------------------------------------- */
+    if (pipe2(fds, O_CLOEXEC) != 0) return NULL; /* kpsewhich gets the write end as fd 3, and nothing other threads start gets either */
+    if (spawnstart(args, "/dev/null", "/dev/fd/3", "/dev/null", fds[1], &pid) != 0) goto end_of_job;
+    close(fds[1]);
+    fds[1] = (-1);
+    while (nbytes < (int)sizeof(pkfile) - 1 && (nread = read(fds[0], pkfile + nbytes, sizeof(pkfile) - 1 - nbytes)) != 0) {
+        if (nread < 0 && errno == EINTR) continue;
+        if (nread < 0) break;
+        nbytes += nread;
+    }
+    pkfile[nbytes] = '\000';
+    if (spawnwait(pid, program, killtime) != 0) *pkfile = '\000'; /* not found, or mktexpk couldn't make it */
+    trimwhite(pkfile);
+
+end_of_job:
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+    log_info(10, "[findpk] %s at %d dpi: %s\n", fontname, dpi, (isempty(pkfile) ? "none" : pkfile));
+    return (isempty(pkfile) ? NULL : pkfile);
+}
+
+int copycache(char *cachefile, char *filename) {
+    int from = (-1), to = (-1); /* cachefile (or its pack), filename */
+    long offset = 0;            /* where cachefile's bytes start in from */
+    int nbytes = 0;             /* its size, then total #bytes copied */
+
+    if (isempty(cachefile) || isempty(filename)) return -1;
+    if ((from = openimage(cachefile, &offset, &nbytes)) < 0) return -1;
+    if ((to = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(from);
+        return -1;
+    }
+    if (sendfd(to, from, offset, nbytes) != nbytes) nbytes = -1;
+    close(from);
+    if (close(to) != 0) nbytes = -1;
+    return nbytes;
+}
+
+int crc16(char *s) {
+    /* -------------------------------------------------------------------------
+    Compute the crc
+    -------------------------------------------------------------------------- */
+    unsigned short crc = 0;                /* returned crc */
+    int ibit;                              /* for(ibit) eight one-bit shifts */
+    while (!isempty(s)) {                  /* while there are still more chars*/
+        crc = (crc ^ (*s) << 8);           /* add next char */
+        for (ibit = 0; ibit < 8; ibit++) { /* generator polynomial */
+            if (crc & 0x8000) {
+                crc <<= 1;
+                crc = crc ^ 4129;
+            } else {
+                crc <<= 1;
+            }
+        }
+        s++; /* next xhar */
+    }
+    return (int)crc; /* back to caller with crc */
+}
 
-    /* --- other variables --- */
-    int ninvalid = 0;                                                     /* #invalid =commands found */
-    int ivalid = 0;                                                       /* invalid[ivalid] list index */
-    char *pcommand = NULL;                                                /* find and remove invalid command */
-    static char args[10][512] = {"", "", "", "", "", "", "", "", "", ""}; /*\cmd{arg}'s*/
-    char *pargs[11] = {
-        args[0], args[1], args[2], args[3], args[4], args[5], args[6], args[7], args[8], args[9], NULL /* ptrs to them */
-    };
-    char display[2048]; /*displaystring with args*/
-    char argstr[256];
-    char optstr[1024];
-    int iarg = 0; /* args[], optionalargs[] indexes */
-    int iopt = 0;
+char *md5str(char *instr) {
+    static THREADLOCAL char outstr[64];
+    unsigned char md5sum[16];
+    md5_context ctx;
+    int j;
+    md5_starts(&ctx);
+    md5_update(&ctx, (uint8 *)instr, strlen(instr));
+    md5_finish(&ctx, md5sum);
+    for (j = 0; j < 16; j++) sprintf(outstr + j * 2, "%02x", md5sum[j]);
+    outstr[32] = '\000';
+    return outstr;
+}
 
+char *cachekey(char *expression) {
     /* -------------------------------------------------------------------------
-    Initialization
+    Allocations and Declarations
     -------------------------------------------------------------------------- */
-    if (isempty(expression)) goto end_of_job; /* no input to validate, so quit */
+    static THREADLOCAL char keybuff[MAXEXPRSZ + 8192]; /* canonical request description */
+    static THREADLOCAL char key[64];                   /* its md5, safe from later md5str()'s */
+    char *pkey = keybuff;                  /* end of keybuff so far */
+    char *pexpr = expression;              /* copy expression from here */
+    char *pexpression = NULL;              /* where it starts in keybuff */
+    char *sorted[9];                       /* \usepackage's, sorted */
+    char packline[9][260];                 /* [args]{name} for each package */
+    char wrapperhash[64];                  /* md5 of latexwrapper template */
+    int ipackage = 0, jpackage = 0;        /* packages[] indexes */
 
     /* -------------------------------------------------------------------------
-    Check each invalid command in list
+    expression with runs of blanks collapsed to one, as latex reads them.
+    newlines stay, since they end % comments and a blank line is a \par
     -------------------------------------------------------------------------- */
-    for (ivalid = 0; !isempty(invalid[ivalid].command); ivalid++) { /*run list*/
-        /* --- extract local copy of invalid command list elements --- */
-        int action = invalid[ivalid].action;                 /* 0=ignore,1=apply,2=abort*/
-        char *command = invalid[ivalid].command;             /* invalid \command */
-        int nargs = invalid[ivalid].nargs;                   /*number of \command {arg}'s*/
-        int myoptionalpos = invalid[ivalid].optionalpos;     /*#{args} before [arg]*/
-        int myargformat = invalid[ivalid].argformat;         /* 0={arg},1=arg*/
-        char *displaystring = invalid[ivalid].displaystring; /*display template*/
+    pkey += sprintf(pkey, "mathtex-key-v%d\n", CACHEKEYVERSION); /* key format first */
+    pexpression = pkey;
+    while (!isempty(pexpr)) {
+        if (isthischar(*pexpr, BLANKS)) { /* collapse a run of blanks */
+            while (isthischar(*pexpr, BLANKS)) pexpr++;
+            if (!isempty(pexpr) && *pexpr != '\n' && pkey[-1] != '\n') *pkey++ = ' '; /* ...which latex drops at either end of a line */
+            continue;
+        }
+        *pkey++ = *pexpr++;
+    }
+    while (pkey > pexpression && isthischar(pkey[-1], WHITESPACE)) pkey--; /* no leading or trailing whitespace */
+    *pkey++ = '\n';
 
-        /* --- arg format info --- */
-        int nfmt = 0;
-        // int isnegfmt = 0;                            /* {arg} format */
-        int argfmt[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0}; /* argformat digits */
+    /* -------------------------------------------------------------------------
+    effective render parameters, in a fixed order
+    -------------------------------------------------------------------------- */
+    pkey += sprintf(pkey, "mathmode=%d\nfontsize=%d\n", render->mathmode, render->fontsize);
+    if (!ISSVG(render->imagetype)) pkey += sprintf(pkey, "density=%g\ngamma=%g\n", atof(render->density), atof(render->gamma)); /* "120" and "120.0" are the same dpi */
+    pkey += sprintf(pkey, "imagetype=%s\nlatexmethod=%d\nimagemethod=%d\n", extensions[render->imagetype], render->latexmethod, render->imagemethod);
+    pkey += sprintf(pkey, "depth=%d\npicture=%d\nquiet=%d\n", render->isdepth, render->ispicture, render->isquiet);
+    if (usemaster()) pkey += sprintf(pkey, "master=%d\n", masterdpi); /* shrunk, not rendered at density */
+    pkey += sprintf(pkey, "documentclass=[%s]{%s}\n", render->dclassoptions, render->dclass);
+
+    /* --- \usepackage's in sorted order, so directive order doesn't matter --- */
+    for (ipackage = 0; ipackage < render->npackages && ipackage < 9; ipackage++) {
+        sprintf(packline[ipackage], "[%s]{%s}", render->packargs[ipackage], render->packages[ipackage]);
+        for (jpackage = ipackage; jpackage > 0; jpackage--) { /* insertion sort */
+            if (strcmp(sorted[jpackage - 1], packline[ipackage]) <= 0) break;
+            sorted[jpackage] = sorted[jpackage - 1];
+        }
+        sorted[jpackage] = packline[ipackage];
+    }
+    for (jpackage = 0; jpackage < ipackage; jpackage++) pkey += sprintf(pkey, "usepackage=%s\n", sorted[jpackage]);
 
-        /* --- args returned as (char *) if nargs=1 or (char **) if nargs>1 --- */
-        void *argptr = (nargs < 2 ? (void *)args[0] : (void *)pargs); /*(char * or **)*/
+    /* --- and the wrapper, which -DUSEPACKAGE/-DNEWCOMMAND may have changed --- */
+    strcpy(wrapperhash, md5str(render->latexwrapper));
+    pkey += sprintf(pkey, "wrapper=%s\n", wrapperhash);
+    *pkey = '\000';
 
-        /* --- find and remove/replace all invalid command occurrences --- */
-        if (action < 1) continue;    /* ignore this invalid \command */
-        optionalpos = myoptionalpos; /* set global arg for getdirective */
-        argformat = myargformat;     /* set global arg for getdirective */
+    log_info(20, "[cachekey] canonical request;\n%s", keybuff);
+    strcpy(key, md5str(keybuff));
+    return key;
+}
 
-        /* --- interpret argformat digits --- */
-        if (argformat != 0) {      /* have argformat */
-            int myfmt = argformat; /* local copy */
-            if (myfmt < 0) {
-                // isnegfmt = 1;
-                myfmt = -myfmt;
-            }                               /* check sign */
-            while (myfmt > 0 && nfmt < 9) { /* have more format digits */
-                argfmt[nfmt] = myfmt % 10;  /* store low-order decimal digit */
-                myfmt /= 10;                /* and shift it out */
-                nfmt++;
-            } /* count another format digit */
-        }
+int checkcacheversion(char *cachedir) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char cachedirbuff[512];      /* local copy, cachedir may be makepath()'s */
+    char stampfile[512];         /* cachedir/.keyversion */
+    FILE *stamp = NULL;          /* stampfile */
+    int version = 1;             /* no stamp was written by version 1 */
+    int nremoved = 0;            /* #stale images removed */
 
-        /* --- remove/replace each occurrence of invalid \command --- */
-        while ((pcommand = getdirective(expression, command, 1, 0, nargs, argptr)) != NULL) { /* found and removed an occurrence */
-            ninvalid++;                                                                       /* count another invalid \command */
-            if (noptional >= 8) noptional = 7;                                                /* don't overflow our buffers */
+    /* -------------------------------------------------------------------------
+    read the version the cache was written with
+    -------------------------------------------------------------------------- */
+    strninit(cachedirbuff, cachedir, 511);
+    cachedir = cachedirbuff;
+    strcpy(stampfile, makepath(cachedir, CACHEKEYSTAMP, NULL));
+    if ((stamp = fopen(stampfile, "r")) != NULL) {
+        if (fscanf(stamp, "%d", &version) != 1) version = 1;
+        fclose(stamp);
+    }
+    if (version >= CACHEKEYVERSION) goto end_of_job; /* current, or a newer mathtex's cache we mustn't touch */
 
-            /* --- construct optional [arg]...[arg] for display --- */
-            *optstr = '\000';                                       /*init optional [arg]...[arg] string*/
-            if (noptional > 0) {                                    /* have optional [args] */
-                for (iopt = 0; iopt < noptional; iopt++) {          /* construct "[arg]...[arg]" */
-                    if (!isempty(optionalargs[iopt])) {             /* have an optional arg */
-                        strcat(optstr, "[");                        /* leading [ for optional arg */
-                        strcat(optstr, nomath(optionalargs[iopt])); /*optional arg string*/
-                        strcat(optstr, "]");
-                    }
-                }
-            }
+    /* -------------------------------------------------------------------------
+    remove images cached under the old key format, i.e. <32 hex digits>.ext
+    -------------------------------------------------------------------------- */
+    if ((nremoved = walkcache(cachedir, removestale, NULL)) < 0) nremoved = 0;
+    log_info(5, "[checkcacheversion] cache key v%d -> v%d, removed %d stale images\n", version, CACHEKEYVERSION, nremoved);
 
-            /* --- construct error message display or use supplied template --- */
-            if (isempty(displaystring)) {                                                /*replace \command by not~permitted*/
-                strcpy(display, "\\mbox{~\\underline{");                                 /* underline error in \mbox{}*/
-                strcat(display, nomath(command));                                        /* command without \ */
-                for (iarg = 0; iarg < nargs; iarg++) {                                   /* add {args} and any [args] */
-                    int ifmt = (nfmt <= iarg ? 0 : argfmt[nfmt - iarg - 1]);             /* arg format digit */
-                    if (iarg == myoptionalpos && noptional > 0) strcat(display, optstr); /* [args] belong here, insert them before next {arg} */
-                    if (isempty(args[iarg])) break;                                      /* no more args */
-                    if (ifmt == 0) strcat(display, "\\{");                               /* insert leading \{ for arg */
-                    strcat(display, nomath(args[iarg]));                                 /* arg */
-                    if (ifmt == 0) strcat(display, "\\}");
-                }
-                strcat(display, "~not~permitted}~}");
-            } else {                                                                                       /* replace \command by displaystring */
-                strcpy(display, displaystring);                                                            /* local copy of display template */
-                if (noptional < 1) strreplace(display, "[#0]", "", 0, 0);                                  /* no optional args, so remove tag from template */
-                for (iarg = 0; iarg < nargs; iarg++) {                                                     /* replace #1 with args[0], etc */
-                    if (iarg == myoptionalpos && noptional > 0) strreplace(display, "[#0]", optstr, 0, 0); /* [args] belong here, insert them before {arg}*/
-                    if (isempty(args[iarg])) break;                                                        /* no more args */
-                    else {                                                                                 /* have an arg */
-                        sprintf(argstr, "#%d", iarg + 1);                                                  /* #1 in template displays args[0] */
-                        strreplace(display, argstr, nomath(args[iarg]), 0, 0);
-                    } /* replace */
-                }
-            }
-            strchange(0, pcommand, display);                        /* place display where command was */
-            for (iarg = 0; iarg < 10; iarg++) *args[iarg] = '\000'; /* reset args */
-        }
-    }
+    /* --- stamp the current version --- */
+    if ((stamp = fopen(stampfile, "w")) == NULL) return -1;
+    fprintf(stamp, "%d\n", CACHEKEYVERSION);
+    fclose(stamp);
 
 end_of_job:
-    return ninvalid; /* back to caller with #invalid */
+    return nremoved;
 }
 
-char *makepath(char *path, char *name, char *extension) {
+int removestale(char *file, char *name, void *data) {
+    char *dot = strchr(name, '.');
+    int iext = 0;
+    if (dot == NULL || dot - name != 32) return 0;             /* not a hash-named file */
+    if (strspn(name, "0123456789abcdef") != 32) return 0;     /* ditto */
+    for (iext = 1; extensions[iext] != NULL; iext++) {
+        if (strcmp(dot + 1, extensions[iext]) == 0) break;
+    }
+    if (extensions[iext] == NULL) return 0; /* not an image */
+    return (remove(file) == 0);
+}
+
+int openindex(void) {
+    if (!render->iscaching || (cachemaxbytes < 1 && cachemaxentries < 1)) return 0;
+    return cacheindexopen(makepath(NULL, CACHEINDEXFILE, NULL), (cachemaxentries > 0 && cachemaxentries < (1 << 29) ? (int)(2 * cachemaxentries) : CACHEINDEXSLOTS));
+}
+
+int indexcache(char *cachefile, char *name, char *ext, int cost) {
+    struct stat filestat; /* for cachefile's size */
+    if (stat(cachefile, &filestat) != 0) return 0;
+    return (cacheindexadd(name, ext, (long)filestat.st_size, cost) == 1);
+}
+
+int evictcache(void) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    static char namebuff[512]; /* buffer for constructed filename */
-    char *filename = NULL;     /*ptr to filename returned to caller*/
+    char name[64], ext[16]; /* cacheindexevict()'s choice */
+    int nevicted = 0;       /* #files removed */
 
     /* -------------------------------------------------------------------------
-    construct filename
+    remove each file the index gives up, with whatever goes with it
     -------------------------------------------------------------------------- */
-    /* --- validity checks --- */
-    // if (isempty(name)) goto end_of_job; /* no name supplied by caller */
+    while (cacheindexevict(cachemaxbytes, cachemaxentries, name, ext)) {
+        if (!openpack() || !packremove(name)) remove(makepath(NULL, name, ext));
+        remove(makepath(NULL, name, (strcmp(ext, "dvi") == 0 || strcmp(ext, "pdf") == 0 ? ".info" : ".depth")));
+        log_info(10, "[evictcache] evicted %s\n", makepath(NULL, name, ext));
+        nevicted++;
+    }
+    return nevicted;
+}
 
-    /* --- start with caller's path/ or default path to cache directory --- */
-    *namebuff = '\000';            /* re-init namebuff */
-    if (path == NULL) {            /* use default path to cache */
-        if (!isempty(cachepath)) { /* have a cache path */
-            if (!tmp_cache) {
-                strcpy(namebuff, cachepath);
-            } else {
-                strcpy(namebuff, "/tmp/mathtex/");
-            }
-        }
-    } else if (*path != '\000') { /* begin filename with path or use caller's supplied path if it's not an empty string */
-        strcpy(namebuff, path);   /* begin filename with path */
+int indexentry(char *file, char *name, void *data) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char *dot = strchr(name, '.');  /* extension */
+    struct stat filestat;           /* file's size */
+    int iext = 0;                   /* extensions[] index */
+
+    /* -------------------------------------------------------------------------
+    hash-named images and latex output
+    -------------------------------------------------------------------------- */
+    if (dot == NULL || dot - name != 32 || strspn(name, "0123456789abcdef") != 32) return 0;
+    for (iext = 1; extensions[iext] != NULL; iext++) {
+        if (strcmp(dot + 1, extensions[iext]) == 0) break;
     }
-    if (!isempty(namebuff)) {                           /* have a leading path */
-        if (!isthischar(lastchar(namebuff), "\\/")) {   /* no \ or / at end of path */
-            strcat(namebuff, (iswindows ? "\\" : "/")); /* so add windows\ or unix/ */
-        }
+    if (extensions[iext] == NULL && strcmp(dot + 1, "dvi") != 0 && strcmp(dot + 1, "pdf") != 0) return 0;
+    if (stat(file, &filestat) != 0) return 0;
+    if (cacheindexadd(name, dot + 1, (long)filestat.st_size, CACHEINDEXCOST) == 0) { /* index full */
+        evictcache();
+        return (cacheindexadd(name, dot + 1, (long)filestat.st_size, CACHEINDEXCOST) == 1);
     }
+    return 1;
+}
 
-    /* --- add name after path/ (name arg might just be a blank space) --- */
-    if (!isempty(name)) {                         /* name supplied by caller */
-        if (!isempty(namebuff)) {                 /* and if we already have a path */
-            if (isthischar(*name, "\\/")) name++; /* skip leading \ or / in name */
-        }
-        strcat(namebuff, name);
-    } /* name concatanated after path/ */
+int gccache(void) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char cachedir[512];           /* makepath(NULL, NULL, NULL) */
+    int isindexed = 0;            /* index already there */
+    int nindexed = 0, nevicted = 0;
+    long nbytes = 0, nentries = 0; /* what's left */
 
-    /* --- add extension after path/name */
-    if (!isempty(extension)) {                                       /* have a filename extension */
-        if (!isthischar(lastchar(namebuff), ".")) {                  /* no . at end of name */
-            if (!isthischar(*extension, ".")) strcat(namebuff, "."); /* and extension has no leading ., so we need to add our own */
-            strcat(namebuff, extension);
-        } else {                                                                          /* . already at end of name */
-            strcat(namebuff, (!isthischar(*extension, ".") ? extension : extension + 1)); /* add extension without ., skip leading . */
-        }
+    /* -------------------------------------------------------------------------
+    the index, built from the files in the cache only if it's new
+    -------------------------------------------------------------------------- */
+    if (cachemaxbytes < 1 && cachemaxentries < 1) {
+        log_error("--gc needs --cache-size or --cache-entries (or -DCACHEMAXBYTES, -DCACHEMAXENTRIES).\n");
+        return -1;
     }
-    filename = namebuff; /* successful name back to caller */
+    strcpy(cachedir, makepath(NULL, NULL, NULL));
+    if (!isdexists(cachedir)) {
+        log_error("No cache directory %s to collect.\n", cachedir);
+        return -1;
+    }
+    isindexed = isfexists(makepath(NULL, CACHEINDEXFILE, NULL));
+    if (!openindex()) {
+        log_error("Unable to open the cache index %s.\n", makepath(NULL, CACHEINDEXFILE, NULL));
+        return -1;
+    }
+    if (!isindexed) nindexed = walkcache(cachedir, indexentry, NULL);
+
+    /* --- and evict --- */
+    nevicted = evictcache();
+    cacheindexstats(&nbytes, &nentries);
+    log_info(1, "[gccache] %s%d files evicted, %ld files of %ld bytes left\n", (isindexed ? "" : "indexed the cache, "), nevicted, nentries, nbytes);
+    if (nindexed < 0) return -1;
+    return nevicted;
+}
 
-    // end_of_job:
-    return filename; /* back with name or NULL=error */
+int publishfile(char *file, char *cachefile) {
+    char tempfile[512]; /* copy of file next to cachefile, when it's on another filesystem */
+
+    if (syncfile(file) != 0) return -1;
+    if (rename(file, cachefile) != 0) {
+        if (errno != EXDEV) return -1;
+        sprintf(tempfile, "%s.%d", cachefile, (int)gettid()); /* copied in place first, so readers never see part of it */
+        if (copycache(file, tempfile) < 0 || syncfile(tempfile) != 0 || rename(tempfile, cachefile) != 0) {
+            remove(tempfile);
+            return -1;
+        }
+        remove(file);
+    }
+    return syncdir(cachefile);
 }
 
-int isfexists(char *filename) {
-    FILE *fp = (isempty(filename) ? NULL : fopen(filename, "r")); /* try to fopen*/
-    int status = 0;                                               /* init for non-existant filename */
-    if (fp != NULL) {                                             /* but filename does exist */
-        status = 1;                                               /* so flip status */
-        fclose(fp);
-    }              /* and close the file */
-    return status; /* tell caller if we found filename*/
+int syncfile(char *file) {
+    int fd = (-1), status = 0;
+    if (durability < 1) return 0;
+    if ((fd = open(file, O_RDONLY)) < 0) return -1;
+    status = (durability > 1 ? fsync(fd) : fdatasync(fd));
+    close(fd);
+    return (status == 0 ? 0 : -1);
 }
 
-int isdexists(char *dirname) {
-    int status = 0;                                /* init for non-existant dirname */
-    if (!isempty(dirname)) {                       /* must have directory name */
-        char directory[512];                       /* local copy of dirname */
-        DIR *dp = NULL;                            /* dp=opendir() opens directory */
-        strcpy(directory, dirname);                /* start with name given by caller */
-        if (!isthischar(lastchar(directory), "/")) /* no / at end of directory */
-            strcat(directory, "/");                /* so add one ourselves */
-        if ((dp = opendir(directory)) != NULL) {   /* dirname exists */
-            status = 1;                            /* so flip status */
-            closedir(dp);
-        } /* and close the directory */
-    }
-    return status; /* tell caller if we found dirname */
+int syncdir(char *file) {
+    char dir[512];      /* file's directory */
+    char *slash = NULL; /* end of it */
+    int fd = (-1), status = 0;
+    if (durability < 2) return 0;
+    strcpy(dir, file);
+    if ((slash = strrchr(dir, '/')) == NULL) strcpy(dir, ".");
+    else if (slash == dir) dir[1] = '\000'; /* file in / */
+    else *slash = '\000';
+    if ((fd = open(dir, O_RDONLY)) < 0) return -1;
+    status = fsync(fd);
+    close(fd);
+    return (status == 0 ? 0 : -1);
 }
 
-char *whichpath(char *program, int *nlocate) {
+int lockrender(char *md5hash, int *iswaited) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    static char pathbuff[256];                                      /* buffer for returned path */
-    char command[256];                                              /* which program */
-    FILE *whichout = NULL;                                          /* which's stdout */
-    int nchars = 0;                                                 /* read whichout one char at a time*/
-    int pathchar;                                                   /* fgetc(whichout) */
-    char *path = NULL;                                              /* either pathbuff or NULL=error */
-    int islocate = (nlocate == NULL ? 1 : (*nlocate != 0 ? 1 : 0)); /* 1=use locate*/
+    char lockfile[512];             /* <md5hash>.lock */
+    int fd = (-1);                  /* open on it */
+    long waited = 0;                /* milliseconds so far */
+    struct stat lockstat, pathstat; /* what we locked, and what's at lockfile now */
 
     /* -------------------------------------------------------------------------
-    Issue which command and read its output
+    poll for the lock, so waiting can time out. unlockrender() removes the
+    file, so the one we get the lock on may no longer be lockfile, and a
+    later render could lock a new one there alongside us: if so, start over
     -------------------------------------------------------------------------- */
-    /* --- check if which() suppressed --- */
-    if (!ISWHICH) return NULL; /*not running which, return failure*/
+    *iswaited = 0;
+    strcpy(lockfile, makepath(NULL, md5hash, ".lock"));
+    for (;;) {
+        if ((fd = open(lockfile, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0) return -1; /* not held by other threads' children */
+        while (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            if (errno != EWOULDBLOCK && errno != EINTR) break;
+            if (!*iswaited) log_info(5, "[lockrender] %s is being rendered by another process, waiting\n", md5hash);
+            *iswaited = 1;
+            if (waited >= renderwait * 1000L) {
+                log_info(1, "[lockrender] gave up waiting %d seconds for %s\n", renderwait, lockfile);
+                break;
+            }
+            if (iscancelled()) break; /* won't be rendering it after all */
+            usleep(RENDERPOLL * 1000);
+            waited += RENDERPOLL;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) { /* render it unlocked, then */
+            close(fd);
+            return -1;
+        }
+        if (fstat(fd, &lockstat) == 0 && stat(lockfile, &pathstat) == 0 && lockstat.st_ino == pathstat.st_ino && lockstat.st_dev == pathstat.st_dev) {
+            return fd;
+        }
+        close(fd); /* removed by its last holder, so lock whatever's there now */
+    }
+}
 
-    /* --- first construct the command --- */
-    if (isempty(program)) goto end_of_job; /* no input */
-    sprintf(command, "which %s", program); /* construct command */
+void unlockrender(int lockfd, char *md5hash) {
+    if (lockfd < 0) return;
+    remove(makepath(NULL, md5hash, ".lock")); /* anyone still waiting on it rechecks the cache once they have it */
+    close(lockfd);
+}
 
-    /* --- use popen() to invoke which --- */
-    whichout = popen(command, "r");        /* issue which and capture stdout */
-    if (whichout == NULL) goto end_of_job; /* failed */
+int readerrors(char *md5hash) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char errfile[512];          /* <md5hash>.err */
+    char *text = NULL, *next = NULL; /* its contents, and each message in it */
+    struct stat errstat;        /* for its age and size */
+    int fd = (-1), nread = 0;
 
-    /* --- read the pipe one char at a time --- */
-    while ((pathchar = fgetc(whichout)) != EOF) { /* get chars until eof */
-        pathbuff[nchars] = (char)pathchar;        /* store the char */
-        if (++nchars >= 255) break;
-    }                          /* don't overflow buffer */
-    pathbuff[nchars] = '\000'; /* null-terminate path */
-    trimwhite(pathbuff);       /*remove leading/trailing whitespace*/
+    /* -------------------------------------------------------------------------
+    a failure that's still fresh
+    -------------------------------------------------------------------------- */
+    if (!render->iscaching || errorttl < 1) return 0;
+    strcpy(errfile, makepath(NULL, md5hash, ".err"));
+    if (stat(errfile, &errstat) != 0) return 0;
+    if (time(NULL) - errstat.st_mtime >= errorttl) { /* time to give latex another go */
+        remove(errfile);
+        return 0;
+    }
+    if ((fd = open(errfile, O_RDONLY)) < 0) return 0;
+    if (errstat.st_size > 0 && (text = malloc(errstat.st_size + 1)) != NULL) nread = readfd(fd, text, (int)errstat.st_size);
+    close(fd);
+    if (nread < 1) {
+        free(text);
+        return 0;
+    }
+    text[nread] = '\000';
 
-    /* --- pclose() waits for command to terminate --- */
-    pclose(whichout);    /* finish */
-    if (nchars > 0) {    /* found path with which */
-        path = pathbuff; /* give user successful path */
-        if (islocate && nlocate != NULL) *nlocate = 0;
-    } /* signal we used which */
+    /* -------------------------------------------------------------------------
+    its messages, nul-separated, are latex's errors[] again
+    -------------------------------------------------------------------------- */
+    if (render->errors == NULL) render->errors = malloc(sizeof(char *) * LATEXERRORCOUNT);
+    for (render->errorcount = 0, next = text; render->errors != NULL && render->errorcount < LATEXERRORCOUNT && next < text + nread; next += strlen(next) + 1) {
+        render->errors[render->errorcount++] = strdup(next);
+        if (msglevel >= 0) fprintf(stderr, "%s", next);
+    }
+    fflush(stderr);
+    free(text);
+    if (render->errorcount < 1) return 0;
+    log_info(5, "[readerrors] %s failed %d seconds ago\n", md5hash, (int)(time(NULL) - errstat.st_mtime));
+    render->msgnumber = LATEXFAILED;
+    return 1;
+}
 
-end_of_job:
-    if (path == NULL) {                                    /* which failed to find program */
-        if (islocate) path = locatepath(program, nlocate); /* and we're using locate, so try locate instead */
+int writeerrors(char *md5hash) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    char errfile[512], tempfile[512]; /* <md5hash>.err, and where it's written first */
+    int fd = (-1), ierror = 0, status = 0;
+
+    /* -------------------------------------------------------------------------
+    each message with its nul, renamed into place so readers never see part
+    -------------------------------------------------------------------------- */
+    if (!render->iscaching || errorttl < 1 || render->errorcount < 1) return -1;
+    strcpy(errfile, makepath(NULL, md5hash, ".err"));
+    sprintf(tempfile, "%s.%d", errfile, (int)gettid());
+    if (mkshards(errfile) < 0 || (fd = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return -1;
+    for (ierror = 0; ierror < render->errorcount && status == 0; ierror++) {
+        if (render->errors[ierror] != NULL && writefd(fd, render->errors[ierror], strlen(render->errors[ierror]) + 1) < 0) status = -1;
     }
-    return path; /* give caller path to command */
+    if (close(fd) != 0 || status != 0 || publishfile(tempfile, errfile) != 0) {
+        remove(tempfile);
+        return -1;
+    }
+    log_info(10, "[writeerrors] %s\n", errfile);
+    return 0;
 }
 
-char *locatepath(char *program, int *nlocate) {
+int openpack(void) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    static char pathbuff[256]; /* buffer for returned path */
-    char command[256];         /* locate program | grep /program$ */
-    FILE *locateout = NULL;    /* locate's stdout */
-    char pathline[256];        /* read locateout one line at a time*/
-    int nlines = 0;            /* #lines read */
-    int linelen = 0;           /* choose shortest path */
-    int pathlen = 9999;
-    char *path = NULL; /* either pathbuff or NULL=error */
+    char packdir[512];                            /* absolute path of PACKDIR */
+    int perm_all = (S_IRWXU | S_IRWXG | S_IRWXO); /* 777 permissions, as the cache directory */
 
     /* -------------------------------------------------------------------------
-    Issue locate|grep command and read its output
+    packs are opened later from wherever we are, so give it an absolute path
     -------------------------------------------------------------------------- */
-    /* --- first construct the command --- */
-    if (isempty(program)) goto end_of_job; /* no input */
+    if (!ispack || !render->iscaching) return 0;
+    *packdir = '\000';
+    if (*makepath(NULL, "", NULL) != '/') {
+        if (isempty(homepath)) return 0;
+        strcpy(packdir, homepath);
+    }
+    strcat(packdir, makepath(NULL, PACKDIR, NULL));
+    if (!isdexists(packdir)) {
+        mkdir(makepath(NULL, NULL, NULL), perm_all); /* EEXIST is fine, anything else fails below */
+        if (mkdir(packdir, perm_all) != 0 && errno != EEXIST) return 0;
+    }
+    return packopen(packdir, PACKINDEXSLOTS, durability); /* covers pack appends too, as syncfile() does files */
+}
 
-    // if (strlen(program) < 2) goto end_of_job; /* might run forever */
-    sprintf(command, "locate -q -r \"/%s$\" | grep \"bin\"", program);
+char *imagepath(char *md5hash, int type) {
+    static THREADLOCAL char path[64]; /* PACKPREFIX, then md5hash */
+    if (!openpack() || !packfind(md5hash, NULL, NULL, NULL, NULL)) return makepath(NULL, md5hash, extensions[type]);
+    sprintf(path, "%s%.32s", PACKPREFIX, md5hash);
+    return path;
+}
 
-    /* --- use popen() to invoke locate|grep --- */
-    locateout = popen(command, "r");        /* issue locate and capture stdout */
-    if (locateout == NULL) goto end_of_job; /* failed */
+int iscached(char *md5hash, int type) {
+    if (openpack() && packfind(md5hash, NULL, NULL, NULL, NULL)) return 1;
+    return isfexists(makepath(NULL, md5hash, extensions[type]));
+}
 
-    /* --- read the pipe one line at a time --- */
-    while (fgets(pathline, 255, locateout) != NULL) { /* get next line until eof */
-        trimwhite(pathline);                          /*remove leading/trailing whitespace*/
-        if ((linelen = strlen(pathline)) > 0) {       /* ignore empty lines */
-            if (linelen < pathlen) {                  /* new shortest path */
-                strcpy(pathbuff, pathline);           /* store shortest for caller */
-                pathlen = linelen;
-            } /* and reset new shortest length */
-            nlines++;
-        }
-    } /* count another non-empty line */
+int openimage(char *imagefile, long *offset, int *nbytes) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    int fd = (-1);         /* returned */
+    struct stat imagestat; /* for a file's size */
 
-    /* --- pclose() waits for command to terminate --- */
-    pclose(locateout);                                 /* finish */
-    if (pathlen > 0 && pathlen < 256) path = pathbuff; /*give user successful path*/
-    if (nlocate != NULL) *nlocate = nlines;            /* and number of locate|grep hits*/
+    /* -------------------------------------------------------------------------
+    a packed image is a slice of its pack
+    -------------------------------------------------------------------------- */
+    *offset = 0;
+    *nbytes = 0;
+    if (isempty(imagefile)) return -1;
+    if (strncmp(imagefile, PACKPREFIX, strlen(PACKPREFIX)) == 0) {
+        if (!packfind(imagefile + strlen(PACKPREFIX), &fd, offset, nbytes, NULL)) return -1;
+        return fd; /* packfind()'s own dup(), closed like any other */
+    }
 
-end_of_job:
-    return path; /* give caller path to command */
+    /* --- anything else is a whole file --- */
+    if ((fd = open(imagefile, O_RDONLY)) < 0) return -1;
+    if (fstat(fd, &imagestat) != 0) {
+        close(fd);
+        return -1;
+    }
+    *nbytes = (int)imagestat.st_size;
+    return fd;
 }
 
-char *presentwd(int nsub) {
+int storepack(char *cachefile, char *md5hash, int depth) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    static char pathbuff[256]; /* buffer for returned path */
-    FILE *pwd = NULL;          /* pwd's stdout */
-    char *path = NULL;         /* either pathbuff or NULL=error */
-    int wdmethod = 1;          /* 1=getcwd(), 2=popen("pwd","r") */
+    unsigned char *image = NULL;  /* cachefile's bytes */
+    struct stat imagestat;        /* for its size */
+    int fd = (-1), nread = 0;
+    int status = (-1);
 
     /* -------------------------------------------------------------------------
-    issue getcwd() call
+    append it to a pack, then drop the file (and its .depth)
     -------------------------------------------------------------------------- */
-    if (wdmethod == 1) {                                             /* --- getcwd(pathbuff,255) --- */
-        if ((path = getcwd(pathbuff, 255)) == NULL) goto end_of_job; /* fail if unable to get cwd */
-        trimwhite(pathbuff);
-    } /*remove leading/trailing whitesapce*/
+    if (!openpack()) return -1;
+    if ((fd = open(cachefile, O_RDONLY)) < 0) return -1;
+    if (fstat(fd, &imagestat) == 0 && imagestat.st_size > 0 && (image = malloc(imagestat.st_size)) != NULL) {
+        nread = readfd(fd, image, (int)imagestat.st_size);
+    }
+    close(fd);
+    if (nread > 0 && nread == (int)imagestat.st_size && packstore(md5hash, image, nread, depth) == 0) {
+        remove(cachefile);
+        remove(makepath(NULL, md5hash, ".depth"));
+        log_info(10, "[storepack] %s packed\n", cachefile);
+        status = 0;
+    } else {
+        log_info(5, "[storepack] can't pack %s, leaving it as a file\n", cachefile);
+    }
+    free(image);
+    return status;
+}
 
+int compactcache(void) {
     /* -------------------------------------------------------------------------
-    issue pwd command and read its output
+    Allocations and Declarations
     -------------------------------------------------------------------------- */
-    if (wdmethod == 2) { /* --- popen("pwd","r") --- */
-        /* --- use popen() to invoke pwd --- */
-        if ((pwd = popen("pwd", "r")) == NULL) goto end_of_job; /* fail if unable to issue pwd and capture stdout */
-        *pathbuff = '\000';                                     /* empty string in case fgets fails */
-
-        /* --- read the pipe one line at a time --- */
-        while (fgets(pathbuff, 255, pwd) != NULL) { /* get next line while not EOF */
-            trimwhite(pathbuff);                    /*remove leading/trailing whitespace*/
-            if (strlen(pathbuff) > 0) break;
-        } /* try again if empty line */
-
-        /* --- pclose() waits for command to terminate --- */
-        pclose(pwd);
-    } /* finish */
+    int ncopied = 0;                                /* #images moved to new packs */
+    long nreclaimed = 0, nentries = 0, nlive = 0, ndead = 0;
 
     /* -------------------------------------------------------------------------
-    strip leading directories
+    copy the live images into new packs
     -------------------------------------------------------------------------- */
-    if (nsub > 0) {                               /* caller wants path above pwd */
-        if (lastchar(pathbuff) == '/')            /* have terminating / */
-            *plastchar(pathbuff) = '\000';        /* strip it */
-        while (nsub > 0) {                        /* still higher path wanted */
-            char *slash = strrchr(pathbuff, '/'); /* last / on path */
-            if (slash == NULL) break;             /* can't go up any higher */
-            *slash = '\000';                      /* truncate "/highestdir" from path */
-            nsub--;
-        } /* we're now one path up */
+    if (!ispack || !isfexists(makepath(NULL, PACKDIR "/" PACKINDEXFILE, NULL))) {
+        log_error("No packs in %s to compact (did you mean --pack?).\n", makepath(NULL, NULL, NULL));
+        return -1;
     }
-    if (lastchar(pathbuff) != '/') strcat(pathbuff, "/"); /* need terminating, so add it */
-
-    /* --- back to caller --- */
-    path = pathbuff; /* back to caller. we have found a suitable path */
+    if (!openpack()) {
+        log_error("Unable to open the pack index %s.\n", makepath(NULL, PACKDIR "/" PACKINDEXFILE, NULL));
+        return -1;
+    }
+    if ((ncopied = packcompact(&nreclaimed)) < 0) {
+        log_error("Compacting %s failed; the old packs are still in use.\n", makepath(NULL, PACKDIR, NULL));
+        return -1;
+    }
+    packstats(&nentries, &nlive, &ndead);
+    log_info(1, "[compactcache] %d images copied, %ld bytes reclaimed, %ld images of %ld bytes packed\n", ncopied, nreclaimed, nentries, nlive);
+    return ncopied;
+}
 
-end_of_job:
-    return path; /* give caller path */
+long msclock(void) {
+    struct timespec now; /* CLOCK_MONOTONIC */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
-int rrmdir(char *path) {
+int mkshards(char *cachefile) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    DIR *directory = NULL;       /* opendir() opens path directory */
-    struct dirent *entry = NULL; /* readdir() gives directory entry */
-    struct stat st_info;         /* lstat() gives info about entry */
-    char nextpath[512];
-    char *pnext = NULL; /* recurse path/filename in dir */
-    int status = -1;    /* init in case of any error */
+    char dir[512];                                /* cachefile's directory */
+    char *slash = NULL;                           /* end of it */
+    int perm_all = (S_IRWXU | S_IRWXG | S_IRWXO); /* 777 permissions, as the cache directory */
+    int ishard = 0, ndir = 0;                     /* shard level, and #chars of dir */
 
     /* -------------------------------------------------------------------------
-    Check file type at path
+    dir ends with cacheshards "ab/" levels, so make each of them, top one first
     -------------------------------------------------------------------------- */
-    if (path != NULL) {        /* have path argument */
-        if (*path != '\000') { /* and it's not an empty string */
-            if (strcmp(path, ".") != 0 && strcmp(path, "..") != 0)
-                status = lstat(path, &st_info); /* and also not "." or ".." ... what kind of file is at path? */
-        }
+    if (cacheshards < 1) return 0;
+    strninit(dir, cachefile, 511);
+    if ((slash = strrchr(dir, '/')) == NULL) return -1;
+    *slash = '\000';
+    ndir = strlen(dir);
+    if (ndir < 3 * cacheshards) return -1;
+    for (ishard = cacheshards - 1; ishard >= 0; ishard--) {
+        char save = dir[ndir - 3 * ishard]; /* '/' below this level, or the final '\0' */
+        dir[ndir - 3 * ishard] = '\000';
+        if (mkdir(dir, perm_all) != 0 && errno != EEXIST) return -1;
+        dir[ndir - 3 * ishard] = save;
     }
-    if (status < 0) goto end_of_job; /* no kind of file found at path */
+    return 0;
+}
 
+int walkcache(char *dir, int (*visit)(char *file, char *name, void *data), void *data) {
     /* -------------------------------------------------------------------------
-    Recurse level if file is a directory
+    Allocations and Declarations
     -------------------------------------------------------------------------- */
-    if (S_ISDIR(st_info.st_mode)) { /* have a directory */
-        /* ---
-         * Initialization
-         * -------------- */
-        /* --- init path for each file in directory --- */
-        strcpy(nextpath, path);                  /* start with path from caller */
-        pnext = nextpath + strlen(path);         /* ptr to '\000' at end of path */
-        if (*(pnext - 1) != '/') *pnext++ = '/'; /* no trailing / at end of path, so add one */
-        *pnext = '\000';                         /* null-terminate nextpath */
-
-        /* --- open the directory at caller's path (with trailing /) --- */
-        directory = opendir(nextpath); /* open the directory */
+    char dirbuff[512];           /* local copy, dir may be makepath()'s */
+    char file[512];              /* dir/entry */
+    DIR *directory = NULL;       /* opendir() dir */
+    struct dirent *entry = NULL; /* readdir() gives directory entry */
+    int nvisited = 0, nsub = 0;  /* #files visit counted, here and in a shard */
 
-        /* ---
-         * Run through all files in directory
-         * ---------------------------------- */
-        if (directory != NULL) {                                                           /* directory successfully opened */
-            while ((entry = readdir(directory)) != NULL) {                                 /* next entry in directory; NULL signals end-of-directory */
-                if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) { /* filename not "." or ".." */
-                    strcpy(pnext, entry->d_name);                                          /* add filename to path */
-                    status = rrmdir(nextpath);                                             /* recurse */
-                }
-            }
-            closedir(directory);                                             /* close directory after last file */
-            log_info(99, "[rrmdir] trying to remove directory: %s\n", path); /* show directory removed*/
+    /* -------------------------------------------------------------------------
+    every file, and every file in every shard subdirectory
+    -------------------------------------------------------------------------- */
+    strninit(dirbuff, dir, 511);
+    if ((directory = opendir(dirbuff)) == NULL) return -1;
+    while ((entry = readdir(directory)) != NULL) {
+        if (*entry->d_name == '.') continue; /* ., .., and .keyversion */
+        strcpy(file, makepath(dirbuff, entry->d_name, NULL));
+        if (strlen(entry->d_name) == 2 && strspn(entry->d_name, "0123456789abcdef") == 2) { /* a shard */
+            if ((nsub = walkcache(file, visit, data)) > 0) nvisited += nsub;
+            continue;
         }
-    } else {
-        log_info(99, "[rrmdir] trying to remove file: %s\n", path); /* file isn't a directory, so show file removed  */
+        nvisited += (visit(file, entry->d_name, data) ? 1 : 0);
     }
+    closedir(directory);
+    return nvisited;
+}
 
+int migratefile(char *file, char *name, void *data) {
     /* -------------------------------------------------------------------------
-    Remove file or directory (keep it for debugging if msglevel>=99)
+    Allocations and Declarations
     -------------------------------------------------------------------------- */
-    if (msglevel < 999 && !keep_work) { status = remove(path); /* remove file or directory */ }
+    int *worker = (int *)data; /* #workers, and this one's index */
+    char shardfile[512];       /* where it goes now */
+    unsigned int firstbyte = 0;
 
-end_of_job:
-    return status;
+    /* -------------------------------------------------------------------------
+    one of this worker's hash-named files, not already in place
+    -------------------------------------------------------------------------- */
+    if (strspn(name, "0123456789abcdef") < 32 || sscanf(name, "%2x", &firstbyte) != 1) return 0;
+    if ((int)(firstbyte % worker[0]) != worker[1]) return 0;
+    strcpy(shardfile, makepath(NULL, name, NULL));
+    if (strcmp(shardfile, file) == 0) return 0;
+    if (mkshards(shardfile) < 0 || rename(file, shardfile) != 0) {
+        log_info(1, "[migratefile] can't move %s to %s\n", file, shardfile);
+        return 0;
+    }
+    return 1;
 }
 
-int readcachefile(char *cachefile, unsigned char *buffer) {
+int migratecache(int nworkers) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    FILE *cacheptr;               /* cachefile */
-    unsigned char cachebuff[512]; /* bytes from cachefile */
-    int buflen = 256;             /* #bytes we try to read from file */
-    int nread = 0;                /* #bytes actually read from file */
-    int maxbytes = MAXGIFSZ;      /* max #bytes returned in buffer */
-    int nbytes = 0;               /* total #bytes read */
+    char cachedir[512];            /* makepath(NULL, NULL, NULL) */
+    int fds[2] = {-1, -1};         /* workers report how many they moved */
+    int iworker = 0, nmoved = 0;   /* worker index, #files moved by all */
+    int nworker = 0;               /* #files moved by one */
+    pid_t pid = 0;
 
     /* -------------------------------------------------------------------------
-    initialization
+    each worker walks the whole cache, moving its share of the files
     -------------------------------------------------------------------------- */
-    /* --- check that files opened okay --- */
-    if ((cacheptr = fopen(cachefile, "rb")) == NULL) { goto end_of_job; }
+    strcpy(cachedir, makepath(NULL, NULL, NULL));
+    if (!isdexists(cachedir)) {
+        log_error("No cache directory %s to migrate.\n", cachedir);
+        return -1;
+    }
+    if (pipe(fds) != 0) return -1;
+    fflush(NULL); /* flush all buffers before fork */
+    for (iworker = 0; iworker < nworkers; iworker++) {
+        if ((pid = fork()) == 0) {
+            int worker[2] = {nworkers, iworker};
+            close(fds[0]);
+            nworker = walkcache(cachedir, migratefile, worker);
+            writefd(fds[1], &nworker, sizeof(nworker));
+            _exit(nworker < 0 ? 1 : 0);
+        }
+        if (pid < 0) break;
+    }
+    close(fds[1]);
+    while (readfd(fds[0], &nworker, sizeof(nworker)) == sizeof(nworker)) {
+        if (nworker > 0) nmoved += nworker;
+    }
+    close(fds[0]);
+    while (wait(NULL) > 0); /* all workers done */
 
-    /* --- check that output buffer provided --- */
-    if (buffer == (unsigned char *)NULL) goto end_of_job; /* no buffer */
+    /* --- and the subdirectories of the old layout, now empty --- */
+    pruneshards(cachedir);
+    log_info(1, "[migratecache] moved %d files in %s to %d level%s of subdirectories\n", nmoved, cachedir, cacheshards, (cacheshards == 1 ? "" : "s"));
+    return nmoved;
+}
 
+int pruneshards(char *dir) {
     /* -------------------------------------------------------------------------
-    read bytes from cachefile
+    Allocations and Declarations
     -------------------------------------------------------------------------- */
-    while (1) {
-        /* --- read bytes from cachefile --- */
-        nread = fread(cachebuff, sizeof(unsigned char), buflen, cacheptr); /* read */
-        if (nbytes + nread > maxbytes) nread = maxbytes - nbytes;          /* block too big for buffer, so truncate it */
-        if (nread < 1) break;                                              /* no bytes left in cachefile */
-
-        /* --- store bytes in buffer --- */
-        memcpy(buffer + nbytes, cachebuff, nread); /* copy current block to buffer */
-
-        /* --- ready to read next block --- */
-        nbytes += nread;               /* bump total #bytes emitted */
-        if (nread < buflen) break;     /* no bytes left in cachefile */
-        if (nbytes >= maxbytes) break; /* avoid buffer overflow */
-    }
-
-end_of_job:
-    if (cacheptr != NULL) fclose(cacheptr); /* close file if opened */
-    return nbytes;                          /* back with #bytes emitted */
-}
+    char dirbuff[512];           /* local copy, dir may be makepath()'s */
+    char shard[512];             /* dir/entry */
+    DIR *directory = NULL;       /* opendir() dir */
+    struct dirent *entry = NULL; /* readdir() gives directory entry */
+    int isleft = 0;              /* anything left in dir */
 
-int crc16(char *s) {
     /* -------------------------------------------------------------------------
-    Compute the crc
+    empty each shard, then remove it if that worked
     -------------------------------------------------------------------------- */
-    unsigned short crc = 0;                /* returned crc */
-    int ibit;                              /* for(ibit) eight one-bit shifts */
-    while (!isempty(s)) {                  /* while there are still more chars*/
-        crc = (crc ^ (*s) << 8);           /* add next char */
-        for (ibit = 0; ibit < 8; ibit++) { /* generator polynomial */
-            if (crc & 0x8000) {
-                crc <<= 1;
-                crc = crc ^ 4129;
-            } else {
-                crc <<= 1;
-            }
+    strninit(dirbuff, dir, 511);
+    if ((directory = opendir(dirbuff)) == NULL) return 0;
+    while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (strlen(entry->d_name) == 2 && strspn(entry->d_name, "0123456789abcdef") == 2) {
+            strcpy(shard, makepath(dirbuff, entry->d_name, NULL));
+            if (pruneshards(shard) && rmdir(shard) == 0) continue;
         }
-        s++; /* next xhar */
+        isleft = 1;
     }
-    return (int)crc; /* back to caller with crc */
-}
-
-char *md5str(char *instr) {
-    static char outstr[64];
-    unsigned char md5sum[16];
-    md5_context ctx;
-    int j;
-    md5_starts(&ctx);
-    md5_update(&ctx, (uint8 *)instr, strlen(instr));
-    md5_finish(&ctx, md5sum);
-    for (j = 0; j < 16; j++) sprintf(outstr + j * 2, "%02x", md5sum[j]);
-    outstr[32] = '\000';
-    return outstr;
+    closedir(directory);
+    return !isleft;
 }
 
 int unescape_url(char *url) {
@@ -2019,6 +4907,113 @@ int setsignal(int sig, void (*handler)(int)) {
 }
 #endif /* ISCOMPILETIMELIMIT */
 
+int spawn(char **argv, char *infile, char *outfile, char *errfile, int killtime) {
+    pid_t pid = 0; /* spawned program */
+    int status = spawnstart(argv, infile, outfile, errfile, -1, &pid);
+    if (status != 0) return status; /* couldn't run it */
+    return spawnwait(pid, argv[0], killtime);
+}
+
+int spawnstart(char **argv, char *infile, char *outfile, char *errfile, int pipefd, pid_t *pid) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    extern char **environ;              /* passed on to the program */
+    posix_spawn_file_actions_t actions; /* stdin, stdout, stderr redirections */
+    char logbuff[2048];                 /* command line, for the log */
+    int spawn_stat = 0, iarg = 0;
+
+    /* -------------------------------------------------------------------------
+    start the program directly, no /bin/sh, with its files opened for it
+    -------------------------------------------------------------------------- */
+    if (argv == NULL || isempty(argv[0])) return -1;
+    if (iscancelled()) return -1; /* nobody wants what it would make */
+    if (msglevel >= 5) {
+        *logbuff = '\000';
+        for (iarg = 0; argv[iarg] != NULL && strlen(logbuff) + strlen(argv[iarg]) < sizeof(logbuff) - 64; iarg++) {
+            sprintf(logbuff + strlen(logbuff), (strpbrk(argv[iarg], " \t\"&") == NULL ? "%s " : "\"%s\" "), argv[iarg]);
+        }
+        log_info(5, "[spawn] %s<%s >%s 2>%s%s\n", logbuff, (infile == NULL ? "-" : infile), (outfile == NULL ? "-" : outfile),
+                 (errfile == NULL ? "-" : errfile), (pipefd >= 0 ? " 3>pipe" : ""));
+    }
+    posix_spawn_file_actions_init(&actions);
+    if (render->workfd >= 0) posix_spawn_file_actions_addfchdir_np(&actions, render->workfd); /* starts in the work dir, where its files are */
+    if (pipefd >= 0) posix_spawn_file_actions_adddup2(&actions, pipefd, 3); /* the program writes /dev/fd/3 (which outfile may name) */
+    if (infile != NULL) posix_spawn_file_actions_addopen(&actions, 0, infile, O_RDONLY, 0);
+    if (outfile != NULL) posix_spawn_file_actions_addopen(&actions, 1, outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (errfile != NULL) posix_spawn_file_actions_addopen(&actions, 2, errfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    fflush(NULL); /* flush all buffers before the child starts */
+    spawn_stat = posix_spawnp(pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (spawn_stat != 0) { /* couldn't exec it */
+        log_info(5, "[spawn] can't run %s: %s\n", argv[0], strerror(spawn_stat));
+        return (spawn_stat == ENOENT || spawn_stat == EACCES ? 127 : -1);
+    }
+    return 0;
+}
+
+int spawnwait(pid_t pid, char *program, int killtime) {
+    struct pollfd fds[2] = {{-1, POLLIN, 0}, {-1, POLLIN, 0}}; /* pidfd, readable once the program exits, and the render's cancelfd */
+    long deadline = 0, remaining = -1;                         /* msclock() to kill it at, and ms until then (-1 for never) */
+    pid_t waited = 0;                                          /* from waitpid() */
+    int status = 0;                                            /* its exit status */
+    int iscancel = 0;                                          /* killed because the render was cancelled */
+
+    /* -------------------------------------------------------------------------
+    wait for it, killing it if it's still running after killtime seconds, or
+    as soon as the render's cancelled. no alarm(), which is the whole
+    process's, so other threads' waits are theirs
+    -------------------------------------------------------------------------- */
+    if (killtime > 999) killtime = 999; /* default maximum to 999 seconds */
+    fds[1].fd = render->cancelfd;
+    if (killtime > 0 || fds[1].fd >= 0) {
+        if (killtime > 0) deadline = msclock() + 1000L * killtime;
+        #if defined(SYS_pidfd_open)
+        fds[0].fd = (int)syscall(SYS_pidfd_open, pid, 0); /* fails before linux 5.3, so we poll waitpid() instead */
+        #endif
+        while ((waited = waitpid(pid, &status, WNOHANG)) == 0 && !(iscancel = iscancelled()) && (killtime <= 0 || (remaining = deadline - msclock()) > 0)) {
+            if (poll(fds, 2, (fds[0].fd < 0 ? 10 : (int)remaining)) < 0) usleep(10000);
+        }
+        if (fds[0].fd >= 0) close(fds[0].fd);
+        if (waited == 0) { /* still running */
+            kill(pid, SIGKILL);
+            if (iscancel) {
+                log_info(5, "[spawn] killed %s, as its render was cancelled\n", program);
+            } else {
+                log_info(5, "[spawn] killed %s after %d seconds\n", program, killtime);
+            }
+        }
+    }
+    if (waited == 0) {
+        while ((waited = waitpid(pid, &status, 0)) < 0 && errno == EINTR);
+    }
+    if (waited < 0 || !WIFEXITED(status)) return -1; /* killed, or lost */
+    return WEXITSTATUS(status);
+}
+
+int splitargs(char *args, char **argv, int maxargs) {
+    char *in = args, *out = args; /* split in place */
+    int nargs = 0;                /* #args split off */
+    while (nargs < maxargs - 1) {
+        while (isspace((int)*in)) in++; /* skip leading blanks */
+        if (*in == '\000') break;       /* no more args */
+        argv[nargs++] = out;
+        while (*in != '\000' && !isspace((int)*in)) {
+            if (*in == '\"') { /* "quoted part" may contain blanks */
+                in++;
+                while (*in != '\000' && *in != '\"') *out++ = *in++;
+                if (*in == '\"') in++;
+            } else {
+                *out++ = *in++;
+            }
+        }
+        if (*in != '\000') in++; /* past the blank ending it */
+        *out++ = '\000';
+    }
+    argv[nargs] = NULL;
+    return nargs;
+}
+
 char *getdirective(char *string, char *directive, int iscase, int isvalid, int nargs, void *args) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
@@ -2039,10 +5034,10 @@ char *getdirective(char *string, char *directive, int iscase, int isvalid, int n
     /* -------------------------------------------------------------------------
     Find first \directive in string
     -------------------------------------------------------------------------- */
-    noptional = 0; /* no optional [args] yet */
-    for (iarg = 0; iarg < 8; iarg++) { *optionalargs[iarg] = '\000'; /* for each one, re-init optional [arg] buffer */ }
-    if (argformat != 0) {      /* have argformat */
-        int myfmt = argformat; /* local copy */
+    render->noptional = 0; /* no optional [args] yet */
+    for (iarg = 0; iarg < 8; iarg++) { *render->optionalargs[iarg] = '\000'; /* for each one, re-init optional [arg] buffer */ }
+    if (render->argformat != 0) {      /* have argformat */
+        int myfmt = render->argformat; /* local copy */
         if (myfmt < 0) {
             // isnegfmt = 1;
             myfmt = -myfmt;
@@ -2080,8 +5075,8 @@ char *getdirective(char *string, char *directive, int iscase, int isvalid, int n
     -------------------------------------------------------------------------- */
     iarg = 0;                                                        /* no args yet */
     if (nargs > 0) {                                                 /* \directive has {args} */
-        while (iarg < nargs + noptional) {                           /* get each arg */
-            int karg = iarg - noptional;                             /* non-optional arg index */
+        while (iarg < nargs + render->noptional) {                           /* get each arg */
+            int karg = iarg - render->noptional;                             /* non-optional arg index */
             int kfmt = (nfmt <= karg ? 0 : argfmt[nfmt - karg - 1]); /* arg format digit */
 
             /* --- find left { and right } arg delimiters --- */
@@ -2091,7 +5086,7 @@ char *getdirective(char *string, char *directive, int iscase, int isvalid, int n
 
             /* --- check LaTeX for single-char arg or {arg} or optional [arg] --- */
             if (kfmt == 0) { /* interpret LaTeX {arg} format */
-                if (!isthischar(*plbrace, (iarg == optionalpos + noptional ? "{[" : "{"))) {
+                if (!isthischar(*plbrace, (iarg == render->optionalpos + render->noptional ? "{[" : "{"))) {
                     /* --- single char argument --- */
                     plast = plbrace + 1;  /* first char after single-char arg*/
                     argfld[0] = *plbrace; /* arg field is this one char */
@@ -2153,10 +5148,10 @@ char *getdirective(char *string, char *directive, int iscase, int isvalid, int n
 
             /* --- store argument field in caller's array --- */
             if (kfmt == 0 && *plbrace == '[') { /*store [arg] as optionalarg instead*/
-                if (noptional < 8) {            /* don't overflow our buffer */
-                    strninit(optionalargs[noptional], argfld, 254);
+                if (render->noptional < 8) {            /* don't overflow our buffer */
+                    strninit(render->optionalargs[render->noptional], argfld, 254);
                 } /*copy to optionalarg*/
-                noptional++;
+                render->noptional++;
             } else {           /*{args} returned in caller's array*/
                 if (gotargs) { /*caller supplied address or array*/
                     if (nargs < 2) {
@@ -2181,8 +5176,8 @@ char *getdirective(char *string, char *directive, int iscase, int isvalid, int n
 Back to caller
 -------------------------------------------------------------------------- */
 end_of_job:
-    if (1) argformat = 0;                            /* always/never reset global arg */
-    if (1) optionalpos = 0;                          /* always/never reset global arg */
+    if (1) render->argformat = 0;                            /* always/never reset global arg */
+    if (1) render->optionalpos = 0;                          /* always/never reset global arg */
     if (pfirst != NULL && plast != NULL) {           /* have directive field delims */
         strsqueeze(pfirst, ((int)(plast - pfirst))); /* squeeze out directive */
     }
@@ -2336,9 +5331,9 @@ char *mathprep(char *expression) {
     /* --- set mathmode for input $$expression$$ --- */
     if (ndollars > 0)                    /* have $$expression$$ input */
         switch (ndollars) {              /* set mathmode accordingly */
-            case 1: mathmode = 1; break; /* $...$ is \textstyle */
-            case 2: mathmode = 0; break; /* $$...$$ is \displaystyle */
-            case 3: mathmode = 2; break; /* $$$...$$$ is \parstyle */
+            case 1: render->mathmode = 1; break; /* $...$ is \textstyle */
+            case 2: render->mathmode = 0; break; /* $$...$$ is \displaystyle */
+            case 3: render->mathmode = 2; break; /* $$$...$$$ is \parstyle */
             default: break;
         } /* I have no idea what you want */
 
@@ -2349,7 +5344,7 @@ char *mathprep(char *expression) {
                 explen -= 4;                                                                             /* remove leading/trailing \[...\] */
                 strsqueeze(expression, 2);                                                               /* squeeze out leading \[ */
                 expression[explen] = '\000';                                                             /* and terminate at trailing \] */
-                mathmode = 0;
+                render->mathmode = 0;
             } /* set \displaystyle */
         }
     }
@@ -2695,7 +5690,7 @@ char *nomath(char *s) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    static char sbuff[4096]; /* copy of s with no math chars */
+    static THREADLOCAL char sbuff[4096]; /* copy of s with no math chars */
 
     /* -------------------------------------------------------------------------
     Make a clean copy of s
@@ -2729,7 +5724,7 @@ char *strwrap(char *s, int linelen, int tablen) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    static char sbuff[4096];                          /* line-wrapped copy of s */
+    static THREADLOCAL char sbuff[4096];                          /* line-wrapped copy of s */
     char *sol = sbuff;                                /* ptr to start of current line*/
     char tab[32] = "                 ";               /* tab string */
     int finalnewline = (lastchar(s) == '\n' ? 1 : 0); /*newline at end of string?*/
@@ -2967,7 +5962,7 @@ int evalterm(struct store_struct *store, char *term) {
     int termval = 0;              /* term value returned to caller */
     char token[2048] = "\000";    /* copy term */
     char *delim = NULL;           /* delim '(' or '?' in token */
-    static int evaltermdepth = 0; /* recursion depth */
+    static THREADLOCAL int evaltermdepth = 0; /* recursion depth */
     int novalue = -89123456;      /* dummy (for now) error signal */
 
     /* -------------------------------------------------------------------------
@@ -3072,7 +6067,7 @@ int getstore(struct store_struct *store, char *identifier) {
     /* -------------------------------------------------------------------------
     Allocations and Declarations
     -------------------------------------------------------------------------- */
-    int value = 0;  /* store[istore].value for identifier */
+    int value = 0;  /* int at store[istore].offset in the render context */
     int istore = 0; /* store[] index containing identifier */
     char seek[512]; /* identifier arg, identifier in store */
     char hide[512];
@@ -3090,8 +6085,8 @@ int getstore(struct store_struct *store, char *identifier) {
         trimwhite(hide);                            /* remove leading/trailing whitespace */
         if (!strcmp(hide, seek)) break;             /* found match, dereference corresponding value */
     }
-    if (store[istore].value != NULL)    /* address of int supplied */
-        value = *(store[istore].value); /* return de-referenced int */
+    if (istore < MAXSTORE && !isempty(store[istore].identifier))     /* found it, not the end of the table */
+        value = *(int *)((char *)render + store[istore].offset); /* return this render's int */
 
 end_of_job:
     return value; /* store->values[istore] or NULL */
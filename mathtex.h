@@ -32,10 +32,11 @@ Program ID
 /* -------------------------------------------------------------------------
 Standard header files
 -------------------------------------------------------------------------- */
+#define _GNU_SOURCE /* before any header: gettid(), posix_spawn_file_actions_addfchdir_np() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h> // for getopts
-#define _GNU_SOURCE
+#include <stddef.h>
 #include <string.h>
 char *strcasestr(); /* non-standard extension */
 #include <ctype.h>
@@ -44,7 +45,12 @@ extern char **environ; /* for \environment directive */
 
 #include <regex.h>
 
+#include "cacheindex.h"
+#include "cachepack.h"
+#include "dvi.h"
+#include "libmathtex.h"
 #include "md5.h"
+#include "pngopt.h"
 
 /* -------------------------------------------------------------------------
 Information adjustable by -D switches on compile line
@@ -89,6 +95,12 @@ Information adjustable by -D switches on compile line
     #define ISCONVERTSWITCH 0          /* no -DCONVERT switch */
     #define CONVERT "/usr/bin/convert" /* default path to convert */
 #endif
+#if defined(DVISVGM)
+    #define ISDVISVGMSWITCH 1 /* have -DDVISVGM=\"path/dvisvgm\" */
+#else
+    #define ISDVISVGMSWITCH 0                      /* no -DDVISVGM switch */
+    #define DVISVGM "/usr/share/texmf/bin/dvisvgm" /* default path to dvisvgm */
+#endif
 #if defined(TIMELIMIT)
     #define ISTIMELIMITSWITCH 1 /* have -DTIMELIMIT=\"path/timelimit\" */
 #else
@@ -104,11 +116,11 @@ Information adjustable by -D switches on compile line
 
 /* --- paths, as specified by -D switches, else from whichpath() --- */
 static char latexpath[256] = LATEX, pdflatexpath[256] = PDFLATEX, dvipngpath[256] = DVIPNG, dvipspath[256] = DVIPS, ps2epsipath[256] = PS2EPSI,
-            convertpath[256] = CONVERT, timelimitpath[256] = TIMELIMIT;
+            convertpath[256] = CONVERT, dvisvgmpath[256] = DVISVGM, timelimitpath[256] = TIMELIMIT;
 
 /* --- source of path info: 0=default, 1=switch, 2=which, 3=locate --- */
 static int islatexpath = ISLATEXSWITCH, ispdflatexpath = ISPDFLATEXSWITCH, isdvipngpath = ISDVIPNGSWITCH, isdvipspath = ISDVIPSSWITCH,
-           isps2epsipath = ISPS2EPSISWITCH, isconvertpath = ISCONVERTSWITCH, istimelimitpath = ISTIMELIMITSWITCH;
+           isps2epsipath = ISPS2EPSISWITCH, isconvertpath = ISCONVERTSWITCH, isdvisvgmpath = ISDVISVGMSWITCH, istimelimitpath = ISTIMELIMITSWITCH;
 
 /* ---
  * home path pwd of running executable image
@@ -121,9 +133,169 @@ static char homepath[256] = "\000"; /* path to executable image */
 #if !defined(CACHE)
     #define CACHE "./cache/" /* relative to mathtex */
 #endif
-static int iscaching = 1;           /* true if caching images */
 static char cachepath[256] = CACHE; /* path to cached image files */
 
+/* ---
+ * cache key format, stamped in the cache directory. bump CACHEKEYVERSION
+ * whenever cachekey() changes what goes into the hash
+ * ------------------------------------------------------------------------ */
+#define CACHEKEYVERSION 3           /* 1 was md5 of the raw input expression, 2 collapsed newlines too */
+#define CACHEKEYSTAMP ".keyversion" /* file in cache dir holding the version */
+
+/* ---
+ * hash-named cache files go CACHESHARDS levels down, in subdirectories named
+ * for successive pairs of their hex digits, e.g. ab/cd/abcd0123....png, so no
+ * one directory holds millions of files. --migrate moves a cache written
+ * with another CACHESHARDS (0 for the old flat layout) into place
+ * ------------------------------------------------------------------------ */
+#if !defined(CACHESHARDS)
+    #define CACHESHARDS 2
+#endif
+#define MAXCACHESHARDS 8                /* up to 16 hex digits of directories */
+static int cacheshards = CACHESHARDS;   /* levels of subdirectories */
+static int migrateworkers = 0;          /* --migrate processes, 0 to render */
+
+/* ---
+ * bound the cache by total size and/or number of files: -DCACHEMAXBYTES=n,
+ * -DCACHEMAXENTRIES=n, or --cache-size, --cache-entries. with either set,
+ * renders and hits are recorded in the cache index (see cacheindex.c), and
+ * each render first evicts what it takes to get back within them (so the
+ * newest render may be over). --gc evicts without rendering, indexing the
+ * cache first if there's no index yet
+ * ------------------------------------------------------------------------ */
+#if !defined(CACHEMAXBYTES)
+    #define CACHEMAXBYTES 0 /* no limit */
+#endif
+#if !defined(CACHEMAXENTRIES)
+    #define CACHEMAXENTRIES 0 /* no limit */
+#endif
+static long cachemaxbytes = CACHEMAXBYTES;     /* most bytes of cached files */
+static long cachemaxentries = CACHEMAXENTRIES; /* most cached files */
+static int isgc = 0;                           /* true for --gc */
+
+/* ---
+ * keep cached images in pack files instead of a file each: -DPACKCACHE=1 or
+ * --pack. each rendered image (and its depth) is appended to a pack under
+ * PACKDIR in the cache directory and indexed there (see cachepack.c), so a
+ * hit is one lookup in the mapped index and a sendfile() from an open pack.
+ * images already cached as files are still served from them. evicted and
+ * re-rendered images leave dead space in the packs until --compact
+ * ------------------------------------------------------------------------ */
+#if !defined(PACKCACHE)
+    #define PACKCACHE 0 /* a file per image */
+#endif
+#define PACKDIR "packs"                /* in the cache directory */
+#define PACKPREFIX "pack:"             /* imagepath() of a packed image */
+static int ispack = PACKCACHE;         /* true to pack images */
+static int iscompact = 0;              /* true for --compact */
+
+/* ---
+ * --serve response frames: 4-byte big-endian length of everything after it,
+ * 1-byte status, 32-char cache key, 4-byte big-endian signed depth in pixels,
+ * then the image (or, for FRAMEERROR, the error message)
+ * ------------------------------------------------------------------------ */
+#define SERVEOPT 256                                /* getopt_long() value for --serve */
+#define BATCHOPT 257                                /* getopt_long() value for --batch */
+#define FORMATOPT 258                               /* getopt_long() value for --fmt */
+#define POOLOPT 259                                 /* getopt_long() value for --pool */
+#define WORKOPT 260                                 /* getopt_long() value for --work */
+#define DVIPNGOPT 261                               /* getopt_long() value for --dvipng */
+#define OPTIMIZEOPT 262                             /* getopt_long() value for --optimize */
+#define MASTEROPT 263                               /* getopt_long() value for --master */
+#define MIGRATEOPT 264                              /* getopt_long() value for --migrate */
+#define SHARDSOPT 265                               /* getopt_long() value for --shards */
+#define CACHESIZEOPT 266                            /* getopt_long() value for --cache-size */
+#define CACHEENTRIESOPT 267                         /* getopt_long() value for --cache-entries */
+#define GCOPT 268                                   /* getopt_long() value for --gc */
+#define PACKOPT 269                                 /* getopt_long() value for --pack */
+#define COMPACTOPT 270                              /* getopt_long() value for --compact */
+#define ERRORTTLOPT 271                             /* getopt_long() value for --error-ttl */
+#define DURABILITYOPT 272                           /* getopt_long() value for --durability */
+#define FRAMEMISS 0                                 /* image rendered for this request */
+#define FRAMEHIT 1                                  /* image served from the cache */
+#define FRAMEERROR 2                                /* payload is an error message */
+#define FRAMEKEYSZ 32                               /* md5 hex digits */
+#define FRAMEHEADERSZ (4 + 1 + FRAMEKEYSZ + 4)      /* length, status, key, depth */
+#define FRAMENODEPTH (-9999)                        /* depth not requested or unknown */
+
+/* ---
+ * keys already rendered by this --batch
+ * ------------------------------------- */
+#define BATCHSEENSZ 65536 /* open addressing slots */
+struct batchseen_struct {
+    char key[FRAMEKEYSZ + 1]; /* cache key, empty if slot unused */
+    int depth;                /* pixels below baseline */
+    int imagetype;            /* for the image's extension */
+    int iscaching;            /* false if every request for it said \nocache */
+};
+static struct batchseen_struct *batchseen = NULL; /* allocated by batch() */
+
+/* ---
+ * --batch requests sharing a preamble are rendered as pages of one latex.tex.
+ * planrequest() reports what it found out about a request in a batchplan
+ * ------------------------------------------------------------------------ */
+#define BATCHGROUPSZ 64 /* max requests planned (and pages rendered) at once */
+#define BATCHSINGLE 3   /* plan status: needs a latex run of its own */
+#define BATCHGROUP 4    /* plan status: can be a page in a shared latex run */
+struct batchplan_struct {
+    int status;                 /* FRAMEMISS, FRAMEHIT, FRAMEERROR, BATCHSINGLE or BATCHGROUP */
+    char key[FRAMEKEYSZ + 1];   /* cache key */
+    int depth;                  /* pixels below baseline */
+    int imagetype;              /* for the image's extension */
+    char message[1024];         /* for error frames */
+    char group[FRAMEKEYSZ + 1]; /* md5 of the preamble and dvipng settings pages must share */
+    char density[256];          /* dvipng settings for the group */
+    char gamma[256];
+    int isquiet;                /* and its replies to latex's error prompts */
+    int iscaching;              /* false for \nocache, whose image batch() removes once it's done */
+    int npreamble, nbody; /* #bytes of latex before and after \begin{document} that follow the plan */
+};
+
+/* ---
+ * --batch -j n: each window's requests are planned, then its groups and
+ * singles rendered, by n threads at once, each claiming the next job
+ * ------------------------------------------------------------------------ */
+#define MAXBATCHTHREADS 64           /* max -j */
+static int batchthreads = 1;         /* -j n */
+struct batchjobs_struct {
+    int (*run)(struct batchjobs_struct *jobs, int ijob); /* does one job */
+    int njobs;                       /* #jobs this round */
+    int nextjob;                     /* next one to claim */
+    int jobs[BATCHGROUPSZ];          /* plans[] index of each request, or members[] index of each group */
+    int ngroups;                     /* jobs[] before this are groups, the rest requests */
+    int nmembers[BATCHGROUPSZ];      /* #members of each group */
+    int members[BATCHGROUPSZ];       /* plans[] indexes of each group's members, one group after another */
+    int firstrequest;                /* request number of plans[0] */
+    char **expressions;              /* batch()'s window */
+    char **texts;
+    struct batchplan_struct *plans;
+    int nfailed, nruns;              /* totals this round */
+};
+
+/* ---
+ * --pool workers: latex already started, waiting on stdin with the preamble
+ * loaded. slots are shared with request children, which claim idle ones
+ * ------------------------------------------------------------------------ */
+#define MAXPOOL 32  /* max --pool workers */
+#define POOLEMPTY 0 /* slot state: no worker */
+#define POOLIDLE 1  /* waiting for a request */
+#define POOLBUSY 2  /* claimed by a request child */
+#define POOLDONE 3  /* used, so serve() replaces it */
+#define POOLDEAD 4  /* exited while idle */
+struct poolworker_struct {
+    volatile int state; /* POOLEMPTY ... POOLDEAD */
+    pid_t pid;          /* worker running latex, and process group */
+    char dir[512];      /* absolute path to its input and done fifos */
+};
+static int poolsize = 0;                      /* --pool N, latex workers for --serve */
+static int npool = 0;                         /* #workers running */
+static struct poolworker_struct *pool = NULL; /* mmap()'ed by startpool() */
+static int poolfds[MAXPOOL];                  /* serve() holds each worker's input fifo open */
+static char *poolpreamble = NULL;             /* preamble workers have loaded */
+static char poolformat[512] = "\000";         /* format workers start from, if any */
+static char pooldir[512] = "\000";            /* where worker directories go */
+static int poolfailures = 0;                  /* workers that exited while idle */
+
 /* ---
  * working directory for temp files -DWORK=\"path/\"
  * ------------------------------------------------- */
@@ -131,6 +303,9 @@ static char cachepath[256] = CACHE; /* path to cached image files */
     #define WORK "./cache/" /* relative to mathtex */
 #endif
 static char workpath[256] = WORK; /* path to temp file working dir */
+#if !defined(WORKSHM)
+    #define WORKSHM "/dev/shm/" /* --work with no dir: in memory */
+#endif
 
 /* ---
  * latex method info specifying latex,pdflatex
@@ -140,8 +315,6 @@ static char workpath[256] = WORK; /* path to temp file working dir */
 #elif !defined(LATEXMETHOD)
     #define LATEXMETHOD 1
 #endif
-static int latexmethod = LATEXMETHOD; /* 1=latex, 2=pdflatex */
-static int ispicture = 0;             /* true for picture environment */
 
 /* ---
  * image method info specifying dvipng or dvips/convert
@@ -155,22 +328,28 @@ static int ispicture = 0;             /* true for picture environment */
 #elif !defined(IMAGEMETHOD)
     #define IMAGEMETHOD 1
 #endif
-static int imagemethod = IMAGEMETHOD; /* 1=dvipng, 2=dvips/convert */
 
 /* ---
- * image type info specifying gif, png
- * ----------------------------------- */
+ * image type info specifying gif, png, or svg (gzipped as svgz), which
+ * dvisvgm renders from the dvi regardless of imagemethod
+ * ------------------------------------------------------------------ */
 #if defined(GIF)
     #define IMAGETYPE 1
 #endif
 #if defined(PNG)
     #define IMAGETYPE 2
 #endif
+#if defined(SVG)
+    #define IMAGETYPE 3
+#endif
+#if defined(SVGZ)
+    #define IMAGETYPE 4
+#endif
 #if !defined(IMAGETYPE)
     #define IMAGETYPE 2 // default image type.
 #endif
-static int imagetype = IMAGETYPE;                       /* 1=gif, 2=png */
-static char *extensions[] = {NULL, "gif", "png", NULL}; /* image type file .extensions */
+#define ISSVG(type) ((type) >= 3)                                     /* dvisvgm, and no dpi */
+static char *extensions[] = {NULL, "gif", "png", "svg", "svgz", NULL}; /* image type file .extensions */
 
 /* ---
  * \[ \displaystyle \]  or  $ \textstyle $  or  \parstyle
@@ -187,7 +366,6 @@ static char *extensions[] = {NULL, "gif", "png", NULL}; /* image type file .exte
 #if !defined(MATHMODE)
     #define MATHMODE 0
 #endif
-static int mathmode = MATHMODE; /* 0=display 1=text 2=paragraph */
 
 /* ---
  * font size info 1=\tiny ... 10=\Huge
@@ -195,7 +373,6 @@ static int mathmode = MATHMODE; /* 0=display 1=text 2=paragraph */
 #if !defined(FONTSIZE)
     #define FONTSIZE 4
 #endif
-static int fontsize = FONTSIZE; /* 0 = tiny ... 9 = Huge */
 static char *sizedirectives[] = {"\\tiny",  "\\scriptsize", "\\footnotesize", "\\small", "\\normalsize", "\\large", "\\Large",
                                  "\\LARGE", "\\huge",       "\\Huge",         NULL};
 
@@ -205,7 +382,6 @@ static char *sizedirectives[] = {"\\tiny",  "\\scriptsize", "\\footnotesize", "\
 #if !defined(DPI)
     #define DPI "120"
 #endif
-static char density[256] = DPI; /*-D/-density arg for dvipng/convert*/
 
 /* ---
  * default -gamma for convert is 0.5, or --gamma for dvipng is 2.5
@@ -224,7 +400,6 @@ static char density[256] = DPI; /*-D/-density arg for dvipng/convert*/
 #else
     #define ISGAMMA 1 /* -DGAMMA=\"gamma\" supplied */
 #endif
-static char gamma[256] = GAMMA; /* -gamma arg for convert() */
 
 /* ---
  * latex -halt-on-error or quiet
@@ -238,7 +413,6 @@ static char gamma[256] = GAMMA; /* -gamma arg for convert() */
 #else
     #define ISQUIET 3 /* default reply 3 <Enter>'s then x*/
 #endif
-static int isquiet = ISQUIET; /* >99=quiet, 0=-halt-on-error */
 
 /* ---
  * emit depth below baseline (for vertical centering)
@@ -248,7 +422,98 @@ static int isquiet = ISQUIET; /* >99=quiet, 0=-halt-on-error */
 #else
     #define ISDEPTH 0
 #endif
-static int isdepth = ISDEPTH; /* true to emit depth */
+
+/* ---
+ * dump the wrapper preamble into a precompiled latex format in the cache
+ * ---------------------------------------------------------------------- */
+#if defined(FORMAT)
+    #define ISFORMAT 1
+#else
+    #define ISFORMAT 0
+#endif
+static int isformat = ISFORMAT; /* true to run latex "&format" */
+
+/* ---
+ * keep latex's output (latex.dvi, or latex.pdf from pdflatex, and latex.info
+ * for depth) in the cache, named for the document it came from, so requests
+ * differing only in density, gamma or image type skip latex. -DDVICACHE=0
+ * always runs latex
+ * ------------------------------------------------------------------------ */
+#if !defined(DVICACHE)
+    #define DVICACHE 1
+#endif
+static int isdvicache = DVICACHE; /* true to cache latex.dvi along with images */
+
+/* ---
+ * remember what latex said about an expression it couldn't compile, as
+ * <md5hash>.err in the cache, and give that answer again for ERRORTTL
+ * seconds without running latex. -DERRORTTL=n or --error-ttl n, 0 to
+ * always rerun latex
+ * ------------------------------------------------------------------------ */
+#if !defined(ERRORTTL)
+    #define ERRORTTL 600
+#endif
+static int errorttl = ERRORTTL; /* seconds a cached failure is good for */
+
+/* ---
+ * render each key in one process at a time: the first to miss takes a lock
+ * on <md5hash>.lock in the cache, and the others wait on it for up to
+ * RENDERWAIT seconds (-DRENDERWAIT=n), then serve what it cached. if it's
+ * still not there they render it themselves, each in a work directory of
+ * its own
+ * ------------------------------------------------------------------------ */
+#if !defined(RENDERWAIT)
+    #define RENDERWAIT 30
+#endif
+#define RENDERPOLL 20                     /* milliseconds between tries for the lock */
+static int renderwait = RENDERWAIT;       /* seconds to wait on another process's render */
+
+/* ---
+ * everything goes into the cache by rename(), from the work directory or a
+ * temporary name next to it, so readers never see part of a file. how hard
+ * to make sure it's on disk first: -DDURABILITY=n or --durability none (0,
+ * leave it to the kernel), data (1, fdatasync() each file) or full (2, also
+ * fsync() each file's directory after the rename). --pack appends are synced
+ * the same way before the pack index points at them
+ * ------------------------------------------------------------------------ */
+#if !defined(DURABILITY)
+    #define DURABILITY 0
+#endif
+static int durability = DURABILITY; /* 0 none, 1 data, 2 full */
+
+/* ---
+ * render png's from latex.dvi ourselves (see dvi.c), leaving only what we
+ * can't (specials, fonts with no pk file) to dvipng. -DDVIRENDER=0 or
+ * --dvipng always runs dvipng
+ * ------------------------------------------------------------------------ */
+#if !defined(DVIRENDER)
+    #define DVIRENDER 1
+#endif
+#define KPSEWHICH "kpsewhich" /* finds pk fonts, next to latex or on the PATH */
+static int isdvirender = DVIRENDER; /* true to try dvirender() before dvipng */
+
+/* ---
+ * re-encode rendered png's as small as their pixels allow, with no
+ * metadata (see pngopt.c): -DOPTIMIZE=level (1-9), or --optimize[=level].
+ * --optimize=max tries every filter and deflate strategy, for warming the
+ * cache with --batch
+ * ------------------------------------------------------------------------ */
+#if !defined(OPTIMIZE)
+    #define OPTIMIZE 0 /* png's as dvipng (or dvirender()) writes them */
+#endif
+static int pnglevel = OPTIMIZE; /* zlib level, 0 to leave png's alone */
+static int pngeffort = 0;       /* 1 for --optimize=max */
+
+/* ---
+ * with caching, render png's at one master resolution and make any lower
+ * density by shrinking the cached master (see pngopt.c), so the same formula
+ * at 120, 150 and 300 dpi runs latex once: -DMASTERDPI=dpi, or --master[=dpi]
+ * ------------------------------------------------------------------------ */
+#if !defined(MASTERDPI)
+    #define MASTERDPI 0 /* every density rendered by itself */
+#endif
+#define DEFAULTMASTERDPI 600             /* for --master without a dpi */
+static int masterdpi = MASTERDPI; /* master resolution, 0 for none */
 
 /* ---
  * misc.
@@ -319,27 +584,11 @@ static int iscompiletimelimit = ISCOMPILETIMELIMIT; /* 1=use timelimit() */
 volatile int fdone, falarm, fsig, sigcaught;
 #endif
 
-/* ---
- * additional latex \usepackage{}'s
- * -------------------------------- */
-static int npackages = 0;     /* number of additional packages */
-static char packages[9][128]; /* additional package names */
-static char packargs[9][128]; /* optional arg for package */
-
-/**
- * preamble detection
- */
-static char dclassargs[2][256];
-static char *dclassoptions = "10pt"; // directive options (optional, no pun intended)
-static char *dclass = "article";     // directive class
-
 /**
  * error detection
  */
 #define LATEXERRORCOUNT 5     // the amount of errors to detect.
 #define LATEXSTACKLENGTH 1024 // temp until something better comes along
-static char **errors;
-static int errorcount;
 
 /* ---
  * default uses locatepath() if whichpath() fails
@@ -365,7 +614,7 @@ static int errorcount;
     #define MAXMSGLEVEL 999999
 #endif
 static int msglevel = MSGLEVEL; /* message level for verbose/debug */
-static FILE *msgfp = NULL;      /* output in command-line mode */
+static FILE *msgfp = NULL;      /* log_info()'s, stdout unless libmathtex makes it stderr */
 char *strwrap();                /* help format debugging messages */
 
 static char *about = "mathTeX v" VERSION ", Copyright(c) " COPYRIGHTDATE
@@ -381,12 +630,50 @@ static char *usage =
     "  -d [dpi]           set dpi of render (default: 120)                    \n"
     "  -f [input_file]    file to read latex expression in from               \n"
     "  -h                 prints this                                         \n"
+    "  -j [threads]       with --batch, render this many requests at once     \n"
     "  -m [log_verbosity] verbosity (\"message level\") of logs               \n"
     "  -o [output_file]   file to write output image from                     \n"
     "  -s                 writes output image to stdout (use `-m 0`!)         \n"
     "  -t                 overrides cache to store images in /tmp/mathtex     \n"
     "                     (shorthand for `-c /tmp/mathtex`)                   \n"
     "  -w                 keeps work directory. exists for debug reasons      \n"
+    "  --fmt              precompile the latex preamble into a format file in \n"
+    "                     the cache, and start latex from that               \n"
+    "  --serve [socket]   render requests from a unix socket until killed.    \n"
+    "                     requests are a 4-byte big-endian length followed by \n"
+    "                     the expression (use directives for options)         \n"
+    "  --work[=dir]       put temp work files under dir (default: /dev/shm),  \n"
+    "                     or the usual place if it isn't usable              \n"
+    "  --dvipng           always run dvipng, rather than rendering the dvi    \n"
+    "                     here when its fonts are available as pk files       \n"
+    "  --optimize[=n|max] recompress rendered pngs at zlib level n (default 9)\n"
+    "                     as small as their pixels allow, without metadata.  \n"
+    "                     max tries every filter and strategy (slow)          \n"
+    "  --master[=dpi]     cache pngs rendered at dpi (default 600), and shrink\n"
+    "                     them for lower densities instead of rerunning latex\n"
+    "  --shards n         keep cached files n levels of ab/cd/ subdirectories \n"
+    "                     deep (default 2, 0 for one flat directory)          \n"
+    "  --migrate[=n]      move the files of a cache written with any other    \n"
+    "                     --shards into place with n processes, and exit      \n"
+    "  --cache-size n     keep the cache under n bytes (k, m or g suffix ok), \n"
+    "                     evicting cheap, unused images first                 \n"
+    "  --cache-entries n  keep the cache under n files                        \n"
+    "  --gc               evict down to --cache-size/--cache-entries, and exit\n"
+    "  --durability m     none (default), data (fdatasync cached files before \n"
+    "                     they're renamed into place) or full (and fsync their\n"
+    "                     directories after)                                  \n"
+    "  --error-ttl n      answer expressions latex failed on from the cache   \n"
+    "                     for n seconds (default 600, 0 to always rerun latex)\n"
+    "  --pack             cache images in a few large pack files, indexed by  \n"
+    "                     key, rather than a file each                        \n"
+    "  --compact          with --pack, copy the packed images into new packs, \n"
+    "                     reclaiming space left by evicted ones, and exit     \n"
+    "  --pool [n]         with --serve, keep n latex processes started with   \n"
+    "                     the default preamble loaded, for cache misses       \n"
+    "  --batch[=json|nul] render every request read from stdin (or -f file),  \n"
+    "                     one json string or {\"expression\":...} per line, or\n"
+    "                     nul-separated expressions. writes the same frames   \n"
+    "                     as --serve to stdout, logging to stderr             \n"
     "\n"
     "Example: `mathtex -o equation1 \"f(x,y)=x^2+y^2\"`                       \n";
 static char *license =
@@ -402,10 +689,9 @@ static char *license =
         fprintf(fp, __VA_ARGS__); \
         fflush(fp);               \
     }
-#define log_info(lvl, ...) log(lvl, stdout, __VA_ARGS__) /** Logs informational stuff to stdout. */
+#define log_info(lvl, ...) log(lvl, (msgfp != NULL ? msgfp : stdout), __VA_ARGS__) /** Logs informational stuff to stdout (or msgfp). */
 #define log_error(...) log(0, stderr, __VA_ARGS__)       /** Logs errors to stderr. */
 
-static int msgnumber = 0; /* embeddedimages() in query mode */
 #define MAXEMBEDDED 16    /* 1...#embedded images available */
 #define TESTMESSAGE 1     /* msg# for mathTeX test message */
 #define UNKNOWNERROR 2    /* msg# for non-specific error */
@@ -423,6 +709,9 @@ static int msgnumber = 0; /* embeddedimages() in query mode */
 #define CONVERTFAILED 14  /* msg# if convert failed */
 #define EMITFAILED 15     /* msg# if emitcache() failed */
 #define REMOVEWORKFAILED 16
+#define SYSVGFAILED 17    /* msg# if system(dvisvgm) failed */
+#define DVISVGMFAILED 18  /* msg# if dvisvgm failed */
+#define PUBLISHFAILED 19  /* msg# if the image couldn't be moved into place */
 
 /** Embedded messages for errors. */
 static char *embeddedtext[] = {NULL,
@@ -442,11 +731,11 @@ static char *embeddedtext[] = {NULL,
                                "convert ran, but failed for whatever reason.\n",                                             // 14
                                "Can't emit cached image; check permissions.\n",                                              // 15
                                "Can't rm -r tempnam/work directory (or some content within it); check permissions.\n",       // 16
+                               "Can't run dvisvgm program; check -DDVISVGM=\"path\", etc.\n",                                // 17
+                               "dvisvgm ran, but failed for whatever reason.\n",                                             // 18
+                               "Can't move the image into the cache; check permissions and free space.\n",                   // 19
                                NULL};
 
-static char outfile[256] = "\000"; /* output file, or empty for default*/
-static char tempdir[256] = "\000"; /* temporary work directory */
-
 /* ---
  * internal buffer sizes
  * --------------------- */
@@ -456,6 +745,9 @@ static char tempdir[256] = "\000"; /* temporary work directory */
 #if !defined(MAXGIFSZ)
     #define MAXGIFSZ (131072) /* max #bytes in output GIF image */
 #endif
+#if !defined(MAXSPAWNARGS)
+    #define MAXSPAWNARGS (64) /* max #args spawn() runs a program with */
+#endif
 
 /* ---
  * latex wrapper document template (default, isdepth=0, without depth)
@@ -554,11 +846,6 @@ static char latexdepthwrapper[MAXEXPRSZ + 16384] =
     "\\usebox{\\mybox}\n"
     "\\end{document}\n";
 
-/* ---
- * latex wrapper used
- * ------------------ */
-static char *latexwrapper = (ISDEPTH ? latexdepthwrapper : latexdefaultwrapper); /* with or without depth */
-
 /* ---
  * elements from \jobname.info to be prepended to graphics file
  * ------------------------------------------------------------ */
@@ -570,10 +857,6 @@ struct imageinfo_struct {
     char units[32];   /* units of value, e.g., "pt" */
     int algorithm;    /* value conversion before writing */
 };                    /* --- end-of-store_struct --- */
-static struct imageinfo_struct imageinfo[MAXIMAGEINFO] = {
-    {"depth", "Vertical-Align:%dpx\n", -9999., "", 1}, /* below baseline */
-    {NULL, NULL, -9999., "", -9999}                    /* end-of-imageinfo */
-};                                                     /* --- end-of-imageinfo[] --- */
 
 /* -------------------------------------------------------------------------
 Unix or Windows header files
@@ -592,9 +875,27 @@ Unix or Windows header files
  * unix headers
  * ------------ */
 #if !defined(WINDOWS) /* if not compiling under Windows... */
+    #include <arpa/inet.h>
     #include <dirent.h>
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <getopt.h>
+    #include <poll.h>
+    #include <pthread.h>
+    #include <signal.h>
+    #include <spawn.h>
+    #include <sys/file.h>
+    #include <sys/mman.h>
+    #if defined(__linux__)
+        #include <sys/eventfd.h>
+        #include <sys/sendfile.h>
+        #include <sys/syscall.h>
+    #endif
+    #include <sys/socket.h>
     #include <sys/stat.h>
     #include <sys/types.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
     #include <unistd.h>
 #endif
 
@@ -636,6 +937,7 @@ application macros
 #define isthischar(thischar, accept) ((thischar) != '\000' && !isempty(accept) && strchr((accept), (thischar)) != (char *)NULL)
 
 #define WHITESPACE " \t\n\r\f\v" /** Default skipped whitespace chars. */
+#define BLANKS " \t\r\f\v"       /** Whitespace that doesn't end a line. */
 
 /** Skips whitespace. */
 #define skipwhite(thisstr) \
@@ -710,12 +1012,118 @@ application macros
 /* -------------------------------------------------------------------------
 other application global data
 -------------------------------------------------------------------------- */
-/* --- getdirective() global data --- */
-static int argformat = 0;           /* 111... if arg not {}-enclosed */
-static int optionalpos = 0;         /* # {args} before optional [args] */
-static int noptional = 0;           /* # optional [args] found */
-static char optionalargs[8][512] = {/* buffer for optional args */
-                                    "\000", "\000", "\000", "\000", "\000", "\000", "\000", "\000"};
+/* ---
+ * everything one render reads and writes: the command line's settings, as
+ * the expression's directives change them, its latex document, work files,
+ * and what went wrong. each render has a context of its own, so --batch -j
+ * threads can render side by side, and render is the calling thread's
+ * ------------------------------------------------------------------------ */
+#if !defined(THREADLOCAL)
+    #define THREADLOCAL __thread /* a variable each thread has its own copy of */
+#endif
+struct render_struct {
+    /* --- settings --- */
+    int latexmethod;       /* 1=latex, 2=pdflatex */
+    int imagemethod;       /* 1=dvipng, 2=dvips/convert */
+    int imagetype;         /* 1=gif, 2=png, 3=svg, 4=svgz */
+    int mathmode;          /* 0=display 1=text 2=paragraph */
+    int fontsize;          /* 0 = tiny ... 9 = Huge */
+    char density[256];     /*-D/-density arg for dvipng/convert*/
+    char gamma[256];       /* -gamma arg for convert() */
+    int isquiet;           /* >99=quiet, 0=-halt-on-error */
+    int isdepth;           /* true to emit depth */
+    int ispicture;         /* true for picture environment */
+    int iscaching;         /* true if caching images */
+    char convertpath[256]; /* \convertpath, or empty for the usual convert */
+
+    /* --- additional latex \usepackage{}'s --- */
+    int npackages;          /* number of additional packages */
+    char packages[9][128];  /* additional package names */
+    char packargs[9][128];  /* optional arg for package */
+
+    /* --- preamble detection --- */
+    char dclassargs[2][256];
+    char *dclassoptions; // directive options (optional, no pun intended)
+    char *dclass;        // directive class
+
+    /* --- latex wrapper used --- */
+    char *latexwrapper; /* wrapper, or a --batch group's whole document */
+    char *wrapper;      /* malloc()'ed copy of a template, filled in */
+
+    /* --- getdirective() data --- */
+    int argformat;            /* 111... if arg not {}-enclosed */
+    int optionalpos;          /* # {args} before optional [args] */
+    int noptional;            /* # optional [args] found */
+    char optionalargs[8][512]; /* buffer for optional args */
+
+    /* --- files --- */
+    char outfile[256]; /* output file, or empty for default*/
+    char tempdir[256]; /* temporary work directory */
+    char workdir[512]; /* its path, with a trailing /, once mathtex() has made it */
+    int workfd;        /* open on it, for programs to start in */
+    int npages;        /* #pages mathtex() renders from latex.tex, >1 for a --batch group */
+    int streamfd;      /* for -s, mathtex() has dvipng's image sent straight here */
+    int isstreamed;    /* true once it has been */
+    int cancelfd;      /* readable once a mathtex_submit() job is cancelled, or -1 */
+
+    /* --- results --- */
+    int iserror;    /* true if procesing error message */
+    int msgnumber;  /* embeddedimages() in query mode */
+    char **errors;  /* latex's error messages, malloc()'ed */
+    int errorcount; /* #errors[] */
+    struct imageinfo_struct imageinfo[MAXIMAGEINFO];
+
+    struct render_struct *parent; /* the thread's context before this one */
+};
+static struct render_struct settings = {
+    /* --- the command line's, which every render starts from --- */
+    .latexmethod = LATEXMETHOD,
+    .imagemethod = IMAGEMETHOD,
+    .imagetype = IMAGETYPE,
+    .mathmode = MATHMODE,
+    .fontsize = FONTSIZE,
+    .density = DPI,
+    .gamma = GAMMA,
+    .isquiet = ISQUIET,
+    .isdepth = ISDEPTH,
+    .iscaching = 1,
+    .dclassoptions = "10pt",
+    .dclass = "article",
+    .latexwrapper = (ISDEPTH ? latexdepthwrapper : latexdefaultwrapper), /* with or without depth */
+    .workfd = (-1),
+    .npages = 1,
+    .streamfd = (-1),
+    .cancelfd = (-1),
+    .imageinfo = {
+        {"depth", "Vertical-Align:%dpx\n", -9999., "", 1}, /* below baseline */
+        {NULL, NULL, -9999., "", -9999}                    /* end-of-imageinfo */
+    },
+};
+static THREADLOCAL struct render_struct *render = &settings; /* the calling thread's */
+
+/* --- a libmathtex context: what its renders start from, as settings is the command line's --- */
+struct mathtexlib_struct {
+    struct render_struct settings;
+};
+
+/* --- a mathtex_submit() job, rendered on a thread of its own --- */
+#define JOBRUNNING 0   /* its thread is rendering */
+#define JOBDONE 1      /* result's ready for mathtex_complete() */
+#define JOBCANCELLED 2 /* given up on, so its thread frees it */
+struct mathtexjob_struct {
+    struct mathtexlib_struct *lib;   /* rendered with */
+    char *expression;                /* malloc()'ed copy */
+    struct mathtexopts_struct opts;  /* copy, if isopts */
+    int isopts;
+    pthread_t thread;                /* rendering it */
+    int state;                       /* JOBRUNNING, JOBDONE or JOBCANCELLED */
+    int donefds[2];                  /* openevent(), signalled once it's JOBDONE */
+    int cancelfds[2];                /* openevent(), signalled by mathtex_cancel() */
+    int status;                      /* librender()'s */
+    unsigned char *image;            /* its image, malloc()'ed */
+    int nbytes;
+    struct mathtexmeta_struct meta;
+};
 
 /* -------------------------------------------------------------------------
 store for evalterm() [n.b., these are stripped-down funcs from nutshell]
@@ -723,13 +1131,13 @@ store for evalterm() [n.b., these are stripped-down funcs from nutshell]
 #define MAXSTORE 100 /* max 100 identifiers */
 struct store_struct {
     char *identifier; /* identifier */
-    int *value;       /* address of corresponding value */
+    size_t offset;    /* of corresponding int in a render_struct */
 };
 static struct store_struct mathtexstore[MAXSTORE] = {
-    {"fontsize", &fontsize},
-    {"fs", &fontsize}, /* font size */
-    //{ "mytestvar", &mytestvar },
-    {NULL, NULL} /* end-of-store */
+    {"fontsize", offsetof(struct render_struct, fontsize)},
+    {"fs", offsetof(struct render_struct, fontsize)}, /* font size */
+    //{ "mytestvar", offsetof(struct render_struct, mytestvar) },
+    {NULL, 0} /* end-of-store */
 };
 
 // Function prototypes.
@@ -752,6 +1160,618 @@ int main(int argc, char *argv[]);
  */
 int mathtex(char *expression, char *filename);
 
+/**
+ * Fills in the latexwrapper template with expression, mathmode, fontsize and the extra \\usepackage{}'s.
+ *
+ * @param expression[in] Null-terminated char* containing the preprocessed expression.
+ * @param ispackages[in] int containing 0 to leave out the user's \\usepackage{}'s (e.g. for the error message).
+ * @return latexwrapper, now holding the complete latex document.
+ */
+char *latexdocument(char *expression, int ispackages);
+
+/**
+ * Finds (or builds) the precompiled latex format for everything before \\begin{document} in document. It's named by the md5 of that preamble and of the
+ * latex binary's path, size and mtime, so it's rebuilt whenever either changes, and kept in the cache directory. A new format is built with latex -ini
+ * and \\dump in the current (working) directory, then tried on an empty document before it's moved into the cache. A preamble that can't be dumped gets
+ * an empty <name>.nofmt marker instead, so it isn't tried again.
+ *
+ * @param document[in] Null-terminated char* containing the complete latex document.
+ * @return Absolute path of the format without its .fmt extension, for latex "&path", or `NULL` if there's no usable format.
+ */
+char *latexformat(char *document);
+
+/**
+ * Names latex's output for document in the cache directory: the md5 of the document, latexmethod, and the latex binary's path, size and mtime (as
+ * latexformat()), so a new latex invalidates it.
+ *
+ * @param document[in] Null-terminated char* containing the complete latex document.
+ * @return Absolute path without extension (in a static buffer), for <path>.dvi or .pdf and <path>.info, or `NULL` if there's no absolute path to the
+ * cache.
+ */
+char *latexcache(char *document);
+
+/**
+ * Computes the cache key of a preprocessed expression, i.e. the md5 of a canonical description of the request. That's the expression with its runs of
+ * blanks collapsed and its newlines kept (directives have already been removed from it), followed by the effective render parameters they and the command line set; mathmode, fontsize,
+ * density, gamma, imagetype, latexmethod, imagemethod, depth, picture and quiet flags, document class, the sorted \\usepackage's and the latex wrapper itself.
+ * Equivalent requests therefore share one cached image, while requests that would render differently never collide.
+ *
+ * @param expression[in] Null-terminated char* containing the expression after directive processing.
+ * @return Null-terminated 32-character MD5 hash, in a static buffer of its own (so later md5str() calls don't change it).
+ */
+char *cachekey(char *expression);
+
+/**
+ * Makes sure the cache directory was written with the current CACHEKEYVERSION. If it was written by an older key format, the images named by those old keys
+ * can never be hit again, so they're removed before the new version is stamped.
+ *
+ * @param cachedir[in] Null-terminated char* containing path to the cache directory.
+ * @return Number of stale images removed, or -1 if the version stamp couldn't be written.
+ */
+int checkcacheversion(char *cachedir);
+
+/**
+ * walkcache() visit for checkcacheversion(): removes a hash-named image.
+ *
+ * @param file[in] Null-terminated char* containing the file's path.
+ * @param name[in] Null-terminated char* containing its name.
+ * @param data[in] void* not used.
+ * @return 1 if it was removed, 0 if it's not an image or couldn't be removed.
+ */
+int removestale(char *file, char *name, void *data);
+
+/**
+ * Opens the cache index for this process, if the cache is bounded by cachemaxbytes or cachemaxentries. Call it in the home directory: the index path
+ * is relative when cachepath is.
+ *
+ * @return 1 if the index is open, 0 if the cache isn't bounded or the index can't be opened.
+ */
+int openindex(void);
+
+/**
+ * Records a file just written to the cache in the cache index, if it's open.
+ *
+ * @param cachefile[in] Null-terminated char* containing the file's path.
+ * @param name[in] Null-terminated char* containing its name, without extension.
+ * @param ext[in] Null-terminated char* containing its extension, without the dot.
+ * @param cost[in] int containing the milliseconds it took to make.
+ * @return 1 if recorded, 0 if not.
+ */
+int indexcache(char *cachefile, char *name, char *ext, int cost);
+
+/**
+ * Removes files chosen by cacheindexevict() (each with its .depth or .info) until the cache is within cachemaxbytes and cachemaxentries, and the
+ * index has room for another file. Call it in the home directory.
+ *
+ * @return Number of files evicted.
+ */
+int evictcache(void);
+
+/**
+ * walkcache() visit for --gc with no index yet: records an image, .dvi or .pdf, with CACHEINDEXCOST as its cost.
+ *
+ * @param file[in] Null-terminated char* containing the file's path.
+ * @param name[in] Null-terminated char* containing its name.
+ * @param data[in] void* not used.
+ * @return 1 if it was recorded, 0 if not.
+ */
+int indexentry(char *file, char *name, void *data);
+
+/**
+ * --gc: evicts until the cache is within its bounds, building the index from the files in the cache first if there isn't one.
+ *
+ * @return Number of files evicted, or -1 if the cache isn't bounded or has no usable index.
+ */
+int gccache(void);
+
+/**
+ * Moves a finished file into place in the cache, by rename(), so readers see all of it or nothing. From another filesystem (e.g. a --work
+ * directory) it's copied to a temporary name next to cachefile first. Syncs per durability.
+ *
+ * @param file[in] Null-terminated char* containing the finished file, which is gone afterwards.
+ * @param cachefile[in] Null-terminated char* containing where it goes, whose directory must exist.
+ * @return 0 if it's in place, -1 if not.
+ */
+int publishfile(char *file, char *cachefile);
+
+/**
+ * fdatasync()'s a file, or fsync()'s it for full durability. Does nothing for durability none.
+ *
+ * @param file[in] Null-terminated char* containing its path.
+ * @return 0 if synced (or nothing to do), -1 if it failed.
+ */
+int syncfile(char *file);
+
+/**
+ * fsync()'s the directory a file is in, for full durability, so a rename() into it survives a crash. Does nothing otherwise.
+ *
+ * @param file[in] Null-terminated char* containing the file's path.
+ * @return 0 if synced (or nothing to do), -1 if it failed.
+ */
+int syncdir(char *file);
+
+/**
+ * Takes the lock on <md5hash>.lock in the cache, waiting up to renderwait seconds if another process holds it (is rendering the same image). If the
+ * file it locked was removed by unlockrender() meanwhile, it locks the one now there instead, so a key only ever has one holder.
+ *
+ * @param md5hash[in] Null-terminated char* containing the image's cache key.
+ * @param iswaited[out] int* receiving 1 if another process held the lock, so the cache is worth checking again.
+ * @return File descriptor holding the lock, for unlockrender(), or -1 if it couldn't be had in time.
+ */
+int lockrender(char *md5hash, int *iswaited);
+
+/**
+ * Releases a lockrender() lock, removing the lock file.
+ *
+ * @param lockfd[in] int containing the file descriptor from lockrender(), or -1 for none.
+ * @param md5hash[in] Null-terminated char* containing the image's cache key.
+ */
+void unlockrender(int lockfd, char *md5hash);
+
+/**
+ * Looks for a failure cached by writeerrors() that's under errorttl seconds old, removing it if it's older. If there is one, its messages become
+ * errors[] and errorcount (printed to stderr, as when latex reported them), and msgnumber is LATEXFAILED.
+ *
+ * @param md5hash[in] Null-terminated char* containing the expression's cache key.
+ * @return 1 if the expression is known to fail, 0 if not.
+ */
+int readerrors(char *md5hash);
+
+/**
+ * Caches latex's errors[] for md5hash as <md5hash>.err, for readerrors().
+ *
+ * @param md5hash[in] Null-terminated char* containing the expression's cache key.
+ * @return 0 if cached, -1 if not.
+ */
+int writeerrors(char *md5hash);
+
+/**
+ * Opens the pack index for this process, making PACKDIR if need be, when packing (ispack) a cache we're using. Call it in the home directory, as
+ * openindex().
+ *
+ * @return 1 if the index is open, 0 if we're not packing or it can't be opened.
+ */
+int openpack(void);
+
+/**
+ * Where a cached image is, for openimage() and the functions that emit it.
+ *
+ * @param md5hash[in] Null-terminated char* containing the image's cache key.
+ * @param type[in] int containing its imagetype.
+ * @return Null-terminated char* in a static buffer: PACKPREFIX and the key if it's packed, otherwise its makepath().
+ */
+char *imagepath(char *md5hash, int type);
+
+/**
+ * Whether an image is in the cache, packed or as a file.
+ *
+ * @param md5hash[in] Null-terminated char* containing the image's cache key.
+ * @param type[in] int containing its imagetype.
+ * @return 1 if it's cached, 0 if not.
+ */
+int iscached(char *md5hash, int type);
+
+/**
+ * Opens an image for sendfd(): a packed one (see imagepath()) as a slice of its pack, anything else as a whole file.
+ *
+ * @param imagefile[in] Null-terminated char* containing the image's path.
+ * @param offset[out] long* receiving where the image starts in the returned file.
+ * @param nbytes[out] int* receiving its size.
+ * @return File descriptor the caller closes, or -1 if the image isn't there.
+ */
+int openimage(char *imagefile, long *offset, int *nbytes);
+
+/**
+ * Moves a just-cached image into a pack with packstore(), removing its file and .depth, if packing. A file that can't be packed stays where it is.
+ *
+ * @param cachefile[in] Null-terminated char* containing the image's path.
+ * @param md5hash[in] Null-terminated char* containing its cache key.
+ * @param depth[in] int containing its depth, or FRAMENODEPTH.
+ * @return 0 if it was packed, -1 if not.
+ */
+int storepack(char *cachefile, char *md5hash, int depth);
+
+/**
+ * --compact: reclaims the dead space in the packs with packcompact().
+ *
+ * @return Number of images copied, or -1 if there are no packs or compacting failed.
+ */
+int compactcache(void);
+
+/**
+ * Milliseconds on a clock that only goes forward, for timing renders.
+ *
+ * @return Milliseconds since some arbitrary start.
+ */
+long msclock(void);
+
+/**
+ * Makes the shard subdirectories a cache file goes in (see makepath()), as far down as cacheshards levels above it.
+ *
+ * @param cachefile[in] Null-terminated char* containing the file's path, from makepath(NULL, ...).
+ * @return 0 if they're there, -1 if one couldn't be made.
+ */
+int mkshards(char *cachefile);
+
+/**
+ * Calls visit for every file in a cache directory, including those in shard subdirectories at any depth (so a cache written with another cacheshards
+ * is walked, too). Names starting with . are skipped.
+ *
+ * @param dir[in] Null-terminated char* containing the cache directory, or a shard subdirectory of it.
+ * @param visit[in] function called with the file's path, its name, and data, returning 1 to count the file.
+ * @param data[in] void* passed on to visit.
+ * @return Number of files visit counted, or -1 if dir can't be read.
+ */
+int walkcache(char *dir, int (*visit)(char *file, char *name, void *data), void *data);
+
+/**
+ * walkcache() visit for --migrate: renames a hash-named file to where makepath() now puts it, if it's one of this worker's.
+ *
+ * @param file[in] Null-terminated char* containing the file's path.
+ * @param name[in] Null-terminated char* containing its name.
+ * @param data[in] void* pointing to two ints, the number of workers and this worker's index; each takes the files whose first byte is its index
+ * modulo the number of workers.
+ * @return 1 if it was moved, 0 if not.
+ */
+int migratefile(char *file, char *name, void *data);
+
+/**
+ * Moves every hash-named file in the cache to where makepath() puts it with the current cacheshards, with nworkers processes in parallel, then removes
+ * shard subdirectories left empty.
+ *
+ * @param nworkers[in] int containing the number of processes to use.
+ * @return Number of files moved, or -1 if there's no cache directory.
+ */
+int migratecache(int nworkers);
+
+/**
+ * Removes a cache directory's empty shard subdirectories, deepest first.
+ *
+ * @param dir[in] Null-terminated char* containing the cache directory, or a shard subdirectory of it.
+ * @return 1 if dir was left empty, 0 if not.
+ */
+int pruneshards(char *dir);
+
+/**
+ * Opens a render context for the calling thread, starting from its current one (the command line's settings, at first), and makes it current. Every
+ * render runs in a context of its own, so threads can render side by side.
+ *
+ * @return The new context, or `NULL` if it can't be allocated.
+ */
+struct render_struct *renderopen(void);
+
+/**
+ * Frees a context from renderopen(), and its error messages, making the one it was opened from current again.
+ *
+ * @param context[in] struct render_struct* to close; may be `NULL`.
+ */
+void renderclose(struct render_struct *context);
+
+/**
+ * mathtex_render(), with a cancel fd for the render context, so mathtex_submit() jobs can be given up on.
+ *
+ * @param cancelfd[in] int containing an fd that's readable once the render's cancelled (see iscancelled()), or -1.
+ * @return As mathtex_render(), with meta's message "Cancelled." if it failed because it was.
+ */
+int librender(struct mathtexlib_struct *lib, int cancelfd, char *expression, struct mathtexopts_struct *opts, unsigned char **image, int *nbytes,
+              struct mathtexmeta_struct *meta);
+
+/**
+ * Renders a mathtex_submit() job with librender(), then hands it to mathtex_complete() (signalling its done fd), or frees it if it was cancelled.
+ *
+ * @param job[in,out] struct mathtexjob_struct* to render.
+ * @return `NULL`.
+ */
+void *submitthread(void *job);
+
+/**
+ * Frees a job, closing its fds, but not its image.
+ *
+ * @param job[in] struct mathtexjob_struct* to free.
+ */
+void freejob(struct mathtexjob_struct *job);
+
+/**
+ * Opens a non-blocking, close-on-exec event: an eventfd on linux (both ends the same fd), otherwise a pipe.
+ *
+ * @param fds[out] int[2] receiving the fd to poll, then the fd to write to signal it.
+ * @return 0 if opened, -1 if not.
+ */
+int openevent(int *fds);
+void closeevent(int *fds);
+
+/**
+ * Whether the current render has been cancelled, i.e. its cancelfd is readable. spawnstart() won't start programs for it, spawnwait() kills the one
+ * it's waiting on, and lockrender() stops waiting.
+ *
+ * @return 1 if so, 0 if not (or it can't be).
+ */
+int iscancelled(void);
+
+/**
+ * Interprets any \\directives in expression, validates it and wraps it up for latex, leaving the result in the global render state (mathmode, density,
+ * packages, etc). Split out of main() so --serve can run it once per request.
+ *
+ * @param expression[in,out] Null-terminated char* containing the raw input expression, replaced by the expression to be rendered.
+ * @return 1 if there's something left to render, 0 if not (or if it was a \\message, etc).
+ */
+int preprocess(char *expression);
+
+/**
+ * Finds the image for a preprocessed expression in the cache, rendering it with mathtex() first if it's not there yet.
+ *
+ * @param expression[in] Null-terminated char* containing the preprocessed expression.
+ * @param md5hash[in] Null-terminated char* containing its cachekey().
+ * @param ishit[out] int* set to 1 if the image came from the cache, 0 if it was rendered; may be `NULL`.
+ * @param depth[out] int* set to the depth below baseline in pixels if isdepth, or FRAMENODEPTH; may be `NULL`.
+ * @return Path to the image (in a static buffer, or outfile), or `NULL` with msgnumber set if it couldn't be rendered.
+ */
+char *cacheimage(char *expression, char *md5hash, int *ishit, int *depth);
+
+/**
+ * Cache key the master image for a preprocessed expression has: the same request at masterdpi.
+ *
+ * @param expression[in] Null-terminated char* containing the preprocessed expression.
+ * @return Null-terminated char* containing the key (in a static buffer), or `NULL` if this request isn't made from a master (see usemaster()).
+ */
+char *masterkey(char *expression);
+
+/**
+ * Whether the current request is made by shrinking a master image: a png, cached, at a density below masterdpi.
+ *
+ * @return 1 if so, 0 if it's rendered by itself.
+ */
+int usemaster(void);
+
+/**
+ * Makes the image for a preprocessed expression by shrinking its master, which cacheimage() renders first if it isn't cached yet.
+ *
+ * @param expression[in] Null-terminated char* containing the preprocessed expression.
+ * @param md5hash[in] Null-terminated char* containing its cachekey(), which names the image written to the cache.
+ * @param depth[out] int* set to the master's depth below baseline scaled to the current density, or FRAMENODEPTH.
+ * @return 0 if the image was written, -1 if not (with msgnumber set if the master couldn't be rendered, or 0 to render it by itself instead).
+ */
+int shrinkmaster(char *expression, char *md5hash, int *depth);
+
+/**
+ * Converts the depth latex reported in latex.info from points to pixels at the current density.
+ *
+ * @return Depth below baseline in pixels, or FRAMENODEPTH if it's not available.
+ */
+int imagedepth(void);
+
+/**
+ * Reads an image's size from its png or gif header.
+ *
+ * @param image[in] unsigned char* containing the image.
+ * @param nbytes[in] int containing its size.
+ * @param width[out] int* receiving its width in pixels, or 0.
+ * @param height[out] int* receiving its height in pixels, or 0.
+ * @return 0 if found, -1 if it's neither (e.g. svg).
+ */
+int imagesize(unsigned char *image, int nbytes, int *width, int *height);
+
+/**
+ * Writes (or reads) exactly nbytes, retrying short transfers and EINTR.
+ *
+ * @param fd[in] int containing the file descriptor.
+ * @param buffer[in,out] void* containing the bytes to write, or receiving the bytes read.
+ * @param nbytes[in] int containing #bytes to transfer.
+ * @return #bytes transferred (fewer than nbytes only for readfd() at eof), or -1 for any error.
+ */
+int writefd(int fd, void *buffer, int nbytes);
+int readfd(int fd, void *buffer, int nbytes);
+
+/**
+ * Sends nbytes from offset in file fromfd to tofd, leaving fromfd's own position alone. Uses sendfile() where the kernel can copy it directly (Linux,
+ * to a pipe, socket or file), otherwise pread()/write() through a 64KB buffer, retrying short writes.
+ *
+ * @param tofd[in] int containing the destination, e.g. stdout or a client socket.
+ * @param fromfd[in] int containing the open file (or pack).
+ * @param offset[in] long containing where to start in it, from openimage().
+ * @param nbytes[in] int containing #bytes to send, usually the image's size.
+ * @return #bytes sent (fewer than nbytes if the file shrank), or -1 for any error.
+ */
+int sendfd(int tofd, int fromfd, long offset, int nbytes);
+
+/**
+ * Writes one --serve response frame to fd. An imagefile that can't be opened (evicted since it was rendered, say) is sent as a
+ * FRAMEERROR frame instead, so the frames that follow it still go out.
+ *
+ * @param fd[in] int containing the client socket.
+ * @param status[in] int containing FRAMEMISS, FRAMEHIT or FRAMEERROR.
+ * @param key[in] Null-terminated char* containing the cache key, or `NULL` if there isn't one.
+ * @param depth[in] int containing the depth in pixels, or FRAMENODEPTH.
+ * @param imagefile[in] Null-terminated char* containing the image to send as payload (a file, or an imagepath() in a pack), or `NULL`.
+ * @param message[in] Null-terminated char* containing the error message to send as payload if imagefile is `NULL`.
+ * @return #bytes written, or -1 for any error.
+ */
+int emitframe(int fd, int status, char *key, int depth, char *imagefile, char *message);
+
+/**
+ * Handles one --serve or --batch request: preprocess(), cachekey() and cacheimage(), then emitframe() with the result. Runs in a render context of its
+ * own, from renderopen(), so the render state it changes never leaks into the next request.
+ *
+ * @param fd[in] int containing the client socket.
+ * @param expression[in,out] Null-terminated char* containing the request expression.
+ * @return #bytes written, or -1 for any error.
+ */
+int serverequest(int fd, char *expression);
+
+/**
+ * Listens on a unix domain socket and renders requests until SIGTERM or SIGINT. Paths and the cache directory are set up once, each connection gets a
+ * forked child, and each request on a connection is handled in turn by serverequest(), in that child.
+ *
+ * @param sockpath[in] Null-terminated char* containing path of the socket to create.
+ * @return 0 on a clean shutdown, 1 if the socket couldn't be set up.
+ */
+int serve(char *sockpath);
+void sigserve(int sig);
+
+/**
+ * Starts the --pool workers for serve(): nworkers latex processes, each reading a fifo as its input file, that have already loaded the preamble of a request
+ * with no directives (from its format, with --fmt). Requests with other preambles run latex as usual.
+ *
+ * @param nworkers[in] int containing #workers wanted, at most MAXPOOL.
+ * @return #workers in the pool, 0 if it can't be used.
+ */
+int startpool(int nworkers);
+
+/**
+ * Starts the latex worker for one pool slot in a new directory, and marks it POOLIDLE.
+ *
+ * @param iworker[in] int containing the slot.
+ * @return 0 if started, or -1 for any error.
+ */
+int startworker(int iworker);
+
+/**
+ * Replaces workers that have been used (POOLDONE) or have exited while idle (POOLDEAD). Called by serve() between connections, so replacements start in
+ * the background of requests being rendered. Disables the pool if workers keep exiting before they get a request.
+ *
+ * @return #workers started.
+ */
+int fillpool(void);
+
+/**
+ * Kills the pool's workers, and removes their directories.
+ */
+void stoppool(void);
+
+/**
+ * What latex's error prompts are answered with, for render->isquiet: nothing (so latex stops at the first error), that many <Enter>'s and then x, or q.
+ *
+ * @return Null-terminated char* containing the replies, in a buffer of the calling thread's that the next call overwrites.
+ */
+char *latexreply(void);
+
+/**
+ * Has an idle pool worker run latex on document, in place of mathtex() running it. Feeds its terminal latexreply(), streams it everything from
+ * \begin{document} on, waits (no longer than killtime, and not once the render's cancelled) for it to finish, and moves its latex.dvi and latex.log to
+ * the render's work dir.
+ *
+ * @param document[in] Null-terminated char* containing the filled-in latex document.
+ * @return latex's exit status, or -1 if document's preamble isn't the pool's, no worker is idle, or the worker failed.
+ */
+int poollatex(char *document);
+
+/**
+ * Finds the batchseen[] slot for a cache key: either the entry recorded when it was emitted earlier in this --batch, or the empty slot to record it in.
+ *
+ * @param key[in] Null-terminated char* containing the 32-character cache key.
+ * @return Pointer to the slot, or `NULL` if not running a --batch or the table is full.
+ */
+struct batchseen_struct *batchlookup(char *key);
+
+/**
+ * Decodes the json string literal starting at json, including any \\uXXXX escapes (written as utf-8).
+ *
+ * @param json[in] Null-terminated char* pointing at the opening quote.
+ * @param string[out] char* receiving the decoded string.
+ * @param maxlen[in] int containing max #chars string can hold.
+ * @return Pointer just past the closing quote, or `NULL` if it's malformed or too long.
+ */
+char *jsonstring(char *json, char *string, int maxlen);
+
+/**
+ * Reads the next --batch request from fp, skipping blank lines.
+ *
+ * @param fp[in] FILE* containing the requests.
+ * @param expression[out] char* (at least MAXEXPRSZ+1 bytes) receiving the request's expression.
+ * @param isnul[in] int containing 1 if requests are nul-separated expressions, or 0 for newline-delimited json.
+ * @return 1 if a request was read, 0 at eof, or -1 if the request was malformed (and has been skipped).
+ */
+int readbatch(FILE *fp, char *expression, int isnul);
+
+/**
+ * Renders every request read from fp, writing a --serve style frame for each one to stdout in the same order. Keys repeated within the batch are only
+ * rendered the first time, and requests sharing a preamble are rendered BATCHGROUPSZ at a time as pages of one latex run.
+ *
+ * @param fp[in] FILE* containing the requests; closed unless it's stdin.
+ * @param isnul[in] int containing 1 if requests are nul-separated expressions, or 0 for newline-delimited json.
+ * @return 0 if every request was read and answered (possibly with an error frame), 1 otherwise.
+ */
+int batch(FILE *fp, int isnul);
+
+/**
+ * Works out how a --batch request should be rendered, in the current render context. Cached requests are looked up right away; the rest are left for
+ * batch() as BATCHSINGLE, or as BATCHGROUP with the npreamble bytes of latex preamble and nbody bytes of document body they'd put on their page.
+ *
+ * @param expression[in,out] Null-terminated char* containing the request expression.
+ * @param isrender[in] int containing 1 to render it by itself now instead of planning.
+ * @param plan[out] struct batchplan_struct* receiving the plan.
+ * @param text[out] char** receiving a malloc()'ed "preamble\0body\0" for BATCHGROUP plans; may be `NULL` otherwise.
+ * @return 0 if successful, -1 for any error.
+ */
+int planrequest(char *expression, int isrender, struct batchplan_struct *plan, char **text);
+
+/**
+ * Runs planrequest() on a copy of expression, in a render context of its own.
+ *
+ * @param expression[in] Null-terminated char* containing the request expression.
+ * @param isrender[in] int passed on to planrequest().
+ * @param plan[out] struct batchplan_struct* receiving the plan; set to FRAMEERROR if planning fails.
+ * @param text[out] char** receiving a malloc()'ed "preamble\0body\0" for BATCHGROUP plans; may be `NULL` otherwise.
+ * @return 0 if successful, -1 if planning failed.
+ */
+int runplan(char *expression, int isrender, struct batchplan_struct *plan, char **text);
+
+/**
+ * Renders BATCHGROUP requests sharing a preamble as the pages of one latex.tex, with one dvipng run writing a page per request into the cache. If
+ * anything fails, the group is bisected until the failing request is rendered by itself, so it gets its own error frame and the rest still share runs.
+ *
+ * @param members[in] int* containing the plans[] indexes in the group.
+ * @param nmembers[in] int containing #members.
+ * @param expressions[in] char** containing the raw request expressions.
+ * @param plans[in,out] struct batchplan_struct* updated to FRAMEMISS, or the result of rendering it alone.
+ * @param texts[in] char** containing each plan's preamble and body.
+ * @return #latex runs that rendered more than one page.
+ */
+int rendergroup(int *members, int nmembers, char **expressions, struct batchplan_struct *plans, char **texts);
+
+/**
+ * Runs a round of --batch jobs on up to batchthreads threads (the caller's among them), each claiming the next unclaimed job until there are none.
+ *
+ * @param jobs[in,out] struct batchjobs_struct* containing the jobs, and run() to do each one with.
+ * @return #threads that ran them.
+ */
+int runjobs(struct batchjobs_struct *jobs);
+
+/**
+ * A runjobs() thread.
+ *
+ * @param jobs[in,out] void* containing the struct batchjobs_struct*.
+ * @return `NULL`.
+ */
+void *jobthread(void *jobs);
+
+/**
+ * Plans one request in a --batch window with runplan().
+ *
+ * @param jobs[in,out] struct batchjobs_struct* containing the window.
+ * @param ijob[in] int containing the job, whose jobs[] entry is the request's plans[] index.
+ * @return 0 if planned, -1 if not (and nfailed is counted up).
+ */
+int planjob(struct batchjobs_struct *jobs, int ijob);
+
+/**
+ * Renders one group (with rendergroup()) or single request (with runplan()) in a --batch window.
+ *
+ * @param jobs[in,out] struct batchjobs_struct* containing the window.
+ * @param ijob[in] int containing the job: below ngroups, its jobs[] entry is where the group starts in members[]; otherwise the request's plans[] index.
+ * @return 0.
+ */
+int renderjob(struct batchjobs_struct *jobs, int ijob);
+
+/**
+ * Moves the working directory for temp files (latex.tex, latex.dvi, logs, etc) to a private mathtex-<uid>/ directory under dir, usually a tmpfs like
+ * /dev/shm, independent of the cache. Leaves workpath alone if dir doesn't exist or isn't writable.
+ *
+ * @param dir[in] Null-terminated char* containing the directory, or `NULL` for WORKSHM.
+ * @return 1 if workpath was moved, 0 if not.
+ */
+int setworkpath(char *dir);
+
 /**
  * Tries to set accurate paths for latex, pdflatex, timelimit, dvipng, dvips, and convert.
  * @todo What the fuck does this function do???
@@ -804,7 +1824,8 @@ int validate(char *expression);
 /**
  * Returns a string containing `path/name.extension`
  *
- * @param path[in] Null-terminated char* containing empty string, path, or `NULL` to use cachepath if caching enabled.
+ * @param path[in] Null-terminated char* containing empty string, path, or `NULL` to use cachepath if caching enabled (a name starting with 32 hex
+ * digits then goes in its cacheshards subdirectories, which mkshards() makes).
  * @param name[in] Null-terminated char* containing filename without extension.
  * @param extension[in] Null-terminated char* containing extension or `NULL`.
  * @return A string containing `path/name.extension`, or `NULL` if an error occured.
@@ -877,6 +1898,63 @@ int rrmdir(char *path);
  */
 int readcachefile(char *cachefile, unsigned char *buffer);
 
+/**
+ * Emits the contents of a (cached) image file to stdout, with sendfd().
+ *
+ * @param cachefile[in] Null-terminated char* containing full path to file to be emitted, or an imagepath() in a pack.
+ * @return Number of bytes emitted, -1 if an error occured.
+ */
+int emitcache(char *cachefile);
+
+/**
+ * Runs dvipng with its image going to a pipe rather than giffile, and passes the image on to streamfd (stdout, for -s) as it arrives. If iskeep, it's also
+ * written to a temp file that's renamed to giffile once the caller has the whole image. Sets isstreamed if any image was sent.
+ *
+ * @param argv[in,out] char** containing dvipng's argv, with giffile as its -o arg (replaced by /dev/fd/3).
+ * @param giffile[in] Null-terminated char* containing the image's path in the cache, or the explicit output file.
+ * @param iskeep[in] int containing true to keep the image in giffile, false if the caller's copy is the only one wanted.
+ * @return dvipng's exit status, as spawn().
+ */
+int streamimage(char **argv, char *giffile, int iskeep);
+
+/**
+ * Renders latex.dvi to giffile with dvirender() rather than dvipng, a page per file for a --batch group (giffile containing %d). If streamfd is set
+ * (and there's one page), the image is also sent there, and isstreamed set.
+ *
+ * @param dvifile[in] Null-terminated char* containing the dvi file.
+ * @param giffile[in] Null-terminated char* containing the image's path, as dvipng's -o arg.
+ * @param npages[in] int containing the number of pages in dvifile.
+ * @param iskeep[in] int containing true to keep the image in giffile, false if the streamfd copy is the only one wanted.
+ * @return 0 if every page was rendered, -1 if any page is left to dvipng.
+ */
+int renderdvi(char *dvifile, char *giffile, int npages, int iskeep);
+
+/**
+ * Rewrites a png with pngoptimize() at pnglevel and pngeffort, through a temp file renamed over it.
+ *
+ * @param giffile[in] Null-terminated char* containing the png's path.
+ * @return 0 if it was rewritten, -1 if it was left alone (e.g. a png pngdecode() doesn't read).
+ */
+int optimizepng(char *giffile);
+
+/**
+ * Finds a pk font with kpsewhich, making it with mktexpk if need be. The dvifontlookup for dvirender().
+ *
+ * @param fontname[in] Null-terminated char* containing the tfm name, e.g. cmr10.
+ * @param dpi[in] int containing the resolution.
+ * @return Null-terminated char* containing the path to the pk file (in a static buffer), or `NULL` if there's none.
+ */
+char *findpk(char *fontname, int dpi);
+
+/**
+ * Copies a (cached) image file to another file, overwriting it if it already exists.
+ *
+ * @param cachefile[in] Null-terminated char* containing full path to file to be copied, or an imagepath() in a pack.
+ * @param filename[in] Null-terminated char* containing path to file to be written.
+ * @return Number of bytes copied, -1 if an error occured.
+ */
+int copycache(char *cachefile, char *filename);
+
 /**
  * 16-bit CRC of string s.
  *
@@ -929,6 +2007,40 @@ char x2c(char *what);
  */
 int timelimit(char *command, int killtime);
 
+/**
+ * Runs a program directly, without a shell, and waits for it, killing it if it's still running after killtime seconds. Takes the place of system() and
+ * timelimit() for latex, dvipng, dvips, ps2epsi and convert: one fork+exec per program rather than two, and no quoting of paths with blanks. It starts
+ * in the render's work dir, once mathtex() has made one, so relative file names are in there. A cancelled render's program is killed at once.
+ *
+ * @param argv[in] char** containing the program (looked up on PATH if it has no /) and its args, ending with `NULL`.
+ * @param infile[in] Null-terminated char* containing the file to open as stdin, or `NULL` to inherit ours.
+ * @param outfile[in] Null-terminated char* containing the file to create as stdout, or `NULL` to inherit ours.
+ * @param errfile[in] Null-terminated char* containing the file to create as stderr, or `NULL` to inherit ours.
+ * @param killtime[in] int containing maximum seconds to allow it to run, or 0 for no limit.
+ * @return Its exit status, 127 if it couldn't be run, or -1 if it was killed or for any other error.
+ */
+int spawn(char **argv, char *infile, char *outfile, char *errfile, int killtime);
+
+/**
+ * The two halves of spawn(), for callers that talk to the program while it runs.
+ *
+ * @param pipefd[in] int containing a descriptor to give the program as fd 3 (so it can write /dev/fd/3), or -1.
+ * @param pid[out] pid_t* receiving the program's pid, for spawnwait().
+ * @return spawnstart(): 0 if started, 127 if it couldn't be run, or -1 for any other error. spawnwait(): as spawn().
+ */
+int spawnstart(char **argv, char *infile, char *outfile, char *errfile, int pipefd, pid_t *pid);
+int spawnwait(pid_t pid, char *program, int killtime);
+
+/**
+ * Splits a template of args, e.g. dvipngargs, into argv for spawn(). Args are separated by blanks, and a "quoted part" of one may contain blanks.
+ *
+ * @param args[in,out] Null-terminated char* containing the args; split in place.
+ * @param argv[out] char** receiving pointers to the args, followed by `NULL`.
+ * @param maxargs[in] int containing #pointers argv has room for, including the `NULL`.
+ * @return #args.
+ */
+int splitargs(char *args, char **argv, int maxargs);
+
 /** Built-in limit functionality below. */
 #if ISCOMPILETIMELIMIT
 /** Signal handlers. */
@@ -0,0 +1,505 @@
+/*
+ * png reading and writing for mathTeX: decodes the pngs dvipng and convert
+ * write, and re-encodes them (and dvirender()'s) as small as their pixels
+ * allow, with nothing but IHDR, PLTE, tRNS, IDAT and IEND. Also shrinks
+ * decoded images, for lower densities made from a master rendering.
+ *
+ * The png format is as described in the W3C Portable Network Graphics
+ * specification.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "pngopt.h"
+
+/* ---
+ * a color type and bit depth to write the pixels as
+ * ------------------------------------------------- */
+struct pnglayout_struct {
+    int colortype;            /* 0 grey, 2 rgb, 3 palette, 4 grey+alpha, 6 rgba */
+    int depth;                /* bits per sample */
+    int channels;             /* samples per pixel */
+    unsigned long plte[256];  /* palette colors, as rgba, those with alpha first */
+    int nplte, ntrns;         /* #colors, and how many of them aren't opaque */
+};
+#define PNGHASHSZ 1024 /* palette lookup, for up to 256 colors */
+
+static unsigned long getlong(unsigned char *p) { return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static void putlong(unsigned char *p, unsigned long value) {
+    p[0] = value >> 24, p[1] = value >> 16, p[2] = value >> 8, p[3] = value;
+}
+static unsigned long getrgba(unsigned char *p) { return getlong(p); }
+
+/* --- one chunk at p, returning past it --- */
+static unsigned char *putchunk(unsigned char *p, char *type, unsigned char *data, int ndata) {
+    putlong(p, ndata);
+    memcpy(p + 4, type, 4);
+    if (ndata > 0 && data != p + 8) memmove(p + 8, data, ndata);
+    putlong(p + 8 + ndata, crc32(0L, p + 4, 4 + ndata));
+    return p + 12 + ndata;
+}
+
+/* --- predictor for filter type 4 --- */
+static int paeth(int a, int b, int c) {
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return (pa <= pb && pa <= pc ? a : (pb <= pc ? b : c));
+}
+
+/* -------------------------------------------------------------------------
+reading
+-------------------------------------------------------------------------- */
+unsigned char *pngdecode(unsigned char *png, int npng, int *width, int *height) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    unsigned char *p = png + 8, *end = png + npng; /* chunks */
+    unsigned char *idat = NULL, *raw = NULL, *rgba = NULL;
+    unsigned char plte[256 * 4];            /* palette, rgba */
+    long nidat = 0, nraw = 0, rowbytes = 0;
+    uLongf ninflated = 0;
+    int w = 0, h = 0, depth = 0, colortype = 0, channels = 0, bpp = 0;
+    int key[3] = {-1, -1, -1};              /* tRNS for grey or rgb */
+    int row = 0, x = 0, i = 0, isdecoded = 0;
+
+    if (npng < 8 + 25 || memcmp(png, "\211PNG\r\n\032\n", 8) != 0) return NULL;
+    for (i = 0; i < 256; i++) plte[4 * i] = plte[4 * i + 1] = plte[4 * i + 2] = 0, plte[4 * i + 3] = 255;
+
+    /* -------------------------------------------------------------------------
+    the chunks we need, ignoring the rest
+    -------------------------------------------------------------------------- */
+    while (p + 12 <= end) {
+        long length = getlong(p);
+        unsigned char *data = p + 8;
+        if (length < 0 || length > end - p - 12) goto end_of_job;
+        if (memcmp(p + 4, "IHDR", 4) == 0 && length >= 13) {
+            w = (int)getlong(data);
+            h = (int)getlong(data + 4);
+            depth = data[8];
+            colortype = data[9];
+            if (data[10] != 0 || data[11] != 0 || data[12] != 0) goto end_of_job; /* interlaced, or unknown methods */
+        } else if (memcmp(p + 4, "PLTE", 4) == 0) {
+            for (i = 0; i < length / 3 && i < 256; i++) memcpy(plte + 4 * i, data + 3 * i, 3);
+        } else if (memcmp(p + 4, "tRNS", 4) == 0) {
+            if (colortype == 3) {
+                for (i = 0; i < length && i < 256; i++) plte[4 * i + 3] = data[i];
+            } else if (colortype == 0 && length >= 2) {
+                key[0] = (data[0] << 8) | data[1];
+            } else if (colortype == 2 && length >= 6) {
+                for (i = 0; i < 3; i++) key[i] = (data[2 * i] << 8) | data[2 * i + 1];
+            }
+        } else if (memcmp(p + 4, "IDAT", 4) == 0) {
+            unsigned char *more = realloc(idat, nidat + length + 1);
+            if (more == NULL) goto end_of_job;
+            idat = more;
+            memcpy(idat + nidat, data, length);
+            nidat += length;
+        } else if (memcmp(p + 4, "IEND", 4) == 0) {
+            break;
+        }
+        p += 12 + length;
+    }
+    channels = (colortype == 0 || colortype == 3 ? 1 : (colortype == 4 ? 2 : (colortype == 2 ? 3 : (colortype == 6 ? 4 : 0))));
+    if (channels == 0 || depth > 8 || (depth & (depth - 1)) != 0 || (colortype != 0 && colortype != 3 && depth != 8)) goto end_of_job;
+    if (w < 1 || h < 1 || (double)w * h > PNGMAXPIXELS || idat == NULL) goto end_of_job;
+
+    /* -------------------------------------------------------------------------
+    inflate, and undo each row's filter
+    -------------------------------------------------------------------------- */
+    rowbytes = ((long)w * channels * depth + 7) / 8;
+    bpp = (channels * depth + 7) / 8;
+    nraw = (rowbytes + 1) * h;
+    if ((raw = malloc(nraw)) == NULL) goto end_of_job;
+    ninflated = nraw;
+    if (uncompress(raw, &ninflated, idat, nidat) != Z_OK || (long)ninflated != nraw) goto end_of_job;
+    for (row = 0; row < h; row++) {
+        unsigned char *line = raw + row * (rowbytes + 1), *prev = (row > 0 ? line - rowbytes - 1 : NULL);
+        int filter = *line++;
+        if (prev != NULL) prev++;
+        for (i = 0; i < rowbytes; i++) {
+            int a = (i >= bpp ? line[i - bpp] : 0), b = (prev != NULL ? prev[i] : 0), c = (i >= bpp && prev != NULL ? prev[i - bpp] : 0);
+            if (filter == 1) line[i] += a;
+            else if (filter == 2) line[i] += b;
+            else if (filter == 3) line[i] += (a + b) / 2;
+            else if (filter == 4) line[i] += paeth(a, b, c);
+            else if (filter != 0) goto end_of_job;
+        }
+    }
+
+    /* -------------------------------------------------------------------------
+    expand to rgba
+    -------------------------------------------------------------------------- */
+    if ((rgba = malloc((size_t)w * h * 4)) == NULL) goto end_of_job;
+    for (row = 0; row < h; row++) {
+        unsigned char *line = raw + row * (rowbytes + 1) + 1;
+        for (x = 0; x < w; x++) {
+            unsigned char *out = rgba + ((size_t)row * w + x) * 4;
+            int sample = 0;
+            if (depth < 8) sample = (line[x * depth / 8] >> (8 - depth - (x * depth) % 8)) & ((1 << depth) - 1);
+            else sample = line[x * channels];
+            if (colortype == 3) {
+                memcpy(out, plte + 4 * sample, 4);
+            } else if (colortype == 0 || colortype == 4) {
+                out[0] = out[1] = out[2] = (unsigned char)(sample * 255 / ((1 << depth) - 1));
+                out[3] = (colortype == 4 ? line[2 * x + 1] : (sample == key[0] ? 0 : 255));
+            } else {
+                memcpy(out, line + x * channels, 3);
+                out[3] = (colortype == 6 ? line[4 * x + 3] : (out[0] == key[0] && out[1] == key[1] && out[2] == key[2] ? 0 : 255));
+            }
+        }
+    }
+    *width = w;
+    *height = h;
+    isdecoded = 1;
+
+end_of_job:
+    free(idat);
+    free(raw);
+    if (!isdecoded) { /* failed, perhaps after allocating rgba */
+        free(rgba);
+        rgba = NULL;
+    }
+    return rgba;
+}
+
+/* -------------------------------------------------------------------------
+writing
+-------------------------------------------------------------------------- */
+/* --- pixels as layout's samples, a row after another, without filter bytes --- */
+static unsigned char *packrows(unsigned char *rgba, int width, int height, struct pnglayout_struct *layout, long *rowbytes) {
+    unsigned long hashcolors[PNGHASHSZ];                /* palette lookup */
+    unsigned char hashindex[PNGHASHSZ], hashused[PNGHASHSZ];
+    unsigned char *rows = NULL;
+    long row = 0, x = 0;
+    int i = 0;
+
+    *rowbytes = ((long)width * layout->channels * layout->depth + 7) / 8;
+    if ((rows = calloc((size_t)*rowbytes * height, 1)) == NULL) return NULL;
+    if (layout->colortype == 3) {
+        memset(hashused, 0, sizeof(hashused));
+        for (i = 0; i < layout->nplte; i++) {
+            unsigned long h = (layout->plte[i] * 2654435761UL >> 7) % PNGHASHSZ;
+            while (hashused[h]) h = (h + 1) % PNGHASHSZ;
+            hashused[h] = 1, hashcolors[h] = layout->plte[i], hashindex[h] = i;
+        }
+    }
+    for (row = 0; row < height; row++) {
+        unsigned char *line = rows + row * *rowbytes;
+        for (x = 0; x < width; x++) {
+            unsigned char *in = rgba + ((size_t)row * width + x) * 4;
+            if (layout->colortype == 3) {
+                unsigned long color = getrgba(in), h = (color * 2654435761UL >> 7) % PNGHASHSZ;
+                while (hashcolors[h] != color) h = (h + 1) % PNGHASHSZ;
+                line[x * layout->depth / 8] |= hashindex[h] << (8 - layout->depth - (x * layout->depth) % 8);
+            } else if (layout->colortype == 0 || layout->colortype == 4) {
+                line[x * layout->channels] = in[0];
+                if (layout->colortype == 4) line[2 * x + 1] = in[3];
+            } else {
+                memcpy(line + x * layout->channels, in, layout->channels);
+            }
+        }
+    }
+    return rows;
+}
+
+/* --- filter every row with filter (0-4), or each with whichever looks smallest (-1), into out --- */
+static int filterrows(unsigned char *rows, long rowbytes, int height, int bpp, int filter, unsigned char *out) {
+    unsigned char *trial = NULL; /* a row, filtered with the type being tried */
+    long row = 0, i = 0;
+    int type = 0;
+    if ((trial = malloc(rowbytes)) == NULL) return -1;
+    for (row = 0; row < height; row++) {
+        unsigned char *line = rows + row * rowbytes, *prev = (row > 0 ? line - rowbytes : NULL);
+        unsigned char *dest = out + row * (rowbytes + 1);
+        long bestsum = -1;
+        for (type = (filter < 0 ? 0 : filter); type <= (filter < 0 ? 4 : filter); type++) {
+            long sum = 0;
+            for (i = 0; i < rowbytes; i++) {
+                int a = (i >= bpp ? line[i - bpp] : 0), b = (prev != NULL ? prev[i] : 0), c = (i >= bpp && prev != NULL ? prev[i - bpp] : 0);
+                unsigned char value = line[i];
+                if (type == 1) value -= a;
+                else if (type == 2) value -= b;
+                else if (type == 3) value -= (a + b) / 2;
+                else if (type == 4) value -= paeth(a, b, c);
+                trial[i] = value;
+                sum += (value < 128 ? value : 256 - value); /* smallest sum of |signed bytes| tends to deflate best */
+            }
+            if (bestsum < 0 || sum < bestsum) {
+                bestsum = sum;
+                dest[0] = type;
+                memcpy(dest + 1, trial, rowbytes);
+            }
+        }
+    }
+    free(trial);
+    return 0;
+}
+
+/* --- deflate with the given settings, returning the size, or -1 --- */
+static long deflaterows(unsigned char *raw, long nraw, int level, int memlevel, int strategy, unsigned char *out, long nout) {
+    z_stream stream;
+    long ndeflated = -1;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15, memlevel, strategy) != Z_OK) return -1;
+    stream.next_in = raw;
+    stream.avail_in = nraw;
+    stream.next_out = out;
+    stream.avail_out = nout;
+    if (deflate(&stream, Z_FINISH) == Z_STREAM_END) ndeflated = stream.total_out;
+    deflateEnd(&stream);
+    return ndeflated;
+}
+
+unsigned char *pngencode(unsigned char *rgba, int width, int height, int level, int effort, int *nbytes) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    struct pnglayout_struct layouts[2], *layout = NULL; /* palette (if it fits), and grey or rgb */
+    unsigned long hashcolors[PNGHASHSZ];                /* distinct colors seen */
+    unsigned char hashused[PNGHASHSZ];
+    unsigned long opaque[256];                          /* palette colors without alpha, till they're appended */
+    int nopaque = 0, ncolors = 0, nlayouts = 0, ilayout = 0, bestlayout = -1;
+    int isgrey = 1, isopaque = 1;                       /* what the pixels need */
+    static int filters[] = {-1, 0, 1, 2, 3, 4};         /* -1 picks per row */
+    static int strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE};
+    int ifilter = 0, nfilters = 0, istrategy = 0, nstrategies = 0;
+    unsigned char *rows = NULL, *filtered = NULL;       /* samples, and with filter bytes */
+    unsigned char *idat = NULL, *best = NULL, *png = NULL, *p = NULL;
+    long rowbytes = 0, nidat = 0, nbest = -1, bound = 0;
+    long overhead = 0, bestsize = 0;                    /* PLTE and tRNS chunks, and them with IDAT */
+    unsigned char header[13], trns[256], plte[3 * 256];
+    long i = 0, npixels = (long)width * height;
+
+    *nbytes = 0;
+    if (width < 1 || height < 1 || (double)width * height > PNGMAXPIXELS) return NULL;
+    if (level < 1 || level > 9) level = PNGDEFAULTLEVEL;
+
+    /* -------------------------------------------------------------------------
+    what the pixels need: alpha? color? how many colors?
+    -------------------------------------------------------------------------- */
+    memset(layouts, 0, sizeof(layouts));
+    memset(hashused, 0, sizeof(hashused));
+    for (i = 0; i < npixels; i++) {
+        unsigned char *pixel = rgba + 4 * i;
+        unsigned long color = 0, h = 0;
+        if (pixel[3] == 0) memset(pixel, 0, 3); /* invisible anyway, and then they all match */
+        if (pixel[3] != 255) isopaque = 0;
+        if (pixel[0] != pixel[1] || pixel[1] != pixel[2]) isgrey = 0;
+        if (ncolors > 256) continue;
+        color = getrgba(pixel);
+        h = (color * 2654435761UL >> 7) % PNGHASHSZ;
+        while (hashused[h] && hashcolors[h] != color) h = (h + 1) % PNGHASHSZ;
+        if (hashused[h]) continue;
+        if (++ncolors > 256) continue;
+        hashused[h] = 1;
+        hashcolors[h] = color;
+        if ((color & 0xff) == 0xff) {
+            opaque[nopaque++] = color;
+        } else {
+            layouts[0].plte[layouts[0].ntrns++] = color; /* tRNS need only cover these */
+        }
+    }
+    if (ncolors <= 256) { /* a palette */
+        layout = layouts + nlayouts++;
+        layout->colortype = 3;
+        layout->channels = 1;
+        layout->nplte = layout->ntrns + nopaque;
+        memcpy(layout->plte + layout->ntrns, opaque, nopaque * sizeof(*opaque));
+        layout->depth = (ncolors <= 2 ? 1 : (ncolors <= 4 ? 2 : (ncolors <= 16 ? 4 : 8)));
+    } else {
+        layouts[0].ntrns = 0;
+    }
+    layout = layouts + nlayouts++; /* grey, grey+alpha, rgb or rgba */
+    layout->colortype = (isgrey ? 0 : 2) + (isopaque ? 0 : 4);
+    layout->channels = (isgrey ? 1 : 3) + (isopaque ? 0 : 1);
+    layout->depth = 8;
+
+    /* -------------------------------------------------------------------------
+    filter and deflate each, and keep the smallest
+    -------------------------------------------------------------------------- */
+    if ((best = malloc(compressBound((4 * (long)width + 1) * height))) == NULL) goto end_of_job; /* room for the largest, rgba */
+    for (ilayout = 0; ilayout < nlayouts; ilayout++) {
+        layout = layouts + ilayout;
+        free(rows);
+        free(filtered);
+        free(idat);
+        filtered = idat = NULL;
+        if ((rows = packrows(rgba, width, height, layout, &rowbytes)) == NULL) goto end_of_job;
+        bound = compressBound((rowbytes + 1) * height);
+        if ((filtered = malloc((rowbytes + 1) * height)) == NULL || (idat = malloc(bound)) == NULL) goto end_of_job;
+        overhead = (layout->nplte > 0 ? 12 + 3 * layout->nplte : 0) + (layout->ntrns > 0 ? 12 + layout->ntrns : 0);
+        if (effort > 0) { /* every filter choice, deflated every way */
+            ifilter = 0, nfilters = 6, nstrategies = 3;
+        } else { /* no filter for palettes and sub-byte samples, otherwise that or per-row filters */
+            ifilter = (layout->colortype == 3 || layout->depth < 8 ? 1 : 0), nfilters = 2, nstrategies = 1;
+        }
+        for (; ifilter < nfilters; ifilter++) {
+            if (filterrows(rows, rowbytes, height, (layout->channels * layout->depth + 7) / 8, filters[ifilter], filtered) != 0) goto end_of_job;
+            for (istrategy = 0; istrategy < nstrategies; istrategy++) {
+                nidat = deflaterows(filtered, (rowbytes + 1) * height, (effort > 0 ? 9 : level), (effort > 0 ? 9 : 8), strategies[istrategy], idat, bound);
+                if (nidat < 0 || (nbest >= 0 && overhead + nidat >= bestsize)) continue;
+                memcpy(best, idat, nidat);
+                nbest = nidat;
+                bestsize = overhead + nidat;
+                bestlayout = ilayout;
+            }
+        }
+    }
+    if (bestlayout < 0) goto end_of_job;
+
+    /* -------------------------------------------------------------------------
+    IHDR, PLTE and tRNS if it's a palette, IDAT, IEND
+    -------------------------------------------------------------------------- */
+    layout = layouts + bestlayout;
+    if ((png = malloc(8 + 25 + (12 + 3 * 256) + (12 + 256) + 12 + nbest + 12)) == NULL) goto end_of_job;
+    memcpy(png, "\211PNG\r\n\032\n", 8);
+    putlong(header, width);
+    putlong(header + 4, height);
+    header[8] = layout->depth;
+    header[9] = layout->colortype;
+    header[10] = header[11] = header[12] = 0; /* deflate, adaptive filtering, no interlace */
+    p = putchunk(png + 8, "IHDR", header, 13);
+    if (layout->colortype == 3) {
+        for (i = 0; i < layout->nplte; i++) {
+            plte[3 * i] = layout->plte[i] >> 24, plte[3 * i + 1] = layout->plte[i] >> 16, plte[3 * i + 2] = layout->plte[i] >> 8;
+            if (i < layout->ntrns) trns[i] = layout->plte[i] & 0xff;
+        }
+        p = putchunk(p, "PLTE", plte, 3 * layout->nplte);
+        if (layout->ntrns > 0) p = putchunk(p, "tRNS", trns, layout->ntrns);
+    }
+    p = putchunk(p, "IDAT", best, (int)nbest);
+    p = putchunk(p, "IEND", NULL, 0);
+    *nbytes = p - png;
+
+end_of_job:
+    free(rows);
+    free(filtered);
+    free(idat);
+    free(best);
+    return png;
+}
+
+unsigned char *pngoptimize(unsigned char *png, int npng, int level, int effort, int *nbytes) {
+    unsigned char *rgba = NULL, *optimized = NULL; /* decoded, and re-encoded */
+    int width = 0, height = 0;
+    *nbytes = 0;
+    if ((rgba = pngdecode(png, npng, &width, &height)) == NULL) return NULL;
+    optimized = pngencode(rgba, width, height, level, effort, nbytes);
+    free(rgba);
+    return optimized;
+}
+
+/* -------------------------------------------------------------------------
+resampling
+-------------------------------------------------------------------------- */
+/* --- for each of nout pixels, the first of the nin pixels under it, how many, and what fraction of it each covers --- */
+static void areaweights(int nin, int nout, double scale, int maxtaps, int *first, int *count, float *weights) {
+    int out = 0, in = 0, k = 0;
+    for (out = 0; out < nout; out++) {
+        double lo = out / scale, hi = (out + 1) / scale, total = 0.;
+        if (hi > nin) hi = nin;
+        first[out] = (int)lo;
+        for (in = first[out], k = 0; in < hi && k < maxtaps; in++, k++) {
+            double left = (in < lo ? lo : in), right = (in + 1 > hi ? hi : in + 1);
+            weights[out * maxtaps + k] = (float)(right - left);
+            total += right - left;
+        }
+        count[out] = k;
+        while (k-- > 0 && total > 0.) weights[out * maxtaps + k] /= (float)total; /* a part pixel at the edge averages what's there */
+    }
+}
+
+unsigned char *pngshrink(unsigned char *rgba, int width, int height, double scale, int *newwidth, int *newheight) {
+    /* -------------------------------------------------------------------------
+    Allocations and Declarations
+    -------------------------------------------------------------------------- */
+    unsigned char *shrunk = NULL, *out = NULL;     /* result, and its next pixel */
+    float *xweights = NULL, *yweights = NULL;       /* areaweights() for each axis */
+    int *xfirst = NULL, *xcount = NULL, *yfirst = NULL, *ycount = NULL;
+    float *rows = NULL, *line = NULL;               /* rows shrunk across, and a row shrunk down */
+    int nwidth = 0, nheight = 0, maxtaps = 0;
+    int x = 0, y = 0, k = 0, j = 0;
+
+    *newwidth = *newheight = 0;
+    if (scale <= 0. || scale > 1. || width < 1 || height < 1 || (long)width * height > PNGMAXPIXELS) return NULL;
+    nwidth = (int)(width * scale);
+    if (width * scale - nwidth > 1e-6) nwidth++; /* part pixels at the right and bottom edges */
+    nheight = (int)(height * scale);
+    if (height * scale - nheight > 1e-6) nheight++;
+    if (nwidth < 1) nwidth = 1;
+    if (nheight < 1) nheight = 1;
+    maxtaps = (int)(1. / scale) + 2;
+    xweights = malloc((size_t)nwidth * maxtaps * sizeof(float));
+    yweights = malloc((size_t)nheight * maxtaps * sizeof(float));
+    xfirst = malloc(nwidth * sizeof(int)), xcount = malloc(nwidth * sizeof(int));
+    yfirst = malloc(nheight * sizeof(int)), ycount = malloc(nheight * sizeof(int));
+    rows = malloc((size_t)nwidth * height * 4 * sizeof(float));
+    line = malloc((size_t)nwidth * 4 * sizeof(float));
+    shrunk = malloc((size_t)nwidth * nheight * 4);
+    if (xweights == NULL || yweights == NULL || xfirst == NULL || xcount == NULL || yfirst == NULL || ycount == NULL || rows == NULL || line == NULL ||
+        shrunk == NULL) {
+        free(shrunk);
+        shrunk = NULL;
+        goto end_of_job;
+    }
+    areaweights(width, nwidth, scale, maxtaps, xfirst, xcount, xweights);
+    areaweights(height, nheight, scale, maxtaps, yfirst, ycount, yweights);
+
+    /* -------------------------------------------------------------------------
+    across each row, with color weighted by alpha so transparent pixels'
+    color (whatever it is) doesn't bleed into the edges of the ink
+    -------------------------------------------------------------------------- */
+    for (y = 0; y < height; y++) {
+        float *acc = rows + (size_t)y * nwidth * 4;
+        for (x = 0; x < nwidth; x++, acc += 4) {
+            unsigned char *in = rgba + ((size_t)y * width + xfirst[x]) * 4;
+            float *weight = xweights + x * maxtaps;
+            acc[0] = acc[1] = acc[2] = acc[3] = 0.f;
+            for (k = 0; k < xcount[x]; k++, in += 4) {
+                float wa = weight[k] * in[3];
+                acc[0] += wa * in[0];
+                acc[1] += wa * in[1];
+                acc[2] += wa * in[2];
+                acc[3] += wa;
+            }
+        }
+    }
+
+    /* -------------------------------------------------------------------------
+    then down each column, a whole row at a time, and back to straight alpha
+    -------------------------------------------------------------------------- */
+    for (y = 0, out = shrunk; y < nheight; y++) {
+        memset(line, 0, (size_t)nwidth * 4 * sizeof(float));
+        for (k = 0; k < ycount[y]; k++) {
+            float weight = yweights[y * maxtaps + k], *in = rows + (size_t)(yfirst[y] + k) * nwidth * 4;
+            for (j = 0; j < nwidth * 4; j++) line[j] += weight * in[j];
+        }
+        for (x = 0; x < nwidth; x++, out += 4) {
+            float *acc = line + x * 4;
+            int alpha = (int)(acc[3] + .5f);
+            if (alpha <= 0) {
+                out[0] = out[1] = out[2] = out[3] = 0;
+                continue;
+            }
+            for (j = 0; j < 3; j++) {
+                float value = acc[j] / acc[3] + .5f;
+                out[j] = (value >= 255.f ? 255 : (unsigned char)value);
+            }
+            out[3] = (alpha >= 255 ? 255 : alpha);
+        }
+    }
+    *newwidth = nwidth;
+    *newheight = nheight;
+
+end_of_job:
+    free(xweights);
+    free(yweights);
+    free(xfirst);
+    free(xcount);
+    free(yfirst);
+    free(ycount);
+    free(rows);
+    free(line);
+    return shrunk;
+}
@@ -0,0 +1,63 @@
+#ifndef __pngopt_h__
+#define __pngopt_h__
+
+/* ---
+ * png writing for mathTeX: the smallest lossless color type the pixels
+ * allow (palette, grey, with or without alpha), per-row filters, and no
+ * ancillary chunks, so the same pixels always give the same bytes. plus
+ * area-averaged shrinking, for densities made from a master rendering
+ * ------------------------------------------------------------------------ */
+#define PNGMAXPIXELS (8192 * 8192) /* larger pngs are left as they are */
+#define PNGDEFAULTLEVEL 6          /* zlib's own default */
+
+/**
+ * Encodes an 8-bit RGBA image as a png. Fully transparent pixels are written as transparent black.
+ *
+ * @param rgba[in,out] unsigned char* containing width*height r,g,b,a quads, top row first (transparent pixels are cleared in place).
+ * @param width[in] int containing the width in pixels.
+ * @param height[in] int containing the height in pixels.
+ * @param level[in] int containing the zlib compression level, 1 to 9.
+ * @param effort[in] int containing 0 for a quick choice of filters at level, or 1 to try every filter choice and deflate strategy at level 9.
+ * @param nbytes[out] int* receiving the size of the png.
+ * @return malloc()'ed png the caller frees, or `NULL` for any error.
+ */
+unsigned char *pngencode(unsigned char *rgba, int width, int height, int level, int effort, int *nbytes);
+
+/**
+ * Decodes a png to 8-bit RGBA.
+ *
+ * @param png[in] unsigned char* containing the png.
+ * @param npng[in] int containing the size of png.
+ * @param width[out] int* receiving the width in pixels.
+ * @param height[out] int* receiving the height in pixels.
+ * @return malloc()'ed width*height r,g,b,a quads the caller frees, or `NULL` if it isn't a png we read (16-bit or interlaced ones aren't).
+ */
+unsigned char *pngdecode(unsigned char *png, int npng, int *width, int *height);
+
+/**
+ * Re-encodes a png with pngencode(), dropping its text, time and other ancillary chunks.
+ *
+ * @param png[in] unsigned char* containing the png.
+ * @param npng[in] int containing the size of png.
+ * @param level[in] int containing the zlib compression level, 1 to 9.
+ * @param effort[in] int containing the effort, as pngencode().
+ * @param nbytes[out] int* receiving the size of the new png.
+ * @return malloc()'ed png the caller frees, or `NULL` if png can't be decoded.
+ */
+unsigned char *pngoptimize(unsigned char *png, int npng, int level, int effort, int *nbytes);
+
+/**
+ * Shrinks an 8-bit RGBA image by area averaging: each new pixel is the mean of the old pixels (and parts of pixels) under it, with color weighted by
+ * alpha, so antialiased edges keep their color and transparent pixels add none.
+ *
+ * @param rgba[in] unsigned char* containing width*height r,g,b,a quads, top row first.
+ * @param width[in] int containing the width in pixels.
+ * @param height[in] int containing the height in pixels.
+ * @param scale[in] double containing the new size as a fraction of the old, greater than 0 and at most 1.
+ * @param newwidth[out] int* receiving the new width, width*scale rounded up.
+ * @param newheight[out] int* receiving the new height, height*scale rounded up.
+ * @return malloc()'ed newwidth*newheight r,g,b,a quads the caller frees, or `NULL` for any error.
+ */
+unsigned char *pngshrink(unsigned char *rgba, int width, int height, double scale, int *newwidth, int *newheight);
+
+#endif // __pngopt_h__